@@ -2,6 +2,7 @@
 
 #include <string>
 #include <vector>
+#include "ChunkedArray.hpp"
 
 #ifdef __linux__
 #include <glm/glm.hpp>
@@ -95,7 +96,7 @@ struct Object {
     Object(std::string &&name) : name(std::move(name)) {}
 
     std::string name;
-    std::vector<Triangle> triangles;
+    ChunkedArray<Triangle> triangles;
     int material_index;
 };
 
@@ -0,0 +1,395 @@
+#include "Animation.hpp"
+#include "Context.hpp"
+#include "Scene.hpp"
+#include "ImageIO.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <glm/gtx/transform.hpp>
+#elif _WIN32
+#include "glm/gtx/transform.hpp"
+#endif
+
+
+struct st_camera_key {
+    int frame{ 0 };
+    glm::dvec3 position{ 0.0 };
+    double pitch{ 0.0 };
+    double yaw{ 0.0 };
+    // Samples per frame from this key on, 0 keeps the previous
+    uint32_t spp{ 0 };
+};
+
+struct st_animation_job {
+    std::string scene{};
+    std::string output{ "res/final/frame_####.exr" };
+    int width{ 1920 };
+    int height{ 1080 };
+    uint32_t spp{ 64 };
+    uint32_t seed{ 95834783u };
+    bool smooth{ false };
+    std::vector<st_camera_key> keys{};
+};
+
+
+static bool readJob(const std::string &name, st_animation_job &job) {
+    std::ifstream jobFile(name);
+    if (!jobFile.is_open()) {
+        std::cerr << "Couldn't open job " << name << '\n';
+        return false;
+    }
+
+    std::string text;
+    int line_number = 0;
+    while (std::getline(jobFile, text)) {
+        line_number++;
+        // A '#' starting a word begins a comment, inside a word it is part of the output pattern
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '#' && (i == 0 || text[i-1] == ' ' || text[i-1] == '\t')) {
+                text.resize(i);
+                break;
+            }
+        }
+
+        std::istringstream line(text);
+        std::string key;
+        if (!(line >> key))
+            continue;
+
+        bool valid = true;
+        if (key == "scene")
+            valid = (bool)(line >> job.scene);
+        else if (key == "output")
+            valid = (bool)(line >> job.output);
+        else if (key == "size")
+            valid = (bool)(line >> job.width >> job.height) && job.width > 0 && job.height > 0;
+        else if (key == "spp")
+            valid = (bool)(line >> job.spp) && job.spp > 0;
+        else if (key == "seed")
+            valid = (bool)(line >> job.seed);
+        else if (key == "interpolation") {
+            std::string mode;
+            valid = (bool)(line >> mode) && (mode == "linear" || mode == "smooth");
+            job.smooth = mode == "smooth";
+        }
+        else if (key == "key") {
+            st_camera_key &camera = job.keys.emplace_back();
+            valid = (bool)(line >> camera.frame >> camera.position.x >> camera.position.y >> camera.position.z
+                                 >> camera.pitch >> camera.yaw);
+            if (!(line >> camera.spp))
+                camera.spp = 0;
+        }
+        else {
+            std::cerr << name << ':' << line_number << ": unknown setting " << key << '\n';
+            return false;
+        }
+
+        if (!valid) {
+            std::cerr << name << ':' << line_number << ": invalid " << key << '\n';
+            return false;
+        }
+    }
+
+    if (job.scene.empty() || job.keys.empty()) {
+        std::cerr << name << ": needs a scene and at least one key\n";
+        return false;
+    }
+    std::stable_sort(job.keys.begin(), job.keys.end(),
+                     [](const st_camera_key &a, const st_camera_key &b) { return a.frame < b.frame; });
+    for (size_t i = 1; i < job.keys.size(); i++) {
+        if (job.keys[i].frame == job.keys[i-1].frame) {
+            std::cerr << name << ": two keys at frame " << job.keys[i].frame << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string frameName(const std::string &pattern, int frame) {
+    // The first run of '#' is replaced by the frame number, without one it goes in front of the extension
+    const size_t first = pattern.find('#');
+    std::string number = std::to_string(frame);
+    if (first == std::string::npos) {
+        const size_t dot = pattern.rfind('.');
+        const size_t slash = pattern.find_last_of("/\\");
+        const size_t insert = (dot == std::string::npos || (slash != std::string::npos && dot < slash)) ? pattern.size() : dot;
+        return pattern.substr(0, insert) + '_' + number + pattern.substr(insert);
+    }
+    const size_t last = pattern.find_first_not_of('#', first);
+    const size_t width = ((last == std::string::npos) ? pattern.size() : last) - first;
+    if (number.size() < width)
+        number.insert(0, width - number.size(), '0');
+    return pattern.substr(0, first) + number + pattern.substr(first + width);
+}
+
+static uint32_t frameSpp(const st_animation_job &job, int frame) {
+    uint32_t spp = job.spp;
+    for (const st_camera_key &key : job.keys) {
+        if (key.frame > frame)
+            break;
+        if (key.spp > 0)
+            spp = key.spp;
+    }
+    return spp;
+}
+
+template<typename T>
+static T catmullRom(const T &p0, const T &p1, const T &p2, const T &p3, double t) {
+    const double t2 = t * t;
+    const double t3 = t2 * t;
+    return 0.5 * ((2.0 * p1) + (p2 - p0) * t + (2.0*p0 - 5.0*p1 + 4.0*p2 - p3) * t2 + (3.0*p1 - p0 - 3.0*p2 + p3) * t3);
+}
+
+static glm::fmat4 cameraAt(const st_animation_job &job, int frame) {
+    const std::vector<st_camera_key> &keys = job.keys;
+    size_t i = 0;
+    while (i + 2 < keys.size() && keys[i+1].frame <= frame)
+        i++;
+
+    st_camera_key camera = keys[i];
+    if (keys.size() > 1 && frame > keys[i].frame) {
+        const st_camera_key &k1 = keys[i];
+        const st_camera_key &k2 = keys[i+1];
+        const double t = std::min(1.0, (double)(frame - k1.frame) / (k2.frame - k1.frame));
+        if (job.smooth) {
+            // The outer keys are repeated at the ends of the path
+            const st_camera_key &k0 = keys[(i > 0) ? i - 1 : i];
+            const st_camera_key &k3 = keys[(i + 2 < keys.size()) ? i + 2 : i + 1];
+            camera.position = catmullRom(k0.position, k1.position, k2.position, k3.position, t);
+            camera.pitch = catmullRom(k0.pitch, k1.pitch, k2.pitch, k3.pitch, t);
+            camera.yaw = catmullRom(k0.yaw, k1.yaw, k2.yaw, k3.yaw, t);
+        }
+        else {
+            camera.position = glm::mix(k1.position, k2.position, t);
+            camera.pitch = glm::mix(k1.pitch, k2.pitch, t);
+            camera.yaw = glm::mix(k1.yaw, k2.yaw, t);
+        }
+    }
+
+    // CAMERA = T * R_y(-yaw) * R_x(-pitch), as in the interactive loop
+    return glm::translate(camera.position)
+         * glm::rotate(-camera.yaw, glm::dvec3(0.0, 1.0, 0.0))
+         * glm::rotate(-camera.pitch, glm::dvec3(1.0, 0.0, 0.0));
+}
+
+
+/*
+    Writes EXR files on its own thread. At most two frames wait for it,
+    further submits block so a slow disk can't pile up frames in memory.
+*/
+class FrameEncoder {
+public:
+    struct st_frame {
+        std::string name;
+        int width;
+        int height;
+        std::vector<glm::fvec3> pixels;
+    };
+
+    FrameEncoder() : m_thread(&FrameEncoder::run, this) {}
+
+    ~FrameEncoder() {
+        finish();
+    }
+
+    void submit(st_frame &&frame) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_signal.wait(lock, [this] { return m_frames.size() < 2; });
+        m_frames.push_back(std::move(frame));
+        m_signal.notify_all();
+    }
+
+    // Writes the queued frames and returns how many of all frames failed
+    uint32_t finish() {
+        if (m_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_quit = true;
+            }
+            m_signal.notify_all();
+            m_thread.join();
+        }
+        return m_failures;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_signal.wait(lock, [this] { return !m_frames.empty() || m_quit; });
+            // queued frames are still written on shutdown
+            if (m_frames.empty())
+                return;
+
+            st_frame frame = std::move(m_frames.front());
+            m_frames.pop_front();
+            m_signal.notify_all();
+            lock.unlock();
+
+            const bool written = writeEXR(frame.name, frame.pixels.data(), frame.width, frame.height);
+            if (!written)
+                std::cerr << "Cannot write frame " << frame.name << '\n';
+            else
+                std::cerr << "Frame written to " << frame.name << '\n';
+
+            lock.lock();
+            if (!written)
+                m_failures++;
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_signal;
+    std::deque<st_frame> m_frames{};
+    uint32_t m_failures{ 0 };
+    bool m_quit{ false };
+    std::thread m_thread;
+};
+
+
+// Render target copy in flight, read back into a pack buffer and fenced
+struct st_readback {
+    GLuint buffer{ 0 };
+    GLsync fence{ nullptr };
+    std::string name{};
+};
+
+static void finishReadback(st_readback &readback, int width, int height, FrameEncoder &encoder) {
+    if (!readback.fence)
+        return;
+
+    glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(readback.fence);
+    readback.fence = nullptr;
+
+    const size_t pixel_count = (size_t)width * height;
+    FrameEncoder::st_frame frame{ std::move(readback.name), width, height, std::vector<glm::fvec3>(pixel_count) };
+    const void *mapped = glMapNamedBufferRange(readback.buffer, 0, pixel_count * sizeof(glm::fvec3), GL_MAP_READ_BIT);
+    std::copy_n(reinterpret_cast<const glm::fvec3*>(mapped), pixel_count, frame.pixels.begin());
+    glUnmapNamedBuffer(readback.buffer);
+
+    encoder.submit(std::move(frame));
+}
+
+int runAnimation(int argc, char* args[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: RayTracer --animate job.txt [--first F] [--last F]\n";
+        return EXIT_FAILURE;
+    }
+
+    st_animation_job job;
+    if (!readJob(args[2], job))
+        return EXIT_FAILURE;
+
+    int first_frame = job.keys.front().frame;
+    int last_frame = job.keys.back().frame;
+    for (int i = 3; i < argc; i++) {
+        const std::string arg(args[i]);
+        if (arg == "--first" && i + 1 < argc)
+            first_frame = std::max(first_frame, atoi(args[++i]));
+        else if (arg == "--last" && i + 1 < argc)
+            last_frame = std::min(last_frame, atoi(args[++i]));
+        else {
+            std::cerr << "Unknown animation option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    if (first_frame > last_frame) {
+        std::cerr << "No frames in " << first_frame << ".." << last_frame << '\n';
+        return EXIT_FAILURE;
+    }
+
+    GLFWwindow *window = createGLContext(job.width, job.height, "GPU RT - Animation", false);
+    if (!window)
+        return 2;
+
+    // Released before the context is gone
+    std::unique_ptr<Scene> scene(new Scene());
+    if (!scene->addWavefrontModel("./res/models/" + job.scene)) {
+        std::cerr << "Scene " << job.scene << " does not exist\n";
+        scene.reset();
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    scene->finalizeObjects();
+    scene->loadEnvironmentTexture(window, "res/models/textures/brownStudio.exr");
+    scene->loadMaterial("res/models/textures/planks", 0);
+    scene->loadMaterial("res/models/textures/aluminium", 1);
+
+    // The same sequence every frame, the remaining noise stays put instead of flickering
+    scene->setSeed(job.seed);
+    scene->adaptResolution({ job.width, job.height });
+
+    // Two pack buffers, one being filled by the GPU while the other one is copied out
+    const size_t frame_bytes = (size_t)job.width * job.height * sizeof(glm::fvec3);
+    st_readback readbacks[2];
+    for (st_readback &readback : readbacks) {
+        glCreateBuffers(1, &readback.buffer);
+        glNamedBufferStorage(readback.buffer, frame_bytes, nullptr, GL_MAP_READ_BIT | GL_CLIENT_STORAGE_BIT);
+    }
+
+    const auto t0 = std::chrono::steady_clock::now();
+    // Settled once from the first camera, settling every frame would wait for the GPU and serialize the frames.
+    // The pages the later frames want stream in while they accumulate.
+    {
+        int width = job.width;
+        int height = job.height;
+        scene->prepare(width, height, false, cameraAt(job, first_frame));
+        scene->settleTextures(width, height);
+    }
+    uint32_t failures = 0;
+    {
+        FrameEncoder encoder;
+        for (int frame = first_frame; frame <= last_frame; frame++) {
+            st_readback &current = readbacks[(frame - first_frame) % 2];
+            st_readback &previous = readbacks[(frame - first_frame + 1) % 2];
+
+            int width = job.width;
+            int height = job.height;
+            scene->prepare(width, height, false, cameraAt(job, frame));
+
+            const uint32_t spp = frameSpp(job, frame);
+            for (uint32_t sample = 0; sample < spp; sample++) {
+                scene->traceScene(width, height, sample);
+                // The GPU has the first sample of this frame queued, now wait for the previous one
+                if (sample == 0)
+                    finishReadback(previous, width, height, encoder);
+            }
+
+            finishReadback(current, width, height, encoder);
+            current.name = frameName(job.output, frame);
+            scene->readRenderTarget(current.buffer);
+            current.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush();
+            std::cerr << "Frame " << frame << " (" << (frame - first_frame + 1) << '/' << (last_frame - first_frame + 1)
+                      << "): " << spp << " samples\n";
+        }
+        for (st_readback &readback : readbacks)
+            finishReadback(readback, job.width, job.height, encoder);
+        failures = encoder.finish();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << (last_frame - first_frame + 1) << " frames in " << seconds << " s\n";
+
+    for (st_readback &readback : readbacks)
+        glDeleteBuffers(1, &readback.buffer);
+    scene.reset();
+    glfwTerminate();
+
+    if (failures > 0) {
+        std::cerr << failures << " frames couldn't be written\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+/*
+    Batch rendering of a camera animation in one process.
+    The scene, its buffers and the tracer programs are loaded once and stay resident for all frames,
+    frame N is read back and encoded to EXR while frame N+1 is traced.
+
+    RayTracer --animate job.txt [--first F] [--last F]
+
+    The job is a text file with one setting per line, lines starting with '#' are comments:
+
+        scene          cornell.obj
+        output         res/final/turntable_####.exr     # '#' run is replaced by the zero padded frame number
+        size           1920 1080
+        spp            64                                # default samples per frame
+        seed           95834783
+        interpolation  smooth                            # linear or smooth (Catmull-Rom)
+        key  0    0.0 1.5 -3.0  -0.785 0.0               # frame, position x y z, pitch, yaw [, spp from this key on]
+        key  120  0.0 1.5 -3.0  -0.785 6.283
+
+    Pitch and yaw are the angles of the interactive camera (MVP_rot) and are interpolated as written,
+    so a full turn is written as 0 -> 2 PI. Frames run from the first to the last key.
+*/
+int runAnimation(int argc, char* args[]);
@@ -0,0 +1,610 @@
+#include "BVH.hpp"
+#include "Timeline.hpp"
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <bit>
+
+
+namespace {
+
+    // spatial splits are only tried where the children of the object split overlap more than this, relative to the root
+    constexpr float SPLIT_OVERLAP = 1e-5f;
+    constexpr uint32_t TREELET_ROUNDS = 3;
+
+    struct st_reference {
+        st_aabb bounds;
+        uint32_t slot;
+    };
+
+    struct st_build_node {
+        st_aabb bounds;
+        int32_t left{ -1 };
+        int32_t right{ -1 };
+        // references of leaves
+        uint32_t first{ 0 };
+        uint32_t count{ 0 };
+
+        [[nodiscard]] inline bool leaf() const { return left < 0; }
+    };
+
+    struct st_split {
+        float cost{ std::numeric_limits<float>::infinity() };
+        int axis{ -1 };
+        // object splits: last bin on the left, spatial splits: plane position
+        uint32_t bin{ 0 };
+        float position{ 0.0f };
+        bool spatial{ false };
+        st_aabb left, right;
+    };
+
+    double millisecondsSince(const std::chrono::steady_clock::time_point &t0) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    class Builder {
+    public:
+        Builder(const std::vector<glm::fvec3> &vertices, bool spatial)
+            : m_vertices(vertices), m_spatial(spatial)
+        {
+            const uint32_t triangles = (uint32_t)(vertices.size() / 3);
+            std::vector<st_reference> references(triangles);
+            st_aabb root;
+            for (uint32_t slot = 0; slot < triangles; slot++) {
+                references[slot].slot = slot;
+                for (int i=0; i < 3; i++)
+                    references[slot].bounds.grow(vertices[3*slot + i]);
+                root.grow(references[slot].bounds);
+            }
+            m_rootArea = root.area();
+            m_budget = (uint32_t)(triangles * BVH::SPLIT_BUDGET);
+            build(std::move(references), 1);
+        }
+
+        std::vector<st_build_node> nodes;
+        std::vector<st_reference> references;
+        uint32_t spatialSplits{ 0 };
+
+    private:
+        int32_t build(std::vector<st_reference> &&refs, uint32_t depth) {
+            const int32_t index = (int32_t)nodes.size();
+            nodes.emplace_back();
+
+            st_aabb bounds, centroids;
+            for (const st_reference &ref : refs) {
+                bounds.grow(ref.bounds);
+                centroids.grow(ref.bounds.center());
+            }
+            nodes[index].bounds = bounds;
+
+            if (refs.size() <= 1 || depth >= BVH::MAX_DEPTH)
+                return makeLeaf(index, refs);
+
+            st_split split = objectSplit(refs, centroids);
+            if (m_spatial && m_budget >= refs.size() && split.axis >= 0) {
+                const float overlap = split.left.intersection(split.right).area();
+                if (overlap > SPLIT_OVERLAP * m_rootArea) {
+                    const st_split spatial = spatialSplit(refs, bounds);
+                    if (spatial.cost < split.cost)
+                        split = spatial;
+                }
+            }
+
+            // SAH relative to this node: a leaf tests all triangles, a split one node and the children
+            const float area = std::max(bounds.area(), 1e-30f);
+            const float leaf_cost = BVH::TRIANGLE_COST * refs.size();
+            const float split_cost = BVH::NODE_COST + BVH::TRIANGLE_COST * split.cost / area;
+            if (refs.size() <= BVH::MAX_LEAF && leaf_cost <= split_cost)
+                return makeLeaf(index, refs);
+
+            std::vector<st_reference> left, right;
+            if (split.spatial)
+                splitSpatial(refs, split, left, right);
+            else if (split.axis >= 0)
+                splitObjects(refs, centroids, split, left, right);
+
+            // all centroids in one spot, halves in any order still bound less
+            if (left.empty() || right.empty()) {
+                left.clear();
+                right.clear();
+                const size_t half = refs.size() / 2;
+                left.assign(refs.begin(), refs.begin() + half);
+                right.assign(refs.begin() + half, refs.end());
+            }
+            refs.clear();
+            refs.shrink_to_fit();
+
+            const int32_t l = build(std::move(left), depth + 1);
+            const int32_t r = build(std::move(right), depth + 1);
+            nodes[index].left = l;
+            nodes[index].right = r;
+            return index;
+        }
+
+        int32_t makeLeaf(int32_t index, const std::vector<st_reference> &refs) {
+            nodes[index].first = (uint32_t)references.size();
+            nodes[index].count = (uint32_t)refs.size();
+            references.insert(references.end(), refs.begin(), refs.end());
+            return index;
+        }
+
+        static uint32_t centroidBin(const st_aabb &centroids, int axis, const glm::fvec3 &c) {
+            const float extent = centroids.max[axis] - centroids.min[axis];
+            const int bin = (int)((c[axis] - centroids.min[axis]) / extent * BVH::BINS);
+            return (uint32_t)std::clamp(bin, 0, (int)BVH::BINS - 1);
+        }
+
+        st_split objectSplit(const std::vector<st_reference> &refs, const st_aabb &centroids) const {
+            st_split best;
+            for (int axis = 0; axis < 3; axis++) {
+                if (centroids.max[axis] - centroids.min[axis] <= 0.0f)
+                    continue;
+
+                st_aabb bins[BVH::BINS];
+                uint32_t counts[BVH::BINS]{};
+                for (const st_reference &ref : refs) {
+                    const uint32_t bin = centroidBin(centroids, axis, ref.bounds.center());
+                    bins[bin].grow(ref.bounds);
+                    counts[bin]++;
+                }
+                sweep(bins, counts, counts, axis, false, best);
+            }
+            return best;
+        }
+
+        /*
+            Plane after bin i of BINS: the left side holds the references entering bins [0, i],
+            the right side those leaving bins [i+1, BINS). Object splits enter and leave in the same bin.
+        */
+        static void sweep(const st_aabb (&bins)[BVH::BINS], const uint32_t (&enter)[BVH::BINS], const uint32_t (&leave)[BVH::BINS],
+                          int axis, bool spatial, st_split &best)
+        {
+            st_aabb right_bounds[BVH::BINS];
+            uint32_t right_counts[BVH::BINS]{};
+            st_aabb accumulated;
+            uint32_t count = 0;
+            for (int i = BVH::BINS - 1; i > 0; i--) {
+                accumulated.grow(bins[i]);
+                count += leave[i];
+                right_bounds[i] = accumulated;
+                right_counts[i] = count;
+            }
+
+            st_aabb left;
+            uint32_t left_count = 0;
+            for (uint32_t i = 0; i + 1 < BVH::BINS; i++) {
+                left.grow(bins[i]);
+                left_count += enter[i];
+                if (left_count == 0 || right_counts[i+1] == 0)
+                    continue;
+                const float cost = left.area() * left_count + right_bounds[i+1].area() * right_counts[i+1];
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i;
+                    best.spatial = spatial;
+                    best.left = left;
+                    best.right = right_bounds[i+1];
+                }
+            }
+        }
+
+        st_split spatialSplit(const std::vector<st_reference> &refs, const st_aabb &bounds) const {
+            st_split best;
+            for (int axis = 0; axis < 3; axis++) {
+                const float origin = bounds.min[axis];
+                const float width = (bounds.max[axis] - origin) / BVH::BINS;
+                if (width <= 0.0f)
+                    continue;
+
+                st_aabb bins[BVH::BINS];
+                uint32_t enter[BVH::BINS]{}, leave[BVH::BINS]{};
+                for (const st_reference &ref : refs) {
+                    const uint32_t first = spatialBin(origin, width, ref.bounds.min[axis]);
+                    const uint32_t last = spatialBin(origin, width, ref.bounds.max[axis]);
+                    enter[first]++;
+                    leave[last]++;
+                    // the part of the triangle in every bin it touches
+                    for (uint32_t bin = first; bin <= last; bin++) {
+                        const float lo = origin + bin * width;
+                        const float hi = (bin + 1 == BVH::BINS) ? bounds.max[axis] : lo + width;
+                        bins[bin].grow(clip(ref, axis, lo, hi));
+                    }
+                }
+
+                const float previous = best.cost;
+                sweep(bins, enter, leave, axis, true, best);
+                if (best.cost < previous)
+                    best.position = origin + (best.bin + 1) * width;
+            }
+            return best;
+        }
+
+        static uint32_t spatialBin(float origin, float width, float x) {
+            return (uint32_t)std::clamp((int)((x - origin) / width), 0, (int)BVH::BINS - 1);
+        }
+
+        // Bounds of the part of the triangle of ref between lo and hi along axis, within the bounds of ref
+        st_aabb clip(const st_reference &ref, int axis, float lo, float hi) const {
+            glm::fvec3 polygon[2][9];
+            uint32_t count = 3;
+            for (int i=0; i < 3; i++)
+                polygon[0][i] = m_vertices[3*ref.slot + i];
+
+            // Sutherland-Hodgman against x >= lo, then x <= hi
+            int current = 0;
+            for (int side = 0; side < 2; side++) {
+                const float plane = side == 0 ? lo : hi;
+                const float sign = side == 0 ? 1.0f : -1.0f;
+                uint32_t clipped = 0;
+                for (uint32_t i = 0; i < count; i++) {
+                    const glm::fvec3 &a = polygon[current][i];
+                    const glm::fvec3 &b = polygon[current][(i + 1) % count];
+                    const float da = sign * (a[axis] - plane);
+                    const float db = sign * (b[axis] - plane);
+                    if (da >= 0.0f)
+                        polygon[1 - current][clipped++] = a;
+                    if ((da < 0.0f) != (db < 0.0f))
+                        polygon[1 - current][clipped++] = a + (b - a) * (da / (da - db));
+                }
+                current = 1 - current;
+                count = clipped;
+            }
+
+            st_aabb part;
+            for (uint32_t i = 0; i < count; i++)
+                part.grow(polygon[current][i]);
+            part = part.intersection(ref.bounds);
+            part.min[axis] = std::max(part.min[axis], lo);
+            part.max[axis] = std::min(part.max[axis], hi);
+            return part;
+        }
+
+        static void splitObjects(std::vector<st_reference> &refs, const st_aabb &centroids, const st_split &split,
+                                 std::vector<st_reference> &left, std::vector<st_reference> &right)
+        {
+            for (const st_reference &ref : refs) {
+                if (centroidBin(centroids, split.axis, ref.bounds.center()) <= split.bin)
+                    left.push_back(ref);
+                else
+                    right.push_back(ref);
+            }
+        }
+
+        void splitSpatial(std::vector<st_reference> &refs, const st_split &split,
+                          std::vector<st_reference> &left, std::vector<st_reference> &right)
+        {
+            const int axis = split.axis;
+            const float infinity = std::numeric_limits<float>::infinity();
+            for (const st_reference &ref : refs) {
+                if (ref.bounds.max[axis] <= split.position) {
+                    left.push_back(ref);
+                } else if (ref.bounds.min[axis] >= split.position) {
+                    right.push_back(ref);
+                } else {
+                    const st_aabb l = clip(ref, axis, -infinity, split.position);
+                    const st_aabb r = clip(ref, axis, split.position, infinity);
+                    if (l.valid() && r.valid()) {
+                        left.push_back({ l, ref.slot });
+                        right.push_back({ r, ref.slot });
+                        m_budget -= std::min(m_budget, 1u);
+                    } else {
+                        // clipping lost the triangle to rounding, it stays whole on the side of its center
+                        (ref.bounds.center()[axis] <= split.position ? left : right).push_back(ref);
+                    }
+                }
+            }
+            spatialSplits++;
+        }
+
+        const std::vector<glm::fvec3> &m_vertices;
+        const bool m_spatial;
+        float m_rootArea{ 0.0f };
+        uint32_t m_budget{ 0 };
+    };
+
+
+    // SAH cost of every subtree, not divided by the root area
+    std::vector<float> subtreeCosts(const std::vector<st_build_node> &nodes) {
+        std::vector<float> costs(nodes.size());
+        // children are built after their parents
+        for (size_t i = nodes.size(); i-- > 0;) {
+            const st_build_node &node = nodes[i];
+            costs[i] = node.leaf() ? BVH::TRIANGLE_COST * node.bounds.area() * node.count
+                                   : BVH::NODE_COST * node.bounds.area() + costs[node.left] + costs[node.right];
+        }
+        return costs;
+    }
+
+    uint32_t treeDepth(const std::vector<st_build_node> &nodes, int32_t index) {
+        const st_build_node &node = nodes[index];
+        return node.leaf() ? 1 : 1 + std::max(treeDepth(nodes, node.left), treeDepth(nodes, node.right));
+    }
+
+    /*
+        One bottom up round of treelet restructuring: the treelet of a node grows by expanding its largest
+        inner leaf, every binary tree over its leaves is compared by dynamic programming over the leaf subsets
+        and the best replaces the treelet, reusing its inner nodes. Returns the number of restructured treelets.
+    */
+    uint32_t restructureTreelets(std::vector<st_build_node> &nodes, std::vector<float> &costs) {
+        constexpr uint32_t LEAVES = BVH::TREELET_LEAVES;
+        constexpr uint32_t SUBSETS = 1u << LEAVES;
+
+        uint32_t restructured = 0;
+        // children of restructured treelets can have smaller indices, a visited mark keeps the order bottom up
+        std::vector<int32_t> order;
+        order.reserve(nodes.size());
+        std::vector<std::pair<int32_t, bool>> stack{ { 0, false } };
+        while (!stack.empty()) {
+            const auto [index, expanded] = stack.back();
+            stack.pop_back();
+            if (expanded || nodes[index].leaf()) {
+                order.push_back(index);
+                continue;
+            }
+            stack.push_back({ index, true });
+            stack.push_back({ nodes[index].right, false });
+            stack.push_back({ nodes[index].left, false });
+        }
+
+        for (const int32_t root : order) {
+            if (nodes[root].leaf())
+                continue;
+
+            int32_t leaves[LEAVES];
+            int32_t inner[LEAVES - 1];
+            uint32_t leaf_count = 2, inner_count = 1;
+            leaves[0] = nodes[root].left;
+            leaves[1] = nodes[root].right;
+            inner[0] = root;
+            while (leaf_count < LEAVES) {
+                int largest = -1;
+                for (uint32_t i = 0; i < leaf_count; i++) {
+                    if (!nodes[leaves[i]].leaf() && (largest < 0 || nodes[leaves[i]].bounds.area() > nodes[leaves[largest]].bounds.area()))
+                        largest = (int)i;
+                }
+                if (largest < 0)
+                    break;
+                const int32_t expanded = leaves[largest];
+                inner[inner_count++] = expanded;
+                leaves[largest] = nodes[expanded].left;
+                leaves[leaf_count++] = nodes[expanded].right;
+            }
+            if (leaf_count < 3)
+                continue;
+
+            const uint32_t full = (1u << leaf_count) - 1;
+            float area[SUBSETS], cost[SUBSETS];
+            uint32_t partition[SUBSETS];
+            for (uint32_t s = 1; s <= full; s++) {
+                st_aabb bounds;
+                for (uint32_t i = 0; i < leaf_count; i++) {
+                    if (s & (1u << i))
+                        bounds.grow(nodes[leaves[i]].bounds);
+                }
+                area[s] = bounds.area();
+            }
+            // subsets in increasing order have all their proper subsets done before
+            for (uint32_t s = 1; s <= full; s++) {
+                if ((s & (s - 1)) == 0) {
+                    cost[s] = costs[leaves[std::countr_zero(s)]];
+                    continue;
+                }
+                const uint32_t lowest = s & (0u - s);
+                float best = std::numeric_limits<float>::infinity();
+                uint32_t best_partition = 0;
+                // each unordered pair once, the part with the lowest leaf on the left
+                for (uint32_t p = (s - 1) & s; p; p = (p - 1) & s) {
+                    if (!(p & lowest))
+                        continue;
+                    const float c = cost[p] + cost[s ^ p];
+                    if (c < best) {
+                        best = c;
+                        best_partition = p;
+                    }
+                }
+                cost[s] = BVH::NODE_COST * area[s] + best;
+                partition[s] = best_partition;
+            }
+
+            if (cost[full] >= costs[root] * (1.0f - 1e-5f))
+                continue;
+
+            uint32_t next_inner = 0;
+            const std::function<int32_t(uint32_t)> assign = [&](uint32_t s) -> int32_t {
+                if ((s & (s - 1)) == 0)
+                    return leaves[std::countr_zero(s)];
+                // the treelet root stays in place, its parent points to it
+                const int32_t index = inner[next_inner++];
+                const int32_t l = assign(partition[s]);
+                const int32_t r = assign(s ^ partition[s]);
+                nodes[index].left = l;
+                nodes[index].right = r;
+                nodes[index].bounds = nodes[l].bounds;
+                nodes[index].bounds.grow(nodes[r].bounds);
+                costs[index] = BVH::NODE_COST * nodes[index].bounds.area() + costs[l] + costs[r];
+                return index;
+            };
+            assign(full);
+            restructured++;
+        }
+        return restructured;
+    }
+
+}
+
+
+void BVH::build(const std::vector<glm::fvec3> &vertices, bool quality) {
+    TIMELINE_ZONE("BVH::build", quality ? "quality" : "base");
+    const uint32_t triangles = (uint32_t)(vertices.size() / 3);
+
+    m_report = st_bvh_report();
+    m_report.quality = quality;
+    m_report.triangles = triangles;
+
+    m_triangleBounds.assign(triangles, st_aabb());
+    m_edited.assign(triangles, 0);
+
+    // depth first, optionally with the child of larger area next to its parent
+    const auto flatten = [this](const std::vector<st_build_node> &nodes, const std::vector<st_reference> &references, bool larger_first) {
+        m_nodes.clear();
+        m_references.clear();
+        m_referenceBounds.clear();
+        m_nodes.reserve(nodes.size());
+        m_references.reserve(references.size());
+        m_referenceBounds.reserve(references.size());
+        const std::function<void(int32_t)> emit = [&](int32_t index) {
+            const st_build_node &node = nodes[index];
+            const uint32_t flat = (uint32_t)m_nodes.size();
+            m_nodes.push_back({ node.bounds.min, 0u, node.bounds.max, node.count });
+            if (node.leaf()) {
+                m_nodes[flat].offset = (uint32_t)m_references.size();
+                for (uint32_t r = node.first; r < node.first + node.count; r++) {
+                    m_references.push_back(references[r].slot);
+                    m_referenceBounds.push_back(references[r].bounds);
+                }
+                return;
+            }
+            const bool swap = larger_first && nodes[node.right].bounds.area() > nodes[node.left].bounds.area();
+            emit(swap ? node.right : node.left);
+            m_nodes[flat].offset = (uint32_t)m_nodes.size();
+            emit(swap ? node.left : node.right);
+        };
+        if (!nodes.empty())
+            emit(0);
+    };
+
+    if (triangles == 0) {
+        m_nodes.assign(1, st_bvh_node{ glm::fvec3(0.0f), 0u, glm::fvec3(0.0f), 0u });
+        m_references.clear();
+        m_referenceBounds.clear();
+        m_report.nodes = 1;
+        return;
+    }
+
+    const auto t_base = std::chrono::steady_clock::now();
+    {
+        Builder base(vertices, false);
+        m_report.depth = treeDepth(base.nodes, 0);
+        flatten(base.nodes, base.references, false);
+    }
+    m_report.base_ms = millisecondsSince(t_base);
+    m_report.base_sah = m_report.split_sah = m_report.sah = sahCost();
+
+    if (quality) {
+        TIMELINE_ZONE("BVH quality pass");
+        const auto t_quality = std::chrono::steady_clock::now();
+        Builder split(vertices, true);
+        m_report.spatial_splits = split.spatialSplits;
+
+        std::vector<float> costs = subtreeCosts(split.nodes);
+        m_report.split_sah = costs[0] / std::max(split.nodes[0].bounds.area(), 1e-30f);
+
+        // the traversal stack bounds the depth, a round that grows the tree too deep is undone
+        for (uint32_t round = 0; round < TREELET_ROUNDS; round++) {
+            const std::vector<st_build_node> previous = split.nodes;
+            const std::vector<float> previous_costs = costs;
+            const uint32_t restructured = restructureTreelets(split.nodes, costs);
+            if (treeDepth(split.nodes, 0) > MAX_DEPTH) {
+                split.nodes = previous;
+                costs = previous_costs;
+                break;
+            }
+            m_report.restructured_treelets += restructured;
+            if (restructured == 0 || costs[0] > previous_costs[0] * 0.999f)
+                break;
+        }
+        m_report.depth = treeDepth(split.nodes, 0);
+        flatten(split.nodes, split.references, true);
+        m_report.quality_ms = millisecondsSince(t_quality);
+        m_report.sah = sahCost();
+    }
+
+    m_report.nodes = (uint32_t)m_nodes.size();
+    m_report.references = (uint32_t)m_references.size();
+}
+
+
+std::vector<uint32_t> BVH::leafOrder(uint32_t fixed) const {
+    const uint32_t triangles = (uint32_t)m_triangleBounds.size();
+    std::vector<uint32_t> order;
+    order.reserve(triangles);
+    std::vector<uint8_t> placed(triangles, 0);
+    for (uint32_t slot = 0; slot < std::min(fixed, triangles); slot++) {
+        order.push_back(slot);
+        placed[slot] = 1;
+    }
+    // a triangle split into several leaves goes with the first
+    for (const uint32_t slot : m_references) {
+        if (!placed[slot]) {
+            order.push_back(slot);
+            placed[slot] = 1;
+        }
+    }
+    for (uint32_t slot = 0; slot < triangles; slot++) {
+        if (!placed[slot])
+            order.push_back(slot);
+    }
+    return order;
+}
+
+void BVH::remapSlots(const std::vector<uint32_t> &order) {
+    std::vector<uint32_t> moved(order.size());
+    std::vector<st_aabb> bounds(order.size());
+    std::vector<uint8_t> edited(order.size());
+    for (uint32_t slot = 0; slot < order.size(); slot++) {
+        moved[order[slot]] = slot;
+        bounds[slot] = m_triangleBounds[order[slot]];
+        edited[slot] = m_edited[order[slot]];
+    }
+    for (uint32_t &reference : m_references)
+        reference = moved[reference];
+    m_triangleBounds = std::move(bounds);
+    m_edited = std::move(edited);
+}
+
+void BVH::setTriangle(uint32_t slot, const glm::fvec3 &p0, const glm::fvec3 &p1, const glm::fvec3 &p2) {
+    st_aabb bounds;
+    bounds.grow(p0);
+    bounds.grow(p1);
+    bounds.grow(p2);
+    m_triangleBounds[slot] = bounds;
+    m_edited[slot] = 1;
+}
+
+void BVH::refit() {
+    // Edited triangles are bound whole, the others keep their references clipped by spatial splits
+    for (uint32_t r = 0; r < m_references.size(); r++) {
+        if (m_edited[m_references[r]])
+            m_referenceBounds[r] = m_triangleBounds[m_references[r]];
+    }
+    std::fill(m_edited.begin(), m_edited.end(), 0);
+
+    for (size_t i = m_nodes.size(); i-- > 0;) {
+        st_bvh_node &node = m_nodes[i];
+        st_aabb bounds;
+        if (node.count > 0) {
+            for (uint32_t r = node.offset; r < node.offset + node.count; r++)
+                bounds.grow(m_referenceBounds[r]);
+        } else if (i + 1 < m_nodes.size()) {
+            bounds.grow(st_aabb{ m_nodes[i+1].bb_min, m_nodes[i+1].bb_max });
+            bounds.grow(st_aabb{ m_nodes[node.offset].bb_min, m_nodes[node.offset].bb_max });
+        }
+        if (bounds.valid()) {
+            node.bb_min = bounds.min;
+            node.bb_max = bounds.max;
+        }
+    }
+}
+
+double BVH::sahCost() const {
+    if (m_nodes.empty())
+        return 0.0;
+
+    double cost = 0.0;
+    for (const st_bvh_node &node : m_nodes) {
+        const double area = st_aabb{ node.bb_min, node.bb_max }.area();
+        cost += node.count > 0 ? TRIANGLE_COST * area * node.count : NODE_COST * area;
+    }
+    return cost / std::max((double)st_aabb{ m_nodes[0].bb_min, m_nodes[0].bb_max }.area(), 1e-30);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include "3Dobjects.hpp"
+
+
+struct st_aabb {
+    glm::fvec3 min{ std::numeric_limits<float>::infinity() };
+    glm::fvec3 max{ -std::numeric_limits<float>::infinity() };
+
+    inline void grow(const glm::fvec3 &p) { min = glm::min(min, p); max = glm::max(max, p); }
+    inline void grow(const st_aabb &b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+    [[nodiscard]] inline bool valid() const { return min.x <= max.x && min.y <= max.y && min.z <= max.z; }
+    [[nodiscard]] inline glm::fvec3 center() const { return (min + max) * 0.5f; }
+    [[nodiscard]] inline float area() const {
+        if (!valid())
+            return 0.0f;
+        const glm::fvec3 d = max - min;
+        return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+    [[nodiscard]] inline st_aabb intersection(const st_aabb &b) const {
+        st_aabb r;
+        r.min = glm::max(min, b.min);
+        r.max = glm::min(max, b.max);
+        return r;
+    }
+};
+
+// BVHNode of raytracer.glsl. Inner nodes have count 0, the left child follows them and offset is the right child.
+// Leaves test the count tracer slots in references[offset, offset + count).
+struct st_bvh_node {
+    glm::fvec3 bb_min;
+    uint32_t offset;
+    glm::fvec3 bb_max;
+    uint32_t count;
+};
+
+struct st_bvh_report {
+    bool quality{ false };
+    uint32_t triangles{ 0 };
+    uint32_t references{ 0 };
+    uint32_t nodes{ 0 };
+    uint32_t depth{ 0 };
+    // SAH cost of the base build, after the spatial splits and of the final tree
+    double base_sah{ 0.0 };
+    double split_sah{ 0.0 };
+    double sah{ 0.0 };
+    uint32_t spatial_splits{ 0 };
+    uint32_t restructured_treelets{ 0 };
+    double base_ms{ 0.0 };
+    double quality_ms{ 0.0 };
+};
+
+/*
+    Bounding volume hierarchy over the tracer slots, traversed by raytracer.glsl.
+    The base build bins object splits by the surface area heuristic. The optional quality pass builds again
+    with spatial splits (Stich et al. 2009), which put parts of large and long triangles into several leaves,
+    restructures treelets of up to TREELET_LEAVES nodes to their optimal topology (Karras and Aila 2013)
+    and lays the nodes out depth first with the larger child next to its parent.
+    Edits keep the topology and refit the bounds.
+*/
+class BVH {
+public:
+    // the traversal stack of raytracer.glsl holds a node per level
+    static constexpr uint32_t MAX_DEPTH = 64;
+    static constexpr uint32_t BINS = 16;
+    static constexpr uint32_t MAX_LEAF = 8;
+    static constexpr float NODE_COST = 1.0f;
+    static constexpr float TRIANGLE_COST = 1.0f;
+    // duplicated references of the spatial splits, relative to the triangles
+    static constexpr float SPLIT_BUDGET = 0.3f;
+    static constexpr uint32_t TREELET_LEAVES = 7;
+
+    // vertices holds the three corners of every tracer slot
+    void build(const std::vector<glm::fvec3> &vertices, bool quality);
+
+    /*
+        Tracer slot order for traversal locality, order[new slot] = old slot.
+        The first fixed slots (the light sources) stay, all others follow the leaves depth first.
+    */
+    std::vector<uint32_t> leafOrder(uint32_t fixed) const;
+    void remapSlots(const std::vector<uint32_t> &order);
+
+    // After an edit, refit() updates the bounds of all nodes
+    void setTriangle(uint32_t slot, const glm::fvec3 &p0, const glm::fvec3 &p1, const glm::fvec3 &p2);
+    void refit();
+
+    [[nodiscard]] double sahCost() const;
+    [[nodiscard]] inline const std::vector<st_bvh_node> &nodes() const noexcept { return m_nodes; }
+    [[nodiscard]] inline const std::vector<uint32_t> &references() const noexcept { return m_references; }
+    [[nodiscard]] inline const st_bvh_report &report() const noexcept { return m_report; }
+
+private:
+    std::vector<st_bvh_node> m_nodes;
+    std::vector<uint32_t> m_references;
+    std::vector<st_aabb> m_referenceBounds;
+    // bounds of the triangles given to setTriangle since the last refit
+    std::vector<st_aabb> m_triangleBounds;
+    std::vector<uint8_t> m_edited;
+    st_bvh_report m_report;
+};
@@ -0,0 +1,581 @@
+#include "Benchmark.hpp"
+#include "Context.hpp"
+#include "Scene.hpp"
+#include "SceneGeometry.hpp"
+#include "CpuTracer.hpp"
+#include "RayQuery.hpp"
+#include "Memory.hpp"
+#include "ImageIO.hpp"
+#include "TaskScheduler.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#ifdef __linux__
+#include <glm/gtx/transform.hpp>
+#elif _WIN32
+#include "glm/gtx/transform.hpp"
+#endif
+
+
+static const char *BENCHMARK_SCENES[] = { "sphere", "box", "cubes", "_ObiWan" };
+
+struct st_benchmark_pose {
+    double pitch;
+    double yaw;
+};
+
+static constexpr st_benchmark_pose BENCHMARK_POSES[] = {
+    { -0.35, 0.0 },
+    { -0.6, 2.4 }
+};
+
+struct st_benchmark_options {
+    bool cpu{ false };
+    int width{ 640 };
+    int height{ 360 };
+    uint32_t spp{ 32 };
+    uint32_t seed{ 95834783u };
+    // GPU only, counts all rays of the timed samples, the counting slows the tracer down
+    bool stats{ false };
+    // GPU only, builds the tracer BVH with its quality pass
+    bool bvh_quality{ false };
+    // CPU ray queries (RayQuery) instead of rendering, rays per query mode
+    bool queries{ false };
+    uint32_t query_rays{ 16384 };
+    // CPU stages on the TaskScheduler at 1, 2, 4, ... threads instead of rendering
+    bool scheduler{ false };
+    std::string output{};
+};
+
+struct st_benchmark_result {
+    std::string pose_name;
+    double render_ms{ 0.0 };
+    double samples_per_second{ 0.0 };
+    // camera rays, width * height * spp on both devices
+    double rays_per_second{ 0.0 };
+    // segments of the paths (no shadow rays), counted by the CPU tracer and by the GPU with --stats, 0 when not counted
+    double path_rays_per_second{ 0.0 };
+    glm::dvec3 mean{ 0.0 };
+    bool stats_counted{ false };
+    st_tracer_stats stats;
+};
+
+struct st_query_result {
+    const char *mode;
+    double rays_per_second{ 0.0 };
+};
+
+struct st_stage_run {
+    unsigned threads{ 1 };
+    double ms{ 0.0 };
+    double speedup{ 1.0 };
+};
+
+struct st_stage_result {
+    const char *name;
+    // the input is missing, no runs
+    bool measured{ false };
+    std::vector<st_stage_run> runs;
+};
+
+struct st_benchmark_scene {
+    std::string name;
+    bool loaded{ false };
+    uint32_t triangles{ 0 };
+    double load_ms{ 0.0 };
+    double build_ms{ 0.0 };
+    // of the process so far, a scene after a larger one reports the larger one's peak
+    double peak_rss_mb{ 0.0 };
+    std::vector<st_benchmark_result> poses;
+    // GPU path guiding against the CPU reference, after all poses
+    bool guide_checked{ false };
+    st_guide_validation guide;
+    // GPU tracer BVH
+    bool bvh_built{ false };
+    st_bvh_report bvh;
+    std::vector<st_query_result> queries;
+    // packet and stream results that differ from the single ray queries
+    uint32_t query_mismatches{ 0 };
+};
+
+
+static double millisecondsSince(const std::chrono::steady_clock::time_point &t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static glm::fmat4 benchmarkCamera(const SceneGeometry &geometry, const st_benchmark_pose &pose) {
+    // Frame the scene bounds, camera conventions as in RayTracer.cpp: CAMERA = T * R_y(-yaw) * R_x(-pitch)
+    glm::fvec3 bb_min, bb_max;
+    geometry.bounds(bb_min, bb_max);
+
+    const glm::dvec3 center = glm::dvec3(bb_min + bb_max) * 0.5;
+    const double radius = glm::length(glm::dvec3(bb_max - bb_min)) * 0.5;
+    const glm::dvec3 forward(-cos(pose.pitch) * sin(pose.yaw), sin(pose.pitch), cos(pose.pitch) * cos(pose.yaw));
+    const glm::dvec3 position = center - forward * (radius * 1.5);
+
+    return glm::translate(position) * glm::rotate(-pose.yaw, glm::dvec3(0.0, 1.0, 0.0)) * glm::rotate(-pose.pitch, glm::dvec3(1.0, 0.0, 0.0));
+}
+
+static void benchmarkGPU(GLFWwindow *window, const st_benchmark_options &options, st_benchmark_scene &result) {
+    std::unique_ptr<Scene> scene(new Scene());
+
+    const auto t_load = std::chrono::steady_clock::now();
+    result.loaded = scene->addWavefrontModel("./res/models/" + result.name);
+    result.load_ms = millisecondsSince(t_load);
+    if (!result.loaded)
+        return;
+
+    const auto t_build = std::chrono::steady_clock::now();
+    scene->setBVHQuality(options.bvh_quality);
+    scene->finalizeObjects();
+    glFinish();
+    result.build_ms = millisecondsSince(t_build);
+    result.triangles = scene->getGeometry().triangleCount();
+    result.bvh = scene->getBVHReport();
+    result.bvh_built = true;
+    result.peak_rss_mb = peakResidentBytes() / 1048576.0;
+
+    // untimed, the irradiance map is cached next to the environment after the first run
+    scene->loadEnvironmentTexture(window, "res/models/textures/brownStudio.exr");
+
+    scene->setSeed(options.seed);
+    scene->adaptResolution({ options.width, options.height });
+    scene->setStatistics(options.stats);
+    TracerStats *stats = scene->getStatistics();
+
+    for (const st_benchmark_pose &pose : BENCHMARK_POSES) {
+        st_benchmark_result &pose_result = result.poses.emplace_back();
+        pose_result.pose_name = std::to_string(pose.pitch) + "," + std::to_string(pose.yaw);
+
+        int width = options.width;
+        int height = options.height;
+        scene->prepare(width, height, false, benchmarkCamera(scene->getGeometry(), pose));
+
+        // warm up, compiles the variant and faults in all buffers
+        scene->traceScene(width, height, 0);
+        if (stats) {
+            // drops the warm up counts
+            stats->capture(0);
+            glFinish();
+            stats->collect();
+            stats->resetTotals();
+        }
+        glFinish();
+
+        const auto t_render = std::chrono::steady_clock::now();
+        for (uint32_t sample = 0; sample < options.spp; sample++)
+            scene->traceScene(width, height, sample);
+        glFinish();
+        pose_result.render_ms = millisecondsSince(t_render);
+
+        const double seconds = pose_result.render_ms * 1e-3;
+        pose_result.samples_per_second = options.spp / seconds;
+        pose_result.rays_per_second = (double)width * height * options.spp / seconds;
+
+        if (stats) {
+            stats->capture(options.spp);
+            glFinish();
+            stats->collect();
+            pose_result.stats = stats->totals();
+            pose_result.stats_counted = true;
+            // the same rays the CPU tracer counts, one per intersection of a path vertex
+            uint64_t path_rays = 0;
+            for (uint32_t stat = STAT_RAYS_DEPTH_0; stat <= STAT_RAYS_DEPTH_LAST; stat++)
+                path_rays += pose_result.stats.counters[stat];
+            pose_result.path_rays_per_second = path_rays / seconds;
+        }
+
+        const std::unique_ptr<glm::fvec4[]> pixels = scene->readRenderTarget();
+        const size_t pixel_count = (size_t)width * height;
+        for (size_t i = 0; i < pixel_count; i++)
+            pose_result.mean += glm::dvec3(pixels[i]);
+        pose_result.mean /= (double)pixel_count;
+    }
+
+    result.guide = scene->validatePathGuide();
+    result.guide_checked = true;
+}
+
+static void benchmarkCPU(const st_benchmark_options &options, st_benchmark_scene &result) {
+    const auto t_load = std::chrono::steady_clock::now();
+    SceneGeometry geometry;
+    result.loaded = geometry.addWavefrontModel("./res/models/" + result.name);
+    result.load_ms = millisecondsSince(t_load);
+    if (!result.loaded)
+        return;
+
+    const auto t_build = std::chrono::steady_clock::now();
+    st_triangle_arrays arrays;
+    geometry.buildTriangleArrays(arrays);
+    // the BVH of the tracer counts as building too, as on the GPU
+    const CpuTracer tracer(arrays, geometry.materials);
+    result.build_ms = millisecondsSince(t_build);
+    result.triangles = arrays.models.size();
+    result.peak_rss_mb = peakResidentBytes() / 1048576.0;
+    std::vector<glm::fvec3> image;
+
+    for (const st_benchmark_pose &pose : BENCHMARK_POSES) {
+        st_benchmark_result &pose_result = result.poses.emplace_back();
+        pose_result.pose_name = std::to_string(pose.pitch) + "," + std::to_string(pose.yaw);
+
+        const auto t_render = std::chrono::steady_clock::now();
+        const uint64_t path_rays = tracer.render(benchmarkCamera(geometry, pose), options.width, options.height, options.spp, options.seed, image);
+        pose_result.render_ms = millisecondsSince(t_render);
+
+        const double seconds = pose_result.render_ms * 1e-3;
+        pose_result.samples_per_second = options.spp / seconds;
+        pose_result.rays_per_second = (double)options.width * options.height * options.spp / seconds;
+        pose_result.path_rays_per_second = path_rays / seconds;
+
+        for (const glm::fvec3 &pixel : image)
+            pose_result.mean += glm::dvec3(pixel);
+        pose_result.mean /= (double)image.size();
+    }
+}
+
+static void benchmarkQueries(const st_benchmark_options &options, st_benchmark_scene &result) {
+    const auto t_load = std::chrono::steady_clock::now();
+    SceneGeometry geometry;
+    result.loaded = geometry.addWavefrontModel("./res/models/" + result.name);
+    result.load_ms = millisecondsSince(t_load);
+    if (!result.loaded)
+        return;
+
+    const auto t_build = std::chrono::steady_clock::now();
+    st_triangle_arrays arrays;
+    geometry.orderTriangles(arrays);
+    const RayQuery query(geometry, arrays);
+    result.build_ms = millisecondsSince(t_build);
+    result.triangles = query.size();
+    result.peak_rss_mb = peakResidentBytes() / 1048576.0;
+
+    // camera rays of the first pose on a grid with the aspect of the image, rows keep the packets coherent
+    const uint32_t columns = std::max(1u, (uint32_t)sqrt((double)options.query_rays * options.width / options.height));
+    const uint32_t rows = std::max(1u, options.query_rays / columns);
+    const size_t count = (size_t)columns * rows;
+    const glm::fmat4 camera = benchmarkCamera(geometry, BENCHMARK_POSES[0]);
+    const glm::fvec3 origin(camera * glm::fvec4(0.0f, 0.0f, 0.0f, 1.0f));
+    std::vector<glm::fvec3> origins(count, origin);
+    std::vector<glm::fvec3> directions(count);
+    for (uint32_t y = 0; y < rows; y++) {
+        for (uint32_t x = 0; x < columns; x++) {
+            const glm::fvec3 dtctor((x - 0.5f*columns + 0.5f) / rows, (y + 0.5f) / rows - 0.5f, 0.5f);
+            directions[(size_t)y * columns + x] = glm::normalize(glm::fvec3(camera * glm::fvec4(glm::normalize(dtctor), 0.0f)));
+        }
+    }
+
+    std::vector<st_ray_hit> single(count), hits(count);
+    std::unique_ptr<bool[]> single_occluded(new bool[count]), occluded(new bool[count]);
+    auto measure = [&](const char *mode, auto &&queries) {
+        const auto t_query = std::chrono::steady_clock::now();
+        queries();
+        result.queries.push_back({ mode, count / (millisecondsSince(t_query) * 1e-3) });
+    };
+
+    measure("single_closest", [&]() {
+        for (size_t i = 0; i < count; i++)
+            single[i] = query.closestHit(origins[i], directions[i]);
+    });
+    measure("single_any", [&]() {
+        for (size_t i = 0; i < count; i++)
+            single_occluded[i] = query.anyHit(origins[i], directions[i]);
+    });
+    measure("packet_closest", [&]() {
+        for (size_t i = 0; i < count; i += RayQuery::WIDTH)
+            query.closestHits(&origins[i], &directions[i], (uint32_t)std::min<size_t>(RayQuery::WIDTH, count - i), &hits[i]);
+    });
+    for (size_t i = 0; i < count; i++)
+        result.query_mismatches += hits[i].triangle != single[i].triangle;
+    measure("packet_any", [&]() {
+        for (size_t i = 0; i < count; i += RayQuery::WIDTH)
+            query.anyHits(&origins[i], &directions[i], (uint32_t)std::min<size_t>(RayQuery::WIDTH, count - i), &occluded[i]);
+    });
+    for (size_t i = 0; i < count; i++)
+        result.query_mismatches += occluded[i] != single_occluded[i];
+    measure("stream_closest", [&]() {
+        query.closestHitStream(origins.data(), directions.data(), count, hits.data());
+    });
+    for (size_t i = 0; i < count; i++)
+        result.query_mismatches += hits[i].triangle != single[i].triangle;
+    measure("stream_any", [&]() {
+        query.anyHitStream(origins.data(), directions.data(), count, occluded.get());
+    });
+    for (size_t i = 0; i < count; i++)
+        result.query_mismatches += occluded[i] != single_occluded[i];
+}
+
+/*
+    Every CPU stage that runs on the TaskScheduler, fastest of SCHEDULER_REPEATS runs per thread count.
+    The speedup is against the single thread run, the same work on every thread count.
+*/
+static constexpr int SCHEDULER_REPEATS = 3;
+static constexpr int SCHEDULER_IMAGE_SIZE = 2048;
+
+static std::vector<st_stage_result> benchmarkScheduler() {
+    std::vector<unsigned> thread_counts;
+    const unsigned max_threads = TaskScheduler::threads();
+    for (unsigned threads = 1; threads < max_threads; threads *= 2)
+        thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
+
+    std::vector<st_stage_result> stages;
+    auto measure = [&](const char *name, bool available, auto &&stage) {
+        st_stage_result &result = stages.emplace_back();
+        result.name = name;
+        result.measured = available;
+        if (!available)
+            return;
+        for (const unsigned threads : thread_counts) {
+            TaskScheduler::setThreads(threads);
+            st_stage_run &run = result.runs.emplace_back();
+            run.threads = threads;
+            run.ms = INFINITY;
+            for (int repeat = 0; repeat < SCHEDULER_REPEATS; repeat++) {
+                const auto t_stage = std::chrono::steady_clock::now();
+                stage();
+                run.ms = std::min(run.ms, millisecondsSince(t_stage));
+            }
+            run.speedup = result.runs.front().ms / run.ms;
+        }
+        std::cerr << name << ": done\n";
+    };
+
+    // OBJ parse includes the Triangle constructors and their tangents
+    const std::string model = "./res/models/_ObiWan";
+    SceneGeometry geometry;
+    const bool model_loaded = geometry.addWavefrontModel(model);
+    measure("obj_parse", model_loaded, [&]() {
+        SceneGeometry parsed;
+        parsed.addWavefrontModel(model);
+    });
+    measure("triangle_order", model_loaded, [&]() {
+        st_triangle_arrays arrays;
+        geometry.orderTriangles(arrays);
+    });
+
+    // like building the page file of a streamed material, one task per texture
+    const std::string material = "res/models/textures/planks";
+    const std::string textures[3] = { material + "_albedo.exr", material + "_normal.exr", material + "_arm.exr" };
+    bool textures_found = true;
+    for (const std::string &texture : textures)
+        textures_found &= std::filesystem::exists(texture);
+    measure("texture_decode", textures_found, [&]() {
+        st_exr_image images[3];
+        TaskGroup group;
+        for (int i = 0; i < 3; i++)
+            group.run([&, i]() { decodeEXR(textures[i], images[i]); });
+    });
+
+    // a gradient with some detail, so the compression has work to do
+    const size_t pixel_count = (size_t)SCHEDULER_IMAGE_SIZE * SCHEDULER_IMAGE_SIZE;
+    std::vector<glm::fvec4> image(pixel_count);
+    std::vector<glm::fvec3> rgb(pixel_count);
+    for (size_t i = 0; i < pixel_count; i++) {
+        const float x = (float)(i % SCHEDULER_IMAGE_SIZE) / SCHEDULER_IMAGE_SIZE;
+        const float y = (float)(i / SCHEDULER_IMAGE_SIZE) / SCHEDULER_IMAGE_SIZE;
+        rgb[i] = glm::fvec3(x, y, 0.5f + 0.5f * sinf(40.0f * x * y)) * 4.0f;
+        image[i] = glm::fvec4(rgb[i], 1.0f);
+    }
+
+    const std::string exr = "./res/cache/scheduler-benchmark.exr";
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(exr).parent_path(), ec);
+    measure("exr_encode", true, [&]() {
+        writeEXR(exr, rgb.data(), SCHEDULER_IMAGE_SIZE, SCHEDULER_IMAGE_SIZE);
+    });
+    std::filesystem::remove(exr, ec);
+
+    std::vector<uint8_t> bgr(pixel_count * 3);
+    measure("tone_map", true, [&]() {
+        toneMapBGR8(image.data(), pixel_count, bgr.data());
+    });
+
+    TaskScheduler::setThreads(max_threads);
+    return stages;
+}
+
+static void writeSchedulerJSON(std::ostream &out, const std::vector<st_stage_result> &stages) {
+    out << "{\n";
+    out << "  \"device\": \"cpu\",\n";
+    out << "  \"threads\": " << TaskScheduler::threads() << ",\n";
+    out << "  \"stages\": [\n";
+    for (size_t s = 0; s < stages.size(); s++) {
+        const st_stage_result &stage = stages[s];
+        out << "    { \"name\": \"" << stage.name << "\", \"measured\": " << (stage.measured ? "true" : "false")
+            << ", \"runs\": [";
+        for (size_t r = 0; r < stage.runs.size(); r++) {
+            out << (r ? ", " : " ") << "{ \"threads\": " << stage.runs[r].threads
+                << ", \"ms\": " << stage.runs[r].ms
+                << ", \"speedup\": " << stage.runs[r].speedup << " }";
+        }
+        out << (stage.runs.empty() ? "] }" : " ] }") << (s + 1 < stages.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+static void writeJSON(std::ostream &out, const st_benchmark_options &options, const std::string &device,
+                      const std::vector<st_benchmark_scene> &scenes)
+{
+    out << "{\n";
+    out << "  \"device\": \"" << (options.cpu ? "cpu" : "gpu") << "\",\n";
+    out << "  \"renderer\": \"" << device << "\",\n";
+    out << "  \"rays\": \"" << (options.queries ? "queries" : "camera") << "\",\n";
+    out << "  \"width\": " << options.width << ",\n";
+    out << "  \"height\": " << options.height << ",\n";
+    out << "  \"spp\": " << options.spp << ",\n";
+    out << "  \"seed\": " << options.seed << ",\n";
+    out << "  \"scenes\": [\n";
+    for (size_t i = 0; i < scenes.size(); i++) {
+        const st_benchmark_scene &scene = scenes[i];
+        out << "    {\n";
+        out << "      \"name\": \"" << scene.name << "\",\n";
+        out << "      \"loaded\": " << (scene.loaded ? "true" : "false") << ",\n";
+        out << "      \"triangles\": " << scene.triangles << ",\n";
+        out << "      \"load_ms\": " << scene.load_ms << ",\n";
+        out << "      \"build_ms\": " << scene.build_ms << ",\n";
+        out << "      \"peak_rss_mb\": " << scene.peak_rss_mb << ",\n";
+        if (scene.guide_checked) {
+            out << "      \"guide\": { \"trained_cells\": " << scene.guide.trained_cells
+                << ", \"resolve_error\": " << scene.guide.resolve_error
+                << ", \"sample_error\": " << scene.guide.sample_error << " },\n";
+        }
+        if (scene.bvh_built) {
+            out << "      \"bvh\": { \"quality\": " << (scene.bvh.quality ? "true" : "false")
+                << ", \"nodes\": " << scene.bvh.nodes
+                << ", \"references\": " << scene.bvh.references
+                << ", \"depth\": " << scene.bvh.depth
+                << ", \"base_sah\": " << scene.bvh.base_sah
+                << ", \"split_sah\": " << scene.bvh.split_sah
+                << ", \"sah\": " << scene.bvh.sah
+                << ", \"spatial_splits\": " << scene.bvh.spatial_splits
+                << ", \"restructured_treelets\": " << scene.bvh.restructured_treelets
+                << ", \"base_ms\": " << scene.bvh.base_ms
+                << ", \"quality_ms\": " << scene.bvh.quality_ms << " },\n";
+        }
+        if (options.queries) {
+            out << "      \"query_mismatches\": " << scene.query_mismatches << ",\n";
+            out << "      \"queries\": [\n";
+            for (size_t q = 0; q < scene.queries.size(); q++) {
+                out << "        { \"mode\": \"" << scene.queries[q].mode << "\", \"rays_per_second\": " << scene.queries[q].rays_per_second << " }"
+                    << (q + 1 < scene.queries.size() ? ",\n" : "\n");
+            }
+            out << "      ],\n";
+        }
+        out << "      \"poses\": [\n";
+        for (size_t p = 0; p < scene.poses.size(); p++) {
+            const st_benchmark_result &pose = scene.poses[p];
+            out << "        { \"pose\": \"" << pose.pose_name << "\""
+                << ", \"render_ms\": " << pose.render_ms
+                << ", \"samples_per_second\": " << pose.samples_per_second
+                << ", \"rays_per_second\": " << pose.rays_per_second;
+            if (pose.path_rays_per_second > 0.0)
+                out << ", \"path_rays_per_second\": " << pose.path_rays_per_second;
+            out << ", \"mean\": [" << pose.mean.r << ", " << pose.mean.g << ", " << pose.mean.b << "]";
+            if (pose.stats_counted) {
+                out << ", \"stats\": {";
+                for (uint32_t stat = 0; stat < STAT_COUNT; stat++)
+                    out << (stat ? ", \"" : " \"") << TracerStats::statName(static_cast<TracerStat>(stat)) << "\": " << pose.stats.counters[stat];
+                out << " }";
+            }
+            out << " }"
+                << (p + 1 < scene.poses.size() ? ",\n" : "\n");
+        }
+        out << "      ]\n";
+        out << "    }" << (i + 1 < scenes.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+int runBenchmark(int argc, char* args[]) {
+    st_benchmark_options options;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg(args[i]);
+        if (arg == "--cpu")
+            options.cpu = true;
+        else if (arg == "--width" && i + 1 < argc)
+            options.width = atoi(args[++i]);
+        else if (arg == "--height" && i + 1 < argc)
+            options.height = atoi(args[++i]);
+        else if (arg == "--spp" && i + 1 < argc)
+            options.spp = (uint32_t)atoi(args[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            options.seed = (uint32_t)strtoul(args[++i], nullptr, 10);
+        else if (arg == "--stats")
+            options.stats = true;
+        else if (arg == "--bvh-quality")
+            options.bvh_quality = true;
+        else if (arg == "--queries")
+            options.cpu = options.queries = true;
+        else if (arg == "--scheduler")
+            options.cpu = options.scheduler = true;
+        else if (arg == "--rays" && i + 1 < argc)
+            options.query_rays = std::max(1, atoi(args[++i]));
+        else if (arg == "--out" && i + 1 < argc)
+            options.output = args[++i];
+        else {
+            std::cerr << "Unknown benchmark option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.scheduler) {
+        const std::vector<st_stage_result> stages = benchmarkScheduler();
+        if (options.output.empty()) {
+            writeSchedulerJSON(std::cout, stages);
+        }
+        else {
+            std::ofstream jsonFile(options.output);
+            writeSchedulerJSON(jsonFile, stages);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<st_benchmark_scene> scenes;
+    std::string device;
+
+    GLFWwindow *window = nullptr;
+    if (options.cpu) {
+        device = "cpu x" + std::to_string(TaskScheduler::threads());
+    }
+    else {
+        window = createGLContext(options.width, options.height, "GPU RT - Benchmark", false);
+        if (!window)
+            return 2;
+        device = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    }
+
+    for (const char *name : BENCHMARK_SCENES) {
+        st_benchmark_scene &scene = scenes.emplace_back();
+        scene.name = name;
+        if (options.queries)
+            benchmarkQueries(options, scene);
+        else if (options.cpu)
+            benchmarkCPU(options, scene);
+        else
+            benchmarkGPU(window, options, scene);
+        std::cerr << name << ": " << (scene.loaded ? "done" : "missing") << '\n';
+    }
+
+    if (window)
+        glfwTerminate();
+
+    if (options.output.empty()) {
+        writeJSON(std::cout, options, device, scenes);
+    }
+    else {
+        std::ofstream jsonFile(options.output);
+        writeJSON(jsonFile, options, device, scenes);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+    Deterministic benchmark over the bundled scenes in res/models.
+    Every scene is rendered from fixed camera poses with a fixed seed, resolution and sample count,
+    load time, build time, peak RSS, samples/s and rays/s are reported as JSON. rays_per_second counts camera rays
+    on both devices, path_rays_per_second the path segments without shadow rays, on the GPU only with --stats.
+    The GPU run also checks the path guiding against its CPU reference (PathGuide),
+    with --stats it reports the tracer counters (TracerStats) of every pose.
+    The GPU run reports the SAH cost of the tracer BVH, --bvh-quality adds its quality pass (BVH),
+    comparing the rays/s of a run with and without shows what the lower cost buys.
+    --queries measures the CPU ray queries (RayQuery) with --rays camera rays per mode instead of rendering.
+    --scheduler measures the CPU stages on the TaskScheduler (OBJ parse, triangle order, texture decode,
+    EXR encode, tone mapping) at 1, 2, 4, ... threads up to --threads and reports the speedup of each.
+
+    RayTracer --benchmark [--cpu] [--width W] [--height H] [--spp N] [--seed S] [--stats] [--bvh-quality]
+                          [--queries [--rays N]] [--scheduler] [--out result.json]
+*/
+int runBenchmark(int argc, char* args[]);
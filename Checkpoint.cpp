@@ -0,0 +1,153 @@
+#include "Checkpoint.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+
+
+#pragma pack(push, 1)
+struct st_CHECKPOINT_HEADER {
+    char magic[4]{ 'G', 'R', 'T', 'C' };
+    uint32_t version{ 1 };
+    int32_t width{ 0 };
+    int32_t height{ 0 };
+    uint32_t spp{ 0 };
+    uint32_t seed{ 0 };
+    uint32_t worker{ 0 };
+    uint32_t workers{ 1 };
+    uint32_t next_sample{ 0 };
+    double position[3]{ 0.0, 0.0, 0.0 };
+    double pitch{ 0.0 };
+    double yaw{ 0.0 };
+    uint32_t scene_length{ 0 };
+    uint32_t output_length{ 0 };
+};
+#pragma pack(pop)
+// Followed by the scene name, the output name and width*height RGBA32F pixels
+
+
+bool writeCheckpoint(const std::string &name, const st_checkpoint &checkpoint) {
+    st_CHECKPOINT_HEADER header;
+    header.width = checkpoint.width;
+    header.height = checkpoint.height;
+    header.spp = checkpoint.spp;
+    header.seed = checkpoint.seed;
+    header.worker = checkpoint.worker;
+    header.workers = checkpoint.workers;
+    header.next_sample = checkpoint.next_sample;
+    header.position[0] = checkpoint.position.x;
+    header.position[1] = checkpoint.position.y;
+    header.position[2] = checkpoint.position.z;
+    header.pitch = checkpoint.pitch;
+    header.yaw = checkpoint.yaw;
+    header.scene_length = checkpoint.scene.size();
+    header.output_length = checkpoint.output.size();
+
+    // A crash while writing leaves the previous checkpoint intact
+    const std::string tmp_name = name + ".tmp";
+    {
+        std::ofstream checkpointFile(tmp_name, std::ios::binary);
+        if (!checkpointFile.is_open())
+            return false;
+        checkpointFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        checkpointFile.write(checkpoint.scene.data(), checkpoint.scene.size());
+        checkpointFile.write(checkpoint.output.data(), checkpoint.output.size());
+        checkpointFile.write(reinterpret_cast<const char*>(checkpoint.pixels.get()),
+                             (size_t)checkpoint.width * checkpoint.height * sizeof(glm::fvec4));
+        if (!checkpointFile.good())
+            return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_name, name, ec);
+    return !ec;
+}
+
+bool readCheckpoint(const std::string &name, st_checkpoint &checkpoint) {
+    std::ifstream checkpointFile(name, std::ios::binary | std::ios::ate);
+    if (!checkpointFile.is_open())
+        return false;
+    const uint64_t file_size = (uint64_t)checkpointFile.tellg();
+    checkpointFile.seekg(0);
+
+    st_CHECKPOINT_HEADER header;
+    checkpointFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!checkpointFile.good() || std::memcmp(header.magic, "GRTC", 4) != 0 || header.version != 1 ||
+        !validImageSize(header.width, header.height) || header.scene_length > 4096 || header.output_length > 4096)
+        return false;
+
+    // a truncated checkpoint is rejected before the pixels are allocated
+    const size_t pixel_count = (size_t)header.width * header.height;
+    if (file_size != sizeof(header) + header.scene_length + header.output_length + pixel_count * sizeof(glm::fvec4))
+        return false;
+
+    checkpoint.width = header.width;
+    checkpoint.height = header.height;
+    checkpoint.spp = header.spp;
+    checkpoint.seed = header.seed;
+    checkpoint.worker = header.worker;
+    checkpoint.workers = header.workers;
+    checkpoint.next_sample = header.next_sample;
+    checkpoint.position = glm::dvec3(header.position[0], header.position[1], header.position[2]);
+    checkpoint.pitch = header.pitch;
+    checkpoint.yaw = header.yaw;
+
+    checkpoint.scene.resize(header.scene_length);
+    checkpoint.output.resize(header.output_length);
+    checkpointFile.read(checkpoint.scene.data(), header.scene_length);
+    checkpointFile.read(checkpoint.output.data(), header.output_length);
+
+    checkpoint.pixels.reset(new glm::fvec4[pixel_count]);
+    checkpointFile.read(reinterpret_cast<char*>(checkpoint.pixels.get()), pixel_count * sizeof(glm::fvec4));
+    return checkpointFile.good();
+}
+
+
+CheckpointWriter::CheckpointWriter(const std::string &name)
+    : m_name(name), m_thread(&CheckpointWriter::run, this)
+{
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_signal.notify_all();
+    m_thread.join();
+}
+
+void CheckpointWriter::submit(st_checkpoint &&checkpoint) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.reset(new st_checkpoint(std::move(checkpoint)));
+    }
+    m_signal.notify_all();
+}
+
+void CheckpointWriter::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_signal.wait(lock, [this] { return !m_pending && !m_writing; });
+}
+
+void CheckpointWriter::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_signal.wait(lock, [this] { return m_pending || m_quit; });
+        // pending checkpoints are still written on shutdown
+        if (!m_pending)
+            return;
+
+        std::unique_ptr<st_checkpoint> checkpoint = std::move(m_pending);
+        m_writing = true;
+        lock.unlock();
+
+        if (writeCheckpoint(m_name, *checkpoint))
+            std::cerr << "Checkpoint at sample " << checkpoint->next_sample << " written to " << m_name << '\n';
+        else
+            std::cerr << "Couldn't write checkpoint " << m_name << '\n';
+
+        lock.lock();
+        m_writing = false;
+        m_signal.notify_all();
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <glm/glm.hpp>
+#elif _WIN32
+#include "glm/glm.hpp"
+#endif
+
+
+/*
+    Progress of a batch render, enough to continue it in a new process.
+    The tracer draws its random numbers from the seed, the sample index and the pixel only,
+    so resuming at next_sample continues the exact sequence of the interrupted run.
+*/
+struct st_checkpoint {
+    std::string scene{};
+    std::string output{};
+    int width{ 0 };
+    int height{ 0 };
+    uint32_t spp{ 0 };
+    uint32_t seed{ 0 };
+    uint32_t worker{ 0 };
+    uint32_t workers{ 1 };
+    uint32_t next_sample{ 0 };
+    glm::dvec3 position{ 0.0 };
+    double pitch{ 0.0 };
+    double yaw{ 0.0 };
+
+    // Render target, mean radiance and sample count per pixel
+    std::unique_ptr<glm::fvec4[]> pixels{};
+};
+
+// Largest image a checkpoint or a partial holds and the job limits of the render daemon, 64M pixels are about 1 GB per RGBA32F target
+static constexpr int MAX_IMAGE_DIMENSION = 16384;
+static constexpr int64_t MAX_IMAGE_PIXELS = int64_t(1) << 26;
+inline bool validImageSize(int width, int height) {
+    return width > 0 && height > 0 && width <= MAX_IMAGE_DIMENSION && height <= MAX_IMAGE_DIMENSION
+        && (int64_t)width * height <= MAX_IMAGE_PIXELS;
+}
+
+bool writeCheckpoint(const std::string &name, const st_checkpoint &checkpoint);
+bool readCheckpoint(const std::string &name, st_checkpoint &checkpoint);
+
+
+/*
+    Writes checkpoints on its own thread, the render loop only pays for the readback.
+    A checkpoint submitted while the previous one is still written replaces the pending one.
+*/
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(const std::string &name);
+    ~CheckpointWriter();
+
+    void submit(st_checkpoint &&checkpoint);
+
+    // Blocks until the pending checkpoint is on disk
+    void flush();
+
+private:
+    void run();
+
+    std::string m_name;
+    std::mutex m_mutex;
+    std::condition_variable m_signal;
+    std::unique_ptr<st_checkpoint> m_pending{};
+    bool m_writing{ false };
+    bool m_quit{ false };
+    std::thread m_thread;
+};
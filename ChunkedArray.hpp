@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+/*
+    Growable array stored in chunks that never move.
+    Appending never copies the existing elements, so loading a large mesh doesn't hold
+    the old and the grown storage at the same time like std::vector does on reallocation.
+    The chunks double from 64 up to 65536 elements, after that all chunks have 65536 elements,
+    objects with few triangles stay small. T has to be default constructible.
+*/
+template<typename T>
+class ChunkedArray {
+    static constexpr size_t FIRST_BITS = 6;
+    static constexpr size_t LAST_BITS = 16;
+    static constexpr size_t GROWING_CHUNKS = LAST_BITS - FIRST_BITS + 1;
+    // elements in the chunks of increasing size
+    static constexpr size_t GROWING_END = ((size_t(1) << GROWING_CHUNKS) - 1) << FIRST_BITS;
+
+    template<typename Array, typename Element>
+    class Iterator {
+    public:
+        Iterator(Array *array, size_t index) : m_array(array), m_index(index) {}
+        Element &operator*() const { return (*m_array)[m_index]; }
+        Element *operator->() const { return &(*m_array)[m_index]; }
+        Iterator &operator++() { m_index++; return *this; }
+        bool operator==(const Iterator &other) const { return m_index == other.m_index; }
+        bool operator!=(const Iterator &other) const { return m_index != other.m_index; }
+    private:
+        Array *m_array;
+        size_t m_index;
+    };
+
+public:
+    using iterator = Iterator<ChunkedArray, T>;
+    using const_iterator = Iterator<const ChunkedArray, const T>;
+
+    [[nodiscard]] inline size_t size() const noexcept { return m_size; }
+    [[nodiscard]] inline bool empty() const noexcept { return m_size == 0; }
+
+    inline T &operator[](size_t index) {
+        const auto [chunk, offset] = locate(index);
+        return m_chunks[chunk][offset];
+    }
+    inline const T &operator[](size_t index) const {
+        const auto [chunk, offset] = locate(index);
+        return m_chunks[chunk][offset];
+    }
+
+    template<typename... Args>
+    T &emplace_back(Args&&... args) {
+        const auto [chunk, offset] = locate(m_size);
+        if (chunk == m_chunks.size())
+            m_chunks.emplace_back(new T[chunkSize(chunk)]);
+        m_size++;
+        return m_chunks[chunk][offset] = T(std::forward<Args>(args)...);
+    }
+
+    // Grows to size default constructed elements, for filling them in any order or in parallel
+    void resize(size_t size) {
+        if (size > 0) {
+            const size_t chunks = locate(size - 1).first + 1;
+            while (m_chunks.size() < chunks)
+                m_chunks.emplace_back(new T[chunkSize(m_chunks.size())]);
+        }
+        m_size = size;
+    }
+
+    void clear() {
+        m_chunks.clear();
+        m_size = 0;
+    }
+
+    // Heap memory held by the elements
+    [[nodiscard]] size_t capacityBytes() const noexcept {
+        size_t elements = 0;
+        for (size_t chunk = 0; chunk < m_chunks.size(); chunk++)
+            elements += chunkSize(chunk);
+        return elements * sizeof(T);
+    }
+
+    inline iterator begin() { return iterator(this, 0); }
+    inline iterator end() { return iterator(this, m_size); }
+    inline const_iterator begin() const { return const_iterator(this, 0); }
+    inline const_iterator end() const { return const_iterator(this, m_size); }
+
+private:
+    static constexpr size_t chunkSize(size_t chunk) {
+        return size_t(1) << (FIRST_BITS + std::min(chunk, GROWING_CHUNKS - 1));
+    }
+
+    static constexpr std::pair<size_t, size_t> locate(size_t index) {
+        if (index < GROWING_END) {
+            // chunk k starts at 64 * (2^k - 1)
+            const size_t chunk = std::bit_width((index >> FIRST_BITS) + 1) - 1;
+            return { chunk, index - (((size_t(1) << chunk) - 1) << FIRST_BITS) };
+        }
+        const size_t rest = index - GROWING_END;
+        return { GROWING_CHUNKS + (rest >> LAST_BITS), rest & ((size_t(1) << LAST_BITS) - 1) };
+    }
+
+    std::vector<std::unique_ptr<T[]>> m_chunks{};
+    size_t m_size{ 0 };
+};
@@ -0,0 +1,41 @@
+#include "Context.hpp"
+#include <iostream>
+
+
+GLFWwindow *createGLContext(int width, int height, const char *title, bool visible) {
+    if (glfwInit() != GLFW_TRUE) {
+        std::cerr << "Cannot initialize GLFW\n";
+        return nullptr;
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
+
+    glfwWindowHint(GLFW_RED_BITS,             10);
+    glfwWindowHint(GLFW_GREEN_BITS,           10);
+    glfwWindowHint(GLFW_BLUE_BITS,            10);
+    glfwWindowHint(GLFW_ALPHA_BITS,            2);
+
+    GLFWwindow *window = glfwCreateWindow(width, height, title, nullptr, nullptr);
+    if (!window) {
+        std::cerr << "Cannot create a GL 4.3 context\n";
+        glfwTerminate();
+        return nullptr;
+    }
+    glfwMakeContextCurrent(window);
+
+    glViewport(0, 0, width, height);
+
+    GLenum err = glewInit();
+    if (err != GLEW_OK) {
+        std::cerr << "GLEW Init error:\n" << glewGetErrorString(err) << '\n';
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return nullptr;
+    }
+
+    return window;
+}
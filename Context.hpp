@@ -0,0 +1,17 @@
+#pragma once
+
+#ifdef __linux__
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#elif _WIN32
+#include "GL/glew.h"
+#include "GLFW/glfw3.h"
+#endif
+
+
+/*
+    Initializes GLFW, opens a window with a 4.3 core context and loads the GL functions.
+    Invisible windows are used by the batch modes which never present.
+    Returns nullptr on failure.
+*/
+GLFWwindow *createGLContext(int width, int height, const char *title, bool visible);
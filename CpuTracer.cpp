@@ -0,0 +1,236 @@
+#include "CpuTracer.hpp"
+#include "TaskScheduler.hpp"
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+
+static constexpr float TWO_PI = 6.283185307179586f;
+
+static inline uint32_t pcgHash(uint32_t k) {
+    const uint32_t state = k * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// Owen-scrambled Sobol sampler of raytracer.glsl
+struct st_sampler {
+    uint32_t pixel_seed;
+    uint32_t sample;
+    uint32_t dimension{ 0 };
+};
+
+static inline glm::fvec2 unitFloat2(st_sampler &sampler) {
+    const uint32_t seed = pcgHash(sampler.pixel_seed ^ pcgHash(sampler.dimension++));
+    const uint32_t index = nestedUniformScramble(sampler.sample, seed);
+
+    uint32_t y = 0u;
+    uint32_t v = 1u << 31;
+    for (uint32_t bits = index; bits != 0u; bits >>= 1, v ^= v >> 1) {
+        if (bits & 1u)
+            y ^= v;
+    }
+    const uint32_t sx = nestedUniformScramble(reverseBits(index), pcgHash(seed));
+    const uint32_t sy = nestedUniformScramble(y, pcgHash(seed + 1u));
+    return glm::fvec2((float)(sx >> 8), (float)(sy >> 8)) * (1.0f / 16777216.0f);
+}
+
+static inline float unitFloat(st_sampler &sampler) {
+    return unitFloat2(sampler).x;
+}
+
+static inline glm::fvec3 randomSphere(st_sampler &sampler) {
+    const glm::fvec2 u = unitFloat2(sampler);
+    const float theta = TWO_PI * u.x;
+    const float x = u.y * 2.0f - 1.0f;
+    const float sinx = sqrtf(1.0f - x*x);
+    return glm::fvec3(sinx * cosf(theta), sinx * sinf(theta), x);
+}
+
+
+// Same formulation as intersectTriangle in raytracer.glsl, the division is only done for the closest hit
+static inline bool intersectTriangle(const glm::fvec3 &position, const glm::fvec3 &direction, const TriangleModel &tri, glm::fvec4 &isec) {
+    const float determinant = -glm::dot(direction, tri.true_normal);
+    if (determinant <= 0.0f)
+        return false;
+
+    const glm::fvec3 delta = position - tri.position;
+    const float relative_depth = glm::dot(tri.true_normal, delta);
+    if (relative_depth <= 0.0f)
+        return false;
+
+    if (isec.z >= 0.0f && relative_depth*isec.w > isec.z * determinant)
+        return false;
+
+    const glm::fvec3 minor = glm::cross(direction, delta);
+    const float u = -glm::dot(minor, tri.span_v);
+    const float v = glm::dot(minor, tri.span_u);
+    if (u < 0.0f || v < 0.0f || u + v > determinant)
+        return false;
+
+    isec = glm::fvec4(u, v, relative_depth, determinant);
+    return true;
+}
+
+// intersectNode of raytracer.glsl, the distance at which the ray enters the bounds, -1 if it misses them before max_t
+static inline float intersectNode(const glm::fvec3 &position, const glm::fvec3 &inv_direction, const st_bvh_node &node, float max_t) {
+    const glm::fvec3 t0 = (node.bb_min - position) * inv_direction;
+    const glm::fvec3 t1 = (node.bb_max - position) * inv_direction;
+    const glm::fvec3 near = glm::min(t0, t1);
+    const glm::fvec3 far = glm::max(t0, t1);
+    const float enter = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+    const float leave = std::min(std::min(far.x, far.y), std::min(far.z, max_t));
+    return (enter <= leave) ? enter : -1.0f;
+}
+
+
+CpuTracer::CpuTracer(const st_triangle_arrays &arrays, const std::vector<Material> &materials)
+    : m_arrays(arrays), m_materials(materials)
+{
+    std::vector<glm::fvec3> vertices;
+    vertices.reserve(3 * arrays.models.size());
+    for (const TriangleModel &tri : arrays.models) {
+        vertices.push_back(tri.position);
+        vertices.push_back(tri.position + tri.span_u);
+        vertices.push_back(tri.position + tri.span_v);
+    }
+    // the slots stay as they are, the quality pass doesn't pay off for one render
+    m_bvh.build(vertices, false);
+}
+
+int CpuTracer::findIntersection(const glm::fvec3 &position, const glm::fvec3 &direction, glm::fvec3 &intersection) const {
+    // findIntersection of raytracer.glsl, the nearer child first and the other one skipped once a closer hit is known
+    int current_tri = -1;
+    glm::fvec4 isec(0.0f, 0.0f, -1.0f, 1.0f);
+    const std::vector<st_bvh_node> &nodes = m_bvh.nodes();
+    const std::vector<uint32_t> &references = m_bvh.references();
+    // axis parallel rays get a huge but finite slope, so the slab test has no 0 * inf
+    const glm::fvec3 inv_direction(1.0f / (direction.x != 0.0f ? direction.x : 1e-20f),
+                                   1.0f / (direction.y != 0.0f ? direction.y : 1e-20f),
+                                   1.0f / (direction.z != 0.0f ? direction.z : 1e-20f));
+
+    uint32_t stack[BVH::MAX_DEPTH];
+    int top = 0;
+    if (!nodes.empty() && intersectNode(position, inv_direction, nodes[0], 3.0e38f) >= 0.0f)
+        stack[top++] = 0;
+
+    while (top > 0) {
+        const uint32_t index = stack[--top];
+        const st_bvh_node &node = nodes[index];
+        if (node.count > 0) {
+            for (uint32_t r = node.offset; r < node.offset + node.count; r++) {
+                const uint32_t triID = references[r];
+                if (intersectTriangle(position, direction, m_arrays.models[triID], isec))
+                    current_tri = (int)triID;
+            }
+            continue;
+        }
+
+        const float max_t = (isec.z >= 0.0f && isec.w > 0.0f) ? isec.z / isec.w : 3.0e38f;
+        uint32_t near_child = index + 1;
+        uint32_t far_child = node.offset;
+        float near_t = intersectNode(position, inv_direction, nodes[near_child], max_t);
+        float far_t = intersectNode(position, inv_direction, nodes[far_child], max_t);
+        if (far_t >= 0.0f && (near_t < 0.0f || far_t < near_t)) {
+            std::swap(near_child, far_child);
+            std::swap(near_t, far_t);
+        }
+        if (far_t >= 0.0f)
+            stack[top++] = far_child;
+        if (near_t >= 0.0f)
+            stack[top++] = near_child;
+    }
+
+    intersection = glm::fvec3(isec) * (1.0f / isec.w);
+    return current_tri;
+}
+
+glm::fvec3 CpuTracer::trace(glm::fvec3 position, glm::fvec3 direction, st_sampler &sampler, uint64_t &rays) const {
+    glm::fvec3 energy(0.0f);
+    glm::fvec3 path(1.0f);
+
+    for (int depth = 0; depth < recursion; depth++) {
+        glm::fvec3 sec;
+        const int current_tri = findIntersection(position, direction, sec);
+        rays++;
+
+        if (current_tri < 0) {
+            energy += sky * path;
+            break;
+        }
+
+        const TriangleShading &tri = m_arrays.shadings[current_tri];
+        const Material &material = m_materials[tri.material_id];
+        if (current_tri < (int)m_arrays.lights)
+            energy += path * glm::fvec3(material.emission_ior);
+
+        const glm::fvec3 N = glm::normalize(tri.normals[0] * (1.0f - sec.x - sec.y) + tri.normals[1] * sec.x + tri.normals[2] * sec.y);
+
+        position += direction * sec.z;
+        direction = glm::normalize(randomSphere(sampler) + N);
+        path *= glm::fvec3(material.albedo);
+
+        if (glm::dot(direction, m_arrays.models[current_tri].true_normal) <= 0.0f)
+            break;
+
+        // Russian roulette
+        const float brightness = glm::clamp((path.r + path.g + path.b) / 3.0f, 1.0f/8.0f, 1.0f);
+        if (unitFloat(sampler) > brightness)
+            break;
+        path /= brightness;
+    }
+
+    return energy;
+}
+
+uint64_t CpuTracer::render(const glm::fmat4 &camera, int width, int height, uint32_t spp, uint32_t seed,
+                           std::vector<glm::fvec3> &image) const
+{
+    image.assign((size_t)width * height, glm::fvec3(0.0f));
+
+    const float inv_width = 1.0f / width;
+    const float inv_height = 1.0f / height;
+    const glm::fvec3 origin(camera * glm::fvec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+    std::atomic<uint64_t> total_rays{ 0 };
+
+    TaskScheduler::parallelFor(0, height, 1, [&](size_t first_row, size_t last_row) {
+        uint64_t rays = 0;
+        for (int y = (int)first_row; y < (int)last_row; y++) {
+            for (int x = 0; x < width; x++) {
+                glm::fvec3 color(0.0f);
+                for (uint32_t sample = 0; sample < spp; sample++) {
+                    st_sampler sampler{ pcgHash(seed ^ pcgHash(x * height + y)), sample };
+                    const glm::fvec2 jitter = unitFloat2(sampler);
+                    const glm::fvec3 dtctor = glm::normalize(glm::fvec3((x - 0.5f*width + 0.5f)*inv_height, (y + 0.5f)*inv_height - 0.5f, 0.5f)
+                                                             + glm::fvec3(jitter.x*inv_width, jitter.y*inv_height, 0.0f));
+                    const glm::fvec3 direction = glm::normalize(glm::fvec3(camera * glm::fvec4(glm::normalize(dtctor), 0.0f)));
+                    color += trace(origin, direction, sampler, rays);
+                }
+                image[(size_t)y * width + x] = color / (float)spp;
+            }
+        }
+        total_rays += rays;
+    });
+
+    return total_rays;
+}
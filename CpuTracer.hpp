@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "SceneGeometry.hpp"
+#include "BVH.hpp"
+
+struct st_sampler;
+
+
+/*
+    Multithreaded CPU fallback of the path tracer for machines without a capable GPU.
+    It uses the same triangle arrays, camera model, sampler, BVH traversal and ray-triangle intersection as
+    raytracer.glsl, but shades with diffuse bounces and a constant sky only. The BVH is the base build over the
+    slots of the arrays, built by the constructor.
+*/
+class CpuTracer {
+public:
+    CpuTracer(const st_triangle_arrays &arrays, const std::vector<Material> &materials);
+
+    // Renders the mean of spp samples per pixel into image (RGB, width*height), returns the number of traced rays
+    uint64_t render(const glm::fmat4 &camera, int width, int height, uint32_t spp, uint32_t seed,
+                    std::vector<glm::fvec3> &image) const;
+
+    int recursion{ 6 };
+    glm::fvec3 sky{ 1.0f };
+
+private:
+    int findIntersection(const glm::fvec3 &position, const glm::fvec3 &direction, glm::fvec3 &intersection) const;
+    glm::fvec3 trace(glm::fvec3 position, glm::fvec3 direction, st_sampler &sampler, uint64_t &rays) const;
+
+    const st_triangle_arrays &m_arrays;
+    const std::vector<Material> &m_materials;
+    BVH m_bvh;
+};
@@ -0,0 +1,521 @@
+#include "Daemon.hpp"
+#include "Context.hpp"
+#include "Scene.hpp"
+#include "Checkpoint.hpp"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <glm/gtx/transform.hpp>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#elif _WIN32
+#include "glm/gtx/transform.hpp"
+#endif
+
+
+static const char *SOCKET_NAME = "gpu-raytracer.sock";
+static const char *DEFAULT_OUTPUT_DIRECTORY = "./res/final";
+// one request can't take the GPU forever, its size is bounded by validImageSize()
+static constexpr uint32_t MAX_SPP = 65536;
+
+struct st_render_job {
+    uint64_t id{ 0 };
+    int priority{ 0 };
+    int width{ 1920 };
+    int height{ 1080 };
+    uint32_t spp{ 64 };
+    uint32_t seed{ 95834783u };
+    glm::dvec3 position{ 0.0, 1.5, -3.0 };
+    double pitch{ -M_PI_4 };
+    double yaw{ 0.0 };
+    std::string scene{};
+    std::string output{};
+    // Connection of the client, progress and the result are written to it
+    int client{ -1 };
+};
+
+#ifdef __linux__
+
+// In the private runtime directory of the user, /tmp with the uid in the name without one
+static std::string defaultSocketPath() {
+    const char *runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0] == '/')
+        return std::string(runtime) + '/' + SOCKET_NAME;
+    return "/tmp/gpu-raytracer-" + std::to_string(getuid()) + ".sock";
+}
+
+// A relative path without "..", so a client can only name files below a directory the daemon owner chose
+static bool isConfinedPath(const std::string &name) {
+    const std::filesystem::path path(name);
+    if (name.empty() || path.is_absolute() || path.has_root_name() || path.has_root_directory())
+        return false;
+    for (const std::filesystem::path &part : path) {
+        if (part == "..")
+            return false;
+    }
+    return true;
+}
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int) {
+    interrupted = 1;
+}
+
+static bool sendLine(int fd, const std::string &line) {
+    const std::string data = line + '\n';
+    size_t sent = 0;
+    while (sent < data.size()) {
+        // MSG_NOSIGNAL, a client that went away must not kill the daemon
+        const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+static bool readLine(int fd, std::string &buffer, std::string &line) {
+    while (true) {
+        const size_t end = buffer.find('\n');
+        if (end != std::string::npos) {
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return true;
+        }
+        if (buffer.size() > 16384)
+            return false;
+
+        char chunk[1024];
+        const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, n);
+    }
+}
+
+static int connectSocket(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return -1;
+    std::copy(path.begin(), path.end(), address.sun_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/*
+    Loaded scenes by path, the most recently used in front.
+    Only touched by the render thread, which owns the GL context.
+*/
+class SceneCache {
+public:
+    SceneCache(GLFWwindow *window, size_t capacity) : m_window(window), m_capacity(std::max<size_t>(capacity, 1)) {}
+
+    Scene *acquire(const std::string &name) {
+        for (auto it = m_scenes.begin(); it != m_scenes.end(); ++it) {
+            if (it->first == name) {
+                m_scenes.splice(m_scenes.begin(), m_scenes, it);
+                return m_scenes.front().second.get();
+            }
+        }
+
+        std::unique_ptr<Scene> scene(new Scene());
+        if (!scene->addWavefrontModel("./res/models/" + name))
+            return nullptr;
+        scene->finalizeObjects();
+        scene->loadEnvironmentTexture(m_window, "res/models/textures/brownStudio.exr");
+        scene->loadMaterial("res/models/textures/planks", 0);
+        scene->loadMaterial("res/models/textures/aluminium", 1);
+
+        while (m_scenes.size() >= m_capacity) {
+            std::cerr << "Evicting " << m_scenes.back().first << '\n';
+            m_scenes.pop_back();
+        }
+        m_scenes.emplace_front(name, std::move(scene));
+        std::cerr << "Loaded " << name << ", " << m_scenes.size() << '/' << m_capacity << " scenes resident\n";
+        return m_scenes.front().second.get();
+    }
+
+    inline void clear() { m_scenes.clear(); }
+
+private:
+    GLFWwindow *m_window;
+    size_t m_capacity;
+    std::list<std::pair<std::string, std::unique_ptr<Scene>>> m_scenes{};
+};
+
+
+/*
+    Pending jobs, highest priority first and in arrival order within a priority.
+    Filled by the socket thread and drained by the render thread.
+*/
+class JobQueue {
+public:
+    void push(st_render_job &&job) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto position = std::find_if(m_jobs.begin(), m_jobs.end(),
+                                           [&job](const st_render_job &queued) { return queued.priority < job.priority; });
+        m_jobs.insert(position, std::move(job));
+        m_signal.notify_all();
+    }
+
+    // Number of jobs a new one with this priority would wait for
+    size_t position(int priority) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return std::count_if(m_jobs.begin(), m_jobs.end(),
+                             [priority](const st_render_job &queued) { return queued.priority >= priority; });
+    }
+
+    // Waits up to timeout_ms for a job, returns false if there was none
+    bool pop(st_render_job &job, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_signal.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return !m_jobs.empty(); }))
+            return false;
+        job = std::move(m_jobs.front());
+        m_jobs.erase(m_jobs.begin());
+        return true;
+    }
+
+    std::vector<std::string> describe() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<std::string> lines;
+        for (const st_render_job &job : m_jobs)
+            lines.push_back("job " + std::to_string(job.id) + ' ' + std::to_string(job.priority) + ' ' + job.scene);
+        return lines;
+    }
+
+    // Jobs left when the daemon stops
+    std::vector<st_render_job> drain() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<st_render_job> jobs = std::move(m_jobs);
+        m_jobs.clear();
+        return jobs;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_signal;
+    std::vector<st_render_job> m_jobs{};
+};
+
+
+static bool parseJob(std::istringstream &fields, st_render_job &job) {
+    return (bool)(fields >> job.priority >> job.width >> job.height >> job.spp >> job.seed
+                         >> job.position.x >> job.position.y >> job.position.z >> job.pitch >> job.yaw)
+           && job.width > 0 && job.height > 0 && job.spp > 0;
+}
+
+static bool withinLimits(const st_render_job &job) {
+    return validImageSize(job.width, job.height) && job.spp <= MAX_SPP;
+}
+
+static void acceptClients(int listener, const std::string &output_directory, JobQueue &queue, std::atomic<bool> &quit) {
+    uint64_t next_id = 1;
+    while (!quit) {
+        const int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            // shutdown() of the listener wakes accept up when the daemon stops
+            if (quit)
+                return;
+            continue;
+        }
+        // Local clients send their request right away, a stuck one can't hold up the others for long
+        timeval timeout{ 5, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::string buffer, line;
+        if (!readLine(client, buffer, line)) {
+            close(client);
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string command;
+        fields >> command;
+
+        if (command == "status") {
+            for (const std::string &job : queue.describe())
+                sendLine(client, job);
+            sendLine(client, "end");
+            close(client);
+        }
+        else if (command == "quit") {
+            sendLine(client, "bye");
+            close(client);
+            quit = true;
+        }
+        else if (command == "render") {
+            st_render_job job;
+            job.id = next_id++;
+            if (!parseJob(fields, job) || !readLine(client, buffer, job.scene) || !readLine(client, buffer, job.output) ||
+                job.scene.empty() || job.output.empty()) {
+                sendLine(client, "error " + std::to_string(job.id) + " malformed request");
+                close(client);
+                continue;
+            }
+            if (!withinLimits(job)) {
+                sendLine(client, "error " + std::to_string(job.id) + " at most " + std::to_string(MAX_IMAGE_DIMENSION) + " pixels per side, "
+                                 + std::to_string(MAX_IMAGE_PIXELS) + " pixels and " + std::to_string(MAX_SPP) + " samples");
+                close(client);
+                continue;
+            }
+            if (!isConfinedPath(job.scene) || !isConfinedPath(job.output)) {
+                sendLine(client, "error " + std::to_string(job.id) + " scene and output have to be relative paths without ..");
+                close(client);
+                continue;
+            }
+            job.output = output_directory + '/' + job.output;
+            job.client = client;
+            std::cerr << "Job " << job.id << " queued: " << job.scene << " -> " << job.output << '\n';
+            // queued is written before the render thread can answer on the connection
+            sendLine(client, "queued " + std::to_string(job.id) + ' ' + std::to_string(queue.position(job.priority)));
+            queue.push(std::move(job));
+        }
+        else {
+            sendLine(client, "error 0 unknown command " + command);
+            close(client);
+        }
+    }
+}
+
+static void renderJob(SceneCache &scenes, const st_render_job &job) {
+    const std::string id = std::to_string(job.id);
+    Scene *scene = scenes.acquire(job.scene);
+    if (!scene) {
+        sendLine(job.client, "error " + id + " scene " + job.scene + " does not exist");
+        return;
+    }
+
+    scene->bind();
+    scene->setSeed(job.seed);
+    scene->adaptResolution({ job.width, job.height });
+
+    // CAMERA = T * R_y(-yaw) * R_x(-pitch), as in the interactive loop
+    const glm::fmat4 camera = glm::translate(job.position)
+                            * glm::rotate(-job.yaw, glm::dvec3(0.0, 1.0, 0.0))
+                            * glm::rotate(-job.pitch, glm::dvec3(1.0, 0.0, 0.0));
+    int width = job.width;
+    int height = job.height;
+    scene->prepare(width, height, false, camera);
+    scene->settleTextures(width, height);
+
+    for (uint32_t sample = 0; sample < job.spp; sample++) {
+        scene->traceScene(width, height, sample);
+        if (sample % 16 == 15 && sample + 1 < job.spp) {
+            glFinish();
+            sendLine(job.client, "progress " + id + ' ' + std::to_string(sample + 1) + ' ' + std::to_string(job.spp));
+        }
+    }
+    glFinish();
+
+    if (scene->exportEXR(job.output.c_str()))
+        sendLine(job.client, "done " + id + ' ' + job.output);
+    else
+        sendLine(job.client, "error " + id + " couldn't write " + job.output);
+}
+
+int runDaemon(int argc, char* args[]) {
+    std::string path = defaultSocketPath();
+    std::string output_directory(DEFAULT_OUTPUT_DIRECTORY);
+    size_t max_scenes = 2;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg(args[i]);
+        if (arg == "--socket" && i + 1 < argc)
+            path = args[++i];
+        else if (arg == "--output-dir" && i + 1 < argc)
+            output_directory = args[++i];
+        else if (arg == "--max-scenes" && i + 1 < argc)
+            max_scenes = (size_t)std::max(1, atoi(args[++i]));
+        else {
+            std::cerr << "Unknown daemon option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << '\n';
+        return EXIT_FAILURE;
+    }
+    std::copy(path.begin(), path.end(), address.sun_path);
+
+    // A socket file left by a crashed daemon is reused, a running one is not taken over
+    const int probe = connectSocket(path);
+    if (probe >= 0) {
+        close(probe);
+        std::cerr << "A daemon already listens on " << path << '\n';
+        return EXIT_FAILURE;
+    }
+    unlink(path.c_str());
+
+    // Only the owner may connect, the socket is created with that mode so no other user gets in before the chmod
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    const mode_t previous_umask = umask(0177);
+    const bool bound = listener >= 0 && bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(previous_umask);
+    if (!bound || chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(listener, 16) != 0) {
+        std::cerr << "Couldn't listen on " << path << '\n';
+        if (listener >= 0)
+            close(listener);
+        if (bound)
+            unlink(path.c_str());
+        return EXIT_FAILURE;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(output_directory, ec);
+
+    GLFWwindow *window = createGLContext(1280, 720, "GPU RT - Daemon", false);
+    if (!window) {
+        close(listener);
+        unlink(path.c_str());
+        return 2;
+    }
+
+    std::signal(SIGINT, onInterrupt);
+    std::signal(SIGTERM, onInterrupt);
+
+    JobQueue queue;
+    std::atomic<bool> quit{ false };
+    std::thread acceptor(acceptClients, listener, std::cref(output_directory), std::ref(queue), std::ref(quit));
+    std::cerr << "Listening on " << path << ", writing to " << output_directory << '\n';
+
+    {
+        // Released before the context is gone
+        SceneCache scenes(window, max_scenes);
+        while (!quit && !interrupted) {
+            st_render_job job;
+            if (!queue.pop(job, 250))
+                continue;
+            std::cerr << "Job " << job.id << ": " << job.scene << ' ' << job.width << 'x' << job.height << ", " << job.spp << " samples\n";
+            renderJob(scenes, job);
+            close(job.client);
+        }
+        scenes.clear();
+    }
+
+    quit = true;
+    shutdown(listener, SHUT_RDWR);
+    acceptor.join();
+    close(listener);
+    unlink(path.c_str());
+
+    for (st_render_job &job : queue.drain()) {
+        sendLine(job.client, "error " + std::to_string(job.id) + " daemon stopped");
+        close(job.client);
+    }
+
+    glfwTerminate();
+    return EXIT_SUCCESS;
+}
+
+int runClient(int argc, char* args[]) {
+    std::string path = defaultSocketPath();
+    st_render_job job;
+    std::string command("render");
+    for (int i = 2; i < argc; i++) {
+        const std::string arg(args[i]);
+        if (arg == "--socket" && i + 1 < argc)
+            path = args[++i];
+        else if (arg == "--status")
+            command = "status";
+        else if (arg == "--quit")
+            command = "quit";
+        else if (arg == "--out" && i + 1 < argc)
+            job.output = args[++i];
+        else if (arg == "--width" && i + 1 < argc)
+            job.width = atoi(args[++i]);
+        else if (arg == "--height" && i + 1 < argc)
+            job.height = atoi(args[++i]);
+        else if (arg == "--spp" && i + 1 < argc)
+            job.spp = (uint32_t)atoi(args[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            job.seed = (uint32_t)strtoul(args[++i], nullptr, 10);
+        else if (arg == "--priority" && i + 1 < argc)
+            job.priority = atoi(args[++i]);
+        else if (arg == "--camera" && i + 5 < argc) {
+            job.position = glm::dvec3(atof(args[i+1]), atof(args[i+2]), atof(args[i+3]));
+            job.pitch = atof(args[i+4]);
+            job.yaw = atof(args[i+5]);
+            i += 5;
+        }
+        else if (arg.rfind("--", 0) != 0 && job.scene.empty())
+            job.scene = arg;
+        else {
+            std::cerr << "Unknown client option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    if (command == "render" && (job.scene.empty() || job.output.empty())) {
+        std::cerr << "Usage: RayTracer --client <scene> --out final.exr [--socket PATH] ...\n";
+        return EXIT_FAILURE;
+    }
+
+    const int fd = connectSocket(path);
+    if (fd < 0) {
+        std::cerr << "No daemon listens on " << path << '\n';
+        return 2;
+    }
+
+    bool sent = true;
+    if (command == "render") {
+        std::ostringstream request;
+        request.precision(17);
+        request << "render " << job.priority << ' ' << job.width << ' ' << job.height << ' ' << job.spp << ' ' << job.seed << ' '
+                << job.position.x << ' ' << job.position.y << ' ' << job.position.z << ' ' << job.pitch << ' ' << job.yaw << '\n'
+                << job.scene << '\n' << job.output;
+        sent = sendLine(fd, request.str());
+    }
+    else {
+        sent = sendLine(fd, command);
+    }
+
+    // Everything the daemon answers is printed until it closes the connection
+    int ret = sent ? EXIT_SUCCESS : EXIT_FAILURE;
+    std::string buffer, line;
+    while (sent && readLine(fd, buffer, line)) {
+        std::cout << line << std::endl;
+        if (line.rfind("error", 0) == 0)
+            ret = EXIT_FAILURE;
+    }
+    close(fd);
+    return ret;
+}
+
+#elif _WIN32
+
+int runDaemon(int argc, char* args[]) {
+    std::cerr << "The render daemon needs Unix domain sockets\n";
+    return EXIT_FAILURE;
+}
+
+int runClient(int argc, char* args[]) {
+    std::cerr << "The render daemon needs Unix domain sockets\n";
+    return EXIT_FAILURE;
+}
+
+#endif
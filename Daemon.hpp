@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+    Resident render service. The daemon keeps recently used scenes loaded (OBJ, textures, irradiance
+    and tracer programs) and renders jobs sent over a local Unix socket, highest priority first.
+
+    RayTracer --daemon [--socket PATH] [--output-dir DIR] [--max-scenes N]
+    RayTracer --client <scene> --out final.exr [--socket PATH] [--width W] [--height H] [--spp N]
+                       [--seed S] [--camera X Y Z PITCH YAW] [--priority P]
+    RayTracer --client --status | --quit [--socket PATH]
+
+    Protocol, one request per connection, all lines end with '\n':
+        client: render PRIORITY WIDTH HEIGHT SPP SEED X Y Z PITCH YAW
+                <scene>
+                <output>
+        daemon: queued ID POSITION
+                progress ID SAMPLES SPP
+                done ID OUTPUT | error ID MESSAGE
+    "status" answers with one "job ID PRIORITY SCENE" line per queued job and "end",
+    "quit" stops the daemon after the current job.
+
+    The socket is only accessible to its owner, in $XDG_RUNTIME_DIR or /tmp/gpu-raytracer-UID.sock.
+    Scene and output are relative paths without "..", below res/models and --output-dir (res/final).
+    Jobs are limited to 16384 pixels per side, 2^26 pixels and 65536 samples.
+*/
+int runDaemon(int argc, char* args[]);
+int runClient(int argc, char* args[]);
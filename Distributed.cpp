@@ -0,0 +1,412 @@
+#include "Distributed.hpp"
+#include "Context.hpp"
+#include "Scene.hpp"
+#include "Checkpoint.hpp"
+#include "ImageIO.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <glm/gtx/transform.hpp>
+#elif _WIN32
+#include "glm/gtx/transform.hpp"
+#endif
+
+
+#pragma pack(push, 1)
+struct st_PARTIAL_HEADER {
+    char magic[4]{ 'G', 'R', 'T', 'P' };
+    uint32_t version{ 1 };
+    int32_t width{ 0 };
+    int32_t height{ 0 };
+    uint32_t total_spp{ 0 };
+    uint32_t first_sample{ 0 };
+    uint32_t sample_count{ 0 };
+    uint32_t seed{ 0 };
+    uint32_t worker{ 0 };
+    uint32_t workers{ 1 };
+};
+#pragma pack(pop)
+
+// Followed by width*height pixels of the radiance sum and the sample count
+struct st_partial_pixel {
+    glm::fvec3 sum;
+    float samples;
+};
+
+struct st_worker_options {
+    std::string scene;
+    std::string output{};
+    uint32_t worker{ 0 };
+    uint32_t workers{ 1 };
+    int width{ 1920 };
+    int height{ 1080 };
+    uint32_t spp{ 256 };
+    uint32_t seed{ 95834783u };
+    // Start pose of the interactive camera
+    glm::dvec3 position{ 0.0, 1.5, -3.0 };
+    double pitch{ -M_PI_4 };
+    double yaw{ 0.0 };
+
+    // Written every checkpoint_interval seconds if set
+    std::string checkpoint{};
+    double checkpoint_interval{ 300.0 };
+};
+
+
+static uint32_t workerSeed(uint32_t seed, uint32_t worker) {
+    // pcg hash of the worker id, so neighbouring workers get unrelated sequences
+    const uint32_t state = (seed ^ worker * 0x9E3779B9u) * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static bool writePartial(const std::string &name, const st_PARTIAL_HEADER &header, const std::vector<st_partial_pixel> &pixels) {
+    // Written next to the target and renamed, a shared directory never exposes half a file
+    const std::string tmp_name = name + ".tmp";
+    {
+        std::ofstream partialFile(tmp_name, std::ios::binary);
+        if (!partialFile.is_open())
+            return false;
+        partialFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        partialFile.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(st_partial_pixel));
+        if (!partialFile.good())
+            return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_name, name, ec);
+    return !ec;
+}
+
+static bool readPartial(const std::string &name, st_PARTIAL_HEADER &header, std::vector<st_partial_pixel> &pixels) {
+    std::ifstream partialFile(name, std::ios::binary | std::ios::ate);
+    if (!partialFile.is_open()) {
+        std::cerr << "Cannot open partial " << name << '\n';
+        return false;
+    }
+    const uint64_t file_size = (uint64_t)partialFile.tellg();
+    partialFile.seekg(0);
+
+    partialFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!partialFile.good() || std::memcmp(header.magic, "GRTP", 4) != 0 || header.version != 1) {
+        std::cerr << name << " is no partial\n";
+        return false;
+    }
+    if (!validImageSize(header.width, header.height) ||
+        (uint64_t)header.first_sample + header.sample_count > header.total_spp) {
+        std::cerr << name << " has an invalid header\n";
+        return false;
+    }
+    // checked before the pixels are allocated
+    if (file_size != sizeof(header) + (uint64_t)header.width * header.height * sizeof(st_partial_pixel)) {
+        std::cerr << name << " is truncated\n";
+        return false;
+    }
+
+    pixels.resize((size_t)header.width * header.height);
+    partialFile.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(st_partial_pixel));
+    return partialFile.good();
+}
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int) {
+    interrupted = 1;
+}
+
+static st_checkpoint makeCheckpoint(const st_worker_options &options, uint32_t next_sample, std::unique_ptr<glm::fvec4[]> &&pixels) {
+    st_checkpoint checkpoint;
+    checkpoint.scene = options.scene;
+    checkpoint.output = options.output;
+    checkpoint.width = options.width;
+    checkpoint.height = options.height;
+    checkpoint.spp = options.spp;
+    checkpoint.seed = options.seed;
+    checkpoint.worker = options.worker;
+    checkpoint.workers = options.workers;
+    checkpoint.next_sample = next_sample;
+    checkpoint.position = options.position;
+    checkpoint.pitch = options.pitch;
+    checkpoint.yaw = options.yaw;
+    checkpoint.pixels = std::move(pixels);
+    return checkpoint;
+}
+
+static int renderPartial(const st_worker_options &options, st_checkpoint *resume) {
+    // Disjoint sample indices, together the workers cover [0, spp)
+    const uint32_t first_sample = (uint32_t)((uint64_t)options.spp * options.worker / options.workers);
+    const uint32_t end_sample   = (uint32_t)((uint64_t)options.spp * (options.worker + 1) / options.workers);
+    const uint32_t start_sample = resume ? resume->next_sample : first_sample;
+
+    GLFWwindow *window = createGLContext(options.width, options.height, "GPU RT - Worker", false);
+    if (!window)
+        return 2;
+
+    // Released before the context is gone
+    std::unique_ptr<Scene> scene(new Scene());
+    if (!scene->addWavefrontModel("./res/models/" + options.scene)) {
+        std::cerr << "Scene " << options.scene << " does not exist\n";
+        scene.reset();
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    scene->finalizeObjects();
+    scene->loadEnvironmentTexture(window, "res/models/textures/brownStudio.exr");
+    scene->loadMaterial("res/models/textures/planks", 0);
+    scene->loadMaterial("res/models/textures/aluminium", 1);
+
+    scene->setSeed(workerSeed(options.seed, options.worker));
+    scene->adaptResolution({ options.width, options.height });
+
+    // CAMERA = T * R_y(-yaw) * R_x(-pitch), as in the interactive loop
+    const glm::fmat4 camera = glm::translate(options.position)
+                            * glm::rotate(-options.yaw, glm::dvec3(0.0, 1.0, 0.0))
+                            * glm::rotate(-options.pitch, glm::dvec3(1.0, 0.0, 0.0));
+    int width = options.width;
+    int height = options.height;
+    scene->prepare(width, height, false, camera);
+    // traces sample 0, before a resumed accumulation is restored
+    scene->settleTextures(width, height);
+    if (resume) {
+        scene->loadRenderTarget(resume->pixels.get());
+        resume->pixels.reset();
+        std::cerr << "Worker " << options.worker << ": resumed at sample " << start_sample << '\n';
+    }
+
+    std::unique_ptr<CheckpointWriter> checkpoints;
+    if (!options.checkpoint.empty()) {
+        checkpoints.reset(new CheckpointWriter(options.checkpoint));
+        std::signal(SIGINT, onInterrupt);
+        std::signal(SIGTERM, onInterrupt);
+    }
+    auto last_checkpoint = std::chrono::steady_clock::now();
+
+    uint32_t sample = start_sample;
+    for (; sample < end_sample && !interrupted; sample++) {
+        scene->traceScene(width, height, sample);
+        if ((sample - first_sample) % 16 == 15) {
+            glFinish();
+            std::cerr << "Worker " << options.worker << ": " << (sample - first_sample + 1) << '/' << (end_sample - first_sample) << '\n';
+
+            const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count();
+            if (checkpoints && elapsed >= options.checkpoint_interval) {
+                checkpoints->submit(makeCheckpoint(options, sample + 1, scene->readRenderTarget()));
+                last_checkpoint = std::chrono::steady_clock::now();
+            }
+        }
+    }
+    glFinish();
+
+    if (interrupted) {
+        // Preempted, save the progress and leave the partial unwritten
+        if (checkpoints) {
+            checkpoints->submit(makeCheckpoint(options, sample, scene->readRenderTarget()));
+            checkpoints->flush();
+        }
+        scene.reset();
+        glfwTerminate();
+        std::cerr << "Worker " << options.worker << ": interrupted at sample " << sample << '\n';
+        return 3;
+    }
+
+    const size_t pixel_count = (size_t)width * height;
+    const std::unique_ptr<glm::fvec4[]> mean = scene->readRenderTarget();
+    std::vector<st_partial_pixel> pixels(pixel_count);
+    for (size_t i = 0; i < pixel_count; i++) {
+        // alpha holds the number of samples, zero if the range was empty
+        const float samples = (end_sample > first_sample) ? mean[i].a : 0.0f;
+        pixels[i].sum = glm::fvec3(mean[i]) * samples;
+        pixels[i].samples = samples;
+    }
+
+    st_PARTIAL_HEADER header;
+    header.width = width;
+    header.height = height;
+    header.total_spp = options.spp;
+    header.first_sample = first_sample;
+    header.sample_count = end_sample - first_sample;
+    header.seed = options.seed;
+    header.worker = options.worker;
+    header.workers = options.workers;
+
+    const bool written = writePartial(options.output, header, pixels);
+
+    checkpoints.reset();
+    scene.reset();
+    glfwTerminate();
+
+    if (!written) {
+        std::cerr << "Couldn't write " << options.output << '\n';
+        return EXIT_FAILURE;
+    }
+    // The partial supersedes the checkpoint
+    if (!options.checkpoint.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(options.checkpoint, ec);
+    }
+    std::cerr << "Worker " << options.worker << ": samples " << first_sample << ".." << end_sample << " written to " << options.output << '\n';
+    return EXIT_SUCCESS;
+}
+
+int runWorker(int argc, char* args[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: RayTracer --render <scene> --out part.rtp [--worker I] [--workers N] ...\n";
+        return EXIT_FAILURE;
+    }
+
+    st_worker_options options;
+    options.scene = args[2];
+    for (int i = 3; i < argc; i++) {
+        const std::string arg(args[i]);
+        if (arg == "--out" && i + 1 < argc)
+            options.output = args[++i];
+        else if (arg == "--worker" && i + 1 < argc)
+            options.worker = (uint32_t)atoi(args[++i]);
+        else if (arg == "--workers" && i + 1 < argc)
+            options.workers = (uint32_t)atoi(args[++i]);
+        else if (arg == "--width" && i + 1 < argc)
+            options.width = atoi(args[++i]);
+        else if (arg == "--height" && i + 1 < argc)
+            options.height = atoi(args[++i]);
+        else if (arg == "--spp" && i + 1 < argc)
+            options.spp = (uint32_t)atoi(args[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            options.seed = (uint32_t)strtoul(args[++i], nullptr, 10);
+        else if (arg == "--camera" && i + 5 < argc) {
+            options.position = glm::dvec3(atof(args[i+1]), atof(args[i+2]), atof(args[i+3]));
+            options.pitch = atof(args[i+4]);
+            options.yaw = atof(args[i+5]);
+            i += 5;
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            options.checkpoint = args[++i];
+        else if (arg == "--checkpoint-interval" && i + 1 < argc)
+            options.checkpoint_interval = atof(args[++i]);
+        else {
+            std::cerr << "Unknown render option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.output.empty() || options.workers == 0 || options.worker >= options.workers ||
+        options.width <= 0 || options.height <= 0) {
+        std::cerr << "Invalid render options\n";
+        return EXIT_FAILURE;
+    }
+
+    return renderPartial(options, nullptr);
+}
+
+int runResume(int argc, char* args[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: RayTracer --resume checkpoint.rtc [--checkpoint-interval S]\n";
+        return EXIT_FAILURE;
+    }
+
+    st_checkpoint checkpoint;
+    if (!readCheckpoint(args[2], checkpoint)) {
+        std::cerr << "Couldn't read checkpoint " << args[2] << '\n';
+        return EXIT_FAILURE;
+    }
+
+    // Everything but the checkpoint interval comes from the interrupted run
+    st_worker_options options;
+    options.scene = checkpoint.scene;
+    options.output = checkpoint.output;
+    options.width = checkpoint.width;
+    options.height = checkpoint.height;
+    options.spp = checkpoint.spp;
+    options.seed = checkpoint.seed;
+    options.worker = checkpoint.worker;
+    options.workers = checkpoint.workers;
+    options.position = checkpoint.position;
+    options.pitch = checkpoint.pitch;
+    options.yaw = checkpoint.yaw;
+    options.checkpoint = args[2];
+    for (int i = 3; i + 1 < argc; i++) {
+        if (std::string(args[i]) == "--checkpoint-interval")
+            options.checkpoint_interval = atof(args[++i]);
+    }
+    if (options.workers == 0 || options.worker >= options.workers) {
+        std::cerr << "Invalid checkpoint " << args[2] << '\n';
+        return EXIT_FAILURE;
+    }
+
+    return renderPartial(options, &checkpoint);
+}
+
+int runMerge(int argc, char* args[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: RayTracer --merge final.exr part0.rtp part1.rtp ...\n";
+        return EXIT_FAILURE;
+    }
+    const std::string output(args[2]);
+
+    st_PARTIAL_HEADER reference;
+    std::vector<glm::dvec4> accumulation;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    std::vector<st_partial_pixel> pixels;
+    int merged = 0;
+    for (int i = 3; i < argc; i++) {
+        // a bad partial only loses its samples, the warning about missing samples below reports them
+        st_PARTIAL_HEADER header;
+        if (!readPartial(args[i], header, pixels)) {
+            std::cerr << "Skipping partial " << args[i] << '\n';
+            continue;
+        }
+
+        if (accumulation.empty()) {
+            reference = header;
+            accumulation.resize(pixels.size(), glm::dvec4(0.0));
+        }
+        else if (header.width != reference.width || header.height != reference.height ||
+                 header.total_spp != reference.total_spp || header.seed != reference.seed) {
+            std::cerr << args[i] << " belongs to another frame\n";
+            return EXIT_FAILURE;
+        }
+
+        for (size_t p = 0; p < pixels.size(); p++)
+            accumulation[p] += glm::dvec4(glm::dvec3(pixels[p].sum), pixels[p].samples);
+        ranges.emplace_back(header.first_sample, header.first_sample + header.sample_count);
+        merged++;
+    }
+    if (merged == 0) {
+        std::cerr << "No partial could be read\n";
+        return EXIT_FAILURE;
+    }
+
+    // Overlapping ranges come from partials of different splits, their samples would be weighted twice
+    std::sort(ranges.begin(), ranges.end());
+    uint64_t covered = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (i > 0 && ranges[i].first < ranges[i-1].second) {
+            std::cerr << "Overlapping sample ranges " << ranges[i-1].first << ".." << ranges[i-1].second
+                      << " and " << ranges[i].first << ".." << ranges[i].second << '\n';
+            return EXIT_FAILURE;
+        }
+        covered += ranges[i].second - ranges[i].first;
+    }
+    if (covered != reference.total_spp)
+        std::cerr << "Warning: only " << covered << " of " << reference.total_spp << " samples merged\n";
+
+    std::vector<glm::fvec3> image(accumulation.size());
+    for (size_t p = 0; p < accumulation.size(); p++) {
+        const glm::dvec4 &pixel = accumulation[p];
+        image[p] = (pixel.a > 0.0) ? glm::fvec3(glm::dvec3(pixel) / pixel.a) : glm::fvec3(0.0f);
+    }
+
+    if (!writeEXR(output, image.data(), reference.width, reference.height)) {
+        std::cerr << "Cannot write " << output << '\n';
+        return EXIT_FAILURE;
+    }
+    std::cerr << "Merged " << merged << " partials, " << covered << " samples, into " << output << '\n';
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+    Sample split rendering of one frame over several processes or machines.
+    Worker i of N traces its own range of the sample indices with a seed derived from i
+    and writes a partial file with the radiance sum and sample count of every pixel.
+    The partials only need to end up in one place, the merge averages them into the final EXR.
+
+    RayTracer --render <scene> --out part.rtp [--worker I] [--workers N] [--width W] [--height H]
+                               [--spp N] [--seed S] [--camera X Y Z PITCH YAW]
+                               [--checkpoint part.rtc] [--checkpoint-interval SECONDS]
+    RayTracer --resume part.rtc
+    RayTracer --merge final.exr part0.rtp part1.rtp ...
+
+    With --checkpoint the accumulation and all settings are saved periodically and on SIGINT/SIGTERM,
+    --resume continues such a render where it stopped.
+*/
+int runWorker(int argc, char* args[]);
+int runResume(int argc, char* args[]);
+int runMerge(int argc, char* args[]);
@@ -0,0 +1,71 @@
+#include "DynamicResolution.hpp"
+
+
+// Ordered by cost, the default is the former fixed preview
+static constexpr st_preview_level PREVIEW_LEVELS[] = {
+    { 120, 1 },
+    { 120, 2 },
+    { 180, 2 },
+    { 180, 3 },
+    { 240, 3 },
+    { 360, 3 },
+    { 480, 4 },
+    { 720, 4 },
+    { 720, 5 },
+    { 1080, 5 },
+    { 1080, 6 },
+};
+static constexpr uint32_t PREVIEW_LEVEL_COUNT = sizeof(PREVIEW_LEVELS) / sizeof(st_preview_level);
+static constexpr uint32_t PREVIEW_DEFAULT_LEVEL = 3;
+
+
+DynamicResolution::DynamicResolution(double target_ms)
+    : m_target(target_ms), m_level(PREVIEW_DEFAULT_LEVEL), m_levels(PREVIEW_LEVEL_COUNT)
+{
+}
+
+double DynamicResolution::cost(const st_preview_level &level) {
+    return (double)level.height * level.height * level.recursion;
+}
+
+void DynamicResolution::setMaxHeight(int height) {
+    m_levels = 1;
+    while (m_levels < PREVIEW_LEVEL_COUNT && PREVIEW_LEVELS[m_levels].height <= height)
+        m_levels++;
+
+    if (m_level >= m_levels)
+        m_level = m_levels - 1;
+    m_average = -1.0;
+}
+
+const st_preview_level &DynamicResolution::getLevel() const noexcept {
+    return PREVIEW_LEVELS[m_level];
+}
+
+bool DynamicResolution::update(double frame_ms) {
+    if (m_hold > 0) {
+        m_hold--;
+        return false;
+    }
+    if (frame_ms <= 0.0)
+        return false;
+
+    m_average = (m_average < 0.0) ? frame_ms : m_average + (frame_ms - m_average) * 0.25;
+
+    const uint32_t old_level = m_level;
+    if (m_average > m_target * 1.1 && m_level > 0) {
+        m_level--;
+    }
+    else if (m_level + 1 < m_levels) {
+        const double predicted = m_average * cost(PREVIEW_LEVELS[m_level + 1]) / cost(PREVIEW_LEVELS[m_level]);
+        if (predicted < m_target * 0.9)
+            m_level++;
+    }
+
+    if (m_level == old_level)
+        return false;
+
+    m_average = -1.0;
+    hold();
+    return true;
+}
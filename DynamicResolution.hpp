@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+
+struct st_preview_level {
+    int height;
+    int recursion;
+};
+
+/*
+    Picks the resolution and bounce depth of the interactive preview from the measured GPU time.
+    A level is only raised if its predicted cost still fits the target, which keeps it from oscillating.
+*/
+class DynamicResolution {
+public:
+    explicit DynamicResolution(double target_ms = 1000.0 / 60.0);
+
+    // Feeds the GPU time of the last preview frame, returns true if the level changed
+    bool update(double frame_ms);
+
+    // Ignores the next timings, they still belong to another level or the full resolution image
+    inline void hold() noexcept { m_hold = 3; }
+
+    void setMaxHeight(int height);
+    inline void setTarget(double ms) noexcept { m_target = ms; }
+    [[nodiscard]] inline double getTarget() const noexcept { return m_target; }
+    [[nodiscard]] const st_preview_level &getLevel() const noexcept;
+
+private:
+    static double cost(const st_preview_level &level);
+
+    double m_target;
+    double m_average{ -1.0 };
+    uint32_t m_level;
+    uint32_t m_levels;
+    uint32_t m_hold{ 0 };
+};
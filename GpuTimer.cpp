@@ -0,0 +1,61 @@
+#include "GpuTimer.hpp"
+#include "Timeline.hpp"
+
+
+GpuProfiler::GpuProfiler() {
+    glCreateQueries(GL_TIME_ELAPSED, PASS_COUNT, m_queries[0]);
+    glCreateQueries(GL_TIME_ELAPSED, PASS_COUNT, m_queries[1]);
+}
+
+GpuProfiler::~GpuProfiler() {
+    glDeleteQueries(PASS_COUNT, m_queries[0]);
+    glDeleteQueries(PASS_COUNT, m_queries[1]);
+}
+
+void GpuProfiler::begin(GpuPass pass) {
+    glBeginQuery(GL_TIME_ELAPSED, m_queries[m_frame & 1][pass]);
+    if (Timeline::enabled())
+        Timeline::gpuBegin(passName(pass));
+}
+
+void GpuProfiler::end(GpuPass pass) {
+    if (Timeline::enabled())
+        Timeline::gpuEnd();
+    glEndQuery(GL_TIME_ELAPSED);
+    m_issued[m_frame & 1][pass] = true;
+}
+
+void GpuProfiler::collect() {
+    m_frame++;
+    if (Timeline::enabled())
+        Timeline::collectGpu();
+
+    // The set used two frames ago is reused now, read whatever has finished meanwhile
+    const uint32_t set = m_frame & 1;
+    for (uint32_t pass = 0; pass < PASS_COUNT; pass++) {
+        if (!m_issued[set][pass])
+            continue;
+
+        GLint available = 0;
+        glGetQueryObjectiv(m_queries[set][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(m_queries[set][pass], GL_QUERY_RESULT, &nanoseconds);
+            m_milliseconds[pass] = nanoseconds * 1e-6;
+        }
+        m_issued[set][pass] = false;
+    }
+}
+
+const char *GpuProfiler::passName(GpuPass pass) {
+    switch (pass) {
+        case PASS_TRACE: return "traceScene";
+        case PASS_DISPLAY: return "display";
+        case PASS_FORWARD: return "forwardRender";
+        case PASS_IRRADIANCE: return "irradiance";
+        case PASS_DRAW_BUFFERS: return "drawBuffers";
+        case PASS_VISIBILITY: return "visibility";
+        case PASS_GUIDE: return "pathGuide";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef __linux__
+#include <GL/glew.h>
+#elif _WIN32
+#include "GL/glew.h"
+#endif
+
+
+enum GpuPass : uint32_t {
+    PASS_TRACE,
+    PASS_DISPLAY,
+    PASS_FORWARD,
+    PASS_IRRADIANCE,
+    PASS_DRAW_BUFFERS,
+    PASS_VISIBILITY,
+    PASS_GUIDE,
+    PASS_COUNT
+};
+
+/*
+    GL_TIME_ELAPSED queries per pass, double-buffered over frames.
+    Results are only read once the driver reports them available, so collecting never stalls the pipeline.
+    Passes must not be nested. While the Timeline records, every pass is a GPU zone of it as well.
+*/
+class GpuProfiler {
+public:
+    GpuProfiler();
+    ~GpuProfiler();
+
+    void begin(GpuPass pass);
+    void end(GpuPass pass);
+
+    // Call once per presented frame, swaps the query sets and reads all finished results
+    void collect();
+
+    [[nodiscard]] inline double getMilliseconds(GpuPass pass) const noexcept { return m_milliseconds[pass]; }
+    [[nodiscard]] inline uint32_t getFrame() const noexcept { return m_frame; }
+
+    static const char *passName(GpuPass pass);
+
+private:
+    GLuint m_queries[2][PASS_COUNT]{};
+    bool m_issued[2][PASS_COUNT]{};
+    double m_milliseconds[PASS_COUNT]{};
+    uint32_t m_frame{ 0 };
+};
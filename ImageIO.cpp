@@ -0,0 +1,72 @@
+#include "ImageIO.hpp"
+#include "TiledEXR.hpp"
+#include "TaskScheduler.hpp"
+#include <iostream>
+#include <cmath>
+
+#include <zlib.h>
+#define TINYEXR_USE_MINIZ 0
+#define TINYEXR_USE_STB_ZLIB 0
+#define TINYEXR_IMPLEMENTATION
+#include "tinyexr/tinyexr.h"
+
+
+// pixels per task of the tone mapping
+static constexpr size_t TONE_MAP_GRAIN = 16384;
+static constexpr int EXR_TILE_SIZE = 64;
+
+
+bool decodeEXR(const std::string &name, st_exr_image &image, bool quiet) {
+    float *data = nullptr;
+    const char *err = nullptr;
+    const int ret = LoadEXR(&data, &image.width, &image.height, name.c_str(), &err);
+
+    if (ret != TINYEXR_SUCCESS) {
+        if (!quiet)
+            std::cerr << "Couldn't load " << name << std::endl;
+        if (err) {
+            if (!quiet)
+                std::cerr << '\t' << err << std::endl;
+            FreeEXRErrorMessage(err);
+        }
+        return false;
+    }
+    image.pixels.reset(data);
+    return true;
+}
+
+bool writeEXR(const std::string &name, const glm::fvec3 *pixels, int width, int height) {
+    TiledEXRWriter writer;
+    if (!writer.open(name, width, height, EXR_TILE_SIZE))
+        return false;
+    const bool written = writer.writeRegion(0, 0, width, height, pixels, width);
+    return writer.close() && written;
+}
+
+glm::fvec3 LinearTosRGB(const glm::fvec3& C) {
+    glm::fvec3 sRGB(0.0f);
+    sRGB.r = (C.r <= 0.0031308f) ? C.r * 12.92f : 1.055f * powf(C.r, 1.0f/2.4f) - 0.055f;
+    sRGB.g = (C.g <= 0.0031308f) ? C.g * 12.92f : 1.055f * powf(C.g, 1.0f/2.4f) - 0.055f;
+    sRGB.b = (C.b <= 0.0031308f) ? C.b * 12.92f : 1.055f * powf(C.b, 1.0f/2.4f) - 0.055f;
+    return sRGB;
+}
+
+glm::fvec3 ACESFilm(const glm::fvec3& x) {
+    constexpr float a = 2.51f;
+    constexpr float b = 0.03f;
+    constexpr float c = 2.43f;
+    constexpr float d = 0.59f;
+    constexpr float e = 0.14f;
+    return glm::clamp((x*(a*x+b))/(x*(c*x+d)+e), glm::fvec3(0.0f), glm::fvec3(1.0f));
+}
+
+void toneMapBGR8(const glm::fvec4 *pixels, size_t count, uint8_t *bgr) {
+    TaskScheduler::parallelFor(0, count, TONE_MAP_GRAIN, [pixels, bgr](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            const glm::fvec3 mappedColor = LinearTosRGB(ACESFilm(pixels[i]));
+            bgr[i * 3 + 0] = static_cast<uint8_t>(glm::clamp(mappedColor.b * 256.0f, 0.0f, 255.0f));
+            bgr[i * 3 + 1] = static_cast<uint8_t>(glm::clamp(mappedColor.g * 256.0f, 0.0f, 255.0f));
+            bgr[i * 3 + 2] = static_cast<uint8_t>(glm::clamp(mappedColor.r * 256.0f, 0.0f, 255.0f));
+        }
+    });
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <glm/glm.hpp>
+#elif _WIN32
+#include "glm/glm.hpp"
+#endif
+
+
+/*
+    Image decoding, encoding and tone mapping without a GL context,
+    so the stages run as TaskScheduler tasks and only the uploads stay on the GL thread.
+*/
+struct st_exr_image {
+    int width{ 0 };
+    int height{ 0 };
+    // RGBA as 32 bit float, allocated by tinyexr
+    std::unique_ptr<float, void(*)(void*)> pixels{ nullptr, std::free };
+};
+
+// Prints why name couldn't be loaded unless quiet
+bool decodeEXR(const std::string &name, st_exr_image &image, bool quiet = false);
+// Tiled ZIP EXR (TiledEXRWriter) of RGB pixels in the order of the render target, the tiles compressed in parallel
+bool writeEXR(const std::string &name, const glm::fvec3 *pixels, int width, int height);
+
+glm::fvec3 LinearTosRGB(const glm::fvec3 &C);
+glm::fvec3 ACESFilm(const glm::fvec3 &x);
+// ACES tone mapped sRGB, 3 bytes per pixel in BMP order, in parallel
+void toneMapBGR8(const glm::fvec4 *pixels, size_t count, uint8_t *bgr);
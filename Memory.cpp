@@ -0,0 +1,26 @@
+#include "Memory.hpp"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#elif _WIN32
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+
+uint64_t peakResidentBytes() {
+#ifdef __linux__
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    // kilobytes on Linux
+    return (uint64_t)usage.ru_maxrss * 1024;
+#elif _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    return 0;
+#endif
+}
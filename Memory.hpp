@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+
+// High-water mark of the resident memory of the process in bytes, 0 if the platform doesn't report it
+uint64_t peakResidentBytes();
@@ -0,0 +1,517 @@
+#include "MeshLOD.hpp"
+#include "Timeline.hpp"
+#include "TempFile.hpp"
+#include <cmath>
+#include <queue>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <unordered_map>
+
+
+namespace {
+
+    const char *CACHE_DIRECTORY = "./res/cache/";
+    constexpr uint32_t CACHE_MAGIC = 0x444F4C47; // "GLOD"
+    constexpr uint32_t CACHE_VERSION = 1;
+    // border constraints against the quadrics of the faces, large enough that open edges barely move
+    constexpr double BORDER_WEIGHT = 16.0;
+    // prefers short edges where the quadrics can't tell, else flat regions collapse into a single fan
+    constexpr double EDGE_WEIGHT = 1e-3;
+    // a collapse may not turn a neighbouring face further than about 78 degrees
+    constexpr float MIN_NORMAL_COSINE = 0.2f;
+
+    // Symmetric 4x4 matrix of the plane distances, upper triangle row by row
+    struct st_quadric {
+        double q[10]{};
+
+        void addPlane(const glm::dvec3 &n, double d, double weight) {
+            q[0] += weight * n.x*n.x; q[1] += weight * n.x*n.y; q[2] += weight * n.x*n.z; q[3] += weight * n.x*d;
+            q[4] += weight * n.y*n.y; q[5] += weight * n.y*n.z; q[6] += weight * n.y*d;
+            q[7] += weight * n.z*n.z; q[8] += weight * n.z*d;
+            q[9] += weight * d*d;
+        }
+
+        st_quadric &operator+=(const st_quadric &other) {
+            for (int i=0; i < 10; i++)
+                q[i] += other.q[i];
+            return *this;
+        }
+
+        double error(const glm::fvec3 &p) const {
+            const double x = p.x, y = p.y, z = p.z;
+            return x*x*q[0] + 2.0*x*y*q[1] + 2.0*x*z*q[2] + 2.0*x*q[3]
+                 + y*y*q[4] + 2.0*y*z*q[5] + 2.0*y*q[6]
+                 + z*z*q[7] + 2.0*z*q[8]
+                 + q[9];
+        }
+    };
+
+    struct st_collapse {
+        double cost;
+        uint32_t keep, remove;
+        uint32_t keep_version, remove_version;
+        // 0 moves to keep, 1 to remove, 2 to the midpoint
+        uint32_t target;
+
+        bool operator>(const st_collapse &other) const { return cost > other.cost; }
+    };
+
+    inline uint64_t edgeKey(uint32_t a, uint32_t b) {
+        return a < b ? (uint64_t(a) << 32 | b) : (uint64_t(b) << 32 | a);
+    }
+
+    class Simplifier {
+    public:
+        explicit Simplifier(const Object &object) {
+            std::unordered_map<uint64_t, uint32_t> welded;
+            welded.reserve(object.triangles.size());
+
+            const auto weld = [&](const Triangle &tri, int corner) -> uint32_t {
+                const glm::fvec3 p = tri.position + (corner == 1 ? tri.u : corner == 2 ? tri.v : glm::fvec3(0.0f));
+                const uint32_t *bits = reinterpret_cast<const uint32_t*>(&p);
+                uint64_t key = 1469598103934665603ull;
+                for (int i=0; i < 3; i++)
+                    key = (key ^ bits[i]) * 1099511628211ull;
+
+                // hash collisions of different positions simply stay separate vertices
+                const auto [it, inserted] = welded.try_emplace(key, (uint32_t)vertices.size());
+                if (!inserted && vertices[it->second].position == p)
+                    return it->second;
+                vertices.push_back({ p, tri.normals[corner], tri.tangents[corner], cornerUV(tri, corner) });
+                return (uint32_t)vertices.size() - 1;
+            };
+
+            for (const Triangle &tri : object.triangles) {
+                const glm::uvec3 t(weld(tri, 0), weld(tri, 1), weld(tri, 2));
+                if (t.x != t.y && t.y != t.z && t.x != t.z)
+                    triangles.push_back(t);
+            }
+
+            alive.assign(triangles.size(), 1);
+            liveTriangles = (uint32_t)triangles.size();
+            quadrics.resize(vertices.size());
+            versions.assign(vertices.size(), 0);
+            removed.assign(vertices.size(), 0);
+            vertexTriangles.resize(vertices.size());
+
+            std::unordered_map<uint64_t, uint32_t> edge_uses;
+            for (uint32_t t = 0; t < triangles.size(); t++) {
+                const glm::uvec3 &tri = triangles[t];
+                const glm::dvec3 p0 = vertices[tri.x].position, p1 = vertices[tri.y].position, p2 = vertices[tri.z].position;
+                const glm::dvec3 cross = glm::cross(p1 - p0, p2 - p0);
+                const double length = glm::length(cross);
+                if (length > 0.0) {
+                    // weighted by area, large faces hold their plane stronger
+                    const glm::dvec3 n = cross / length;
+                    st_quadric plane;
+                    plane.addPlane(n, -glm::dot(n, p0), length * 0.5);
+                    for (int i=0; i < 3; i++)
+                        quadrics[tri[i]] += plane;
+                }
+                for (int i=0; i < 3; i++) {
+                    vertexTriangles[tri[i]].push_back(t);
+                    edge_uses[edgeKey(tri[i], tri[(i+1) % 3])]++;
+                }
+            }
+
+            // planes through open edges, perpendicular to their face
+            for (uint32_t t = 0; t < triangles.size(); t++) {
+                const glm::uvec3 &tri = triangles[t];
+                const glm::dvec3 face = faceNormal(tri);
+                for (int i=0; i < 3; i++) {
+                    const uint32_t a = tri[i], b = tri[(i+1) % 3];
+                    if (edge_uses[edgeKey(a, b)] != 1)
+                        continue;
+                    const glm::dvec3 pa = vertices[a].position, pb = vertices[b].position;
+                    const glm::dvec3 edge = pb - pa;
+                    const glm::dvec3 cross = glm::cross(edge, face);
+                    const double length = glm::length(cross);
+                    if (length <= 0.0)
+                        continue;
+                    const glm::dvec3 n = cross / length;
+                    st_quadric border;
+                    border.addPlane(n, -glm::dot(n, pa), BORDER_WEIGHT * glm::dot(edge, edge));
+                    quadrics[a] += border;
+                    quadrics[b] += border;
+                }
+            }
+
+            for (const auto &[key, uses] : edge_uses)
+                pushCollapse(uint32_t(key >> 32), uint32_t(key));
+        }
+
+        [[nodiscard]] uint32_t triangleCount() const { return liveTriangles; }
+
+        // Collapses the cheapest edges until at most target triangles are left or nothing can collapse anymore
+        void simplify(uint32_t target) {
+            while (liveTriangles > target && !queue.empty()) {
+                const st_collapse collapse = queue.top();
+                queue.pop();
+                if (removed[collapse.keep] || removed[collapse.remove] ||
+                    versions[collapse.keep] != collapse.keep_version || versions[collapse.remove] != collapse.remove_version)
+                    continue;
+                apply(collapse);
+            }
+        }
+
+        st_lod_mesh snapshot() const {
+            st_lod_mesh mesh;
+            std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+            mesh.indices.reserve(liveTriangles * 3);
+            for (uint32_t t = 0; t < triangles.size(); t++) {
+                if (!alive[t])
+                    continue;
+                for (int i=0; i < 3; i++) {
+                    const uint32_t v = triangles[t][i];
+                    if (remap[v] == UINT32_MAX) {
+                        remap[v] = (uint32_t)mesh.vertices.size();
+                        mesh.vertices.push_back(vertices[v]);
+                    }
+                    mesh.indices.push_back(remap[v]);
+                }
+            }
+            return mesh;
+        }
+
+    private:
+        static glm::fvec2 cornerUV(const Triangle &tri, int corner) {
+            return tri.tex_p + (corner == 1 ? tri.tex_u : corner == 2 ? tri.tex_v : glm::fvec2(0.0f));
+        }
+
+        glm::dvec3 faceNormal(const glm::uvec3 &tri) const {
+            const glm::dvec3 p0 = vertices[tri.x].position;
+            const glm::dvec3 n = glm::cross(glm::dvec3(vertices[tri.y].position) - p0, glm::dvec3(vertices[tri.z].position) - p0);
+            const double length = glm::length(n);
+            return length > 0.0 ? n / length : n;
+        }
+
+        glm::fvec3 targetPosition(uint32_t keep, uint32_t remove, uint32_t target) const {
+            if (target == 0)
+                return vertices[keep].position;
+            if (target == 1)
+                return vertices[remove].position;
+            return (vertices[keep].position + vertices[remove].position) * 0.5f;
+        }
+
+        void pushCollapse(uint32_t a, uint32_t b) {
+            st_quadric q = quadrics[a];
+            q += quadrics[b];
+
+            // the quadrics weigh squared distances by area
+            const double length2 = glm::dot(vertices[a].position - vertices[b].position, vertices[a].position - vertices[b].position);
+            const double shape = EDGE_WEIGHT * length2 * length2;
+
+            st_collapse best{ INFINITY, a, b, versions[a], versions[b], 0 };
+            for (uint32_t target = 0; target < 3; target++) {
+                const double cost = q.error(targetPosition(a, b, target)) + shape;
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.target = target;
+                }
+            }
+            queue.push(best);
+        }
+
+        // No face around the collapsed edge may flip or degenerate
+        bool valid(uint32_t keep, uint32_t remove, const glm::fvec3 &p) const {
+            for (const uint32_t v : { keep, remove }) {
+                for (const uint32_t t : vertexTriangles[v]) {
+                    if (!alive[t])
+                        continue;
+                    const glm::uvec3 &tri = triangles[t];
+                    const bool has_keep = tri.x == keep || tri.y == keep || tri.z == keep;
+                    const bool has_remove = tri.x == remove || tri.y == remove || tri.z == remove;
+                    // the faces on the edge vanish
+                    if (has_keep && has_remove)
+                        continue;
+
+                    glm::fvec3 corners[3];
+                    for (int i=0; i < 3; i++)
+                        corners[i] = tri[i] == v ? p : vertices[tri[i]].position;
+                    const glm::fvec3 moved = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+                    const float moved_length = glm::length(moved);
+                    if (moved_length <= 0.0f)
+                        return false;
+                    if (glm::dot(moved / moved_length, glm::fvec3(faceNormal(tri))) < MIN_NORMAL_COSINE)
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        void apply(const st_collapse &collapse) {
+            const uint32_t keep = collapse.keep, remove = collapse.remove;
+            const glm::fvec3 p = targetPosition(keep, remove, collapse.target);
+            if (!valid(keep, remove, p))
+                return;
+
+            st_lod_vertex &kept = vertices[keep];
+            const st_lod_vertex &gone = vertices[remove];
+            if (collapse.target == 1) {
+                kept = gone;
+            } else if (collapse.target == 2) {
+                kept.normal = kept.normal + gone.normal;
+                kept.normal = glm::dot(kept.normal, kept.normal) > 0.0f ? glm::normalize(kept.normal) : gone.normal;
+                kept.tangent = kept.tangent + gone.tangent;
+                kept.tangent = glm::dot(kept.tangent, kept.tangent) > 0.0f ? glm::normalize(kept.tangent) : gone.tangent;
+                kept.uv = (kept.uv + gone.uv) * 0.5f;
+            }
+            kept.position = p;
+            quadrics[keep] += quadrics[remove];
+
+            for (const uint32_t t : vertexTriangles[remove]) {
+                if (!alive[t])
+                    continue;
+                glm::uvec3 &tri = triangles[t];
+                if (tri.x == keep || tri.y == keep || tri.z == keep) {
+                    alive[t] = 0;
+                    liveTriangles--;
+                } else {
+                    for (int i=0; i < 3; i++) {
+                        if (tri[i] == remove)
+                            tri[i] = keep;
+                    }
+                    vertexTriangles[keep].push_back(t);
+                }
+            }
+            removed[remove] = 1;
+            vertexTriangles[remove].clear();
+
+            // drop the dead faces, they were only kept for the version checks
+            std::vector<uint32_t> &around = vertexTriangles[keep];
+            around.erase(std::remove_if(around.begin(), around.end(), [this](uint32_t t) { return !alive[t]; }), around.end());
+
+            // every edge at keep costs something else now
+            versions[keep]++;
+            std::vector<uint32_t> neighbours;
+            for (const uint32_t t : around) {
+                for (int i=0; i < 3; i++) {
+                    const uint32_t v = triangles[t][i];
+                    if (v != keep && std::find(neighbours.begin(), neighbours.end(), v) == neighbours.end())
+                        neighbours.push_back(v);
+                }
+            }
+            for (const uint32_t v : neighbours)
+                pushCollapse(keep, v);
+        }
+
+        std::vector<st_lod_vertex> vertices;
+        std::vector<st_quadric> quadrics;
+        std::vector<uint32_t> versions;
+        std::vector<uint8_t> removed;
+
+        std::vector<glm::uvec3> triangles;
+        std::vector<uint8_t> alive;
+        std::vector<std::vector<uint32_t>> vertexTriangles;
+        uint32_t liveTriangles{ 0 };
+
+        std::priority_queue<st_collapse, std::vector<st_collapse>, std::greater<>> queue;
+    };
+
+    template<typename T>
+    void writeValues(std::ofstream &file, const T *values, size_t count) {
+        file.write(reinterpret_cast<const char*>(values), sizeof(T) * count);
+    }
+
+    template<typename T>
+    bool readValues(std::ifstream &file, T *values, size_t count) {
+        return (bool)file.read(reinterpret_cast<char*>(values), sizeof(T) * count);
+    }
+
+}
+
+
+st_object_lods MeshLOD::build(const Object &object) {
+    TIMELINE_ZONE("MeshLOD::build", object.name);
+    st_object_lods lods;
+    if (object.triangles.empty())
+        return lods;
+
+    glm::fvec3 bb_min(INFINITY), bb_max(-INFINITY);
+    for (const Triangle &tri : object.triangles) {
+        for (const glm::fvec3 &p : { tri.position, tri.position + tri.u, tri.position + tri.v }) {
+            bb_min = glm::min(bb_min, p);
+            bb_max = glm::max(bb_max, p);
+        }
+    }
+    lods.center = (bb_min + bb_max) * 0.5f;
+    for (const Triangle &tri : object.triangles) {
+        for (const glm::fvec3 &p : { tri.position, tri.position + tri.u, tri.position + tri.v })
+            lods.radius = std::max(lods.radius, glm::length(p - lods.center));
+    }
+
+    if (object.triangles.size() < MIN_TRIANGLES)
+        return lods;
+
+    Simplifier simplifier(object);
+    uint32_t previous = simplifier.triangleCount();
+    for (uint32_t level = 1; level < MAX_LEVELS; level++) {
+        const uint32_t target = (uint32_t)(previous * LEVEL_RATIO);
+        if (target < MIN_TRIANGLES)
+            break;
+
+        simplifier.simplify(target);
+        // a level that barely simplifies only costs memory
+        if (simplifier.triangleCount() > previous * 0.75f)
+            break;
+
+        previous = simplifier.triangleCount();
+        lods.levels.push_back(simplifier.snapshot());
+    }
+    return lods;
+}
+
+
+uint32_t MeshLOD::selectLevel(const st_object_lods &lods, const glm::fvec3 &position, float viewport_height) {
+    const float distance = glm::length(lods.center - position);
+    if (lods.levels.empty() || distance <= lods.radius)
+        return 0;
+
+    // tan(45 degrees) is 1, half the viewport spans distance world units
+    const float pixels = lods.radius / distance * viewport_height * 0.5f;
+    if (pixels >= FULL_DETAIL_PIXELS)
+        return 0;
+
+    // every halving of the screen size drops a level
+    const float halvings = std::log2(FULL_DETAIL_PIXELS / std::max(pixels, 1e-6f));
+    return std::min((uint32_t)std::min(halvings, 64.0f) + 1, (uint32_t)lods.levels.size());
+}
+
+
+void MeshLOD::transform(st_object_lods &lods, const glm::fmat4 &transform) {
+    const glm::fmat3 linear(transform);
+    const glm::fmat3 normal_matrix = glm::transpose(glm::inverse(linear));
+
+    lods.center = glm::fvec3(transform * glm::fvec4(lods.center, 1.0f));
+    // the longest axis bounds the stretched sphere
+    lods.radius *= std::max({ glm::length(linear[0]), glm::length(linear[1]), glm::length(linear[2]) });
+
+    for (st_lod_mesh &mesh : lods.levels) {
+        for (st_lod_vertex &vertex : mesh.vertices) {
+            vertex.position = glm::fvec3(transform * glm::fvec4(vertex.position, 1.0f));
+            vertex.normal = glm::normalize(normal_matrix * vertex.normal);
+            vertex.tangent = glm::normalize(linear * vertex.tangent);
+        }
+    }
+}
+
+
+uint64_t MeshLOD::hashObjects(const std::vector<Object> &objects, size_t first, size_t count) {
+    // FNV-1a over the parameters and every triangle the levels depend on
+    uint64_t hash = 1469598103934665603ull;
+    const auto mix = [&hash](const void *data, size_t bytes) {
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; i++)
+            hash = (hash ^ p[i]) * 1099511628211ull;
+    };
+
+    const uint32_t parameters[] = { CACHE_VERSION, MAX_LEVELS, MIN_TRIANGLES, (uint32_t)(LEVEL_RATIO * 1000.0f) };
+    mix(parameters, sizeof(parameters));
+    for (size_t o = first; o < first + count; o++) {
+        const uint64_t triangles = objects[o].triangles.size();
+        mix(&triangles, sizeof(triangles));
+        for (const Triangle &tri : objects[o].triangles) {
+            mix(&tri.position, sizeof(glm::fvec3) * 3);
+            mix(tri.normals, sizeof(tri.normals));
+            mix(tri.tangents, sizeof(tri.tangents));
+            mix(&tri.tex_p, sizeof(glm::fvec2) * 3);
+        }
+    }
+    return hash;
+}
+
+
+std::string MeshLOD::cachePath(const std::string &model_name) {
+    return CACHE_DIRECTORY + std::filesystem::path(model_name).filename().string() + ".lod";
+}
+
+
+bool MeshLOD::loadCache(const std::string &filename, uint64_t hash, std::vector<st_object_lods> &lods) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    // counts are checked against the bytes left before anything is allocated
+    const uint64_t file_size = (uint64_t)file.tellg();
+    file.seekg(0);
+    const auto remaining = [&file, file_size]() { return file_size - (uint64_t)file.tellg(); };
+
+    uint32_t magic = 0, version = 0, objects = 0;
+    uint64_t file_hash = 0;
+    if (!readValues(file, &magic, 1) || !readValues(file, &version, 1) || !readValues(file, &file_hash, 1) ||
+        !readValues(file, &objects, 1) || magic != CACHE_MAGIC || version != CACHE_VERSION || file_hash != hash)
+        return false;
+    constexpr uint64_t OBJECT_HEADER_SIZE = sizeof(glm::fvec3) + sizeof(float) + sizeof(uint32_t);
+    if ((uint64_t)objects * OBJECT_HEADER_SIZE > remaining())
+        return false;
+
+    std::vector<st_object_lods> loaded(objects);
+    for (st_object_lods &object : loaded) {
+        uint32_t levels = 0;
+        if (!readValues(file, &object.center, 1) || !readValues(file, &object.radius, 1) ||
+            !readValues(file, &levels, 1) || levels >= MAX_LEVELS)
+            return false;
+
+        object.levels.resize(levels);
+        for (st_lod_mesh &mesh : object.levels) {
+            uint32_t sizes[2]{};
+            if (!readValues(file, sizes, 2) || sizes[1] % 3 != 0 ||
+                (uint64_t)sizes[0] * sizeof(st_lod_vertex) + (uint64_t)sizes[1] * sizeof(uint32_t) > remaining())
+                return false;
+            mesh.vertices.resize(sizes[0]);
+            mesh.indices.resize(sizes[1]);
+            if (!readValues(file, mesh.vertices.data(), sizes[0]) || !readValues(file, mesh.indices.data(), sizes[1]))
+                return false;
+            // the indices are drawn without further checks
+            for (uint32_t index : mesh.indices) {
+                if (index >= sizes[0])
+                    return false;
+            }
+        }
+    }
+    if (remaining() != 0)
+        return false;
+    lods = std::move(loaded);
+    return true;
+}
+
+
+bool MeshLOD::saveCache(const std::string &filename, uint64_t hash, const std::vector<st_object_lods> &lods) {
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), ec);
+
+    // written next to the cache and renamed, neither a failed write nor another worker writing the same cache leaves a truncated one
+    const std::string tmp_name = temporaryPath(filename);
+    std::ofstream file(tmp_name, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    const uint32_t objects = (uint32_t)lods.size();
+    writeValues(file, &CACHE_MAGIC, 1);
+    writeValues(file, &CACHE_VERSION, 1);
+    writeValues(file, &hash, 1);
+    writeValues(file, &objects, 1);
+    for (const st_object_lods &object : lods) {
+        const uint32_t levels = (uint32_t)object.levels.size();
+        writeValues(file, &object.center, 1);
+        writeValues(file, &object.radius, 1);
+        writeValues(file, &levels, 1);
+        for (const st_lod_mesh &mesh : object.levels) {
+            const uint32_t sizes[2] = { (uint32_t)mesh.vertices.size(), (uint32_t)mesh.indices.size() };
+            writeValues(file, sizes, 2);
+            writeValues(file, mesh.vertices.data(), mesh.vertices.size());
+            writeValues(file, mesh.indices.data(), mesh.indices.size());
+        }
+    }
+    file.close();
+    if (file.fail()) {
+        std::filesystem::remove(tmp_name, ec);
+        return false;
+    }
+    std::filesystem::rename(tmp_name, filename, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_name, ec);
+        return false;
+    }
+    return true;
+}
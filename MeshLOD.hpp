@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "3Dobjects.hpp"
+
+
+struct st_lod_vertex {
+    glm::fvec3 position;
+    glm::fvec3 normal;
+    glm::fvec3 tangent;
+    glm::fvec2 uv;
+};
+
+// One simplified version of an object, indexed triangles
+struct st_lod_mesh {
+    std::vector<st_lod_vertex> vertices;
+    std::vector<uint32_t> indices;
+
+    // placement in the preview buffers of the Scene, not cached
+    uint32_t base_vertex{ 0 };
+    uint32_t first_index{ 0 };
+};
+
+struct st_object_lods {
+    // bounding sphere, the projected radius selects the level
+    glm::fvec3 center{ 0.0f };
+    float radius{ 0.0f };
+    // levels[k] is level k + 1, level 0 is the object itself
+    std::vector<st_lod_mesh> levels;
+};
+
+/*
+    Levels of detail for the raster preview, built by quadric error edge collapses (Garland and Heckbert 1997).
+    Vertices are welded by position, so UV seams are merged, and open borders are held by constraint planes.
+    Every level keeps about LEVEL_RATIO of the triangles of the previous one, it is meant for objects covering
+    half the screen size of the previous level. The tracer always uses the full geometry.
+*/
+class MeshLOD {
+public:
+    static constexpr uint32_t MAX_LEVELS = 4;
+    static constexpr float LEVEL_RATIO = 0.25f;
+    // objects with fewer triangles aren't simplified any further
+    static constexpr uint32_t MIN_TRIANGLES = 64;
+    // projected radius in pixels at and above which an object is drawn in full detail
+    static constexpr float FULL_DETAIL_PIXELS = 256.0f;
+
+    static st_object_lods build(const Object &object);
+    // Level of an object seen from position, with a 90 degree vertical field of view over viewport_height pixels
+    static uint32_t selectLevel(const st_object_lods &lods, const glm::fvec3 &position, float viewport_height);
+    // The same affine transformation as SceneGeometry::transformObject
+    static void transform(st_object_lods &lods, const glm::fmat4 &transform);
+
+    /*
+        Cache of the levels of all objects of a model file, in res/cache as <model>.lod.
+        The hash covers the triangles the levels were built from, a different hash doesn't load.
+    */
+    static std::string cachePath(const std::string &model_name);
+    static uint64_t hashObjects(const std::vector<Object> &objects, size_t first, size_t count);
+    static bool loadCache(const std::string &filename, uint64_t hash, std::vector<st_object_lods> &lods);
+    static bool saveCache(const std::string &filename, uint64_t hash, const std::vector<st_object_lods> &lods);
+};
@@ -0,0 +1,92 @@
+#include "PathGuide.hpp"
+#include <algorithm>
+#include <cmath>
+
+
+static constexpr float PI = 3.141592653589793f;
+static constexpr float TWO_PI = 6.283185307179586f;
+
+
+uint32_t PathGuide::directionBin(const glm::fvec3 &direction) {
+    const float map_x = direction.z * 0.5f + 0.5f;
+    const float map_y = std::atan2(direction.y, direction.x) * (0.5f / PI) + 0.5f;
+    const uint32_t bin_x = (uint32_t)std::clamp((int)(map_x * 8.0f), 0, 7);
+    const uint32_t bin_y = (uint32_t)std::clamp((int)(map_y * 8.0f), 0, 7);
+
+    uint32_t leaf = 0;
+    for (uint32_t bit = 0; bit < DEPTH; bit++)
+        leaf |= ((bin_x >> bit) & 1u) << (2*bit) | ((bin_y >> bit) & 1u) << (2*bit + 1);
+    return leaf;
+}
+
+float PathGuide::pdf(const float *cell, const glm::fvec3 &direction) {
+    // a leaf covers 4 PI / BINS steradians
+    return cell[LEAVES + directionBin(direction)] * (BINS / (4.0f * PI));
+}
+
+glm::fvec3 PathGuide::sample(const float *cell, glm::fvec2 u) {
+    uint32_t node = 0;
+    uint32_t level_offset = 0;
+    float mass = 1.0f;
+    for (uint32_t level = 0; level < DEPTH; level++) {
+        const uint32_t first = level_offset + 4*node;
+        float pick = u.x * mass;
+        uint32_t child = 0;
+        for (; child < 3; child++) {
+            if (pick < cell[first + child])
+                break;
+            pick -= cell[first + child];
+        }
+        const float p = cell[first + child];
+        u.x = std::clamp(pick / p, 0.0f, 0.99999994f);
+        mass = p;
+        node = 4*node + child;
+        level_offset += 4u << (2*level);
+    }
+
+    uint32_t bin_x = 0, bin_y = 0;
+    for (uint32_t bit = 0; bit < DEPTH; bit++) {
+        bin_x |= ((node >> (2*bit)) & 1u) << bit;
+        bin_y |= ((node >> (2*bit + 1)) & 1u) << bit;
+    }
+    const float z = ((bin_x + u.x) / 8.0f) * 2.0f - 1.0f;
+    const float phi = ((bin_y + u.y) / 8.0f - 0.5f) * TWO_PI;
+    const float r = std::sqrt(std::max(1.0f - z*z, 0.0f));
+    return glm::fvec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+void PathGuide::initialize(std::vector<float> &distribution) {
+    distribution.assign((size_t)CELLS * STRIDE, 0.0f);
+    for (uint32_t cell = 0; cell < CELLS; cell++) {
+        float *nodes = &distribution[(size_t)cell * STRIDE];
+        std::fill(nodes, nodes + 4, 1.0f / 4.0f);
+        std::fill(nodes + 4, nodes + LEAVES, 1.0f / 16.0f);
+        std::fill(nodes + LEAVES, nodes + LEAVES + BINS, 1.0f / BINS);
+    }
+}
+
+float PathGuide::decodeFlux(const uint32_t *words) {
+    return (float)words[1] * (4294967296.0f / FLUX_SCALE) + (float)words[0] / FLUX_SCALE;
+}
+
+void PathGuide::resolveCell(uint32_t records, const uint32_t *flux, float *cell) {
+    if (records < MIN_RECORDS)
+        return;
+
+    float sums[BINS];
+    float total = 0.0f;
+    for (uint32_t bin = 0; bin < BINS; bin++) {
+        sums[bin] = decodeFlux(&flux[2*bin]);
+        total += sums[bin];
+    }
+    if (total <= 0.0f)
+        return;
+
+    for (uint32_t bin = 0; bin < BINS; bin++)
+        cell[LEAVES + bin] = (1.0f - UNIFORM) * (sums[bin] / total) + UNIFORM / BINS;
+    for (uint32_t node = 0; node < 16; node++)
+        cell[4 + node] = ((cell[LEAVES + 4*node] + cell[LEAVES + 4*node + 1]) + cell[LEAVES + 4*node + 2]) + cell[LEAVES + 4*node + 3];
+    for (uint32_t node = 0; node < 4; node++)
+        cell[node] = ((cell[4 + 4*node] + cell[4 + 4*node + 1]) + cell[4 + 4*node + 2]) + cell[4 + 4*node + 3];
+    cell[TRAINED] = 1.0f;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __linux__
+#include <glm/glm.hpp>
+#elif _WIN32
+#include "glm/glm.hpp"
+#endif
+
+
+/*
+    CPU reference of the path guiding in raytracer.glsl and pathGuide.glsl, same layout and arithmetic.
+
+    The scene bounds are split into RESOLUTION^3 cells, every cell holds a fixed 8x8 histogram over the
+    cylindrical equal-area map of the sphere (z, phi). There is no refinement or collapsing of the nodes as in
+    the adaptive quadtrees of the paper: every cell has the same size, so the resolve pass rebuilds it in place
+    without allocating, and one iteration rarely has enough records in a cell to refine past 64 bins anyway.
+    The bins are summed into a complete quadtree of DEPTH levels, sampling walks it in DEPTH steps.
+    A cell is STRIDE floats:
+        [0, 4)    probabilities of the first level
+        [4, 20)   second level
+        [20, 84)  leaves in Morton order, the four children of a node are neighbours
+        [84]      1 once the cell was trained, the tracer only guides from trained cells
+    The training buffer holds one record counter per cell followed by BINS incident flux sums per cell.
+    A flux sum is fixed point with FLUX_SCALE steps, a low and a high word, so the paths add it with integer
+    atomics and carry into the high word like the TracerStats counters.
+*/
+class PathGuide {
+public:
+    static constexpr uint32_t RESOLUTION = 16;
+    static constexpr uint32_t CELLS = RESOLUTION * RESOLUTION * RESOLUTION;
+    static constexpr uint32_t DEPTH = 3;
+    static constexpr uint32_t BINS = 64;
+    static constexpr uint32_t LEAVES = 20;
+    static constexpr uint32_t TRAINED = 84;
+    static constexpr uint32_t STRIDE = 88;
+    // A cell needs this many records in one iteration to replace its quadtree
+    static constexpr uint32_t MIN_RECORDS = 16;
+    // Share of the uniform distribution in every quadtree, keeps the density positive everywhere
+    static constexpr float UNIFORM = 0.1f;
+    // Fixed point steps of the flux sums and the largest flux of one record, it fits into the low word
+    static constexpr float FLUX_SCALE = 65536.0f;
+    static constexpr float FLUX_MAX = 65535.0f;
+    // Samples of the first training iteration, every further one doubles up to the last
+    static constexpr uint32_t FIRST_ITERATION = 1;
+    static constexpr uint32_t LAST_ITERATION = 256;
+
+    static uint32_t directionBin(const glm::fvec3 &direction);
+    static float pdf(const float *cell, const glm::fvec3 &direction);
+    static glm::fvec3 sample(const float *cell, glm::fvec2 u);
+
+    // Uniform untrained quadtrees for all cells
+    static void initialize(std::vector<float> &distribution);
+
+    // Flux sum of a low and a high word, as the GPU resolve pass
+    static float decodeFlux(const uint32_t *words);
+    // Rebuilds a cell from the records and the BINS flux sums of one iteration, as the GPU resolve pass
+    static void resolveCell(uint32_t records, const uint32_t *flux, float *cell);
+};
+
+struct st_guide_validation {
+    // Largest difference between the GPU and the CPU resolve of the same training
+    float resolve_error{ 0.0f };
+    // Largest difference between the leaf frequencies of stratified PathGuide::sample calls and the leaf probabilities
+    float sample_error{ 0.0f };
+    uint32_t trained_cells{ 0 };
+};
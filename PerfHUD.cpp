@@ -0,0 +1,131 @@
+#include "PerfHUD.hpp"
+#include <iostream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <imgui.h>
+#include <imgui_impl_glfw.h>
+#include <imgui_impl_opengl3.h>
+#elif _WIN32
+#include "imgui.h"
+#include "imgui_impl_glfw.h"
+#include "imgui_impl_opengl3.h"
+#endif
+
+
+PerfHUD::PerfHUD(GLFWwindow *window) {
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    ImGui::GetIO().IniFilename = nullptr;
+    ImGui::StyleColorsDark();
+    ImGui_ImplGlfw_InitForOpenGL(window, true);
+    ImGui_ImplOpenGL3_Init("#version 450 core");
+
+    m_lastTime = m_windowStart = glfwGetTime();
+}
+
+PerfHUD::~PerfHUD() {
+    ImGui_ImplOpenGL3_Shutdown();
+    ImGui_ImplGlfw_Shutdown();
+    ImGui::DestroyContext();
+    if (m_csv.is_open())
+        m_csv.close();
+}
+
+bool PerfHUD::openCSV(const std::string &filename) {
+    m_csv.open(filename);
+    if (!m_csv) {
+        std::cerr << "Cannot open " << filename << std::endl;
+        return false;
+    }
+
+    m_csv << "time,frame,sample,batch,frame_ms";
+    for (uint32_t pass = 0; pass < PASS_COUNT; pass++)
+        m_csv << ',' << GpuProfiler::passName(static_cast<GpuPass>(pass)) << "_ms";
+    m_csv << ",samples_per_s,camera_mrays_per_s\n";
+    return true;
+}
+
+void PerfHUD::record(const GpuProfiler &profiler, uint32_t sample, uint32_t samples, uint64_t traced_pixels) {
+    const double time = glfwGetTime();
+    const double frame_ms = (time - m_lastTime) * 1000.0;
+    m_lastTime = time;
+    m_sample = sample;
+
+    const double trace_ms = profiler.getMilliseconds(PASS_TRACE);
+    // one camera ray per pixel and sample, timed on the GPU
+    if (m_lastRays > 0 && trace_ms > 0.0)
+        m_megaRaysPerSecond = m_lastRays / (trace_ms * 1000.0);
+    m_lastRays = traced_pixels * samples;
+    if (traced_pixels > 0) {
+        m_windowSamples += samples;
+        m_batch = samples;
+    }
+
+    if (time - m_windowStart >= 0.5) {
+        m_samplesPerSecond = m_windowSamples / (time - m_windowStart);
+        m_windowSamples = 0;
+        m_windowStart = time;
+    }
+
+    m_frameHistory[m_historyOffset] = (float)frame_ms;
+    m_traceHistory[m_historyOffset] = (float)trace_ms;
+    m_historyOffset = (m_historyOffset + 1) % HISTORY;
+
+    if (m_csv.is_open()) {
+        m_csv << time << ',' << profiler.getFrame() << ',' << sample << ',' << samples << ',' << frame_ms;
+        for (uint32_t pass = 0; pass < PASS_COUNT; pass++)
+            m_csv << ',' << profiler.getMilliseconds(static_cast<GpuPass>(pass));
+        m_csv << ',' << m_samplesPerSecond << ',' << m_megaRaysPerSecond << '\n';
+    }
+}
+
+void PerfHUD::recordStats(const st_tracer_stats &stats) {
+    m_stats = stats;
+    m_hasStats = true;
+}
+
+void PerfHUD::draw(const GpuProfiler &profiler) {
+    if (!m_visible)
+        return;
+
+    ImGui_ImplOpenGL3_NewFrame();
+    ImGui_ImplGlfw_NewFrame();
+    ImGui::NewFrame();
+
+    ImGui::SetNextWindowPos(ImVec2(8.0f, 8.0f), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowBgAlpha(0.6f);
+    ImGui::Begin("Performance", nullptr, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoFocusOnAppearing);
+
+    ImGui::Text("Samples     %u", m_sample);
+    if (m_hasStats) {
+        const double paths = std::max<double>(m_stats.counters[STAT_PATHS], 1.0);
+        ImGui::Text("Rays/path   %.2f", m_stats.rays() / paths);
+        ImGui::Text("Tests/ray   %.1f", m_stats.testsPerRay());
+        ImGui::Text("Shadow L/S  %.2f / %.2f", m_stats.counters[STAT_SHADOW_LIGHT] / paths, m_stats.counters[STAT_SHADOW_SKY] / paths);
+        ImGui::Text("Roulette    %.1f %%", 100.0 * m_stats.counters[STAT_ROULETTE] / paths);
+        ImGui::Text("Sky         %.1f %%", 100.0 * m_stats.counters[STAT_SKY_ESCAPES] / paths);
+        if (ImGui::TreeNode("Rays per depth")) {
+            for (uint32_t depth = STAT_RAYS_DEPTH_0; depth <= STAT_RAYS_DEPTH_LAST; depth++)
+                ImGui::Text("%-14s %10llu", TracerStats::statName(static_cast<TracerStat>(depth)),
+                            (unsigned long long)m_stats.counters[depth]);
+            ImGui::TreePop();
+        }
+    }
+    ImGui::Text("Samples/s   %.1f", m_samplesPerSecond);
+    ImGui::Text("Cam Mrays/s %.1f", m_megaRaysPerSecond);
+    ImGui::Text("Batch       %u", m_batch);
+    ImGui::Separator();
+    for (uint32_t pass = 0; pass < PASS_COUNT; pass++) {
+        const GpuPass gpu_pass = static_cast<GpuPass>(pass);
+        ImGui::Text("%-14s %8.3f ms", GpuProfiler::passName(gpu_pass), profiler.getMilliseconds(gpu_pass));
+    }
+    ImGui::Separator();
+    ImGui::PlotLines("frame ms", m_frameHistory, HISTORY, m_historyOffset, nullptr, 0.0f, 50.0f, ImVec2(240.0f, 48.0f));
+    ImGui::PlotLines("trace ms", m_traceHistory, HISTORY, m_historyOffset, nullptr, 0.0f, 50.0f, ImVec2(240.0f, 48.0f));
+
+    ImGui::End();
+
+    ImGui::Render();
+    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+}
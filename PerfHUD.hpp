@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include "GpuTimer.hpp"
+#include "TracerStats.hpp"
+
+#ifdef __linux__
+#include <GLFW/glfw3.h>
+#elif _WIN32
+#include "GLFW/glfw3.h"
+#endif
+
+
+/*
+    ImGui overlay with the GPU time per pass, samples/s and camera Mrays/s
+    and a rolling graph of the frame time. The same values can be logged to a CSV file.
+*/
+class PerfHUD {
+public:
+    explicit PerfHUD(GLFWwindow *window);
+    ~PerfHUD();
+
+    bool openCSV(const std::string &filename);
+
+    // Accounts the frame that was just submitted, it traced samples samples of traced_pixels pixels each
+    void record(const GpuProfiler &profiler, uint32_t sample, uint32_t samples, uint64_t traced_pixels);
+    // Latest tracer counters, shown below the sample count
+    void recordStats(const st_tracer_stats &stats);
+    void draw(const GpuProfiler &profiler);
+
+    inline void toggle() noexcept { m_visible = !m_visible; }
+
+private:
+    static constexpr int HISTORY = 240;
+
+    float m_frameHistory[HISTORY]{};
+    float m_traceHistory[HISTORY]{};
+    int m_historyOffset{ 0 };
+
+    double m_lastTime{ 0.0 };
+    double m_windowStart{ 0.0 };
+    uint32_t m_windowSamples{ 0 };
+    double m_samplesPerSecond{ 0.0 };
+    double m_megaRaysPerSecond{ 0.0 };
+    uint32_t m_sample{ 0 };
+    uint32_t m_batch{ 0 };
+    // camera rays of the previous frame, the trace time collected now belongs to it
+    uint64_t m_lastRays{ 0 };
+    st_tracer_stats m_stats;
+    bool m_hasStats{ false };
+
+    bool m_visible{ true };
+    std::ofstream m_csv;
+};
@@ -0,0 +1,183 @@
+#include "ProgramCache.hpp"
+#include "Shader.hpp"
+#include "Timeline.hpp"
+#include "TempFile.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+
+
+static const char *CACHE_DIRECTORY = "./res/cache/";
+// far above any driver's program binary, a corrupt length is rejected before allocating
+static constexpr uint32_t MAX_BINARY_LENGTH = 256u << 20;
+
+#pragma pack(push, 1)
+struct st_PROGRAM_BINARY_HEADER {
+    char magic[4]{ 'G', 'R', 'T', 'B' };
+    uint32_t version{ 1 };
+    uint64_t key{ 0 };
+    uint32_t format{ 0 };
+    uint32_t length{ 0 };
+};
+#pragma pack(pop)
+
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a(uint64_t hash, const char *str) {
+    return (str) ? fnv1a(hash, str, strlen(str)) : hash;
+}
+
+static void injectDefines(std::string &source, const std::string &defines) {
+    if (defines.empty())
+        return;
+
+    size_t line_end = 0;
+    const size_t version = source.find("#version");
+    if (version != std::string::npos) {
+        line_end = source.find('\n', version);
+        line_end = (line_end == std::string::npos) ? source.size() : line_end + 1;
+    }
+    // keep the line numbers of compiler messages in sync with the file
+    const long lines = std::count(source.begin(), source.begin() + line_end, '\n');
+    source.insert(line_end, defines + "#line " + std::to_string(lines + 1) + "\n");
+}
+
+static uint64_t programCacheKey(const std::vector<ShaderStage> &stages, const std::vector<std::string> &sources) {
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fnv1a(hash, reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+    hash = fnv1a(hash, reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+    hash = fnv1a(hash, reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+
+    for (size_t i = 0; i < stages.size(); i++) {
+        hash = fnv1a(hash, &stages[i].type, sizeof(GLint));
+        hash = fnv1a(hash, sources[i].data(), sources[i].size());
+    }
+    return hash;
+}
+
+static std::string programCachePath(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+    return std::string(CACHE_DIRECTORY) + name;
+}
+
+static bool loadProgramBinary(GLuint programID, uint64_t key) {
+    std::ifstream binFile(programCachePath(key), std::ios::binary | std::ios::ate);
+    if (!binFile)
+        return false;
+    const uint64_t bytes = (uint64_t)binFile.tellg();
+    binFile.seekg(0);
+
+    st_PROGRAM_BINARY_HEADER header;
+    binFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!binFile || memcmp(header.magic, st_PROGRAM_BINARY_HEADER().magic, 4) != 0 || header.version != 1 || header.key != key)
+        return false;
+    // a truncated file is recompiled and written again
+    if (header.length == 0 || header.length > MAX_BINARY_LENGTH || bytes != sizeof(header) + (uint64_t)header.length)
+        return false;
+
+    std::unique_ptr<char[]> binary(new char[header.length]);
+    binFile.read(binary.get(), header.length);
+    if (!binFile)
+        return false;
+
+    glProgramBinary(programID, header.format, binary.get(), header.length);
+
+    int success;
+    glGetProgramiv(programID, GL_LINK_STATUS, &success);
+    return success;
+}
+
+static void storeProgramBinary(GLuint programID, uint64_t key) {
+    int length = 0;
+    glGetProgramiv(programID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    st_PROGRAM_BINARY_HEADER header;
+    header.key = key;
+    header.length = length;
+
+    std::unique_ptr<char[]> binary(new char[length]);
+    glGetProgramBinary(programID, length, nullptr, &header.format, binary.get());
+
+    std::error_code ec;
+    std::filesystem::create_directories(CACHE_DIRECTORY, ec);
+
+    // Written next to the cache file and renamed, a crash, a full disk or another process linking the same program never leaves half a binary
+    const std::string name = programCachePath(key);
+    const std::string tmp_name = temporaryPath(name);
+    bool written;
+    {
+        std::ofstream binFile(tmp_name, std::ios::binary);
+        binFile.write(reinterpret_cast<char*>(&header), sizeof(header));
+        binFile.write(binary.get(), length);
+        binFile.close();
+        written = !binFile.fail();
+    }
+    if (written)
+        std::filesystem::rename(tmp_name, name, ec);
+    if (!written || ec) {
+        std::filesystem::remove(tmp_name, ec);
+        std::cout << "[WARNING ][Cache  ] Cannot write " << name << std::endl;
+    }
+}
+
+bool linkProgramCached(GLuint programID, const std::vector<ShaderStage> &stages) {
+    TIMELINE_ZONE("linkProgramCached", stages.empty() ? std::string() : stages[0].filename);
+    std::vector<std::string> sources(stages.size());
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (!readShaderSource(stages[i].filename, sources[i])) {
+            std::cout << "[ ERROR  ][Shader ] Cannot read: " << stages[i].filename << std::endl;
+            return false;
+        }
+        injectDefines(sources[i], stages[i].defines);
+    }
+
+    int binaryFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+
+    const uint64_t key = programCacheKey(stages, sources);
+    if (binaryFormats > 0 && loadProgramBinary(programID, key))
+        return true;
+
+    std::vector<GLuint> shaderIDs(stages.size(), 0);
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (compileShaderSource(stages[i].filename, sources[i], stages[i].type, shaderIDs[i]))
+            glAttachShader(programID, shaderIDs[i]);
+    }
+
+    glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(programID);
+
+    for (GLuint shaderID : shaderIDs) {
+        if (shaderID != 0)
+            glDeleteShader(shaderID);
+    }
+
+    int success;
+    char infoLog[1024];
+    glGetProgramiv(programID, GL_LINK_STATUS, &success);
+    if (!success) {
+        glGetProgramInfoLog(programID, 1024, nullptr, infoLog);
+        std::cout << "[ ERROR  ][Shader ] Link:" << std::endl << infoLog << std::endl;
+        return false;
+    }
+
+    if (binaryFormats > 0)
+        storeProgramBinary(programID, key);
+
+    return true;
+}
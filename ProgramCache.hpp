@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <GL/glew.h>
+#elif _WIN32
+#include "GL/glew.h"
+#endif
+
+
+struct ShaderStage {
+    std::string filename;
+    GLint type;
+    // #define lines inserted right after the #version directive of the source
+    std::string defines{};
+};
+
+/*
+    Links programID from the given shader stages.
+    A program binary stored in the cache directory is used, if its key matches the hash of all sources
+    and the GL vendor, renderer and version. If there is none or the driver rejects it,
+    the stages are compiled from source and the resulting binary is stored for the next launch.
+*/
+bool linkProgramCached(GLuint programID, const std::vector<ShaderStage> &stages);
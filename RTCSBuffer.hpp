@@ -9,21 +9,77 @@
 #include "glm/glm.hpp"
 #endif
 
+#include <string>
+
+
+// Compile-time specialisation of the RayTracer ComputeShader
+struct st_RTCS_variant {
+    int recursion{ 6 };
+    bool textures{ true };
+    bool lights{ true };
+    // Ray and path counters, see TracerStats.hpp
+    bool stats{ false };
+
+    inline uint32_t key() const {
+        return (uint32_t)recursion << 3 | (uint32_t)stats << 2 | (uint32_t)textures << 1 | (uint32_t)lights;
+    }
+
+    inline std::string defines() const {
+        return "#define TRACER_RECURSION " + std::to_string(recursion) + "\n"
+               "#define TRACER_TEXTURES " + std::to_string((int)textures) + "\n"
+               "#define TRACER_LIGHTS " + std::to_string((int)lights) + "\n"
+               "#define TRACER_STATS " + std::to_string((int)stats) + "\n";
+    }
+};
+
+// Scene wide uniforms shared by all RayTracer ComputeShader variants
+struct st_RTCS_uniforms {
+    int count{ 0 };
+    int lights{ 0 };
+    glm::fvec3 bb_center{ 0.0f };
+    float exposure{ 1.0f };
+    // Path guiding grid, cell = (position - guide_min) * guide_scale
+    glm::fvec3 guide_min{ 0.0f };
+    glm::fvec3 guide_scale{ 0.0f };
+    // Tile of the render target in the whole image, a zero image size renders the render target as the image
+    glm::ivec2 tile_offset{ 0 };
+    glm::ivec2 image_size{ 0 };
+};
+
 // RayTracer ComputeShader Data
 struct st_RTCS_data {
     ~st_RTCS_data() {
         glDeleteTextures(2, &renderTarget);
+        glDeleteTextures(2, &gbuffer);
+        glDeleteTextures(2, &historyColor);
+        glDeleteTextures(4, &visibility);
         glDeleteBuffers(3, buffer.arr);
     }
     bool initialized{false};
     glm::ivec2 resolution{0, 0};
     glm::ivec2 buffer_res{0, 0};
+    glm::ivec2 resolution_low{0, 0};
+    glm::ivec2 history_res{0, 0};
 
     uint32_t triangles{ 0 };
 
     GLuint renderTarget{0};
     GLuint renderTargetLow{0};
 
+    // Primary hit normal and distance of each render target
+    GLuint gbuffer{0};
+    GLuint gbufferLow{0};
+
+    // Rasterized primary triangle of each render target and its depth attachment
+    GLuint visibility{0};
+    GLuint visibilityLow{0};
+    GLuint visibilityDepth{0};
+    GLuint visibilityDepthLow{0};
+
+    // Copy of the accumulation the next frame is reprojected from
+    GLuint historyColor{0};
+    GLuint historyGBuffer{0};
+
     union {
         GLuint arr[3];
         struct {
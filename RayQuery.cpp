@@ -0,0 +1,365 @@
+#include "RayQuery.hpp"
+#include "TaskScheduler.hpp"
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+
+/*
+    Lanes of the widest instruction set the compiler targets, vfloat holds LANES floats and vmask
+    the result of comparing them. Without SSE the lanes are plain loops, left to the auto-vectorizer.
+*/
+#if defined(__AVX__)
+
+static constexpr uint32_t LANES = 8;
+struct vfloat { __m256 v; };
+struct vmask { __m256 m; };
+
+static inline vfloat load(const float *p) { return { _mm256_loadu_ps(p) }; }
+static inline vfloat broadcast(float x) { return { _mm256_set1_ps(x) }; }
+static inline void store(float *p, vfloat a) { _mm256_storeu_ps(p, a.v); }
+static inline vfloat operator+(vfloat a, vfloat b) { return { _mm256_add_ps(a.v, b.v) }; }
+static inline vfloat operator-(vfloat a, vfloat b) { return { _mm256_sub_ps(a.v, b.v) }; }
+static inline vfloat operator*(vfloat a, vfloat b) { return { _mm256_mul_ps(a.v, b.v) }; }
+static inline vmask operator>(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+static inline vmask operator>=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+static inline vmask operator<=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+static inline vmask operator<(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+static inline vmask operator&(vmask a, vmask b) { return { _mm256_and_ps(a.m, b.m) }; }
+static inline vfloat select(vmask m, vfloat a, vfloat b) { return { _mm256_blendv_ps(b.v, a.v, m.m) }; }
+static inline uint32_t bits(vmask m) { return (uint32_t)_mm256_movemask_ps(m.m); }
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+static constexpr uint32_t LANES = 4;
+struct vfloat { __m128 v; };
+struct vmask { __m128 m; };
+
+static inline vfloat load(const float *p) { return { _mm_loadu_ps(p) }; }
+static inline vfloat broadcast(float x) { return { _mm_set1_ps(x) }; }
+static inline void store(float *p, vfloat a) { _mm_storeu_ps(p, a.v); }
+static inline vfloat operator+(vfloat a, vfloat b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline vfloat operator-(vfloat a, vfloat b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline vfloat operator*(vfloat a, vfloat b) { return { _mm_mul_ps(a.v, b.v) }; }
+static inline vmask operator>(vfloat a, vfloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+static inline vmask operator>=(vfloat a, vfloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+static inline vmask operator<=(vfloat a, vfloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+static inline vmask operator<(vfloat a, vfloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+static inline vmask operator&(vmask a, vmask b) { return { _mm_and_ps(a.m, b.m) }; }
+static inline vfloat select(vmask m, vfloat a, vfloat b) { return { _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)) }; }
+static inline uint32_t bits(vmask m) { return (uint32_t)_mm_movemask_ps(m.m); }
+
+#else
+
+static constexpr uint32_t LANES = 4;
+struct vfloat { float v[LANES]; };
+struct vmask { bool m[LANES]; };
+
+#define LANEWISE(type, expression) type r{}; for (uint32_t i = 0; i < LANES; i++) expression; return r;
+static inline vfloat load(const float *p) { LANEWISE(vfloat, r.v[i] = p[i]) }
+static inline vfloat broadcast(float x) { LANEWISE(vfloat, r.v[i] = x) }
+static inline void store(float *p, vfloat a) { for (uint32_t i = 0; i < LANES; i++) p[i] = a.v[i]; }
+static inline vfloat operator+(vfloat a, vfloat b) { LANEWISE(vfloat, r.v[i] = a.v[i] + b.v[i]) }
+static inline vfloat operator-(vfloat a, vfloat b) { LANEWISE(vfloat, r.v[i] = a.v[i] - b.v[i]) }
+static inline vfloat operator*(vfloat a, vfloat b) { LANEWISE(vfloat, r.v[i] = a.v[i] * b.v[i]) }
+static inline vmask operator>(vfloat a, vfloat b) { LANEWISE(vmask, r.m[i] = a.v[i] > b.v[i]) }
+static inline vmask operator>=(vfloat a, vfloat b) { LANEWISE(vmask, r.m[i] = a.v[i] >= b.v[i]) }
+static inline vmask operator<=(vfloat a, vfloat b) { LANEWISE(vmask, r.m[i] = a.v[i] <= b.v[i]) }
+static inline vmask operator<(vfloat a, vfloat b) { LANEWISE(vmask, r.m[i] = a.v[i] < b.v[i]) }
+static inline vmask operator&(vmask a, vmask b) { LANEWISE(vmask, r.m[i] = a.m[i] && b.m[i]) }
+static inline vfloat select(vmask m, vfloat a, vfloat b) { LANEWISE(vfloat, r.v[i] = m.m[i] ? a.v[i] : b.v[i]) }
+static inline uint32_t bits(vmask m) { LANEWISE(uint32_t, r |= (uint32_t)m.m[i] << i) }
+#undef LANEWISE
+
+#endif
+
+static_assert(RayQuery::WIDTH % LANES == 0, "a triangle block has to split into whole lanes");
+
+
+struct vvec3 {
+    vfloat x, y, z;
+};
+
+static inline vvec3 broadcast(const glm::fvec3 &a) { return { broadcast(a.x), broadcast(a.y), broadcast(a.z) }; }
+static inline vvec3 load(const float *x, const float *y, const float *z) { return { load(x), load(y), load(z) }; }
+static inline vvec3 operator-(const vvec3 &a, const vvec3 &b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+static inline vfloat dot(const vvec3 &a, const vvec3 &b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+static inline vvec3 cross(const vvec3 &a, const vvec3 &b) {
+    return { a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x };
+}
+
+struct st_lane_hit {
+    vfloat depth;
+    vfloat determinant;
+    vfloat u;
+    vfloat v;
+};
+
+/*
+    intersectTriangle of raytracer.glsl on all lanes, the lanes strictly closer than best_depth / best_determinant are set.
+    Every lane visits its slots in ascending order, so the first of equally close triangles stays.
+*/
+static inline vmask intersectTriangles(const vvec3 &position, const vvec3 &direction,
+                                       const vvec3 &true_normal, const vvec3 &tri_position, const vvec3 &span_u, const vvec3 &span_v,
+                                       vfloat best_depth, vfloat best_determinant, st_lane_hit &hit)
+{
+    const vfloat zero = broadcast(0.0f);
+    hit.determinant = zero - dot(direction, true_normal);
+    const vvec3 delta = position - tri_position;
+    hit.depth = dot(true_normal, delta);
+    const vvec3 minor = cross(direction, delta);
+    hit.u = zero - dot(minor, span_v);
+    hit.v = dot(minor, span_u);
+
+    return (hit.determinant > zero) & (hit.depth > zero) & (hit.u >= zero) & (hit.v >= zero)
+         & (hit.u + hit.v <= hit.determinant) & (hit.depth * best_determinant < best_depth * hit.determinant);
+}
+
+// Closest hit of each ray in the packet lanes, or of one ray over the triangle lanes
+struct st_lane_best {
+    float depth[LANES];
+    float determinant[LANES];
+    float u[LANES];
+    float v[LANES];
+    int slot[LANES];
+};
+
+static inline void keepHits(uint32_t mask, const st_lane_hit &hit, uint32_t first_slot, uint32_t slot_step, st_lane_best &best) {
+    float u[LANES], v[LANES], depth[LANES], determinant[LANES];
+    store(u, hit.u);
+    store(v, hit.v);
+    store(depth, hit.depth);
+    store(determinant, hit.determinant);
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        if (!(mask >> lane & 1u))
+            continue;
+        best.depth[lane] = depth[lane];
+        best.determinant[lane] = determinant[lane];
+        best.u[lane] = u[lane];
+        best.v[lane] = v[lane];
+        best.slot[lane] = (int)(first_slot + lane * slot_step);
+    }
+}
+
+static inline void initBest(st_lane_best &best, float max_distance) {
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        best.depth[lane] = max_distance;
+        best.determinant[lane] = 1.0f;
+        best.slot[lane] = -1;
+    }
+}
+
+static inline st_ray_hit resolveHit(const st_lane_best &best, uint32_t lane, const std::vector<uint32_t> &objects) {
+    st_ray_hit hit;
+    if (best.slot[lane] < 0)
+        return hit;
+
+    // the only division of the query
+    const float inv_det = 1.0f / best.determinant[lane];
+    hit.triangle = best.slot[lane];
+    hit.object = objects[best.slot[lane]];
+    hit.distance = best.depth[lane] * inv_det;
+    hit.uv = glm::fvec2(best.u[lane], best.v[lane]) * inv_det;
+    return hit;
+}
+
+
+void RayQuery::build(const SceneGeometry &geometry, const st_triangle_arrays &arrays) {
+    m_objects.assign(arrays.slots.size(), 0);
+    m_blocks.assign((arrays.slots.size() + WIDTH - 1) / WIDTH, st_triangle_block{});
+
+    for (uint32_t obj_id = 0; obj_id < geometry.objects.size(); obj_id++) {
+        const uint32_t offset = arrays.object_offsets[obj_id];
+        const Object &obj = geometry.objects[obj_id];
+        for (uint32_t i = 0; i < obj.triangles.size(); i++)
+            setTriangle(arrays.slots[offset + i], obj.triangles[i], obj_id);
+    }
+}
+
+void RayQuery::setTriangle(uint32_t slot, const Triangle &tri, uint32_t object) {
+    st_triangle_block &block = m_blocks[slot / WIDTH];
+    const uint32_t lane = slot % WIDTH;
+    block.nx[lane] = tri.true_normal.x; block.ny[lane] = tri.true_normal.y; block.nz[lane] = tri.true_normal.z;
+    block.px[lane] = tri.position.x;    block.py[lane] = tri.position.y;    block.pz[lane] = tri.position.z;
+    block.ux[lane] = tri.u.x;           block.uy[lane] = tri.u.y;           block.uz[lane] = tri.u.z;
+    block.vx[lane] = tri.v.x;           block.vy[lane] = tri.v.y;           block.vz[lane] = tri.v.z;
+    m_objects[slot] = object;
+}
+
+st_ray_hit RayQuery::closestHit(const glm::fvec3 &origin, const glm::fvec3 &direction, float max_distance) const {
+    const vvec3 position = broadcast(origin);
+    const vvec3 dir = broadcast(direction);
+
+    st_lane_best best;
+    initBest(best, max_distance);
+    vfloat best_depth = broadcast(max_distance);
+    vfloat best_determinant = broadcast(1.0f);
+
+    for (uint32_t block_id = 0; block_id < m_blocks.size(); block_id++) {
+        const st_triangle_block &block = m_blocks[block_id];
+        for (uint32_t lane = 0; lane < WIDTH; lane += LANES) {
+            st_lane_hit hit;
+            const vmask closer = intersectTriangles(position, dir,
+                load(block.nx + lane, block.ny + lane, block.nz + lane), load(block.px + lane, block.py + lane, block.pz + lane),
+                load(block.ux + lane, block.uy + lane, block.uz + lane), load(block.vx + lane, block.vy + lane, block.vz + lane),
+                best_depth, best_determinant, hit);
+
+            const uint32_t mask = bits(closer);
+            if (!mask)
+                continue;
+            best_depth = select(closer, hit.depth, best_depth);
+            best_determinant = select(closer, hit.determinant, best_determinant);
+            keepHits(mask, hit, block_id * WIDTH + lane, 1, best);
+        }
+    }
+
+    // every lane holds the closest of its own triangles, compared without dividing like above, ties go to the lower slot
+    uint32_t closest = 0;
+    for (uint32_t lane = 1; lane < LANES; lane++) {
+        if (best.slot[lane] < 0)
+            continue;
+        if (best.slot[closest] < 0) {
+            closest = lane;
+            continue;
+        }
+        const float lane_depth = best.depth[lane] * best.determinant[closest];
+        const float closest_depth = best.depth[closest] * best.determinant[lane];
+        if (lane_depth < closest_depth || (lane_depth == closest_depth && best.slot[lane] < best.slot[closest]))
+            closest = lane;
+    }
+    return resolveHit(best, closest, m_objects);
+}
+
+bool RayQuery::anyHit(const glm::fvec3 &origin, const glm::fvec3 &direction, float max_distance) const {
+    const vvec3 position = broadcast(origin);
+    const vvec3 dir = broadcast(direction);
+    const vfloat max_depth = broadcast(max_distance);
+    const vfloat one = broadcast(1.0f);
+
+    for (const st_triangle_block &block : m_blocks) {
+        for (uint32_t lane = 0; lane < WIDTH; lane += LANES) {
+            st_lane_hit hit;
+            const vmask occluding = intersectTriangles(position, dir,
+                load(block.nx + lane, block.ny + lane, block.nz + lane), load(block.px + lane, block.py + lane, block.pz + lane),
+                load(block.ux + lane, block.uy + lane, block.uz + lane), load(block.vx + lane, block.vy + lane, block.vz + lane),
+                max_depth, one, hit);
+            if (bits(occluding))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Rays [first, first + LANES) of the packet in lanes, missing rays have no direction and hit nothing
+static inline void loadRays(const glm::fvec3 *origins, const glm::fvec3 *directions, uint32_t first, uint32_t count,
+                            vvec3 &position, vvec3 &direction)
+{
+    float rays[6][LANES]{};
+    for (uint32_t lane = 0; lane < LANES && first + lane < count; lane++) {
+        for (int c = 0; c < 3; c++) {
+            rays[c][lane] = origins[first + lane][c];
+            rays[3 + c][lane] = directions[first + lane][c];
+        }
+    }
+    position = load(rays[0], rays[1], rays[2]);
+    direction = load(rays[3], rays[4], rays[5]);
+}
+
+void RayQuery::closestHits(const glm::fvec3 *origins, const glm::fvec3 *directions, uint32_t count, st_ray_hit *hits,
+                           float max_distance) const
+{
+    count = std::min(count, WIDTH);
+    const uint32_t triangles = size();
+    for (uint32_t first = 0; first < count; first += LANES) {
+        vvec3 position, dir;
+        loadRays(origins, directions, first, count, position, dir);
+
+        st_lane_best best;
+        initBest(best, max_distance);
+        vfloat best_depth = broadcast(max_distance);
+        vfloat best_determinant = broadcast(1.0f);
+
+        for (uint32_t slot = 0; slot < triangles; slot++) {
+            const st_triangle_block &block = m_blocks[slot / WIDTH];
+            const uint32_t i = slot % WIDTH;
+            st_lane_hit hit;
+            const vmask closer = intersectTriangles(position, dir,
+                broadcast(glm::fvec3(block.nx[i], block.ny[i], block.nz[i])), broadcast(glm::fvec3(block.px[i], block.py[i], block.pz[i])),
+                broadcast(glm::fvec3(block.ux[i], block.uy[i], block.uz[i])), broadcast(glm::fvec3(block.vx[i], block.vy[i], block.vz[i])),
+                best_depth, best_determinant, hit);
+
+            const uint32_t mask = bits(closer);
+            if (!mask)
+                continue;
+            best_depth = select(closer, hit.depth, best_depth);
+            best_determinant = select(closer, hit.determinant, best_determinant);
+            keepHits(mask, hit, slot, 0, best);
+        }
+
+        for (uint32_t lane = 0; lane < LANES && first + lane < count; lane++)
+            hits[first + lane] = resolveHit(best, lane, m_objects);
+    }
+}
+
+void RayQuery::anyHits(const glm::fvec3 *origins, const glm::fvec3 *directions, uint32_t count, bool *occluded,
+                       float max_distance) const
+{
+    count = std::min(count, WIDTH);
+    const uint32_t triangles = size();
+    const vfloat max_depth = broadcast(max_distance);
+    const vfloat one = broadcast(1.0f);
+    for (uint32_t first = 0; first < count; first += LANES) {
+        vvec3 position, dir;
+        loadRays(origins, directions, first, count, position, dir);
+
+        // lanes without a ray count as occluded, the packet stops once all lanes are
+        const uint32_t rays = std::min(count - first, LANES);
+        const uint32_t all = (1u << LANES) - 1u;
+        uint32_t found = all & ~((1u << rays) - 1u);
+        for (uint32_t slot = 0; slot < triangles && found != all; slot++) {
+            const st_triangle_block &block = m_blocks[slot / WIDTH];
+            const uint32_t i = slot % WIDTH;
+            st_lane_hit hit;
+            found |= bits(intersectTriangles(position, dir,
+                broadcast(glm::fvec3(block.nx[i], block.ny[i], block.nz[i])), broadcast(glm::fvec3(block.px[i], block.py[i], block.pz[i])),
+                broadcast(glm::fvec3(block.ux[i], block.uy[i], block.uz[i])), broadcast(glm::fvec3(block.vx[i], block.vy[i], block.vz[i])),
+                max_depth, one, hit));
+        }
+
+        for (uint32_t lane = 0; lane < rays; lane++)
+            occluded[first + lane] = found >> lane & 1u;
+    }
+}
+
+// Calls packet(first, count) for all packets of a stream, on all cores unless the stream is short
+template<typename Packet>
+static void forEachPacket(size_t count, const Packet &packet) {
+    constexpr size_t WIDTH = RayQuery::WIDTH;
+    const size_t packets = (count + WIDTH - 1) / WIDTH;
+
+    // a task is only worth it for a few dozen packets
+    TaskScheduler::parallelFor(0, packets, 32, [&](size_t first, size_t last) {
+        for (size_t p = first; p < last; p++)
+            packet(p * WIDTH, (uint32_t)std::min(WIDTH, count - p * WIDTH));
+    });
+}
+
+void RayQuery::closestHitStream(const glm::fvec3 *origins, const glm::fvec3 *directions, size_t count, st_ray_hit *hits,
+                                float max_distance) const
+{
+    forEachPacket(count, [&](size_t first, uint32_t rays) {
+        closestHits(origins + first, directions + first, rays, hits + first, max_distance);
+    });
+}
+
+void RayQuery::anyHitStream(const glm::fvec3 *origins, const glm::fvec3 *directions, size_t count, bool *occluded,
+                            float max_distance) const
+{
+    forEachPacket(count, [&](size_t first, uint32_t rays) {
+        anyHits(origins + first, directions + first, rays, occluded + first, max_distance);
+    });
+}
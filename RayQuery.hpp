@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include "SceneGeometry.hpp"
+
+
+struct st_ray_hit {
+    // tracer slot of the closest triangle, -1 if the ray hit nothing
+    int triangle{ -1 };
+    uint32_t object{ 0 };
+    // along the direction, in multiples of its length
+    float distance{ 0.0f };
+    // local coordinates along span_u and span_v, like current_intersection.xy in raytracer.glsl
+    glm::fvec2 uv{ 0.0f };
+};
+
+/*
+    CPU ray casting against the triangles of the tracer, for picking and other scene queries without a GPU round trip.
+    The triangles are kept in blocks of WIDTH as structure of arrays and tested with AVX (8 lanes), SSE (4 lanes)
+    or scalar code, whatever the compiler targets. The test is intersectTriangle of raytracer.glsl: back faces are
+    culled the same way, candidates are compared without dividing and only the closest hit is divided out.
+    A hit has to be strictly closer to replace another one, of equally close triangles the lowest slot wins,
+    so single rays, packets and streams return the same hit.
+
+    Single rays test the triangles of a block side by side, packets test every triangle against up to WIDTH rays
+    at once and streams split any number of rays into packets spread over all cores.
+*/
+class RayQuery {
+public:
+    static constexpr uint32_t WIDTH = 8;
+    static constexpr float UNLIMITED = std::numeric_limits<float>::infinity();
+
+    RayQuery() = default;
+    RayQuery(const SceneGeometry &geometry, const st_triangle_arrays &arrays) { build(geometry, arrays); }
+
+    // Takes all triangles of geometry in the tracer slots of arrays
+    void build(const SceneGeometry &geometry, const st_triangle_arrays &arrays);
+    // Replaces the triangle in a slot, after an edit of its object
+    void setTriangle(uint32_t slot, const Triangle &tri, uint32_t object);
+
+    [[nodiscard]] inline uint32_t size() const noexcept { return (uint32_t)m_objects.size(); }
+
+    st_ray_hit closestHit(const glm::fvec3 &origin, const glm::fvec3 &direction, float max_distance = UNLIMITED) const;
+    bool anyHit(const glm::fvec3 &origin, const glm::fvec3 &direction, float max_distance = UNLIMITED) const;
+
+    // Up to WIDTH rays, best with similar origins and directions
+    void closestHits(const glm::fvec3 *origins, const glm::fvec3 *directions, uint32_t count, st_ray_hit *hits,
+                     float max_distance = UNLIMITED) const;
+    void anyHits(const glm::fvec3 *origins, const glm::fvec3 *directions, uint32_t count, bool *occluded,
+                 float max_distance = UNLIMITED) const;
+
+    // Any number of rays, packets of WIDTH consecutive rays on all cores
+    void closestHitStream(const glm::fvec3 *origins, const glm::fvec3 *directions, size_t count, st_ray_hit *hits,
+                          float max_distance = UNLIMITED) const;
+    void anyHitStream(const glm::fvec3 *origins, const glm::fvec3 *directions, size_t count, bool *occluded,
+                      float max_distance = UNLIMITED) const;
+
+private:
+    struct alignas(32) st_triangle_block {
+        float nx[WIDTH], ny[WIDTH], nz[WIDTH];
+        float px[WIDTH], py[WIDTH], pz[WIDTH];
+        float ux[WIDTH], uy[WIDTH], uz[WIDTH];
+        float vx[WIDTH], vy[WIDTH], vz[WIDTH];
+    };
+
+    // the padding of the last block has no normal, nothing hits it
+    std::vector<st_triangle_block> m_blocks;
+    std::vector<uint32_t> m_objects;
+};
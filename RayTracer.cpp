@@ -1,6 +1,17 @@
 #include <iostream>
 #include <fstream>
 #include "Scene.hpp"
+#include "PerfHUD.hpp"
+#include "Context.hpp"
+#include "Benchmark.hpp"
+#include "Distributed.hpp"
+#include "Animation.hpp"
+#include "Daemon.hpp"
+#include "TiledRender.hpp"
+#include "SampleBatcher.hpp"
+#include "Timeline.hpp"
+#include "TaskScheduler.hpp"
+#include <algorithm>
 
 #ifdef __linux__
 
@@ -21,30 +32,126 @@ constexpr double M_PI = 3.141592653589793;
 static constexpr glm::dvec3 rot_x(1.0f, 0.0f, 0.0f);
 static constexpr glm::dvec3 rot_y(0.0f, 1.0f, 0.0f);
 static int WIDTH(3440), HEIGHT(1440);
+// An idle viewport accumulates up to this many samples, then stops tracing
+static uint32_t IDLE_SAMPLES(4096);
+static constexpr uint32_t FINAL_SAMPLES = 64;
+// Presenting more often only costs samples while the image converges
+static constexpr double PRESENT_INTERVAL = 1.0 / 30.0;
 
 static glm::dvec3 MVP_translation(0.0, 1.5, -3.0);
 static glm::dvec2 MVP_rot(-M_PI_4, 0.0);
 
 
-void finalRender(GLFWwindow *window, Scene &scene, int width, int height, uint32_t &sample) {
+static void collectFrame(Scene &scene, PerfHUD &hud, SampleBatcher &batcher, uint32_t sample, uint32_t samples, uint64_t traced_pixels) {
+    TIMELINE_ZONE("collectFrame");
+    GpuProfiler &profiler = scene.getProfiler();
+    profiler.collect();
+    batcher.update(profiler.getMilliseconds(PASS_TRACE));
+    hud.record(profiler, sample, samples, traced_pixels);
+
+    // the counters of this frame arrive a few frames later, like the timings
+    if (TracerStats *stats = scene.getStatistics()) {
+        stats->capture(sample + samples);
+        if (stats->collect())
+            hud.recordStats(stats->latest());
+    }
+}
+
+static void presentFrame(GLFWwindow *window, Scene &scene, PerfHUD &hud) {
+    TIMELINE_ZONE("presentFrame");
+    hud.draw(scene.getProfiler());
+    glfwSwapBuffers(window);
+}
+
+// Casts the camera ray of the pixel under the cursor on the CPU, reports what it hits and returns its object, -1 for the sky
+static int pickObject(GLFWwindow *window, const Scene &scene, const glm::fmat4 &camera) {
+    TIMELINE_ZONE("pickObject");
+    double cursor_x, cursor_y;
+    int window_width, window_height;
+    glfwGetCursorPos(window, &cursor_x, &cursor_y);
+    glfwGetWindowSize(window, &window_width, &window_height);
+
+    // detector mapping of raytracer.glsl, its rows start at the bottom
+    const float x = (float)(cursor_x / window_width * WIDTH);
+    const float y = (float)((1.0 - cursor_y / window_height) * HEIGHT);
+    const glm::fvec3 dtctor((x - 0.5f*WIDTH) / HEIGHT, y / HEIGHT - 0.5f, 0.5f);
+    const glm::fvec3 origin(camera * glm::fvec4(0.0f, 0.0f, 0.0f, 1.0f));
+    const glm::fvec3 direction = glm::normalize(glm::fvec3(camera * glm::fvec4(glm::normalize(dtctor), 0.0f)));
+
+    const st_ray_hit hit = scene.getRayQuery().closestHit(origin, direction);
+    if (hit.triangle < 0) {
+        std::cout << "Picked: sky" << std::endl;
+        return -1;
+    }
+    std::cout << "Picked: " << scene.getGeometry().objects[hit.object].name << " (object " << hit.object
+              << ", triangle " << hit.triangle << ") at distance " << hit.distance << std::endl;
+    return (int)hit.object;
+}
+
+/*
+    Edits the picked object, committed by the next commitEdits(): the arrow keys move it in x and z,
+    page up and down in y, [ and ] change the roughness of the material of its first triangle.
+*/
+static void editObject(GLFWwindow *window, Scene &scene, int object_id, double step) {
+    glm::dvec3 offset(0.0);
+    if (glfwGetKey(window, GLFW_KEY_RIGHT))     offset.x += step;
+    if (glfwGetKey(window, GLFW_KEY_LEFT))      offset.x -= step;
+    if (glfwGetKey(window, GLFW_KEY_UP))        offset.z += step;
+    if (glfwGetKey(window, GLFW_KEY_DOWN))      offset.z -= step;
+    if (glfwGetKey(window, GLFW_KEY_PAGE_UP))   offset.y += step;
+    if (glfwGetKey(window, GLFW_KEY_PAGE_DOWN)) offset.y -= step;
+    if (glm::dot(offset, offset) > 0.0)
+        scene.transformObject(object_id, glm::translate(glm::fvec3(offset)));
+
+    const Object &object = scene.getGeometry().objects[object_id];
+    const double roughness_step = (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) ? step : 0.0) - (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) ? step : 0.0);
+    if (roughness_step != 0.0 && !object.triangles.empty()) {
+        const uint32_t material_id = object.triangles[0].material_id;
+        Material material = scene.getGeometry().materials[material_id];
+        material.specular_roughness.a = glm::clamp(material.specular_roughness.a + (float)roughness_step * 0.25f, 0.0f, 1.0f);
+        scene.setMaterial(material_id, material);
+    }
+}
+
+// Frames that aren't presented aren't throttled by the swap, this keeps at most two batches queued
+static void throttleBatches(GLsync &in_flight) {
+    if (in_flight) {
+        glClientWaitSync(in_flight, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(in_flight);
+    }
+    in_flight = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void finalRender(GLFWwindow *window, Scene &scene, PerfHUD &hud, SampleBatcher &batcher, int width, int height, uint32_t &sample) {
+    TIMELINE_ZONE("finalRender");
     glm::dmat4 ROT = glm::rotate(-MVP_rot.y, rot_y) * glm::rotate(-MVP_rot.x, rot_x);
     glm::fmat4 CAMERA = glm::translate(MVP_translation) * ROT;
     glm::fmat4 MVP = glm::perspectiveFov(glm::radians(90.0), (double)WIDTH, (double)HEIGHT, 0.03, 1024.0) * glm::rotate(-MVP_rot.x, rot_x) * glm::rotate(-MVP_rot.y, rot_y) * glm::translate(glm::dvec3(-1,-1,1)*MVP_translation);
     scene.prepare(width, height, false, CAMERA);
     const auto t0 = glfwGetTime();
-    double t;
+    double lastPresent = t0;
     glfwSwapInterval(0);
     const uint32_t start_sample = sample;
-    while (true) {
-        scene.traceScene(width, height, ++sample);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        scene.display();
-        glfwSetWindowTitle(window, ("GPU RT - Samples: " + std::to_string(sample+1)).c_str());
-        glfwSwapBuffers(window);
+    GLsync in_flight = nullptr;
+    while (sample + 1 < FINAL_SAMPLES) {
+        const uint32_t samples = std::min(batcher.next(), FINAL_SAMPLES - 1 - sample);
+        scene.traceScene(width, height, sample + 1, samples);
+        sample += samples;
+        throttleBatches(in_flight);
+        collectFrame(scene, hud, batcher, sample, samples, (uint64_t)width*height);
+        if (glfwGetTime() - lastPresent >= PRESENT_INTERVAL || sample + 1 >= FINAL_SAMPLES) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            scene.display();
+            glfwSetWindowTitle(window, ("GPU RT - Samples: " + std::to_string(sample+1)).c_str());
+            presentFrame(window, scene, hud);
+            lastPresent = glfwGetTime();
+        }
         glfwPollEvents();
-        if (glfwGetKey(window, GLFW_KEY_F3) == GLFW_PRESS || sample == 63)
+        if (glfwGetKey(window, GLFW_KEY_F3) == GLFW_PRESS)
             break;
     }
+    if (in_flight)
+        glDeleteSync(in_flight);
     double sps = (sample - start_sample) / (glfwGetTime() - t0);
     std::cout << sps << std::endl;
     glfwSwapInterval(1);
@@ -53,15 +160,26 @@ void finalRender(GLFWwindow *window, Scene &scene, int width, int height, uint32
 }
 
 
-void mainLoop(GLFWwindow *window, Scene &scene) {
+void mainLoop(GLFWwindow *window, Scene &scene, PerfHUD &hud, SampleBatcher &batcher) {
     static glm::dmat4 P = glm::perspectiveFov(glm::radians(90.0), (double)WIDTH, (double)HEIGHT, 0.03, 1024.0);
     static glm::dmat4 ROT = glm::rotate(-MVP_rot.y, rot_y) * glm::rotate(-MVP_rot.x, rot_x);
 
     glm::dvec2 mouse, lastMouse;
     bool lastMoving = true;
+    bool lastToggleHUD = false;
+    bool lastToggleTemporal = false;
+    bool lastToggleVisibility = false;
+    bool lastToggleGuiding = false;
+    bool lastToggleLOD = false;
+    bool lastLeftBtn = false;
+    int selectedObject = -1;
+    uint32_t workloadVersion = scene.getWorkloadVersion();
     glfwSwapInterval(1);
+    scene.setTemporalReprojection(true);
 
     double lastUpdate = glfwGetTime();
+    double lastPresent = lastUpdate;
+    GLsync in_flight = nullptr;
 
     glEnable(GL_DEPTH_TEST);
     glFrontFace(GL_CW);
@@ -70,6 +188,7 @@ void mainLoop(GLFWwindow *window, Scene &scene) {
     static unsigned int sample = 0;
 
     while (!glfwWindowShouldClose(window)) {
+        TIMELINE_ZONE("frame");
         const double time = glfwGetTime();
         const double deltaT = time - lastUpdate;
         lastUpdate = time;
@@ -119,49 +238,143 @@ void mainLoop(GLFWwindow *window, Scene &scene) {
             sample = 0;
         }
 
-        if (moving || lastMoving != moving)
+        if (selectedObject >= 0)
+            editObject(window, scene, selectedObject, deltaT * (shift ? 8.0 : 1.0) * (ctrl ? 0.125 : 1.0));
+
+        // Scene edits invalidate the accumulated samples
+        const bool edited = scene.commitEdits();
+        if (workloadVersion != scene.getWorkloadVersion()) {
+            workloadVersion = scene.getWorkloadVersion();
+            batcher.reset();
+        }
+
+        // An idle viewport keeps converging, several samples per dispatch and presented at PRESENT_INTERVAL
+        const bool converging = !moving && sample < IDLE_SAMPLES;
+        if (moving || lastMoving != moving || edited || converging)
         {
             int width = WIDTH;
             int height = HEIGHT;
-            if (lastMoving != moving)
+            if (lastMoving != moving || edited)
                 sample = 0;
             ROT = glm::rotate(-MVP_rot.y, rot_y) * glm::rotate(-MVP_rot.x, rot_x);
             glm::fmat4 CameraTransform = glm::translate(MVP_translation) * ROT;
             glm::fmat4 MVP = P * glm::rotate(-MVP_rot.x, rot_x) * glm::rotate(-MVP_rot.y, rot_y) * glm::translate(glm::dvec3(-1,-1,1)*MVP_translation);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            uint64_t traced_pixels = 0;
+            uint32_t samples = 0;
+            bool present = true;
             if (!moving) {
-                glfwSetWindowTitle(window, ("GPU RT - Samples: " + std::to_string(sample+1)).c_str());
                 scene.prepare(width, height, false, CameraTransform);
-                scene.traceScene(width, height, sample++);
-                scene.display();
+                samples = std::min(batcher.next(), IDLE_SAMPLES - sample);
+                scene.traceScene(width, height, sample, samples);
+                sample += samples;
+                traced_pixels = (uint64_t)width*height;
+                throttleBatches(in_flight);
+                // the first batch after a restart is shown right away
+                present = sample == samples || sample >= IDLE_SAMPLES || time - lastPresent >= PRESENT_INTERVAL;
+                if (present) {
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    glfwSetWindowTitle(window, ("GPU RT - Samples: " + std::to_string(sample)).c_str());
+                    scene.display();
+                }
             }
             else if (middleBtn) {
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
                 glfwSetWindowTitle(window, ("GPU RT - Samples: " + std::to_string(sample+1)).c_str());
                 scene.prepare(width, height, true, CameraTransform);
                 scene.traceScene(width, height, sample++);
                 scene.display();
+                traced_pixels = (uint64_t)width*height;
+                samples = 1;
             }
             else {
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
                 glfwSetWindowTitle(window, "GPU RT - OpenGL Phong");
                 scene.forwardRender(MVP, MVP_translation);
             }
-            if (glfwGetKey(window, GLFW_KEY_LEFT_ALT) == GLFW_PRESS) {
+            if (present && glfwGetKey(window, GLFW_KEY_LEFT_ALT) == GLFW_PRESS) {
                 scene.renderWireframe(MVP, MVP_translation);
             }
-            glfwSwapBuffers(window);
+            collectFrame(scene, hud, batcher, sample, samples, traced_pixels);
+            if (present) {
+                presentFrame(window, scene, hud);
+                lastPresent = time;
+            }
+            if (moving && middleBtn)
+                scene.updatePreview();
         }
         lastMoving = moving;
 
+        const bool toggleHUD = glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS;
+        if (toggleHUD && !lastToggleHUD)
+            hud.toggle();
+        lastToggleHUD = toggleHUD;
+
+        const bool toggleTemporal = glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS;
+        if (toggleTemporal && !lastToggleTemporal) {
+            scene.setTemporalReprojection(!scene.getTemporalReprojection());
+            std::cout << "Temporal reprojection " << (scene.getTemporalReprojection() ? "on" : "off") << std::endl;
+        }
+        lastToggleTemporal = toggleTemporal;
+
+        const bool toggleVisibility = glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS;
+        if (toggleVisibility && !lastToggleVisibility) {
+            scene.setVisibilityBuffer(!scene.getVisibilityBuffer());
+            std::cout << "Visibility buffer " << (scene.getVisibilityBuffer() ? "on" : "off") << std::endl;
+        }
+        lastToggleVisibility = toggleVisibility;
+
+        const bool toggleGuiding = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+        if (toggleGuiding && !lastToggleGuiding) {
+            scene.setPathGuiding(!scene.getPathGuiding());
+            std::cout << "Path guiding " << (scene.getPathGuiding() ? "on" : "off") << std::endl;
+        }
+        lastToggleGuiding = toggleGuiding;
+
+        const bool toggleLOD = glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS;
+        if (toggleLOD && !lastToggleLOD) {
+            scene.setPreviewLOD(!scene.getPreviewLOD());
+            std::cout << "Preview LOD " << (scene.getPreviewLOD() ? "on" : "off") << std::endl;
+        }
+        lastToggleLOD = toggleLOD;
+
+        const bool leftBtn = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT);
+        if (leftBtn && !lastLeftBtn && !ImGui::GetIO().WantCaptureMouse) {
+            const glm::fmat4 camera = glm::translate(MVP_translation) * glm::rotate(-MVP_rot.y, rot_y) * glm::rotate(-MVP_rot.x, rot_x);
+            selectedObject = pickObject(window, scene, camera);
+        }
+        lastLeftBtn = leftBtn;
+
         if (glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS) {
-            finalRender(window, scene, WIDTH, HEIGHT, sample);
+            finalRender(window, scene, hud, batcher, WIDTH, HEIGHT, sample);
         }
+        // results handed back to the GL thread by tasks
+        TaskScheduler::runMainTasks();
         glfwPollEvents();
     }
+    if (in_flight)
+        glDeleteSync(in_flight);
 }
 
 
-int main(int argc, char* args[]) {
-    if (argc != 4)
+static int run(int argc, char* args[]) {
+    if (argc >= 2 && std::string(args[1]) == "--benchmark")
+        return runBenchmark(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--render")
+        return runWorker(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--resume")
+        return runResume(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--merge")
+        return runMerge(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--animate")
+        return runAnimation(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--daemon")
+        return runDaemon(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--client")
+        return runClient(argc, args);
+    if (argc >= 2 && std::string(args[1]) == "--tiled")
+        return runTiled(argc, args);
+
+    if (argc < 4)
         return EXIT_FAILURE;
 
     std::string name(args[1]);
@@ -169,32 +382,10 @@ int main(int argc, char* args[]) {
     WIDTH = atoi(args[2]);
     HEIGHT = atoi(args[3]);
 
-    if (glfwInit() != GLFW_TRUE) {
-        std::cerr << "Cannot initialize GLFW\n";
-        return 1;
-    }
-
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-    glfwWindowHint(GLFW_RED_BITS,             10);
-    glfwWindowHint(GLFW_GREEN_BITS,           10);
-    glfwWindowHint(GLFW_BLUE_BITS,            10);
-    glfwWindowHint(GLFW_ALPHA_BITS,            2);
-
     glm::ivec2 display(720.0f*(float)WIDTH/(float)HEIGHT, 720);
-    GLFWwindow *window = glfwCreateWindow(display.x, display.y, "GPU RT", nullptr, nullptr);
-    glfwMakeContextCurrent(window);
-
-    glViewport(0, 0, display.x, display.y);
-
-    GLenum err = glewInit();
-    if (err != GLEW_OK) {
-        std::cerr << "GLEW Init error:\n" << glewGetErrorString(err) << '\n';
+    GLFWwindow *window = createGLContext(display.x, display.y, "GPU RT", true);
+    if (!window)
         return 2;
-    }
 
     int r(0),g(0),b(0),a(0);
     glGetIntegerv(GL_RED_BITS, &r);
@@ -208,6 +399,11 @@ int main(int argc, char* args[]) {
     std::cout << (scene.addWavefrontModel("./res/models/"+name) ? "Scene Loaded" : "Scene does not exist") << '\n';
 
     glDisable(GL_FRAMEBUFFER_SRGB);
+    // built by finalizeObjects(), a later switch would build twice
+    for (int i = 4; i < argc; i++) {
+        if (std::string(args[i]) == "--bvh-quality")
+            scene.setBVHQuality(true);
+    }
     scene.finalizeObjects();
 
     scene.loadEnvironmentTexture(window, "res/models/textures/brownStudio.exr");
@@ -216,9 +412,55 @@ int main(int argc, char* args[]) {
     scene.loadMaterial("res/models/textures/aluminium", 1);
     //scene.loadMaterial("res/models/textures/rubber", 2);
 
-    mainLoop(window, scene);
+    {
+        PerfHUD hud(window);
+        SampleBatcher batcher;
+        for (int i = 4; i < argc; i++) {
+            const bool value = i + 1 < argc;
+            if (std::string(args[i]) == "--perf-csv" && value)
+                hud.openCSV(args[++i]);
+            else if (std::string(args[i]) == "--preview-ms" && value)
+                scene.getPreview().setTarget(atof(args[++i]));
+            else if (std::string(args[i]) == "--batch-ms" && value)
+                batcher.setTarget(atof(args[++i]));
+            else if (std::string(args[i]) == "--idle-spp" && value)
+                IDLE_SAMPLES = std::max(atoi(args[++i]), 1);
+            else if (std::string(args[i]) == "--stats")
+                scene.setStatistics(true);
+            else if (std::string(args[i]) == "--stats-csv" && value) {
+                scene.setStatistics(true);
+                scene.getStatistics()->openCSV(args[++i]);
+            }
+        }
 
+        mainLoop(window, scene, hud, batcher);
+    }
+
+    Timeline::finish();
     glfwTerminate();
 
     return 0;
 }
+
+int main(int argc, char* args[]) {
+    // --timeline out.json, --threads N and --texture-cache-mb N work with every mode, the modes never see them
+    std::vector<char*> arguments;
+    unsigned threads = 0;
+    for (int i = 0; i < argc; i++) {
+        if (std::string(args[i]) == "--timeline" && i + 1 < argc)
+            Timeline::start(args[++i]);
+        else if (std::string(args[i]) == "--threads" && i + 1 < argc)
+            threads = (unsigned)std::max(atoi(args[++i]), 0);
+        else if (std::string(args[i]) == "--texture-cache-mb" && i + 1 < argc)
+            Scene::setTextureCacheSize((size_t)std::max(atoi(args[++i]), 1));
+        else
+            arguments.push_back(args[i]);
+    }
+    // after the timeline, so it names the workers
+    TaskScheduler::initialize(threads);
+
+    const int result = run((int)arguments.size(), arguments.data());
+    TaskScheduler::shutdown();
+    Timeline::finish();
+    return result;
+}
@@ -0,0 +1,36 @@
+#include "SampleBatcher.hpp"
+#include <algorithm>
+#include <cmath>
+
+
+SampleBatcher::SampleBatcher(double target_ms, uint32_t max_samples)
+    : m_target(target_ms), m_maxSamples(std::max(max_samples, 1u))
+{
+}
+
+uint32_t SampleBatcher::next() {
+    m_issued[m_frame & 1] = m_samples;
+    return m_samples;
+}
+
+void SampleBatcher::update(double trace_ms) {
+    // the profiler just read the queries of the previous frame
+    m_frame++;
+    const uint32_t timed = m_issued[m_frame & 1];
+    m_issued[m_frame & 1] = 0;
+    if (timed == 0 || trace_ms <= 0.0)
+        return;
+
+    const double sample_ms = trace_ms / timed;
+    m_sampleMs = (m_sampleMs < 0.0) ? sample_ms : m_sampleMs + (sample_ms - m_sampleMs) * 0.25;
+
+    // At most doubles per step, a wrong estimate must not stall the GPU for seconds
+    const double fitting = std::floor(m_target / m_sampleMs);
+    m_samples = (uint32_t)std::clamp(fitting, 1.0, (double)std::min(m_samples * 2, m_maxSamples));
+}
+
+void SampleBatcher::reset() noexcept {
+    m_sampleMs = -1.0;
+    m_samples = 1;
+    m_issued[0] = m_issued[1] = 0;
+}
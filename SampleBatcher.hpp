@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+
+/*
+    Picks the number of samples accumulated per dispatch from the measured GPU time,
+    so a converging image runs at full GPU throughput instead of one sample per presented frame.
+    The timings of GpuProfiler arrive one frame late, they are matched to the batch that produced them.
+*/
+class SampleBatcher {
+public:
+    explicit SampleBatcher(double target_ms = 1000.0 / 30.0, uint32_t max_samples = 64);
+
+    // Samples for the next dispatch, remembered until its timing arrives
+    uint32_t next();
+
+    // Call once per GpuProfiler::collect() with the trace time, also in frames without a batch
+    void update(double trace_ms);
+
+    // Drops the estimate, the next batches belong to another resolution or scene
+    void reset() noexcept;
+
+    inline void setTarget(double ms) noexcept { m_target = ms; }
+    [[nodiscard]] inline double getTarget() const noexcept { return m_target; }
+    [[nodiscard]] inline uint32_t getSamples() const noexcept { return m_samples; }
+
+private:
+    double m_target;
+    double m_sampleMs{ -1.0 };
+    uint32_t m_maxSamples;
+    uint32_t m_samples{ 1 };
+    // batch sizes of the last two dispatches, 0 if the frame traced no batch
+    uint32_t m_issued[2]{ 0, 0 };
+    uint32_t m_frame{ 0 };
+};
@@ -1,24 +1,26 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <atomic>
 #include "Scene.hpp"
 #include "Shader.hpp"
+#include "ProgramCache.hpp"
+#include "Memory.hpp"
+#include "PathGuide.hpp"
+#include "Timeline.hpp"
+#include "TaskScheduler.hpp"
+#include "ImageIO.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
-#include <zlib.h>
-#define TINYEXR_USE_MINIZ 0
-#define TINYEXR_USE_STB_ZLIB 0
-#define TINYEXR_IMPLEMENTATION
-#include "tinyexr/tinyexr.h"
 
 
 #ifdef __linux__
-#define SSCANF sscanf
 #include <GLFW/glfw3.h>
+#include <glm/gtx/transform.hpp>
 #elif _WIN32
-#define SSCANF sscanf_s
 #include "GLFW/glfw3.h"
+#include "glm/gtx/transform.hpp"
 #endif
 
 
@@ -55,68 +57,24 @@ constexpr T ceilPower2(const T n) {
     return (n >> p) + bool(p & ((1 << p)-1));
 }
 
-glm::fvec3 LinearTosRGB(const glm::fvec3& C) {
-    glm::fvec3 sRGB(0.0f);
-    sRGB.r = (C.r <= 0.0031308f) ? C.r * 12.92f : 1.055f * powf(C.r, 1.0f/2.4f) - 0.055f;
-    sRGB.g = (C.g <= 0.0031308f) ? C.g * 12.92f : 1.055f * powf(C.g, 1.0f/2.4f) - 0.055f;
-    sRGB.b = (C.b <= 0.0031308f) ? C.b * 12.92f : 1.055f * powf(C.b, 1.0f/2.4f) - 0.055f;
-    return sRGB;
-}
-
-glm::fvec3 ACESFilm(const glm::fvec3& x) {
-    constexpr float a = 2.51f;
-    constexpr float b = 0.03f;
-    constexpr float c = 2.43f;
-    constexpr float d = 0.59f;
-    constexpr float e = 0.14f;
-    return glm::clamp((x*(a*x+b))/(x*(c*x+d)+e), glm::fvec3(0.0f), glm::fvec3(1.0f));
-}
-
-bool Scene::loadTexture(const std::string &texture_name, uint32_t material_id, uint32_t offset)
-{
-    int width, height;
-    float* image_data = nullptr;
-    const char* err = nullptr;
-
-    int ret = LoadEXR(&image_data, &width, &height, texture_name.c_str(), &err);
-
-    if (ret != TINYEXR_SUCCESS) {
-        std::cerr << "Couldn't load " << texture_name << std::endl;
-        if (err) {
-            std::cerr << '\t' << err << std::endl;
-            FreeEXRErrorMessage(err);
-        }
-        return false;
-    }
-
-    std::cout << texture_name << '\t' << width << 'x' << height << std::endl;
-    glTextureSubImage3D(textureAtlas,
-        0,
-        0, 0, material_id*3u + offset,
-        width, height, 1,
-        GL_RGBA, GL_FLOAT, image_data
-    );
-    free(image_data);
-
-    return true;
-}
-
 bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &texture_name)
 {
-    int width, height;
-    float* image_data = nullptr;
-    const char* err = nullptr;
-
-    int ret = LoadEXR(&image_data, &width, &height, texture_name.c_str(), &err);
-
-    if (ret != TINYEXR_SUCCESS) {
-        std::cerr << "Couldn't load " << texture_name << std::endl;
-        if (err) {
-            std::cerr << '\t' << err << std::endl;
-            FreeEXRErrorMessage(err);
-        }
-        return false;
+    TIMELINE_ZONE("loadEnvironmentTexture", texture_name);
+    // the irradiance cache is decoded next to the radiance, it is usually there
+    st_exr_image radiance, cached_irradiance;
+    bool irradiance_cached = false;
+    {
+        TaskGroup group;
+        group.run([&]() {
+            TIMELINE_ZONE("decodeEXR", texture_name);
+            irradiance_cached = decodeEXR(texture_name + "-irradiance.exr", cached_irradiance, true);
+        });
+        TIMELINE_ZONE("decodeEXR", texture_name);
+        if (!decodeEXR(texture_name, radiance))
+            return false;
     }
+    const int width = radiance.width;
+    const int height = radiance.height;
     std::cout << texture_name << '\t' << width << 'x' << height << std::endl;
     if (radianceTexture)
         glDeleteTextures(1, &radianceTexture);
@@ -130,9 +88,8 @@ bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &textur
     glTextureParameteri(radianceTexture, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTextureParameteri(radianceTexture, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTextureParameteri(radianceTexture, GL_TEXTURE_MAX_LEVEL, 1);
-    glTextureSubImage2D(radianceTexture, 0, 0, 0, width, height, GL_RGBA, GL_FLOAT, image_data);
-
-    free(image_data);
+    glTextureSubImage2D(radianceTexture, 0, 0, 0, width, height, GL_RGBA, GL_FLOAT, radiance.pixels.get());
+    radiance.pixels.reset();
 
     glCreateTextures(GL_TEXTURE_2D, 1, &irradianceTexture);
     glTextureStorage2D(irradianceTexture, 1, GL_RGBA32F, width/4, height/4);
@@ -148,9 +105,7 @@ bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &textur
     glActiveTexture(GL_TEXTURE3);
     glBindTexture(GL_TEXTURE_2D, irradianceTexture);
 
-    glProgramUniform1i(eyeRayTracerProgram, 2, 2);
     glProgramUniform1i(modelShader.getID(), 2, 2);
-    glProgramUniform1i(eyeRayTracerProgram, 3, 3);
     glProgramUniform1i(modelShader.getID(), 3, 3);
 
     glActiveTexture(GL_TEXTURE0);
@@ -159,21 +114,18 @@ bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &textur
     glBindImageTexture(0, radianceTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
     glBindImageTexture(1, irradianceTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
     
-    int irr_width, irr_height;
-    ret = LoadEXR(&image_data, &irr_width, &irr_height, (texture_name + "-irradiance.exr").c_str(), &err);
-    if (ret == TINYEXR_SUCCESS)
+    if (irradiance_cached)
     {
-        glTextureSubImage2D(irradianceTexture, 0, 0, 0, irr_width, irr_height, GL_RGBA, GL_FLOAT, image_data);
-        free(image_data);
+        glTextureSubImage2D(irradianceTexture, 0, 0, 0, cached_irradiance.width, cached_irradiance.height,
+                            GL_RGBA, GL_FLOAT, cached_irradiance.pixels.get());
     }
     else
     {
-        if (err)
-            FreeEXRErrorMessage(err);
-
+        TIMELINE_ZONE("irradiance");
         const uint32_t widthDivCeil  = ceilPower2<uint32_t, 6U>(width/4);
         const uint32_t heightDivCeil = ceilPower2<uint32_t, 0U>(height/4);
 
+        profiler.begin(PASS_IRRADIANCE);
         glUseProgram(irradianceProgram);
         for (int i=0; i < height; i++) {
             glProgramUniform1i(irradianceProgram, 1, i);
@@ -184,6 +136,7 @@ bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &textur
                 glFinish();
             }
         }
+        profiler.end(PASS_IRRADIANCE);
 
         const unsigned long pixel_count = (unsigned long)width*height/16;
         std::unique_ptr<glm::fvec3[]> raw_pixels(new glm::fvec3[pixel_count]);
@@ -191,12 +144,8 @@ bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &textur
                         pixel_count * sizeof(glm::fvec3),
                         &raw_pixels[0]);
         
-        const char * error = nullptr;
-        const int ret2 = SaveEXR(&raw_pixels[0].r, width/4, height/4, 3, false, (texture_name + "-irradiance.exr").c_str(), &error);
-        if (ret2 != TINYEXR_SUCCESS) {
-            fprintf(stderr, "Save EXR err: %s\n", error);
-            FreeEXRErrorMessage(error);
-        }
+        if (!writeEXR(texture_name + "-irradiance.exr", raw_pixels.get(), width/4, height/4))
+            std::cerr << "Couldn't write " << texture_name << "-irradiance.exr" << std::endl;
     }
 
     return true;
@@ -204,53 +153,41 @@ bool Scene::loadEnvironmentTexture(GLFWwindow* window, const std::string &textur
 
 
 bool Scene::loadMaterial(const std::string &name, uint32_t material_id) {
-    if (material_id >= m_materials.size())
+    TIMELINE_ZONE("loadMaterial", name);
+    if (!textureStreamer || material_id >= geometry.materials.size())
         return false;
-    
-    bool diffuse = loadTexture(name+"_albedo.exr",   material_id, 0);
-    bool normal = loadTexture(name+"_normal.exr", material_id, 1);
-    bool arm = loadTexture(name+"_arm.exr",    material_id, 2);
-    if (diffuse && normal && arm)
-    {
-        activeTextures[material_id] = 1;
-    }
-    else {
-        activeTextures[material_id] = 0;
-    }
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D_ARRAY, textureAtlas);
-    glProgramUniform1i(eyeRayTracerProgram, 1, 1);
-    glProgramUniform1i(modelShader.getID(), 1, 1);
 
-    glActiveTexture(GL_TEXTURE0);
+    // only the coarse mips are loaded here, the tracer and the preview ask for the rest
+    const bool loaded = textureStreamer->addMaterial(name, material_id);
+    activeTextures[material_id] = loaded ? 1 : 0;
+    glBindTextureUnit(1, textureStreamer->cacheTexture());
+    glProgramUniform1i(modelShader.getID(), 1, 1);
 
     glNamedBufferSubData(hasTextureBuffer, 0, sizeof(int)*activeTextures.size(), activeTextures.data());
-    return diffuse && normal && arm;
+    return loaded;
 }
 
 Scene::Scene()
-    : eyeRayTracerProgram(glCreateProgram()), drawBufferProgram(glCreateProgram()), irradianceProgram(glCreateProgram()),
-      displayShader("./res/shader/displayQuad"), modelShader("./res/shader/model")
+    : drawBufferProgram(glCreateProgram()), irradianceProgram(glCreateProgram()), guideProgram(glCreateProgram()),
+      displayShader("./res/shader/displayQuad"), modelShader("./res/shader/model"),
+      visibilityShader("./res/shader/visibility")
 {
-    GLuint computeID = 0;
-    if (loadShaderProgram("./res/shader/raytracer.glsl", GL_COMPUTE_SHADER, computeID))
-        glAttachShader(eyeRayTracerProgram, computeID);
-    glLinkProgram(eyeRayTracerProgram);
-    glDeleteShader(computeID);
-
-    if (loadShaderProgram("./res/shader/createDrawBuffers.glsl", GL_COMPUTE_SHADER, computeID))
-        glAttachShader(drawBufferProgram, computeID);
-    glLinkProgram(drawBufferProgram);
-    glDeleteShader(computeID);
-
-    if (loadShaderProgram("./res/shader/irradiance.glsl", GL_COMPUTE_SHADER, computeID))
-        glAttachShader(irradianceProgram, computeID);
-    glLinkProgram(irradianceProgram);
-    glDeleteShader(computeID);
+    eyeRayTracerProgram = getTracerProgram(st_RTCS_variant());
+    linkProgramCached(drawBufferProgram,   { { "./res/shader/createDrawBuffers.glsl", GL_COMPUTE_SHADER } });
+    linkProgramCached(irradianceProgram,   { { "./res/shader/irradiance.glsl", GL_COMPUTE_SHADER } });
+    linkProgramCached(guideProgram,        { { "./res/shader/pathGuide.glsl", GL_COMPUTE_SHADER } });
 
     glCreateVertexArrays(1, &screenVAO);
     glCreateVertexArrays(1, &modelVAO);
+    glCreateVertexArrays(1, &lodVAO);
     glCreateBuffers(1, &screenBuffer);
+    glCreateFramebuffers(1, &visibilityFBO);
+
+    // record counters and fixed point flux sums of every cell, the quadtrees of every cell
+    glCreateBuffers(1, &guideTraining);
+    glNamedBufferStorage(guideTraining, sizeof(uint32_t) * PathGuide::CELLS * (1 + 2 * PathGuide::BINS), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &guideDistribution);
+    glNamedBufferStorage(guideDistribution, sizeof(float) * PathGuide::CELLS * PathGuide::STRIDE, nullptr, GL_DYNAMIC_STORAGE_BIT);
 
     static glm::fvec2 quad[] = {
         glm::fvec2(-1.0f, -1.0f),
@@ -268,83 +205,109 @@ Scene::Scene()
 Scene::~Scene() {
     glDeleteVertexArrays(1, &screenVAO);
     glDeleteVertexArrays(1, &modelVAO);
+    glDeleteVertexArrays(1, &lodVAO);
     glDeleteBuffers(1, &screenBuffer);
     glDeleteBuffers(1, &modelBuffer);
+    glDeleteBuffers(1, &objectIndexBuffer);
+    glDeleteBuffers(1, &lodVertexBuffer);
+    glDeleteBuffers(1, &lodIndexBuffer);
+    glDeleteFramebuffers(1, &visibilityFBO);
+    glDeleteBuffers(1, &guideTraining);
+    glDeleteBuffers(1, &guideDistribution);
     glDeleteBuffers(1, &hasTextureBuffer);
+    glDeleteBuffers(1, &bvhNodeBuffer);
+    glDeleteBuffers(1, &bvhReferenceBuffer);
     glDeleteTextures(1, &radianceTexture);
     glDeleteTextures(1, &irradianceTexture);
-    glDeleteTextures(1, &textureAtlas);
-    glDeleteProgram(eyeRayTracerProgram);
+    for (const auto &[key, program] : tracerPrograms)
+        glDeleteProgram(program);
     glDeleteProgram(drawBufferProgram);
     glDeleteProgram(irradianceProgram);
+    glDeleteProgram(guideProgram);
 }
 
 
-void Scene::createTrianglesBuffers() {
-    computeData.triangles = 0;
-    uint32_t light_sources = 0;
-    for (const Object &obj: m_objects) {
-        computeData.triangles += obj.triangles.size();
-        const glm::fvec3 light = m_materials[obj.material_index].emission_ior;
-        if (glm::dot(light,light) > 0.0f)
-            light_sources += obj.triangles.size();
-    }
+GLuint Scene::getTracerProgram(const st_RTCS_variant &variant) {
+    const auto cached = tracerPrograms.find(variant.key());
+    if (cached != tracerPrograms.end())
+        return cached->second;
 
-    glProgramUniform1i(eyeRayTracerProgram, 6, light_sources);
+    std::cout << "[  INFO  ][Tracer ] Build variant: recursion " << variant.recursion
+              << ", textures " << variant.textures << ", lights " << variant.lights
+              << (variant.stats ? ", statistics" : "") << '\n';
 
-    const uint64_t triangleBytes = computeData.triangles * sizeof(Triangle);
+    const GLuint program = glCreateProgram();
+    linkProgramCached(program, { { "./res/shader/raytracer.glsl", GL_COMPUTE_SHADER, variant.defines() } });
+    applyTracerUniforms(program);
 
-    std::cout << "Triangles: " << computeData.triangles << "\t " << roundf(triangleBytes/1024.0f*100.0f)/100.0f << " KB\n";
-    
-    Triangle *        const triangles        = new Triangle[computeData.triangles]{};
-    TriangleModel *   const triangleModels   = new TriangleModel[computeData.triangles]{};
-    TriangleShading * const triangleShadings = new TriangleShading[computeData.triangles]{};
+    tracerPrograms[variant.key()] = program;
+    return program;
+}
 
-    uint32_t index = light_sources;
-    uint32_t light_index = 0;
-    
-    glm::fvec3 bb_min = m_objects[0].triangles[0].position;
-    glm::fvec3 bb_max = m_objects[0].triangles[0].position;
-
-    for (const Object &obj: m_objects) {
-        for (const Triangle &tri: obj.triangles) {
-            bb_min.x = std::min(tri.position.x, bb_min.x);
-            bb_min.y = std::min(tri.position.y, bb_min.y);
-            bb_min.z = std::min(tri.position.z, bb_min.z);
-
-            bb_max.x = std::max(tri.position.x, bb_max.x);
-            bb_max.y = std::max(tri.position.y, bb_max.y);
-            bb_max.z = std::max(tri.position.z, bb_max.z);
-
-            const glm::fvec3 light = m_materials[obj.material_index].emission_ior;
-            uint32_t id;
-            if (glm::dot(light, light) > 0.0f)
-                id = light_index++;
-            else
-                id = index++;
-            triangles[id] = tri;
-        }
-    }
+void Scene::applyTracerUniforms(GLuint program) const {
+    glProgramUniform1i(program, glGetUniformLocation(program, "textureAtlas"), 1);
+    glProgramUniform1i(program, glGetUniformLocation(program, "RADIANCE"), 2);
+    glProgramUniform1i(program, glGetUniformLocation(program, "IRRADIANCE"), 3);
+    glProgramUniform1i(program, glGetUniformLocation(program, "HISTORY"), 4);
+    glProgramUniform1i(program, glGetUniformLocation(program, "HISTORY_GBUFFER"), 5);
+    glProgramUniform1i(program, glGetUniformLocation(program, "VISIBILITY"), 6);
+    glProgramUniform1f(program, glGetUniformLocation(program, "HISTORY_CAP"), historyCap);
+    glProgramUniform1i(program, glGetUniformLocation(program, "COUNT"), tracerUniforms.count);
+    glProgramUniform1i(program, glGetUniformLocation(program, "LIGHTS"), tracerUniforms.lights);
+    glProgramUniform3f(program, glGetUniformLocation(program, "BB_CENTER"), tracerUniforms.bb_center.x, tracerUniforms.bb_center.y, tracerUniforms.bb_center.z);
+    glProgramUniform1f(program, glGetUniformLocation(program, "EXPOSURE"), tracerUniforms.exposure);
+    glProgramUniform3f(program, glGetUniformLocation(program, "GUIDE_MIN"), tracerUniforms.guide_min.x, tracerUniforms.guide_min.y, tracerUniforms.guide_min.z);
+    glProgramUniform3f(program, glGetUniformLocation(program, "GUIDE_SCALE"), tracerUniforms.guide_scale.x, tracerUniforms.guide_scale.y, tracerUniforms.guide_scale.z);
+    glProgramUniform2i(program, glGetUniformLocation(program, "TILE_OFFSET"), tracerUniforms.tile_offset.x, tracerUniforms.tile_offset.y);
+    glProgramUniform2i(program, glGetUniformLocation(program, "IMAGE_SIZE"), tracerUniforms.image_size.x, tracerUniforms.image_size.y);
+}
 
-    const glm::fvec3 bb_center = (bb_min + bb_max) * 0.5f;
-    glProgramUniform3f(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "BB_CENTER"), bb_center.x, bb_center.y, bb_center.z);
-    glProgramUniform1f(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "EXPOSURE"), 1.0f);
-    glProgramUniform1f(modelShader.getID(), 4, 1.0f);
+void Scene::updateTracerUniforms() const {
+    for (const auto &[key, program] : tracerPrograms)
+        applyTracerUniforms(program);
+}
 
-    std::sort(triangles + light_sources, triangles + computeData.triangles, [](const Triangle &a, const Triangle &b) { return glm::length(glm::cross(a.u, a.v)) > glm::length(glm::cross(b.u, b.v)); });
+bool Scene::addWavefrontModel(const std::string &model_name) {
+    const size_t first_object = geometry.objects.size();
+    const bool loaded = geometry.addWavefrontModel(model_name);
+    if (loaded)
+        models.emplace_back(model_name, first_object);
+    // a mesh added to a finalized scene needs new buffers
+    if (loaded && computeData.initialized)
+        structureDirty = true;
+    return loaded;
+}
 
-    for (int i=0; i < computeData.triangles; i++) {
-        const Triangle &tri = triangles[i];
-        new (&triangleModels[i])   TriangleModel  (tri.true_normal, tri.position, tri.u, tri.v);
-        new (&triangleShadings[i]) TriangleShading(tri.material_id, tri.normals, tri.tangents, tri.tex_p, tri.tex_u, tri.tex_v);
-    }
-    delete[] triangles;
+void Scene::createTrianglesBuffers() {
+    TIMELINE_ZONE("createTrianglesBuffers");
+    std::vector<uint32_t> order = geometry.orderTriangles(triangleArrays);
+    computeData.triangles = order.size();
+    buildBVH(order);
+
+    tracerUniforms.lights = triangleArrays.lights;
+
+    const uint64_t triangleBytes = computeData.triangles * (sizeof(TriangleModel) + sizeof(TriangleShading));
+
+    std::cout << "Triangles: " << computeData.triangles << "\t " << roundf(triangleBytes/1024.0f*100.0f)/100.0f << " KB\n";
 
-    glCreateBuffers(4, computeData.buffer.arr);
-    glNamedBufferStorage(computeData.buffer.models,    sizeof(TriangleModel)   * computeData.triangles, triangleModels, 0);
-    glNamedBufferStorage(computeData.buffer.shading,   sizeof(TriangleShading) * computeData.triangles, triangleShadings, 0);
-    glNamedBufferStorage(computeData.buffer.materials, sizeof(Material)        * computeData.triangles, m_materials.data(), 0);
-    delete[] triangleModels, triangleShadings;
+    tracerUniforms.bb_center = (triangleArrays.bb_min + triangleArrays.bb_max) * 0.5f;
+    tracerUniforms.exposure = 1.0f;
+    glProgramUniform1f(modelShader.getID(), 4, 1.0f);
+
+    glCreateBuffers(3, computeData.buffer.arr);
+    glNamedBufferStorage(computeData.buffer.models,    sizeof(TriangleModel)   * computeData.triangles, nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glNamedBufferStorage(computeData.buffer.shading,   sizeof(TriangleShading) * computeData.triangles, nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glNamedBufferStorage(computeData.buffer.materials, sizeof(Material)        * geometry.materials.size(), geometry.materials.data(), GL_DYNAMIC_STORAGE_BIT);
+    uploadTriangles(0, order.data(), computeData.triangles);
+
+    // nodes are refit by edits, the topology and references only change with a rebuild
+    glCreateBuffers(1, &bvhNodeBuffer);
+    glCreateBuffers(1, &bvhReferenceBuffer);
+    glNamedBufferStorage(bvhNodeBuffer, sizeof(st_bvh_node) * bvh.nodes().size(), bvh.nodes().data(), GL_DYNAMIC_STORAGE_BIT);
+    // an empty buffer can't be bound
+    glNamedBufferStorage(bvhReferenceBuffer, sizeof(uint32_t) * std::max<size_t>(bvh.references().size(), 1), bvh.references().empty() ? nullptr : bvh.references().data(), 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, bvhNodeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, bvhReferenceBuffer);
 
     glCreateBuffers(1, &modelBuffer);
     glNamedBufferStorage(modelBuffer, sizeof(Vertex)*3*computeData.triangles, nullptr, 0);
@@ -355,64 +318,455 @@ void Scene::createTrianglesBuffers() {
         glVertexArrayAttribFormat(modelVAO, i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::fvec4)*i);
         glEnableVertexArrayAttrib(modelVAO, i);
     }
+
+    // the triangles of every object, in the vertices their tracer slots build
+    std::vector<uint32_t> indices(computeData.triangles * 3);
+    for (uint32_t flat = 0; flat < computeData.triangles; flat++) {
+        for (uint32_t i = 0; i < 3; i++)
+            indices[3*flat + i] = 3*triangleArrays.slots[flat] + i;
+    }
+    glCreateBuffers(1, &objectIndexBuffer);
+    glNamedBufferStorage(objectIndexBuffer, sizeof(uint32_t) * indices.size(), indices.data(), 0);
+    glVertexArrayElementBuffer(modelVAO, objectIndexBuffer);
+
+    glBindBuffersBase(GL_SHADER_STORAGE_BUFFER, 1, 3, computeData.buffer.arr);
+    resetPathGuide();
+    rayQuery.build(geometry, triangleArrays);
+    createLODBuffers();
+
+    dirtyObjects.assign(geometry.objects.size(), 0);
+    dirtyMaterials.assign(geometry.materials.size(), 0);
 }
 
-void Scene::createRTCSData() {
-    createTrianglesBuffers();
-    glProgramUniform1i(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "COUNT"), computeData.triangles);
+void Scene::buildBVH(std::vector<uint32_t> &order) {
+    TIMELINE_ZONE("buildBVH");
+    std::vector<glm::fvec3> vertices;
+    vertices.reserve(3 * order.size());
+    for (const uint32_t flat : order) {
+        const Triangle &tri = geometry.flatTriangle(triangleArrays, flat);
+        vertices.push_back(tri.position);
+        vertices.push_back(tri.position + tri.u);
+        vertices.push_back(tri.position + tri.v);
+    }
+    bvh.build(vertices, bvhQuality);
+
+    if (bvhQuality) {
+        // Triangles of a leaf in neighbouring slots, the light sources keep theirs for sampleLight
+        const std::vector<uint32_t> leaf_order = bvh.leafOrder(triangleArrays.lights);
+        std::vector<uint32_t> reordered(order.size());
+        for (uint32_t slot = 0; slot < order.size(); slot++)
+            reordered[slot] = order[leaf_order[slot]];
+        order = std::move(reordered);
+        for (uint32_t slot = 0; slot < order.size(); slot++)
+            triangleArrays.slots[order[slot]] = slot;
+        bvh.remapSlots(leaf_order);
+    }
+
+    const st_bvh_report &report = bvh.report();
+    std::cout << "[  INFO  ][BVH    ] " << report.nodes << " nodes, depth " << report.depth
+              << ", SAH " << report.base_sah << " in " << roundf(report.base_ms*100.0f)/100.0f << " ms\n";
+    if (report.quality) {
+        std::cout << "[  INFO  ][BVH    ] Quality pass: SAH " << report.base_sah << " -> " << report.split_sah
+                  << " (" << report.spatial_splits << " spatial splits, " << report.references - report.triangles << " references added) -> "
+                  << report.sah << " (" << report.restructured_treelets << " treelets restructured) in "
+                  << roundf(report.quality_ms*100.0f)/100.0f << " ms\n";
+    }
+}
 
-    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &textureAtlas);
-    glTextureStorage3D(textureAtlas, 1, GL_R11F_G11F_B10F, 4096, 4096, m_materials.size() * 3);
-    glTextureParameteri(textureAtlas, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTextureParameteri(textureAtlas, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTextureParameteri(textureAtlas, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTextureParameteri(textureAtlas, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTextureParameteri(textureAtlas, GL_TEXTURE_MAX_LEVEL, 1);
+void Scene::setBVHQuality(bool enabled) {
+    if (enabled == bvhQuality)
+        return;
+    bvhQuality = enabled;
+    if (computeData.initialized)
+        structureDirty = true;
+}
 
-    activeTextures.resize(m_materials.size());
+void Scene::uploadTriangles(uint32_t first, const uint32_t *flat, uint32_t count) {
+    // Converted and uploaded in pieces, the tracer layout of the whole scene never exists on the CPU
+    static constexpr uint32_t STAGING_TRIANGLES = 65536;
+    std::vector<TriangleModel> models;
+    std::vector<TriangleShading> shadings;
+    models.reserve(std::min(count, STAGING_TRIANGLES));
+    shadings.reserve(std::min(count, STAGING_TRIANGLES));
+
+    for (uint32_t done = 0; done < count; done += STAGING_TRIANGLES) {
+        const uint32_t piece = std::min(count - done, STAGING_TRIANGLES);
+        models.clear();
+        shadings.clear();
+        for (uint32_t i = 0; i < piece; i++) {
+            const Triangle &tri = geometry.flatTriangle(triangleArrays, flat[done + i]);
+            models.emplace_back(tri.true_normal, tri.position, tri.u, tri.v);
+            shadings.emplace_back(tri.material_id, tri.normals, tri.tangents, tri.tex_p, tri.tex_u, tri.tex_v);
+        }
+        glNamedBufferSubData(computeData.buffer.models,  sizeof(TriangleModel)   * (first + done), sizeof(TriangleModel)   * piece, models.data());
+        glNamedBufferSubData(computeData.buffer.shading, sizeof(TriangleShading) * (first + done), sizeof(TriangleShading) * piece, shadings.data());
+    }
+}
+
+void Scene::createLODBuffers() {
+    TIMELINE_ZONE("createLODBuffers");
+    // Levels of new objects, cached per model file and built on all cores otherwise
+    const size_t first_new = objectLODs.size();
+    objectLODs.resize(geometry.objects.size());
+    for (size_t first = first_new; first < geometry.objects.size();) {
+        std::string cache;
+        size_t end = geometry.objects.size();
+        for (size_t m = 0; m < models.size(); m++) {
+            if (models[m].second == first) {
+                cache = MeshLOD::cachePath(models[m].first);
+                if (m + 1 < models.size())
+                    end = models[m+1].second;
+            } else if (models[m].second > first) {
+                end = std::min(end, models[m].second);
+            }
+        }
+
+        std::vector<st_object_lods> lods;
+        const uint64_t hash = MeshLOD::hashObjects(geometry.objects, first, end - first);
+        if (cache.empty() || !MeshLOD::loadCache(cache, hash, lods) || lods.size() != end - first) {
+            lods.assign(end - first, st_object_lods());
+            TaskScheduler::parallelFor(0, lods.size(), 1, [&](size_t l_first, size_t l_last) {
+                for (size_t i = l_first; i < l_last; i++)
+                    lods[i] = MeshLOD::build(geometry.objects[first + i]);
+            });
+
+            if (!cache.empty() && !MeshLOD::saveCache(cache, hash, lods))
+                std::cerr << "[WARNING ][LOD    ] Cannot write " << cache << '\n';
+        } else {
+            std::cout << "[  INFO  ][LOD    ] Loaded " << cache << '\n';
+        }
+        std::move(lods.begin(), lods.end(), objectLODs.begin() + first);
+        first = end;
+    }
+
+    uint32_t vertices = 0, indices = 0;
+    for (st_object_lods &lods : objectLODs) {
+        for (st_lod_mesh &mesh : lods.levels) {
+            mesh.base_vertex = vertices;
+            mesh.first_index = indices;
+            vertices += mesh.vertices.size();
+            indices += mesh.indices.size();
+        }
+    }
+    std::cout << "Preview LODs: " << indices / 3 << " triangles\t "
+              << roundf((sizeof(Vertex)*vertices + sizeof(uint32_t)*indices)/1024.0f*100.0f)/100.0f << " KB\n";
+
+    glCreateBuffers(1, &lodVertexBuffer);
+    glNamedBufferStorage(lodVertexBuffer, sizeof(Vertex) * std::max(vertices, 1u), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &lodIndexBuffer);
+    glNamedBufferStorage(lodIndexBuffer, sizeof(uint32_t) * std::max(indices, 1u), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    for (const st_object_lods &lods : objectLODs) {
+        for (const st_lod_mesh &mesh : lods.levels)
+            glNamedBufferSubData(lodIndexBuffer, sizeof(uint32_t) * mesh.first_index, sizeof(uint32_t) * mesh.indices.size(), mesh.indices.data());
+    }
+    for (uint32_t obj_id = 0; obj_id < objectLODs.size(); obj_id++)
+        uploadLODs(obj_id);
+
+    for (int i=0; i < 7; ++i) {
+        glVertexArrayVertexBuffer(lodVAO, i, lodVertexBuffer, 0, sizeof(Vertex));
+        glVertexArrayAttribFormat(lodVAO, i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::fvec4)*i);
+        glEnableVertexArrayAttrib(lodVAO, i);
+    }
+    glVertexArrayElementBuffer(lodVAO, lodIndexBuffer);
+}
+
+void Scene::uploadLODs(uint32_t object_id) {
+    // The same vertices as createDrawBuffers.glsl, an object has a single material
+    const uint32_t material_id = geometry.objects[object_id].material_index;
+    const Material &material = geometry.materials[material_id];
+
+    std::vector<Vertex> vertices;
+    for (const st_lod_mesh &mesh : objectLODs[object_id].levels) {
+        vertices.clear();
+        for (const st_lod_vertex &v : mesh.vertices) {
+            vertices.push_back({
+                glm::fvec4(v.position, 1.0f), glm::fvec4(v.normal, 0.0f), glm::fvec4(v.tangent, 0.0f),
+                glm::fvec4(glm::fvec3(material.albedo), 0.0f), material.specular_roughness, material.emission_ior,
+                glm::fvec4(v.uv, 0.0f, material_id)
+            });
+        }
+        glNamedBufferSubData(lodVertexBuffer, sizeof(Vertex) * mesh.base_vertex, sizeof(Vertex) * vertices.size(), vertices.data());
+    }
+}
+
+void Scene::createMaterialTextures() {
+    glDeleteBuffers(1, &hasTextureBuffer);
+
+    // the old streamer finishes its reads before the new one starts
+    textureStreamer.reset();
+    textureStreamer = std::make_unique<TextureStreamer>((uint32_t)geometry.materials.size(), textureCacheBytes);
+    glBindTextureUnit(1, textureStreamer->cacheTexture());
+
+    activeTextures.resize(geometry.materials.size());
     std::fill(activeTextures.begin(), activeTextures.end(), 0);
 
     glCreateBuffers(1, &hasTextureBuffer);
-    glNamedBufferStorage(hasTextureBuffer, sizeof(int)*m_materials.size(), activeTextures.data(), GL_DYNAMIC_STORAGE_BIT);
+    glNamedBufferStorage(hasTextureBuffer, sizeof(int)*geometry.materials.size(), activeTextures.data(), GL_DYNAMIC_STORAGE_BIT);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, hasTextureBuffer);
 
     std::cout << "Material Count: " << activeTextures.size() << '\n';
 }
 
+void Scene::createRTCSData() {
+    createTrianglesBuffers();
+    tracerUniforms.count = computeData.triangles;
+    updateTracerUniforms();
+
+    createMaterialTextures();
+}
+
+void Scene::buildDrawBuffers(uint32_t first, uint32_t count) {
+    const uint32_t trisDiv64Ceil = ceilPower2<uint32_t, 6U>(count);
+
+    glProgramUniform1ui(drawBufferProgram, 0, first);
+    glProgramUniform1ui(drawBufferProgram, 1, count);
+
+    profiler.begin(PASS_DRAW_BUFFERS);
+    glUseProgram(drawBufferProgram);
+    glDispatchCompute(trisDiv64Ceil, 1, 1);
+    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    profiler.end(PASS_DRAW_BUFFERS);
+}
+
 void Scene::finalizeObjects() {
+    TIMELINE_ZONE("finalizeObjects");
     if (!computeData.initialized) {
         createRTCSData();
-        glBindBuffersBase(GL_SHADER_STORAGE_BUFFER, 1, 3, computeData.buffer.arr);
+        buildDrawBuffers(0, computeData.triangles);
 
-        const uint32_t trisDiv64Ceil = ceilPower2<uint32_t, 6U>(computeData.triangles);
+        computeData.initialized = true;
+        std::cout << "Peak RSS: " << roundf(peakResidentBytes()/1048576.0f*100.0f)/100.0f << " MB\n";
+    }
+}
 
-        glUseProgram(drawBufferProgram);
-        glDispatchCompute(trisDiv64Ceil, 1, 1);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
+void Scene::transformObject(uint32_t object_id, const glm::fmat4 &transform) {
+    geometry.transformObject(object_id, transform);
+    if (object_id < objectLODs.size())
+        MeshLOD::transform(objectLODs[object_id], transform);
+    if (object_id < dirtyObjects.size())
+        dirtyObjects[object_id] = 1;
+}
 
-        computeData.initialized = true;
+void Scene::setMaterial(uint32_t material_id, const Material &material) {
+    const glm::fvec3 old_light = geometry.materials[material_id].emission_ior;
+    const glm::fvec3 new_light = material.emission_ior;
+    geometry.materials[material_id] = material;
+
+    // Light sources are stored in front of all other triangles, turning one on or off reorders them
+    if ((glm::dot(old_light, old_light) > 0.0f) != (glm::dot(new_light, new_light) > 0.0f))
+        structureDirty = true;
+    else if (material_id < dirtyMaterials.size())
+        dirtyMaterials[material_id] = 1;
+}
+
+void Scene::rebuildBuffers() {
+    TIMELINE_ZONE("rebuildBuffers");
+    const size_t material_count = activeTextures.size();
+
+    glDeleteBuffers(3, computeData.buffer.arr);
+    glDeleteBuffers(1, &modelBuffer);
+    glDeleteBuffers(1, &objectIndexBuffer);
+    glDeleteBuffers(1, &lodVertexBuffer);
+    glDeleteBuffers(1, &lodIndexBuffer);
+    glDeleteBuffers(1, &bvhNodeBuffer);
+    glDeleteBuffers(1, &bvhReferenceBuffer);
+    createTrianglesBuffers();
+    tracerUniforms.count = computeData.triangles;
+    updateTracerUniforms();
+
+    if (geometry.materials.size() != material_count) {
+        std::cout << "Material count changed, material textures have to be reloaded\n";
+        createMaterialTextures();
+    }
+    buildDrawBuffers(0, computeData.triangles);
+}
+
+void Scene::refitBounds() {
+    geometry.bounds(triangleArrays.bb_min, triangleArrays.bb_max);
+    tracerUniforms.bb_center = (triangleArrays.bb_min + triangleArrays.bb_max) * 0.5f;
+    updateTracerUniforms();
+}
+
+void Scene::resetPathGuide() {
+    // a small margin keeps the cells of the boundary faces inside
+    const glm::fvec3 extent = glm::max(triangleArrays.bb_max - triangleArrays.bb_min, glm::fvec3(1e-4f)) * 1.01f;
+    tracerUniforms.guide_min = (triangleArrays.bb_min + triangleArrays.bb_max) * 0.5f - extent * 0.5f;
+    tracerUniforms.guide_scale = glm::fvec3((float)PathGuide::RESOLUTION) / extent;
+
+    std::vector<float> distribution;
+    PathGuide::initialize(distribution);
+    glNamedBufferSubData(guideDistribution, 0, sizeof(float) * distribution.size(), distribution.data());
+    glClearNamedBufferData(guideTraining, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, guideTraining);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, guideDistribution);
+
+    guideSamples = 0;
+    guideIteration = PathGuide::FIRST_ITERATION;
+}
+
+void Scene::resolvePathGuide() {
+    profiler.begin(PASS_GUIDE);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUseProgram(guideProgram);
+    glDispatchCompute(PathGuide::CELLS / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    profiler.end(PASS_GUIDE);
+
+    guideSamples = 0;
+    guideIteration = std::min(guideIteration * 2, PathGuide::LAST_ITERATION);
+}
+
+st_guide_validation Scene::validatePathGuide() {
+    st_guide_validation result;
+    const size_t cells = PathGuide::CELLS;
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    std::vector<uint32_t> records(cells);
+    std::vector<uint32_t> flux(cells * 2 * PathGuide::BINS);
+    std::vector<float> expected(cells * PathGuide::STRIDE);
+    glGetNamedBufferSubData(guideTraining, 0, sizeof(uint32_t) * cells, records.data());
+    glGetNamedBufferSubData(guideTraining, sizeof(uint32_t) * cells, sizeof(uint32_t) * flux.size(), flux.data());
+    glGetNamedBufferSubData(guideDistribution, 0, sizeof(float) * expected.size(), expected.data());
+
+    for (size_t cell = 0; cell < cells; cell++)
+        PathGuide::resolveCell(records[cell], &flux[cell * 2 * PathGuide::BINS], &expected[cell * PathGuide::STRIDE]);
+
+    resolvePathGuide();
+    std::vector<float> resolved(expected.size());
+    glGetNamedBufferSubData(guideDistribution, 0, sizeof(float) * resolved.size(), resolved.data());
+    for (size_t i = 0; i < resolved.size(); i++)
+        result.resolve_error = std::max(result.resolve_error, std::abs(resolved[i] - expected[i]));
+
+    // The leaves sampled by the CPU reference have to follow the leaf probabilities
+    constexpr uint32_t STRATA = 128;
+    for (size_t cell = 0; cell < cells; cell++) {
+        const float *nodes = &resolved[cell * PathGuide::STRIDE];
+        if (nodes[PathGuide::TRAINED] <= 0.0f)
+            continue;
+        result.trained_cells++;
+
+        uint32_t counts[PathGuide::BINS]{};
+        for (uint32_t y = 0; y < STRATA; y++)
+            for (uint32_t x = 0; x < STRATA; x++)
+                counts[PathGuide::directionBin(PathGuide::sample(nodes, glm::fvec2((x + 0.5f) / STRATA, (y + 0.5f) / STRATA)))]++;
+        for (uint32_t bin = 0; bin < PathGuide::BINS; bin++)
+            result.sample_error = std::max(result.sample_error, std::abs(counts[bin] / float(STRATA * STRATA) - nodes[PathGuide::LEAVES + bin]));
+    }
+    return result;
+}
+
+bool Scene::commitEdits() {
+    TIMELINE_ZONE("commitEdits");
+    if (!computeData.initialized)
+        return false;
+
+    if (structureDirty) {
+        rebuildBuffers();
+        structureDirty = false;
+        workloadVersion++;
+        invalidateHistory();
+        return true;
+    }
+
+    // Tracer slots and flat indices of all triangles of edited objects, rewritten from the edited geometry
+    std::vector<std::pair<uint32_t, uint32_t>> edited;
+    for (uint32_t obj_id = 0; obj_id < dirtyObjects.size(); obj_id++) {
+        if (!dirtyObjects[obj_id])
+            continue;
+        dirtyObjects[obj_id] = 0;
+
+        const uint32_t offset = triangleArrays.object_offsets[obj_id];
+        for (uint32_t i = 0; i < geometry.objects[obj_id].triangles.size(); i++) {
+            const Triangle &tri = geometry.objects[obj_id].triangles[i];
+            edited.emplace_back(triangleArrays.slots[offset + i], offset + i);
+            rayQuery.setTriangle(triangleArrays.slots[offset + i], tri, obj_id);
+            bvh.setTriangle(triangleArrays.slots[offset + i], tri.position, tri.position + tri.u, tri.position + tri.v);
+        }
+        uploadLODs(obj_id);
+    }
+    std::sort(edited.begin(), edited.end());
+
+    // Upload contiguous runs of slots only
+    std::vector<uint32_t> flat;
+    for (size_t run = 0; run < edited.size();) {
+        size_t end = run + 1;
+        while (end < edited.size() && edited[end].first == edited[end-1].first + 1)
+            end++;
+
+        const uint32_t first = edited[run].first;
+        const uint32_t count = end - run;
+        flat.clear();
+        for (size_t i = run; i < end; i++)
+            flat.push_back(edited[i].second);
+        uploadTriangles(first, flat.data(), count);
+        buildDrawBuffers(first, count);
+        run = end;
+    }
+
+    bool materials_changed = false;
+    for (size_t run = 0; run < dirtyMaterials.size(); run++) {
+        if (!dirtyMaterials[run])
+            continue;
+
+        size_t end = run;
+        while (end < dirtyMaterials.size() && dirtyMaterials[end])
+            dirtyMaterials[end++] = 0;
+
+        glNamedBufferSubData(computeData.buffer.materials, sizeof(Material) * run, sizeof(Material) * (end - run), &geometry.materials[run]);
+        materials_changed = true;
+        run = end;
+    }
+    // The raster vertices carry a copy of their material
+    if (materials_changed) {
+        buildDrawBuffers(0, computeData.triangles);
+        for (uint32_t obj_id = 0; obj_id < objectLODs.size(); obj_id++)
+            uploadLODs(obj_id);
+    }
+
+    if (!edited.empty()) {
+        refitBounds();
+        bvh.refit();
+        glNamedBufferSubData(bvhNodeBuffer, 0, sizeof(st_bvh_node) * bvh.nodes().size(), bvh.nodes().data());
     }
+
+    const bool changed = !edited.empty() || materials_changed;
+    if (changed) {
+        workloadVersion++;
+        invalidateHistory();
+        // The grid follows the bounds and the learned radiance belongs to the old scene
+        resetPathGuide();
+        updateTracerUniforms();
+    }
+    return changed;
 }
 
 void Scene::adaptResolution(const glm::ivec2 &newRes) {
     const unsigned long newSize = newRes.x * newRes.y;
-    const unsigned long oldSize = computeData.resolution.x * computeData.resolution.y;
+    const glm::ivec2 oldRes = computeData.resolution;
     computeData.resolution = newRes;
 
-    if (newSize != oldSize) {
+    // The storage is immutable, a transposed resolution with the same size needs new textures too
+    if (newRes != oldRes) {
+        workloadVersion++;
         glDeleteTextures(1, &computeData.renderTarget);
-        glDeleteTextures(1, &computeData.renderTargetLow);
+        glDeleteTextures(1, &computeData.gbuffer);
+        invalidateHistory();
+
         glCreateTextures(GL_TEXTURE_2D, 1, &computeData.renderTarget);
         glTextureStorage2D(computeData.renderTarget, 1, GL_RGBA32F, newRes.x, newRes.y);
         glTextureParameteri(computeData.renderTarget, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTextureParameteri(computeData.renderTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTextureParameteri(computeData.renderTarget, GL_TEXTURE_WRAP_S, GL_CLAMP);
         glTextureParameteri(computeData.renderTarget, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glClearTexImage(computeData.renderTarget, 0, GL_RGBA, GL_FLOAT, nullptr);
+
+        glCreateTextures(GL_TEXTURE_2D, 1, &computeData.gbuffer);
+        glTextureStorage2D(computeData.gbuffer, 1, GL_RGBA32F, newRes.x, newRes.y);
 
-        glCreateTextures(GL_TEXTURE_2D, 1, &computeData.renderTargetLow);
-        glTextureStorage2D(computeData.renderTargetLow, 1, GL_RGBA32F, (int)(180.0/newRes.y*newRes.x), 180); // >> 3
-        glTextureParameteri(computeData.renderTargetLow, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTextureParameteri(computeData.renderTargetLow, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        createVisibilityTarget(computeData.visibility, computeData.visibilityDepth, newRes);
+
+        preview.setMaxHeight(newRes.y);
+        resizePreview(preview.getLevel().height);
 
         if (newSize > computeData.buffer_res.x*computeData.buffer_res.y) {
             computeData.buffer_res = newRes;
@@ -420,54 +774,301 @@ void Scene::adaptResolution(const glm::ivec2 &newRes) {
     }
 }
 
-void Scene::traceScene(const uint32_t width, const uint32_t height, const uint32_t sample) {
-    const uint32_t widthDivCeil  = ceilPower2<uint32_t, 3U>(width);
-    const uint32_t heightDivCeil = ceilPower2<uint32_t, 3U>(height);
+void Scene::bind() const {
+    glBindBuffersBase(GL_SHADER_STORAGE_BUFFER, 1, 3, computeData.buffer.arr);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, modelBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, hasTextureBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, guideTraining);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, guideDistribution);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, bvhNodeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, bvhReferenceBuffer);
+    if (statistics)
+        statistics->bind();
+    if (textureStreamer)
+        textureStreamer->bind();
+
+    glBindTextureUnit(1, textureStreamer ? textureStreamer->cacheTexture() : 0);
+    glBindTextureUnit(2, radianceTexture);
+    glBindTextureUnit(3, irradianceTexture);
+    glBindTextureUnit(4, computeData.historyColor);
+    glBindTextureUnit(5, computeData.historyGBuffer);
+}
+
+void Scene::resizePreview(int height) {
+    const glm::ivec2 size((int)((double)height/computeData.resolution.y*computeData.resolution.x + 0.5), height);
+    if (size == computeData.resolution_low)
+        return;
+    computeData.resolution_low = size;
+    workloadVersion++;
+    targetValid[1] = false;
+    visibilityValid[1] = false;
+
+    glDeleteTextures(1, &computeData.renderTargetLow);
+    glDeleteTextures(1, &computeData.gbufferLow);
+
+    // Linear filtering, the display shader upscales it with a bicubic filter
+    glCreateTextures(GL_TEXTURE_2D, 1, &computeData.renderTargetLow);
+    glTextureStorage2D(computeData.renderTargetLow, 1, GL_RGBA32F, size.x, size.y);
+    glTextureParameteri(computeData.renderTargetLow, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(computeData.renderTargetLow, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(computeData.renderTargetLow, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(computeData.renderTargetLow, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glCreateTextures(GL_TEXTURE_2D, 1, &computeData.gbufferLow);
+    glTextureStorage2D(computeData.gbufferLow, 1, GL_RGBA32F, size.x, size.y);
+
+    createVisibilityTarget(computeData.visibilityLow, computeData.visibilityDepthLow, size);
+
+    // zero samples in alpha, the next frame starts over even if it continues the sample index
+    glClearTexImage(computeData.renderTargetLow, 0, GL_RGBA, GL_FLOAT, nullptr);
+}
 
-    static const int SAMPLEloc = glGetUniformLocation(eyeRayTracerProgram, "SAMPLE");
-    glProgramUniform1ui(eyeRayTracerProgram, SAMPLEloc, sample);
+void Scene::createVisibilityTarget(GLuint &ids, GLuint &depth, const glm::ivec2 &size) {
+    glDeleteTextures(1, &ids);
+    glDeleteTextures(1, &depth);
 
+    glCreateTextures(GL_TEXTURE_2D, 1, &ids);
+    glTextureStorage2D(ids, 1, GL_R32UI, size.x, size.y);
+    glCreateTextures(GL_TEXTURE_2D, 1, &depth);
+    glTextureStorage2D(depth, 1, GL_DEPTH_COMPONENT32F, size.x, size.y);
+}
+
+void Scene::rasterizeVisibility(const uint32_t width, const uint32_t height) {
+    const GLuint ids = tracingLow ? computeData.visibilityLow : computeData.visibility;
+    glBindTextureUnit(6, ids);
+    if (visibilityValid[tracingLow] && visibilityCamera[tracingLow] == currentCamera)
+        return;
+
+    /*
+        Same pinhole as the camera rays of the tracer: 90 degrees vertical, looking along +z of CAMERA.
+        The z flip turns it into a GL view space, which mirrors the winding, so the tracer's
+        front faces are clockwise like in forwardRender. The near plane only clips what no pixel
+        center sees anyway, the tracer intersects the chosen triangle again at full precision.
+    */
+    const glm::fmat4 projection = glm::perspectiveFov(glm::radians(90.0f), (float)width, (float)height, 0.01f, 4096.0f);
+    const glm::fmat4 viewProjection = projection * glm::scale(glm::fvec3(1.0f, 1.0f, -1.0f)) * glm::inverse(currentCamera);
+
+    glNamedFramebufferTexture(visibilityFBO, GL_COLOR_ATTACHMENT0, ids, 0);
+    glNamedFramebufferTexture(visibilityFBO, GL_DEPTH_ATTACHMENT, tracingLow ? computeData.visibilityDepthLow : computeData.visibilityDepth, 0);
+    const GLuint sky = 0;
+    const GLfloat far = 1.0f;
+    glClearNamedFramebufferuiv(visibilityFBO, GL_COLOR, 0, &sky);
+    glClearNamedFramebufferfv(visibilityFBO, GL_DEPTH, 0, &far);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    const GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    const GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+    GLint frontFace;
+    glGetIntegerv(GL_FRONT_FACE, &frontFace);
+
+    profiler.begin(PASS_VISIBILITY);
+    glBindFramebuffer(GL_FRAMEBUFFER, visibilityFBO);
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    glFrontFace(GL_CW);
+    glCullFace(GL_BACK);
+
+    visibilityShader.Bind();
+    visibilityShader.setMatrixFloat4("VIEW_PROJECTION", viewProjection);
+    glBindVertexArray(modelVAO);
+    glDrawArrays(GL_TRIANGLES, 0, computeData.triangles*3);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    profiler.end(PASS_VISIBILITY);
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (!depthTest)
+        glDisable(GL_DEPTH_TEST);
+    if (!cullFace)
+        glDisable(GL_CULL_FACE);
+    glFrontFace(frontFace);
+
+    visibilityCamera[tracingLow] = currentCamera;
+    visibilityValid[tracingLow] = true;
+}
+
+void Scene::updatePreview() {
+    if (lastTracedLow)
+        preview.update(profiler.getMilliseconds(PASS_TRACE) + profiler.getMilliseconds(PASS_DISPLAY));
+}
+
+void Scene::traceScene(const uint32_t width, const uint32_t height, const uint32_t sample, const uint32_t samples) {
+    TIMELINE_ZONE("traceScene");
+    const uint32_t widthDivCeil  = ceilPower2<uint32_t, 3U>(width);
+    const uint32_t heightDivCeil = ceilPower2<uint32_t, 3U>(height);
+    previewing = false;
+
+    // A resized preview has nothing to accumulate on either
+    const bool restart = sample == 0 || !targetValid[tracingLow];
+    // the history and the visibility buffer cover the whole image, a tile doesn't
+    const bool tiled = tracerUniforms.image_size.x > 0;
+    const bool reproject = temporalReprojection && !tiled && restart && snapshotHistory();
+
+    // The sampler scramble has to stay the same while a pixel accumulates, only restarts draw a new one
+    if (fixedSeed)
+        sequenceSeed = seed;
+    else if (restart)
+        sequenceSeed = (uint32_t)clock() + ++restarts;
+    glProgramUniform1ui(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "CLOCK"), sequenceSeed);
+
+    glProgramUniform1ui(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "SAMPLE"), sample);
+    glProgramUniform1ui(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "SAMPLES"), std::max(samples, 1u));
+    glProgramUniform1ui(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "REPROJECT"), reproject);
+
+    const bool visibility = visibilityBuffer && !tiled;
+    if (visibility)
+        rasterizeVisibility(width, height);
+    glProgramUniform1ui(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "USE_VISIBILITY"), visibility);
+    glProgramUniform1ui(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "GUIDING"), pathGuiding);
+
+    profiler.begin(PASS_TRACE);
     glUseProgram(eyeRayTracerProgram);
     glDispatchCompute(widthDivCeil, heightDivCeil, 1);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+    profiler.end(PASS_TRACE);
+
+    if (textureStreamer && eyeRayTracerVariant.textures)
+        textureStreamer->update();
+
+    // Training iterations double in length, later ones learn from more and better guided paths
+    if (pathGuiding) {
+        guideSamples += std::max(samples, 1u);
+        if (guideSamples >= guideIteration)
+            resolvePathGuide();
+    }
+
+    targetCamera[tracingLow] = currentCamera;
+    targetValid[tracingLow] = true;
+    lastTracedLow = tracingLow;
+}
+
+void Scene::settleTextures(const uint32_t width, const uint32_t height) {
+    if (!textureStreamer || !eyeRayTracerVariant.textures)
+        return;
+    TIMELINE_ZONE("settleTextures");
+    // the paths of the coarse mips neither train the guide nor count in the statistics
+    const bool guiding = pathGuiding;
+    pathGuiding = false;
+    // finer pages change the normals and the bounces, those can want other pages again
+    constexpr int SETTLE_PASSES = 3;
+    for (int pass = 0; pass < SETTLE_PASSES; pass++) {
+        traceScene(width, height, 0);
+        const uint32_t loaded = textureStreamer->settle();
+        if (loaded == 0)
+            break;
+        std::cout << "[  INFO  ][Stream ] Settled " << loaded << " pages\n";
+    }
+    pathGuiding = guiding;
+    if (statistics)
+        statistics->discard();
+
+    // A render continuing at a later sample loads the target as its history, it has to be empty again
+    glClearTexImage(tracingLow ? computeData.renderTargetLow : computeData.renderTarget, 0, GL_RGBA, GL_FLOAT, nullptr);
+    invalidateHistory();
+}
+
+void Scene::setTile(const glm::ivec2 &offset, const glm::ivec2 &image_size) {
+    tracerUniforms.tile_offset = offset;
+    tracerUniforms.image_size = image_size;
+    updateTracerUniforms();
+    // the render target holds another part of the image now
+    invalidateHistory();
+}
+
+void Scene::setStatistics(bool enabled) {
+    if (enabled == (statistics != nullptr))
+        return;
+    // the variant switches in the next prepare()
+    if (enabled) {
+        statistics = std::make_unique<TracerStats>();
+        statistics->bind();
+    }
+    else
+        statistics.reset();
+}
+
+bool Scene::snapshotHistory() {
+    // Low resolution previews never feed the full resolution image
+    const int source = (tracingLow && lastTracedLow && targetValid[1]) ? 1 : 0;
+    if (!targetValid[source])
+        return false;
+
+    const GLuint color   = source ? computeData.renderTargetLow : computeData.renderTarget;
+    const GLuint gbuffer = source ? computeData.gbufferLow : computeData.gbuffer;
+    const glm::ivec2 size = source ? computeData.resolution_low : computeData.resolution;
+
+    if (computeData.history_res != size) {
+        glDeleteTextures(2, &computeData.historyColor);
+        glCreateTextures(GL_TEXTURE_2D, 2, &computeData.historyColor);
+        glTextureStorage2D(computeData.historyColor, 1, GL_RGBA32F, size.x, size.y);
+        glTextureStorage2D(computeData.historyGBuffer, 1, GL_RGBA32F, size.x, size.y);
+        computeData.history_res = size;
+    }
+    glCopyImageSubData(color,   GL_TEXTURE_2D, 0, 0, 0, 0, computeData.historyColor,   GL_TEXTURE_2D, 0, 0, 0, 0, size.x, size.y, 1);
+    glCopyImageSubData(gbuffer, GL_TEXTURE_2D, 0, 0, 0, 0, computeData.historyGBuffer, GL_TEXTURE_2D, 0, 0, 0, 0, size.x, size.y, 1);
+    glBindTextureUnit(4, computeData.historyColor);
+    glBindTextureUnit(5, computeData.historyGBuffer);
+
+    const glm::fmat4 view = glm::inverse(targetCamera[source]);
+    const glm::fvec3 position(targetCamera[source][3]);
+    glProgramUniformMatrix4fv(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "PREV_VIEW"), 1, GL_FALSE, &view[0].x);
+    glProgramUniform3f(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "PREV_POSITION"), position.x, position.y, position.z);
+    return true;
 }
 
 void Scene::prepare(int &width, int &height, bool moving, const glm::fmat4 &Camera) {
-    static bool firstTime = true;
-    if (firstTime) {
+    TIMELINE_ZONE("prepare");
+    if (computeData.resolution.x == 0)
         adaptResolution({ width, height });
-        firstTime = false;
-    }
     
-    static const int CAMERAloc = glGetUniformLocation(eyeRayTracerProgram, "CAMERA");
-    static const int RECloc = glGetUniformLocation(eyeRayTracerProgram, "RECURSION");
-    static const int CLOCKloc = glGetUniformLocation(eyeRayTracerProgram, "CLOCK");
+    st_RTCS_variant variant;
+    variant.lights = tracerUniforms.lights > 0;
+    variant.stats = statistics != nullptr;
+    if (moving) {
+        // Interactive preview, untextured materials and the bounces of the current preview level
+        variant.recursion = preview.getLevel().recursion;
+        variant.textures = false;
+    }
+    else {
+        variant.recursion = 6;
+        variant.textures = std::find(activeTextures.begin(), activeTextures.end(), 1) != activeTextures.end();
+    }
+    eyeRayTracerProgram = getTracerProgram(variant);
+    eyeRayTracerVariant = variant;
+
+    glProgramUniformMatrix4fv(eyeRayTracerProgram, glGetUniformLocation(eyeRayTracerProgram, "CAMERA"), 1, GL_FALSE, &Camera[0].x);
 
-    glProgramUniformMatrix4fv(eyeRayTracerProgram, CAMERAloc, 1, GL_FALSE, &Camera[0].x);
-    glProgramUniform1ui(eyeRayTracerProgram, CLOCKloc, clock()); // clock() 95834783
+    currentCamera = Camera;
+    tracingLow = moving;
 
     if (moving) {
-        glBindImageTexture(0, computeData.renderTargetLow, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-        glBindTextureUnit(0, computeData.renderTargetLow);
+        if (!lastTracedLow)
+            preview.hold();
+        resizePreview(preview.getLevel().height);
 
-        width = (int)(240.0/height*width);
-        height = 240;
+        glBindImageTexture(0, computeData.renderTargetLow, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindImageTexture(1, computeData.gbufferLow, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindTextureUnit(0, computeData.renderTargetLow);
 
-        glProgramUniform1i(eyeRayTracerProgram, RECloc, 3);
+        width = computeData.resolution_low.x;
+        height = computeData.resolution_low.y;
     }
     else {
-        glBindImageTexture(0, computeData.renderTarget, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(0, computeData.renderTarget, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindImageTexture(1, computeData.gbuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
         glBindTextureUnit(0, computeData.renderTarget);
-
-        glProgramUniform1i(eyeRayTracerProgram, RECloc, 6);
     }
 }
 
 void Scene::display() {
+    profiler.begin(PASS_DISPLAY);
     displayShader.Bind();
 
     glBindVertexArray(screenVAO);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    profiler.end(PASS_DISPLAY);
 }
 
 void Scene::renderWireframe(const glm::fmat4 &MVP, const glm::fvec3 &cam_pos) {
@@ -476,7 +1077,10 @@ void Scene::renderWireframe(const glm::fmat4 &MVP, const glm::fvec3 &cam_pos) {
     glEnable(GL_CULL_FACE);
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-    forwardRender(MVP, cam_pos);
+    modelShader.Bind();
+    modelShader.setMatrixFloat4("MVP", MVP);
+    modelShader.setFloat3("CAMERA", cam_pos);
+    drawModels(cam_pos, previewing);
 
     glDisable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
@@ -488,24 +1092,60 @@ void Scene::forwardRender(const glm::fmat4 &MVP, const glm::fvec3 &cam_pos) {
     modelShader.Bind();
     modelShader.setMatrixFloat4("MVP", MVP);
     modelShader.setFloat3("CAMERA", cam_pos);
+    previewing = true;
+    profiler.begin(PASS_FORWARD);
+    drawModels(cam_pos, true);
+    profiler.end(PASS_FORWARD);
+    if (textureStreamer)
+        textureStreamer->update();
+}
+
+void Scene::drawModels(const glm::fvec3 &cam_pos, bool lod) {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // Objects in full detail draw their ranges of modelBuffer, the others one of their levels
+    std::vector<GLsizei> full_counts, lod_counts;
+    std::vector<const void*> full_offsets, lod_offsets;
+    std::vector<GLint> base_vertices;
+    if (lod && previewLOD) {
+        for (uint32_t obj_id = 0; obj_id < objectLODs.size(); obj_id++) {
+            const st_object_lods &lods = objectLODs[obj_id];
+            const uint32_t level = MeshLOD::selectLevel(lods, cam_pos, (float)viewport[3]);
+            if (level == 0) {
+                full_counts.push_back(3 * geometry.objects[obj_id].triangles.size());
+                full_offsets.push_back((const void*)(sizeof(uint32_t) * 3 * triangleArrays.object_offsets[obj_id]));
+            } else {
+                const st_lod_mesh &mesh = lods.levels[level-1];
+                lod_counts.push_back(mesh.indices.size());
+                lod_offsets.push_back((const void*)(sizeof(uint32_t) * mesh.first_index));
+                base_vertices.push_back(mesh.base_vertex);
+            }
+        }
+    }
+
     glBindVertexArray(modelVAO);
-    glDrawArrays(GL_TRIANGLES, 0, computeData.triangles*3);
+    if (lod_counts.empty()) {
+        glDrawArrays(GL_TRIANGLES, 0, computeData.triangles*3);
+        return;
+    }
+    if (!full_counts.empty())
+        glMultiDrawElements(GL_TRIANGLES, full_counts.data(), GL_UNSIGNED_INT, full_offsets.data(), full_counts.size());
+
+    glBindVertexArray(lodVAO);
+    glMultiDrawElementsBaseVertex(GL_TRIANGLES, lod_counts.data(), GL_UNSIGNED_INT, lod_offsets.data(), lod_counts.size(), base_vertices.data());
 }
 
 
-void Scene::exportEXR(const char *name) const {
+bool Scene::exportEXR(const char *name) const {
+    TIMELINE_ZONE("exportEXR", name);
     unsigned long pixel_count = (unsigned long)computeData.resolution.x*computeData.resolution.y;
     std::unique_ptr<glm::fvec3[]> raw_pixels(new glm::fvec3[pixel_count]);
     glGetTextureImage(computeData.renderTarget, 0, GL_RGB, GL_FLOAT,
                       pixel_count * sizeof(glm::fvec3),
                       &raw_pixels[0]);
     
-    const char * error = nullptr;
-    const int ret = SaveEXR(&raw_pixels[0].r, computeData.resolution.x, computeData.resolution.y, 3, false, name, &error);
-    if (ret != TINYEXR_SUCCESS) {
-        fprintf(stderr, "Save EXR err: %s\n", error);
-        FreeEXRErrorMessage(error);
-    }
+    return writeEXR(name, raw_pixels.get(), computeData.resolution.x, computeData.resolution.y);
 }
 
 void Scene::exportRAW(const char *name) const {
@@ -519,6 +1159,27 @@ void Scene::exportRAW(const char *name) const {
     f.close();
 }
 
+std::unique_ptr<glm::fvec4[]> Scene::readRenderTarget() const {
+    unsigned long pixel_count = (unsigned long)computeData.resolution.x*computeData.resolution.y;
+    std::unique_ptr<glm::fvec4[]> raw_pixels(new glm::fvec4[pixel_count]);
+    glGetTextureImage(computeData.renderTarget, 0, GL_RGBA, GL_FLOAT,
+                      pixel_count * sizeof(glm::fvec4),
+                      raw_pixels.get());
+    return raw_pixels;
+}
+
+void Scene::readRenderTarget(GLuint pack_buffer) const {
+    const GLsizei size = (GLsizei)((size_t)computeData.resolution.x*computeData.resolution.y*sizeof(glm::fvec3));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pack_buffer);
+    glGetTextureImage(computeData.renderTarget, 0, GL_RGB, GL_FLOAT, size, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void Scene::loadRenderTarget(const glm::fvec4 *pixels) {
+    glTextureSubImage2D(computeData.renderTarget, 0, 0, 0, computeData.resolution.x, computeData.resolution.y, GL_RGBA, GL_FLOAT, pixels);
+    invalidateHistory();
+}
+
 std::shared_ptr<unsigned char[]> Scene::exportRGBA8() const  {
     unsigned long pixel_count = (unsigned long)computeData.resolution.x*computeData.resolution.y;
 
@@ -529,13 +1190,15 @@ std::shared_ptr<unsigned char[]> Scene::exportRGBA8() const  {
                       pixel_count * sizeof(glm::fvec4),
                       raw_pixels.get());
 
-    for (int i = 0; i < pixel_count; ++i) {
-        const glm::fvec4 &pixel = raw_pixels[i];
-        bmpData[i * 4 + 0] = static_cast<unsigned char>(pixel.r * 255);
-        bmpData[i * 4 + 1] = static_cast<unsigned char>(pixel.g * 255); // glm::pow(pixel.g, 1.6f)
-        bmpData[i * 4 + 2] = static_cast<unsigned char>(pixel.b * 255);
-        bmpData[i * 4 + 3] = static_cast<unsigned char>(255);
-    }
+    TaskScheduler::parallelFor(0, pixel_count, 16384, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            const glm::fvec4 &pixel = raw_pixels[i];
+            bmpData[i * 4 + 0] = static_cast<unsigned char>(pixel.r * 255);
+            bmpData[i * 4 + 1] = static_cast<unsigned char>(pixel.g * 255); // glm::pow(pixel.g, 1.6f)
+            bmpData[i * 4 + 2] = static_cast<unsigned char>(pixel.b * 255);
+            bmpData[i * 4 + 3] = static_cast<unsigned char>(255);
+        }
+    });
 
     return bmpData;
 }
@@ -555,148 +1218,14 @@ bool Scene::exportBMP(const char *name) const
     info.biWidth = computeData.resolution.x;
     info.biHeight = computeData.resolution.y;
 
+    std::unique_ptr<uint8_t[]> bgr(new uint8_t[pixel_count * 3]);
+    toneMapBGR8(raw_pixels.get(), pixel_count, bgr.get());
+
     std::ofstream bmpFile(name, std::ios::binary);
     bmpFile.write(reinterpret_cast<char*>(&header), sizeof(header));
     bmpFile.write(reinterpret_cast<char*>(&info), sizeof(info));
-
-    for (unsigned long i = 0; i < pixel_count; ++i)
-    {
-        const glm::fvec3 mappedColor = LinearTosRGB(ACESFilm(raw_pixels[i]));
-        bmpFile << static_cast<unsigned char>(glm::clamp(mappedColor.b * 256.0f, 0.0f, 255.0f));
-        bmpFile << static_cast<unsigned char>(glm::clamp(mappedColor.g * 256.0f, 0.0f, 255.0f));
-        bmpFile << static_cast<unsigned char>(glm::clamp(mappedColor.r * 256.0f, 0.0f, 255.0f));
-    }
-
+    bmpFile.write(reinterpret_cast<char*>(bgr.get()), pixel_count * 3);
     bmpFile.close();
 
     return true;
 }
-
-
-struct st_wf_face {
-    st_wf_face() = default;
-
-    unsigned int pos_i[3];
-    unsigned int tex_i[3];
-    unsigned int nrm_i[3];
-};
-
-
-bool Scene::addWavefrontModel(const std::string &name) {
-    std::ifstream objFile(name + ".obj");
-    if (!objFile || !readWFMaterial(name))
-        return false;
-
-    Object *object = nullptr;
-    std::vector<glm::fvec3> positions;
-    std::vector<glm::fvec3> normals;
-    std::vector<glm::fvec2> uv_coords;
-    std::vector<st_wf_face> faces;
-
-    std::string line;
-
-    while (getline(objFile, line)) {
-        if (line.length() <= 2)
-            continue;
-
-        if (line[0] == 'o') {
-            if (object) {
-                for (const st_wf_face &face: faces) {
-                    object->triangles.emplace_back(
-                        positions[face.pos_i[0] - 1], positions[face.pos_i[1] - 1], positions[face.pos_i[2] - 1],
-                        normals[face.nrm_i[0] - 1], normals[face.nrm_i[1] - 1], normals[face.nrm_i[2] - 1],
-                        uv_coords[face.tex_i[0] - 1], uv_coords[face.tex_i[1] - 1], uv_coords[face.tex_i[2] - 1],
-                        object->material_index
-                    );
-                }
-            }
-            faces.clear();
-            object = &getObject(std::string(line.begin() + 2, line.end()));
-        } else if (line[0] == 'v') {
-            switch (line[1]) {
-                case ' ': {
-                    glm::fvec3 &p = positions.emplace_back();
-                    SSCANF(line.c_str(), "%*s %f %f %f", &p.x, &p.y, &p.z);
-                }
-                    break;
-                case 't': {
-                    glm::fvec2 &uv = uv_coords.emplace_back();
-                    SSCANF(line.c_str(), "%*s %f %f", &uv.x, &uv.y);
-                }
-                    break;
-                case 'n': {
-                    glm::fvec3 &n = normals.emplace_back();
-                    SSCANF(line.c_str(), "%*s %f %f %f", &n.x, &n.y, &n.z);
-                }
-                    break;
-            }
-        } else if (object != nullptr && line.compare(0, 6, "usemtl") == 0) {
-            object->material_index = getMaterialIndex(line.substr(7));
-        } else if (line[0] == 'f') {
-            st_wf_face &face = faces.emplace_back();
-            SSCANF(line.c_str(), "%*s %i/%i/%i %i/%i/%i %i/%i/%i",
-                   &face.pos_i[0], &face.tex_i[0], &face.nrm_i[0],
-                   &face.pos_i[1], &face.tex_i[1], &face.nrm_i[1],
-                   &face.pos_i[2], &face.tex_i[2], &face.nrm_i[2]
-            );
-        }
-    }
-    if (object) {
-        for (const st_wf_face &face: faces) {
-            object->triangles.emplace_back(
-                positions[face.pos_i[0] - 1], positions[face.pos_i[1] - 1], positions[face.pos_i[2] - 1],
-                normals[face.nrm_i[0] - 1], normals[face.nrm_i[1] - 1], normals[face.nrm_i[2] - 1],
-                uv_coords[face.tex_i[0] - 1], uv_coords[face.tex_i[1] - 1], uv_coords[face.tex_i[2] - 1],
-                object->material_index
-            );
-        }
-    }
-    objFile.close();
-
-    return true;
-}
-
-bool Scene::readWFMaterial(const std::string &material_name) {
-    std::ifstream mtlFile(material_name + ".mtl");
-    if (!mtlFile)
-        return false;
-
-    Material *material_ptr = nullptr;
-    std::string line;
-
-    while (getline(mtlFile, line)) {
-        if (line.length() <= 3)
-            continue;
-
-        if (line.compare(0, 6, "newmtl") == 0) {
-            material_ptr = &getMaterial(line.substr(7).c_str());
-        }
-
-        if (material_ptr) {
-            Material &material = *material_ptr;
-            if (line.compare(0, 2, "Kd") == 0)
-                SSCANF(line.c_str(), "%*s %f %f %f", &material.albedo.r, &material.albedo.g, &material.albedo.b);
-
-            else if (line.compare(0, 2, "Ks") == 0)
-                SSCANF(line.c_str(), "%*s %f %f %f", &material.specular_roughness.r, &material.specular_roughness.g, &material.specular_roughness.b);
-
-            else if (line.compare(0, 2, "Ke") == 0)
-                SSCANF(line.c_str(), "%*s %f %f %f", &material.emission_ior.r, &material.emission_ior.g, &material.emission_ior.b);
-
-            else if (line.compare(0, 2, "Ni") == 0) {
-                SSCANF(line.c_str(), "%*s %f", &material.emission_ior.a);
-            }
-            else if (line.compare(0, 2, "Ns") == 0) {
-                SSCANF(line.c_str(), "%*s %f", &material.specular_roughness.a);
-                material.specular_roughness.a /= 1000.0f;
-            }
-        }
-    }
-
-    mtlFile.close();
-
-    for (const auto &mat : m_material_indices) {
-        std::cout << mat.first << "\t:\t" << mat.second << '\n';
-    }
-    return true;
-}
@@ -3,9 +3,19 @@
 #include <unordered_map>
 #include "Material.hpp"
 #include "3Dobjects.hpp"
+#include "SceneGeometry.hpp"
 #include "RTCSBuffer.hpp"
 #include "Shader.hpp"
+#include "GpuTimer.hpp"
+#include "DynamicResolution.hpp"
+#include "PathGuide.hpp"
+#include "TracerStats.hpp"
+#include "RayQuery.hpp"
+#include "MeshLOD.hpp"
+#include "BVH.hpp"
+#include "TextureStreamer.hpp"
 #include <memory>
+#include <algorithm>
 
 #include "GLFW/glfw3.h"
 
@@ -17,76 +27,224 @@ public:
 
     bool addWavefrontModel(const std::string &model_name);
 
+    // Streams the textures of the material page by page, after finalizeObjects()
     bool loadMaterial(const std::string &name, uint32_t material_id);
     bool loadEnvironmentTexture(GLFWwindow* window, const std::string &texture_name);
 
     void finalizeObjects();
+
+    /*
+        Scene edits after finalizeObjects(). Changes are tracked per object and material
+        and uploaded by commitEdits(), which returns true if the accumulated image is invalid.
+    */
+    inline int findObject(const std::string &name) const { return geometry.findObject(name); }
+    void transformObject(uint32_t object_id, const glm::fmat4 &transform);
+    void setMaterial(uint32_t material_id, const Material &material);
+    bool commitEdits();
     void adaptResolution(const glm::ivec2 &newRes);
+    // Changes with the resolution, the preview level and committed edits, batch timings of older versions don't apply
+    inline uint32_t getWorkloadVersion() const { return workloadVersion; }
+    // Rebinds the buffers and textures of this scene, for several scenes sharing one context
+    void bind() const;
+    inline const glm::ivec2 &getResolution() const { return computeData.resolution; }
     void prepare(int &width, int &height, bool moving, const glm::fmat4 &Camera);
-    void traceScene(const uint32_t width, const uint32_t height, const uint32_t sample);
+    // Accumulates the samples [sample, sample + samples) in one dispatch
+    void traceScene(const uint32_t width, const uint32_t height, const uint32_t sample, const uint32_t samples = 1);
+    /*
+        Traces sample 0 until the texture pages it wants are resident, for offline renders that shouldn't
+        accumulate the coarse fallback mips. Call after prepare(), the render target is cleared afterwards
+        and the settle passes train no path guide and count in no statistics.
+    */
+    void settleTextures(const uint32_t width, const uint32_t height);
+
+    // The first sample after a camera change continues from the previous accumulation
+    inline void setTemporalReprojection(bool enabled) { temporalReprojection = enabled; }
+    inline bool getTemporalReprojection() const { return temporalReprojection; }
+    // Camera rays start from a rasterized visibility buffer instead of traversing all triangles
+    inline void setVisibilityBuffer(bool enabled) { visibilityBuffer = enabled; }
+    inline bool getVisibilityBuffer() const { return visibilityBuffer; }
+    // Indirect bounces are guided by the radiance learned from earlier samples
+    inline void setPathGuiding(bool enabled) { pathGuiding = enabled; }
+    inline bool getPathGuiding() const { return pathGuiding; }
+    // Resolves the current training on the GPU and with the CPU reference and compares both
+    st_guide_validation validatePathGuide();
+    /*
+        Renders the render target as the tile at offset of an image_size image, with the camera rays and
+        pixel seeds of the whole image. A zero image_size goes back to rendering the whole image.
+    */
+    void setTile(const glm::ivec2 &offset, const glm::ivec2 &image_size);
+    // Counts rays and path events in the tracer, nullptr while disabled
+    void setStatistics(bool enabled);
+    inline TracerStats *getStatistics() { return statistics.get(); }
+    // Far objects of the raster preview are drawn with simplified meshes, the tracer always uses the full geometry
+    inline void setPreviewLOD(bool enabled) { previewLOD = enabled; }
+    inline bool getPreviewLOD() const { return previewLOD; }
+    /*
+        The tracer BVH is built with spatial splits, treelet restructuring and a slot order following its leaves.
+        Slower to build, a finalized scene rebuilds at the next commitEdits().
+    */
+    void setBVHQuality(bool enabled);
+    inline bool getBVHQuality() const { return bvhQuality; }
+    inline const st_bvh_report &getBVHReport() const { return bvh.report(); }
+    // Budget of the texture page cache of scenes finalized from now on, 256 MB by default
+    static inline void setTextureCacheSize(size_t megabytes) { textureCacheBytes = std::max<size_t>(megabytes, 1) << 20; }
+    [[nodiscard]] inline st_streaming_stats getTextureStats() const {
+        return textureStreamer ? textureStreamer->stats() : st_streaming_stats();
+    }
     void display();
+    // In full detail once the scene is traced again, like the traced image under it
     void renderWireframe(const glm::fmat4 &MVP, const glm::fvec3 &cam_pos);
     void forwardRender(const glm::fmat4 &MVP, const glm::fvec3 &cam_pos);
+    std::unique_ptr<glm::fvec4[]> readRenderTarget() const;
+    // Queues a copy of the RGB render target into pack_buffer and returns without waiting for it
+    void readRenderTarget(GLuint pack_buffer) const;
+    // Restores an accumulation read with readRenderTarget(), mean radiance and sample count in alpha
+    void loadRenderTarget(const glm::fvec4 *pixels);
     std::shared_ptr<unsigned char[]> exportRGBA8() const;
     bool exportBMP(const char *name) const;
     void exportRAW(const char *name) const;
-    void exportEXR(const char *name) const;
+    bool exportEXR(const char *name) const;
+
+    inline GpuProfiler &getProfiler() { return profiler; }
+    inline DynamicResolution &getPreview() { return preview; }
+
+    // Adapts the preview to the GPU time of the last preview frame
+    void updatePreview();
 
     inline Object &getObject(std::string &&name) {
-        return m_objects.emplace_back(std::move(name));
+        return geometry.getObject(std::move(name));
     }
 
     inline int getMaterialIndex(const std::string &name) const {
-        if (!m_material_indices.contains(name))
-            return -1;
-
-        return m_material_indices.at(name);
+        return geometry.getMaterialIndex(name);
     }
 
     inline Material &getMaterial(const std::string &name) {
-        if (m_material_indices.contains(name))
-            return m_materials[m_material_indices.at(name)];
+        return geometry.getMaterial(name);
+    }
+
+    inline const SceneGeometry &getGeometry() const { return geometry; }
+    // CPU ray casting against the current triangles, edits are included by commitEdits()
+    inline const RayQuery &getRayQuery() const { return rayQuery; }
 
-        m_material_indices[name] = (int)m_materials.size();
-        return m_materials.emplace_back();
+    // Replaces the clock() based seed of every accumulation by a fixed one, for reproducible images
+    inline void setSeed(uint32_t seed) {
+        fixedSeed = true;
+        this->seed = seed;
     }
 
 private:
     st_RTCS_data computeData;
+    GpuProfiler profiler;
+    DynamicResolution preview;
 
     GLuint modelBuffer{ 0 };
-    GLuint modelVAO;
+    GLuint modelVAO{ 0 };
+    // per object index ranges into modelBuffer, for drawing some objects in full detail
+    GLuint objectIndexBuffer{ 0 };
+    GLuint lodVertexBuffer{ 0 };
+    GLuint lodIndexBuffer{ 0 };
+    GLuint lodVAO{ 0 };
 
     GLuint skyBuffer{ 0 };
-    GLuint skyVAO;
+    GLuint skyVAO{ 0 };
 
-    GLuint screenBuffer;
-    GLuint screenVAO;
+    GLuint screenBuffer{ 0 };
+    GLuint screenVAO{ 0 };
 
     GLuint hasTextureBuffer{ 0 };
 
+    GLuint bvhNodeBuffer{ 0 };
+    GLuint bvhReferenceBuffer{ 0 };
+
     Shader displayShader;
     Shader modelShader;
+    Shader visibilityShader;
+    GLuint visibilityFBO{ 0 };
 
-    GLuint eyeRayTracerProgram;
+    GLuint eyeRayTracerProgram{ 0 };
+    st_RTCS_variant eyeRayTracerVariant;
     GLuint drawBufferProgram;
     GLuint irradianceProgram;
-    GLuint radianceTexture;
-    GLuint irradianceTexture;
-    GLuint textureAtlas;
+    GLuint guideProgram;
+    GLuint guideTraining{ 0 };
+    GLuint guideDistribution{ 0 };
+    GLuint radianceTexture{ 0 };
+    GLuint irradianceTexture{ 0 };
+    std::unique_ptr<TextureStreamer> textureStreamer;
+    static inline size_t textureCacheBytes{ size_t(256) << 20 };
     std::vector<int> activeTextures;
 
-    void createTrianglesBuffers();
+    st_RTCS_uniforms tracerUniforms;
+    std::unordered_map<uint32_t, GLuint> tracerPrograms;
 
-    void createRTCSData();
+    GLuint getTracerProgram(const st_RTCS_variant &variant);
+    void applyTracerUniforms(GLuint program) const;
+    void updateTracerUniforms() const;
 
-    bool readWFMaterial(const std::string &material_name);
+    void createTrianglesBuffers();
+    // Loads or builds the levels of objects added since the last call and lays out all levels in the preview buffers
+    void createLODBuffers();
+    void uploadLODs(uint32_t object_id);
+    void drawModels(const glm::fvec3 &cam_pos, bool lod);
+    // Builds the BVH over the tracer slots of order, the quality build reorders them
+    void buildBVH(std::vector<uint32_t> &order);
+    // Writes the triangles at the flat indices to the tracer slots [first, first + count)
+    void uploadTriangles(uint32_t first, const uint32_t *flat, uint32_t count);
+    void createMaterialTextures();
+    void buildDrawBuffers(uint32_t first, uint32_t count);
+    void rebuildBuffers();
+    void refitBounds();
+    void resetPathGuide();
+    void resolvePathGuide();
+    bool snapshotHistory();
+    void resizePreview(int height);
+    void createVisibilityTarget(GLuint &ids, GLuint &depth, const glm::ivec2 &size);
+    void rasterizeVisibility(const uint32_t width, const uint32_t height);
+    inline void invalidateHistory() {
+        targetValid[0] = targetValid[1] = false;
+        visibilityValid[0] = visibilityValid[1] = false;
+    }
 
-    bool loadTexture(const std::string &texture_name, uint32_t material_id, uint32_t offset);
+    void createRTCSData();
 
-    std::vector<Object> m_objects;
-    std::vector<Material> m_materials;
-    std::unordered_map<std::string, int> m_material_indices;
+    SceneGeometry geometry;
+    st_triangle_arrays triangleArrays;
+    std::vector<uint8_t> dirtyObjects;
+    std::vector<uint8_t> dirtyMaterials;
+    bool structureDirty{ false };
+    bool temporalReprojection{ false };
+    bool visibilityBuffer{ true };
+    bool pathGuiding{ true };
+    std::unique_ptr<TracerStats> statistics;
+    RayQuery rayQuery;
+    BVH bvh;
+    bool bvhQuality{ false };
+    // objectLODs[i] belongs to geometry.objects[i], models are the loaded files and their first object
+    std::vector<st_object_lods> objectLODs;
+    std::vector<std::pair<std::string, size_t>> models;
+    bool previewLOD{ true };
+    // no frame was traced since the last raster preview
+    bool previewing{ false };
+    uint32_t workloadVersion{ 0 };
+    // samples traced in the current training iteration and its length
+    uint32_t guideSamples{ 0 };
+    uint32_t guideIteration{ PathGuide::FIRST_ITERATION };
+    float historyCap{ 32.0f };
+    // index 0 is the full resolution render target, 1 the low resolution preview
+    bool tracingLow{ false };
+    bool lastTracedLow{ false };
+    bool targetValid[2]{ false, false };
+    glm::fmat4 targetCamera[2];
+    // The visibility buffers stay valid while the camera and the geometry don't change
+    bool visibilityValid[2]{ false, false };
+    glm::fmat4 visibilityCamera[2];
+    glm::fmat4 currentCamera;
+
+    bool fixedSeed{ false };
+    uint32_t seed{ 0 };
+    uint32_t sequenceSeed{ 0 };
+    uint32_t restarts{ 0 };
 };
 
 
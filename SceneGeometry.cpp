@@ -0,0 +1,353 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include "SceneGeometry.hpp"
+#include "Timeline.hpp"
+#include "TaskScheduler.hpp"
+
+
+#ifdef __linux__
+#define SSCANF sscanf
+#elif _WIN32
+#define SSCANF sscanf_s
+#endif
+
+
+struct st_wf_face {
+    st_wf_face() = default;
+
+    unsigned int pos_i[3];
+    unsigned int tex_i[3];
+    unsigned int nrm_i[3];
+};
+
+// o and usemtl lines, in front of face `face` of their chunk
+struct st_wf_statement {
+    size_t face;
+    bool object;
+    std::string name;
+};
+
+// A piece of the file of whole lines, parsed on its own. OBJ indices count over the whole file.
+struct st_wf_chunk {
+    const char *begin;
+    const char *end;
+    std::vector<glm::fvec3> positions;
+    std::vector<glm::fvec3> normals;
+    std::vector<glm::fvec2> uv_coords;
+    std::vector<st_wf_face> faces;
+    std::vector<st_wf_statement> statements;
+};
+
+static constexpr size_t WF_CHUNK_BYTES = 1 << 20;
+
+static void parseWavefrontChunk(st_wf_chunk &chunk) {
+    TIMELINE_ZONE("parseWavefrontChunk");
+    // sscanf measures the whole string, every line is copied on its own
+    std::string line;
+    for (const char *p = chunk.begin; p < chunk.end;) {
+        const char *eol = std::find(p, chunk.end, '\n');
+        line.assign(p, eol);
+        p = eol + 1;
+        if (line.length() <= 2)
+            continue;
+
+        if (line[0] == 'o') {
+            chunk.statements.push_back({ chunk.faces.size(), true, std::string(line.begin() + 2, line.end()) });
+        } else if (line[0] == 'v') {
+            switch (line[1]) {
+                case ' ': {
+                    glm::fvec3 &p = chunk.positions.emplace_back();
+                    SSCANF(line.c_str(), "%*s %f %f %f", &p.x, &p.y, &p.z);
+                }
+                    break;
+                case 't': {
+                    glm::fvec2 &uv = chunk.uv_coords.emplace_back();
+                    SSCANF(line.c_str(), "%*s %f %f", &uv.x, &uv.y);
+                }
+                    break;
+                case 'n': {
+                    glm::fvec3 &n = chunk.normals.emplace_back();
+                    SSCANF(line.c_str(), "%*s %f %f %f", &n.x, &n.y, &n.z);
+                }
+                    break;
+            }
+        } else if (line.compare(0, 6, "usemtl") == 0) {
+            chunk.statements.push_back({ chunk.faces.size(), false, line.substr(7) });
+        } else if (line[0] == 'f') {
+            st_wf_face &face = chunk.faces.emplace_back();
+            SSCANF(line.c_str(), "%*s %i/%i/%i %i/%i/%i %i/%i/%i",
+                   &face.pos_i[0], &face.tex_i[0], &face.nrm_i[0],
+                   &face.pos_i[1], &face.tex_i[1], &face.nrm_i[1],
+                   &face.pos_i[2], &face.tex_i[2], &face.nrm_i[2]
+            );
+        }
+    }
+}
+
+
+bool SceneGeometry::addWavefrontModel(const std::string &name) {
+    TIMELINE_ZONE("addWavefrontModel", name);
+    std::ifstream objFile(name + ".obj", std::ios::binary);
+    if (!objFile || !readWFMaterial(name))
+        return false;
+
+    /*
+        The file is parsed in pieces of whole lines on all threads, then the o and usemtl lines are applied
+        in file order and the triangles, with their tangents, are built in parallel into the chunks of
+        Object::triangles, which never move. The text, the face indices and the vertex attributes are
+        shared by all objects of the file and freed at the end.
+    */
+    std::string text;
+    {
+        TIMELINE_ZONE("readWavefrontFile");
+        objFile.seekg(0, std::ios::end);
+        text.resize((size_t)objFile.tellg());
+        objFile.seekg(0, std::ios::beg);
+        objFile.read(text.data(), text.size());
+        objFile.close();
+    }
+
+    std::vector<st_wf_chunk> chunks;
+    const char *const text_end = text.data() + text.size();
+    for (const char *p = text.data(); p < text_end;) {
+        const char *end = p + std::min<size_t>(WF_CHUNK_BYTES, text_end - p);
+        end = std::min(std::find(end, text_end, '\n') + 1, text_end);
+        st_wf_chunk &chunk = chunks.emplace_back();
+        chunk.begin = p;
+        chunk.end = end;
+        p = end;
+    }
+    TaskScheduler::parallelFor(0, chunks.size(), 1, [&chunks](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+            parseWavefrontChunk(chunks[i]);
+    });
+
+    std::vector<glm::fvec3> positions;
+    std::vector<glm::fvec3> normals;
+    std::vector<glm::fvec2> uv_coords;
+    // faces of the objects of this file in file order, the faces of object first_object + i start at first_faces[i]
+    std::vector<st_wf_face> faces;
+    std::vector<size_t> first_faces;
+    const size_t first_object = objects.size();
+    {
+        TIMELINE_ZONE("joinWavefrontChunks");
+        for (st_wf_chunk &chunk : chunks) {
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            uv_coords.insert(uv_coords.end(), chunk.uv_coords.begin(), chunk.uv_coords.end());
+
+            size_t statement = 0;
+            for (size_t face = 0; face <= chunk.faces.size(); face++) {
+                for (; statement < chunk.statements.size() && chunk.statements[statement].face == face; statement++) {
+                    st_wf_statement &line = chunk.statements[statement];
+                    if (line.object) {
+                        getObject(std::move(line.name));
+                        first_faces.push_back(faces.size());
+                    } else if (objects.size() > first_object) {
+                        // all triangles of an object carry its material, as the last usemtl of the object sets it
+                        objects.back().material_index = getMaterialIndex(line.name);
+                    }
+                }
+                // faces before the first object are dropped
+                if (face < chunk.faces.size() && objects.size() > first_object)
+                    faces.push_back(chunk.faces[face]);
+            }
+            chunk = st_wf_chunk();
+        }
+        text = std::string();
+        first_faces.push_back(faces.size());
+    }
+
+    TIMELINE_ZONE("buildWavefrontTriangles");
+    for (size_t i = first_object; i < objects.size(); i++)
+        objects[i].triangles.resize(first_faces[i - first_object + 1] - first_faces[i - first_object]);
+    TaskScheduler::parallelFor(0, faces.size(), 4096, [&](size_t first, size_t last) {
+        size_t object = std::upper_bound(first_faces.begin(), first_faces.end(), first) - first_faces.begin() - 1;
+        for (size_t i = first; i < last; i++) {
+            while (i >= first_faces[object + 1])
+                object++;
+            Object &obj = objects[first_object + object];
+            const st_wf_face &face = faces[i];
+            obj.triangles[i - first_faces[object]] = Triangle(
+                positions[face.pos_i[0] - 1], positions[face.pos_i[1] - 1], positions[face.pos_i[2] - 1],
+                normals[face.nrm_i[0] - 1], normals[face.nrm_i[1] - 1], normals[face.nrm_i[2] - 1],
+                uv_coords[face.tex_i[0] - 1], uv_coords[face.tex_i[1] - 1], uv_coords[face.tex_i[2] - 1],
+                obj.material_index
+            );
+        }
+    });
+
+    return true;
+}
+
+bool SceneGeometry::readWFMaterial(const std::string &material_name) {
+    TIMELINE_ZONE("readWFMaterial", material_name);
+    std::ifstream mtlFile(material_name + ".mtl");
+    if (!mtlFile)
+        return false;
+
+    Material *material_ptr = nullptr;
+    std::string line;
+
+    while (getline(mtlFile, line)) {
+        if (line.length() <= 3)
+            continue;
+
+        if (line.compare(0, 6, "newmtl") == 0) {
+            material_ptr = &getMaterial(line.substr(7).c_str());
+        }
+
+        if (material_ptr) {
+            Material &material = *material_ptr;
+            if (line.compare(0, 2, "Kd") == 0)
+                SSCANF(line.c_str(), "%*s %f %f %f", &material.albedo.r, &material.albedo.g, &material.albedo.b);
+
+            else if (line.compare(0, 2, "Ks") == 0)
+                SSCANF(line.c_str(), "%*s %f %f %f", &material.specular_roughness.r, &material.specular_roughness.g, &material.specular_roughness.b);
+
+            else if (line.compare(0, 2, "Ke") == 0)
+                SSCANF(line.c_str(), "%*s %f %f %f", &material.emission_ior.r, &material.emission_ior.g, &material.emission_ior.b);
+
+            else if (line.compare(0, 2, "Ni") == 0) {
+                SSCANF(line.c_str(), "%*s %f", &material.emission_ior.a);
+            }
+            else if (line.compare(0, 2, "Ns") == 0) {
+                SSCANF(line.c_str(), "%*s %f", &material.specular_roughness.a);
+                material.specular_roughness.a /= 1000.0f;
+            }
+        }
+    }
+
+    mtlFile.close();
+
+    for (const auto &mat : material_indices) {
+        std::cout << mat.first << "\t:\t" << mat.second << '\n';
+    }
+    return true;
+}
+
+
+// All three vertices, the fresh order and the refit after an edit agree on the bounds
+static inline void growBounds(const Triangle &tri, glm::fvec3 &bb_min, glm::fvec3 &bb_max) {
+    for (const glm::fvec3 &p : { tri.position, tri.position + tri.u, tri.position + tri.v }) {
+        bb_min = glm::min(bb_min, p);
+        bb_max = glm::max(bb_max, p);
+    }
+}
+
+std::vector<uint32_t> SceneGeometry::orderTriangles(st_triangle_arrays &arrays) const {
+    uint32_t triangle_count = 0;
+    uint32_t light_sources = 0;
+    arrays.object_offsets.clear();
+    for (const Object &obj: objects) {
+        arrays.object_offsets.push_back(triangle_count);
+        triangle_count += obj.triangles.size();
+        if (isLight(obj))
+            light_sources += obj.triangles.size();
+    }
+
+    // order[slot] is the flat index (object offset + triangle) placed at the tracer slot
+    std::vector<uint32_t> order(triangle_count);
+    std::vector<float> areas(triangle_count);
+
+    // every object fills a run of order, the light sources in front of all others
+    std::vector<uint32_t> object_slots(objects.size());
+    uint32_t index = light_sources;
+    uint32_t light_index = 0;
+    for (uint32_t obj_id = 0; obj_id < objects.size(); obj_id++) {
+        uint32_t &next = isLight(objects[obj_id]) ? light_index : index;
+        object_slots[obj_id] = next;
+        next += objects[obj_id].triangles.size();
+    }
+
+    std::mutex bounds_lock;
+    glm::fvec3 bb_min(INFINITY);
+    glm::fvec3 bb_max(-INFINITY);
+
+    for (uint32_t obj_id = 0; obj_id < objects.size(); obj_id++) {
+        const Object &obj = objects[obj_id];
+        TaskScheduler::parallelFor(0, obj.triangles.size(), 16384, [&](size_t first, size_t last) {
+            glm::fvec3 piece_min(INFINITY);
+            glm::fvec3 piece_max(-INFINITY);
+            for (size_t i = first; i < last; i++) {
+                const Triangle &tri = obj.triangles[i];
+                growBounds(tri, piece_min, piece_max);
+
+                const uint32_t flat = arrays.object_offsets[obj_id] + i;
+                areas[flat] = glm::length(glm::cross(tri.u, tri.v));
+                order[object_slots[obj_id] + i] = flat;
+            }
+            std::lock_guard<std::mutex> guard(bounds_lock);
+            bb_min = glm::min(bb_min, piece_min);
+            bb_max = glm::max(bb_max, piece_max);
+        });
+    }
+
+    // a total order, equal areas would otherwise land in slots depending on how the sort was split over the threads
+    TaskScheduler::parallelSort(order.begin() + light_sources, order.end(), [&areas](uint32_t a, uint32_t b) {
+        return areas[a] != areas[b] ? areas[a] > areas[b] : a < b;
+    });
+
+    arrays.slots.resize(triangle_count);
+    for (uint32_t slot = 0; slot < triangle_count; slot++)
+        arrays.slots[order[slot]] = slot;
+    arrays.lights = light_sources;
+    arrays.bb_min = bb_min;
+    arrays.bb_max = bb_max;
+    return order;
+}
+
+const Triangle &SceneGeometry::flatTriangle(const st_triangle_arrays &arrays, uint32_t flat) const {
+    const uint32_t obj_id = std::upper_bound(arrays.object_offsets.begin(), arrays.object_offsets.end(), flat) - arrays.object_offsets.begin() - 1;
+    return objects[obj_id].triangles[flat - arrays.object_offsets[obj_id]];
+}
+
+void SceneGeometry::buildTriangleArrays(st_triangle_arrays &arrays) const {
+    const std::vector<uint32_t> order = orderTriangles(arrays);
+
+    arrays.models.clear();
+    arrays.shadings.clear();
+    arrays.models.reserve(order.size());
+    arrays.shadings.reserve(order.size());
+    for (const uint32_t flat : order) {
+        const Triangle &tri = flatTriangle(arrays, flat);
+        arrays.models.emplace_back(tri.true_normal, tri.position, tri.u, tri.v);
+        arrays.shadings.emplace_back(tri.material_id, tri.normals, tri.tangents, tri.tex_p, tri.tex_u, tri.tex_v);
+    }
+}
+
+void SceneGeometry::bounds(glm::fvec3 &bb_min, glm::fvec3 &bb_max) const {
+    bb_min = glm::fvec3(INFINITY);
+    bb_max = glm::fvec3(-INFINITY);
+    for (const Object &obj: objects) {
+        for (const Triangle &tri: obj.triangles)
+            growBounds(tri, bb_min, bb_max);
+    }
+}
+
+void SceneGeometry::transformObject(uint32_t object_id, const glm::fmat4 &transform) {
+    const glm::fmat3 linear(transform);
+    const glm::fmat3 normal_matrix = glm::transpose(glm::inverse(linear));
+
+    for (Triangle &tri: objects[object_id].triangles) {
+        tri.position = glm::fvec3(transform * glm::fvec4(tri.position, 1.0f));
+        tri.u = linear * tri.u;
+        tri.v = linear * tri.v;
+        for (int i=0; i < 3; i++) {
+            tri.normals[i] = glm::normalize(normal_matrix * tri.normals[i]);
+            tri.tangents[i] = glm::normalize(linear * tri.tangents[i]);
+        }
+        tri.true_normal = glm::cross(tri.u, tri.v);
+    }
+}
+
+int SceneGeometry::findObject(const std::string &name) const {
+    for (uint32_t i = 0; i < objects.size(); i++) {
+        if (objects[i].name == name)
+            return (int)i;
+    }
+    return -1;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "Material.hpp"
+#include "3Dobjects.hpp"
+
+
+// Triangles in the order of the tracer: light sources first, then by descending area, or the leaves of a quality BVH.
+// The Scene streams models and shadings to the GPU and keeps them empty.
+struct st_triangle_arrays {
+    std::vector<TriangleModel> models;
+    std::vector<TriangleShading> shadings;
+    // slots[object_offsets[object] + i] is the index of the i-th triangle of object in models and shadings
+    std::vector<uint32_t> object_offsets;
+    std::vector<uint32_t> slots;
+    uint32_t lights{ 0 };
+    glm::fvec3 bb_min{ 0.0f };
+    glm::fvec3 bb_max{ 0.0f };
+};
+
+
+// CPU side scene description, loaded without any GL context
+class SceneGeometry {
+public:
+    bool addWavefrontModel(const std::string &model_name);
+
+    void buildTriangleArrays(st_triangle_arrays &arrays) const;
+    /*
+        Only the tracer order of buildTriangleArrays: fills everything but models and shadings
+        and returns the flat index of the triangle at each slot, for uploads in pieces.
+    */
+    std::vector<uint32_t> orderTriangles(st_triangle_arrays &arrays) const;
+    // Triangle at a flat index (object offset + triangle) of arrays
+    const Triangle &flatTriangle(const st_triangle_arrays &arrays, uint32_t flat) const;
+    void bounds(glm::fvec3 &bb_min, glm::fvec3 &bb_max) const;
+
+    // Applies an affine transformation to all triangles of the object, including normals and tangents
+    void transformObject(uint32_t object_id, const glm::fmat4 &transform);
+
+    int findObject(const std::string &name) const;
+
+    inline Object &getObject(std::string &&name) {
+        return objects.emplace_back(std::move(name));
+    }
+
+    inline int getMaterialIndex(const std::string &name) const {
+        if (!material_indices.contains(name))
+            return -1;
+
+        return material_indices.at(name);
+    }
+
+    inline Material &getMaterial(const std::string &name) {
+        if (material_indices.contains(name))
+            return materials[material_indices.at(name)];
+
+        material_indices[name] = (int)materials.size();
+        return materials.emplace_back();
+    }
+
+    inline bool isLight(const Object &obj) const {
+        const glm::fvec3 light = materials[obj.material_index].emission_ior;
+        return glm::dot(light, light) > 0.0f;
+    }
+
+    inline uint32_t triangleCount() const {
+        uint32_t count = 0;
+        for (const Object &obj: objects)
+            count += obj.triangles.size();
+        return count;
+    }
+
+    std::vector<Object> objects;
+    std::vector<Material> materials;
+    std::unordered_map<std::string, int> material_indices;
+
+private:
+    bool readWFMaterial(const std::string &material_name);
+};
@@ -1,25 +1,27 @@
 #include "Shader.hpp"
+#include "ProgramCache.hpp"
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <utility>
 
 
-bool loadShaderProgram(const std::string&& filename, GLint shaderType, GLuint &shaderID) {
-    std::string sourceCode;
+bool readShaderSource(const std::string &filename, std::string &sourceCode) {
     std::ifstream shaderFile(filename);
+    if (!shaderFile)
+        return false;
 
-    if (shaderFile) {
-        std::stringstream sourceStringStream;
-        sourceStringStream << shaderFile.rdbuf();
-
-        shaderFile.close();
+    std::stringstream sourceStringStream;
+    sourceStringStream << shaderFile.rdbuf();
+    shaderFile.close();
 
-        sourceCode = sourceStringStream.str();
-    } else {
-        return false;
-    }
+    sourceCode = sourceStringStream.str();
+    return true;
+}
 
+bool compileShaderSource(const std::string &filename, const std::string &sourceCode, GLint shaderType, GLuint &shaderID) {
     int success;
     char infoLog[1024];
 
@@ -39,6 +41,14 @@ bool loadShaderProgram(const std::string&& filename, GLint shaderType, GLuint &s
     return true;
 }
 
+bool loadShaderProgram(const std::string&& filename, GLint shaderType, GLuint &shaderID) {
+    std::string sourceCode;
+    if (!readShaderSource(filename, sourceCode))
+        return false;
+
+    return compileShaderSource(filename, sourceCode, shaderType, shaderID);
+}
+
 
 
 
@@ -61,51 +71,28 @@ bool Shader::Reload() noexcept {
 bool Shader::Load() noexcept {
     std::cout << "[  INFO  ][Shader ] Create Shader: " << m_shaderName << " - ";
 
-    GLuint vertexID(0), fragmentID(0), geometryID(0), computeID(0);
-    bool hasVertex   = loadShaderProgram(m_shaderName + ".vs", GL_VERTEX_SHADER, vertexID);
-    bool hasFragment = loadShaderProgram(m_shaderName + ".fs", GL_FRAGMENT_SHADER, fragmentID);
-    bool hasGeometry = loadShaderProgram(m_shaderName + ".gs", GL_GEOMETRY_SHADER, geometryID);
-    bool hasCompute = loadShaderProgram(m_shaderName + ".cs", GL_COMPUTE_SHADER, computeID);
+    static constexpr std::pair<const char*, GLint> extensions[] = {
+        { ".vs", GL_VERTEX_SHADER },
+        { ".fs", GL_FRAGMENT_SHADER },
+        { ".gs", GL_GEOMETRY_SHADER },
+        { ".cs", GL_COMPUTE_SHADER }
+    };
+
+    std::vector<ShaderStage> stages;
+    for (const auto &[extension, type] : extensions) {
+        const std::string filename = m_shaderName + extension;
+        if (std::ifstream(filename))
+            stages.push_back({ filename, type });
+    }
 
     std::cout << '\n';
 
     // no shader source found
-    if (!hasVertex && !hasFragment && !hasGeometry && !hasCompute)
+    if (stages.empty())
         return false;
 
-    // Create and Link the Shader Program, attach and delete available Shaders
     m_programID = glCreateProgram();
-
-    if (hasVertex)
-        glAttachShader(m_programID, vertexID);
-    if (hasFragment)
-        glAttachShader(m_programID, fragmentID);
-    if (hasGeometry)
-        glAttachShader(m_programID, geometryID);
-    if (hasCompute)
-        glAttachShader(m_programID, computeID);
-
-    glLinkProgram(m_programID);
-
-    if (hasVertex)
-        glDeleteShader(vertexID);
-    if (hasFragment)
-        glDeleteShader(fragmentID);
-    if (hasGeometry)
-        glDeleteShader(geometryID);
-    if (hasCompute)
-        glDeleteShader(computeID);
-
-    int success;
-    char infoLog[1024];
-    glGetProgramiv(m_programID, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(m_programID, 1024, nullptr, infoLog);
-        std::cout << "[ ERROR  ][Shader ] Link:" << std::endl << infoLog << std::endl;
-        return false;
-    }
-
-    return true;
+    return linkProgramCached(m_programID, stages);
 }
 
 void Shader::setBool(std::string_view name, bool value) noexcept {
@@ -12,6 +12,8 @@
 #include "glm/glm.hpp"
 #endif
 
+bool readShaderSource(const std::string &filename, std::string &sourceCode);
+bool compileShaderSource(const std::string &filename, const std::string &sourceCode, GLint shaderType, GLuint &shaderID);
 bool loadShaderProgram(const std::string&& filename, GLint shaderType, GLuint &shaderID);
 
 
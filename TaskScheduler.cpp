@@ -0,0 +1,239 @@
+#include "TaskScheduler.hpp"
+#include "Timeline.hpp"
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <string>
+#include <cstdlib>
+#include <condition_variable>
+
+
+namespace {
+
+    // finishes its group itself, see TaskGroup::run
+    using st_task = std::function<void()>;
+
+    struct st_task_queue {
+        std::mutex lock;
+        std::deque<st_task> tasks;
+    };
+
+    // one queue per worker, the last one is shared by all other threads
+    std::vector<std::unique_ptr<st_task_queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<uint32_t> queued{ 0 };
+    std::atomic<bool> stopping{ false };
+    std::atomic<bool> initialized{ false };
+    std::mutex poolLock;
+
+    // sleeping workers and waiting groups, taken around every wake up so none is missed
+    std::mutex sleepLock;
+    std::condition_variable wake;
+
+    std::thread::id mainThread;
+    std::mutex mainLock;
+    std::vector<std::function<void()>> mainTasks;
+    std::atomic<uint32_t> mainQueued{ 0 };
+
+    thread_local int localQueue{ -1 };
+    thread_local uint32_t stealSeed{ 0 };
+
+    void notify(bool all) {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        if (all)
+            wake.notify_all();
+        else
+            wake.notify_one();
+    }
+
+    bool takeTask(st_task &task) {
+        if (queues.empty())
+            return false;
+
+        if (localQueue >= 0) {
+            st_task_queue &own = *queues[localQueue];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+
+        // victims from a random start, so thieves spread over the workers
+        stealSeed = stealSeed * 1664525u + 1013904223u;
+        const size_t count = queues.size();
+        const size_t start = (stealSeed >> 8) % count;
+        for (size_t i = 0; i < count; i++) {
+            const size_t victim = (start + i) % count;
+            if ((int)victim == localQueue)
+                continue;
+            st_task_queue &queue = *queues[victim];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int index) {
+        localQueue = index;
+        stealSeed = (uint32_t)index * 2654435761u + 1u;
+        const std::string name = "Worker " + std::to_string(index + 1);
+        Timeline::setThreadName(name.c_str());
+
+        st_task task;
+        while (!stopping) {
+            if (takeTask(task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepLock);
+            wake.wait(lock, []() { return queued > 0 || stopping; });
+        }
+        localQueue = -1;
+    }
+
+    void startWorkers(unsigned threads) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        const unsigned worker_count = threads - 1;
+        queues.clear();
+        for (unsigned i = 0; i <= worker_count; i++)
+            queues.push_back(std::make_unique<st_task_queue>());
+        stopping = false;
+        for (unsigned i = 0; i < worker_count; i++)
+            workers.emplace_back(workerLoop, (int)i);
+    }
+
+    void stopWorkers() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+            wake.notify_all();
+        }
+        for (std::thread &worker : workers)
+            worker.join();
+        workers.clear();
+        queues.clear();
+    }
+
+    void ensureInitialized() {
+        if (initialized)
+            return;
+        std::lock_guard<std::mutex> guard(poolLock);
+        if (initialized)
+            return;
+        mainThread = std::this_thread::get_id();
+        startWorkers(0);
+        initialized = true;
+        // joined before the static thread list is destroyed
+        std::atexit(TaskScheduler::shutdown);
+    }
+
+}
+
+
+void TaskGroup::run(std::function<void()> task) {
+    ensureInitialized();
+    m_pending++;
+    // the main thread is counted as a thread, without workers it runs everything itself
+    st_task_queue &queue = *queues[localQueue >= 0 ? localQueue : queues.size() - 1];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.emplace_back([this, task = std::move(task)]() {
+            task();
+            if (--m_pending == 0)
+                notify(true);
+        });
+    }
+    queued++;
+    notify(false);
+}
+
+void TaskGroup::wait() {
+    const bool main = TaskScheduler::isMainThread();
+    st_task task;
+    while (m_pending > 0) {
+        if (main && mainQueued > 0)
+            TaskScheduler::runMainTasks();
+        if (takeTask(task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepLock);
+        wake.wait(lock, [this, main]() { return m_pending == 0 || queued > 0 || (main && mainQueued > 0); });
+    }
+    // handed back by the last tasks of the group
+    if (main && mainQueued > 0)
+        TaskScheduler::runMainTasks();
+}
+
+
+void TaskScheduler::initialize(unsigned threads) {
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (initialized)
+        stopWorkers();
+    else
+        std::atexit(TaskScheduler::shutdown);
+    mainThread = std::this_thread::get_id();
+    startWorkers(threads);
+    initialized = true;
+}
+
+void TaskScheduler::shutdown() {
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (!initialized)
+        return;
+    stopWorkers();
+    initialized = false;
+}
+
+unsigned TaskScheduler::threads() {
+    ensureInitialized();
+    return (unsigned)workers.size() + 1;
+}
+
+void TaskScheduler::setThreads(unsigned threads) {
+    ensureInitialized();
+    std::lock_guard<std::mutex> guard(poolLock);
+    stopWorkers();
+    startWorkers(threads);
+}
+
+bool TaskScheduler::isMainThread() {
+    ensureInitialized();
+    return std::this_thread::get_id() == mainThread;
+}
+
+void TaskScheduler::runOnMain(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(mainLock);
+        mainTasks.push_back(std::move(task));
+        mainQueued++;
+    }
+    notify(true);
+}
+
+size_t TaskScheduler::runMainTasks() {
+    if (mainQueued == 0)
+        return 0;
+
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> guard(mainLock);
+        tasks.swap(mainTasks);
+        mainQueued = 0;
+    }
+    for (std::function<void()> &task : tasks)
+        task();
+    return tasks.size();
+}
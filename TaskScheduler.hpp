@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+
+
+/*
+    Tasks waited for together. Waiting runs queued tasks of any group until all of this group are done,
+    on the main thread also the tasks handed back with TaskScheduler::runOnMain.
+*/
+class TaskGroup {
+public:
+    TaskGroup() = default;
+    ~TaskGroup() { wait(); }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup &operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    std::atomic<uint32_t> m_pending{ 0 };
+};
+
+
+/*
+    Work stealing thread pool shared by all CPU stages. Every worker has a deque, it pushes and pops its own
+    tasks at the back and idle workers steal from the front of the others, tasks of other threads go to a shared
+    queue. Parallel loops split their range in halves, so a thief takes the largest piece left.
+    The main thread (the GL thread) only runs tasks while it waits and is counted as one of the threads.
+*/
+class TaskScheduler {
+public:
+    // threads 0 uses all cores, the calling thread becomes the main thread
+    static void initialize(unsigned threads = 0);
+    static void shutdown();
+    // Workers and the main thread, initializes with all cores on first use
+    [[nodiscard]] static unsigned threads();
+    // Replaces the workers, only while no task is queued
+    static void setThreads(unsigned threads);
+
+    [[nodiscard]] static bool isMainThread();
+    // Queues task for the main thread, run by its next TaskGroup::wait() or runMainTasks()
+    static void runOnMain(std::function<void()> task);
+    static size_t runMainTasks();
+
+    // body(first, last) for pieces of [begin, end) of about grain elements
+    template<typename Body>
+    static void parallelFor(size_t begin, size_t end, size_t grain, const Body &body) {
+        if (end <= begin)
+            return;
+        grain = std::max<size_t>(grain, 1);
+        if (end - begin <= grain || threads() == 1) {
+            body(begin, end);
+            return;
+        }
+        TaskGroup group;
+        splitRange(group, begin, end, grain, body);
+        group.wait();
+    }
+
+    /*
+        Unstable sort like std::sort: pieces sorted in parallel, then merged pairwise in rounds,
+        each merge split at the median of the longer half and a binary search in the other.
+    */
+    template<typename Iterator, typename Compare>
+    static void parallelSort(Iterator first, Iterator last, Compare compare) {
+        using Value = typename std::iterator_traits<Iterator>::value_type;
+        const size_t count = last - first;
+        const size_t pieces = std::min<size_t>(threads() * 4, count / SORT_GRAIN);
+        if (pieces <= 1) {
+            std::sort(first, last, compare);
+            return;
+        }
+
+        std::vector<size_t> bounds(pieces + 1);
+        for (size_t i = 0; i <= pieces; i++)
+            bounds[i] = count * i / pieces;
+        parallelFor(0, pieces, 1, [&](size_t p_first, size_t p_last) {
+            for (size_t p = p_first; p < p_last; p++)
+                std::sort(first + bounds[p], first + bounds[p + 1], compare);
+        });
+
+        // ping pong between the range and a buffer
+        std::vector<Value> buffer(count);
+        bool in_buffer = false;
+        while (bounds.size() > 2) {
+            std::vector<size_t> merged;
+            TaskGroup group;
+            for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+                const size_t a = bounds[i];
+                const size_t b = bounds[i + 1];
+                const size_t c = (i + 2 < bounds.size()) ? bounds[i + 2] : b;
+                merged.push_back(a);
+                group.run([=, &buffer, &group]() {
+                    if (in_buffer)
+                        parallelMerge(group, buffer.begin() + a, buffer.begin() + b, buffer.begin() + b, buffer.begin() + c, first + a, compare);
+                    else
+                        parallelMerge(group, first + a, first + b, first + b, first + c, buffer.begin() + a, compare);
+                });
+            }
+            merged.push_back(count);
+            group.wait();
+            bounds = std::move(merged);
+            in_buffer = !in_buffer;
+        }
+        if (in_buffer) {
+            parallelFor(0, count, SORT_GRAIN, [&](size_t c_first, size_t c_last) {
+                std::move(buffer.begin() + c_first, buffer.begin() + c_last, first + c_first);
+            });
+        }
+    }
+
+private:
+    static constexpr size_t SORT_GRAIN = 16384;
+
+    template<typename Body>
+    static void splitRange(TaskGroup &group, size_t begin, size_t end, size_t grain, const Body &body) {
+        while (end - begin > grain) {
+            const size_t middle = begin + (end - begin) / 2;
+            group.run([&group, middle, end, grain, &body]() { splitRange(group, middle, end, grain, body); });
+            end = middle;
+        }
+        body(begin, end);
+    }
+
+    template<typename InIterator, typename OutIterator, typename Compare>
+    static void parallelMerge(TaskGroup &group, InIterator a_first, InIterator a_last, InIterator b_first, InIterator b_last,
+                              OutIterator out, Compare compare)
+    {
+        while ((size_t)((a_last - a_first) + (b_last - b_first)) > SORT_GRAIN) {
+            // the longer half is split, so both parts shrink
+            if (a_last - a_first < b_last - b_first) {
+                std::swap(a_first, b_first);
+                std::swap(a_last, b_last);
+            }
+            const InIterator a_middle = a_first + (a_last - a_first) / 2;
+            const InIterator b_middle = std::lower_bound(b_first, b_last, *a_middle, compare);
+            const OutIterator out_middle = out + (a_middle - a_first) + (b_middle - b_first);
+            group.run([=, &group]() { parallelMerge(group, a_middle, a_last, b_middle, b_last, out_middle, compare); });
+            a_last = a_middle;
+            b_last = b_middle;
+        }
+        std::merge(std::make_move_iterator(a_first), std::make_move_iterator(a_last),
+                   std::make_move_iterator(b_first), std::make_move_iterator(b_last), out, compare);
+    }
+};
@@ -0,0 +1,22 @@
+#include "TempFile.hpp"
+#include <atomic>
+#include <cstdint>
+
+#ifdef __linux__
+#include <unistd.h>
+#elif _WIN32
+#include <process.h>
+#endif
+
+
+std::string temporaryPath(const std::string &name) {
+    static std::atomic<uint32_t> counter{ 0 };
+#ifdef __linux__
+    const long pid = (long)getpid();
+#elif _WIN32
+    const long pid = (long)_getpid();
+#else
+    const long pid = 0;
+#endif
+    return name + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+}
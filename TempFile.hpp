@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+
+/*
+    Name of a temporary file next to name, unique to the process and the call. Caches shared by the viewer,
+    the daemon and the workers on one host are written to it and renamed over name, so concurrent writers
+    of the same file never write into the same temporary file.
+*/
+std::string temporaryPath(const std::string &name);
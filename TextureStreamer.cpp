@@ -0,0 +1,618 @@
+#include "TextureStreamer.hpp"
+#include "TaskScheduler.hpp"
+#include "ImageIO.hpp"
+#include "Timeline.hpp"
+#include "TempFile.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <cstring>
+#include <bit>
+
+
+namespace {
+
+    const char *CACHE_DIRECTORY = "./res/cache/";
+    const char *MAP_SUFFIXES[TextureStreamer::MAPS] = { "_albedo.exr", "_normal.exr", "_arm.exr" };
+    constexpr size_t PAGE_WORDS = TextureStreamer::PAGE_BYTES / sizeof(uint32_t);
+    constexpr size_t SLOT_WORDS = (size_t)TextureStreamer::SLOT_SIZE * TextureStreamer::SLOT_SIZE;
+    constexpr uint32_t SLOTS_PER_LAYER = TextureStreamer::SLOT_GRID * TextureStreamer::SLOT_GRID;
+    // the largest maps have 4096 pages per side, the page table offsets stay in 32 bits
+    constexpr uint32_t MAX_LEVELS = 13;
+
+#pragma pack(push, 1)
+    struct st_PAGE_FILE_HEADER {
+        char magic[4]{ 'G', 'R', 'P', 'G' };
+        uint32_t version{ 1 };
+        uint64_t hash{ 0 };
+        uint32_t size{ 0 };
+        uint32_t levels{ 0 };
+        uint32_t page_size{ TextureStreamer::PAGE_SIZE };
+        uint32_t page_border{ TextureStreamer::PAGE_BORDER };
+    };
+#pragma pack(pop)
+    // Followed by the pages of all mips from fine to coarse, each the slot rows of the albedo, normal and ARM map
+
+    // Pages of the mips finer than mip, the same sum as pageEntry() in raytracer.glsl
+    uint32_t pagesBefore(uint32_t levels, uint32_t mip) {
+        return ((1u << 2u*levels) - (1u << 2u*(levels - mip))) / 3u;
+    }
+
+    // Unsigned float with a 5 bit exponent like half floats, negative values and NaN become 0
+    uint32_t packUnsignedFloat(float value, uint32_t mantissa_bits) {
+        if (!(value > 0.0f))
+            return 0;
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        const int exponent = (int)(bits >> 23) - 127 + 15;
+        const uint32_t max_finite = (31u << mantissa_bits) - 1u;
+        if (exponent >= 31)
+            return max_finite;
+
+        uint32_t rebased;
+        if (exponent > 0) {
+            rebased = (uint32_t)exponent << 23 | (bits & 0x7FFFFFu);
+        } else {
+            // denormal, the implicit one moves into the mantissa
+            const uint32_t denormal_shift = 1 - exponent;
+            if (denormal_shift > 24)
+                return 0;
+            rebased = (0x800000u | (bits & 0x7FFFFFu)) >> denormal_shift;
+        }
+        // rounded to nearest, a carry moves into the exponent
+        const uint32_t shift = 23 - mantissa_bits;
+        return std::min((rebased + (1u << (shift - 1))) >> shift, max_finite);
+    }
+
+    // GL_UNSIGNED_INT_10F_11F_11F_REV, the layout of GL_R11F_G11F_B10F
+    uint32_t packR11G11B10(const glm::fvec4 &color) {
+        return packUnsignedFloat(color.r, 6) | packUnsignedFloat(color.g, 6) << 11 | packUnsignedFloat(color.b, 5) << 22;
+    }
+
+    // FNV-1a over size and modification time of the source maps
+    bool hashSources(const std::string &name, uint64_t &hash) {
+        hash = 1469598103934665603ull;
+        const auto mix = [&hash](const void *data, size_t bytes) {
+            const unsigned char *p = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < bytes; i++)
+                hash = (hash ^ p[i]) * 1099511628211ull;
+        };
+        for (const char *suffix : MAP_SUFFIXES) {
+            std::error_code ec;
+            const std::filesystem::path source(name + suffix);
+            const uint64_t bytes = std::filesystem::file_size(source, ec);
+            if (ec)
+                return false;
+            const int64_t modified = std::filesystem::last_write_time(source, ec).time_since_epoch().count();
+            if (ec)
+                return false;
+            mix(&bytes, sizeof(bytes));
+            mix(&modified, sizeof(modified));
+        }
+        return true;
+    }
+
+    bool readPageFile(const std::string &filename, uint64_t hash, st_material_pages &pages) {
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        const uint64_t bytes = (uint64_t)file.tellg();
+        file.seekg(0);
+
+        const st_PAGE_FILE_HEADER expected;
+        st_PAGE_FILE_HEADER header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version ||
+            header.hash != hash || header.page_size != expected.page_size || header.page_border != expected.page_border ||
+            header.levels == 0 || header.levels > MAX_LEVELS || header.size != TextureStreamer::PAGE_SIZE << (header.levels - 1))
+            return false;
+
+        // an interrupted build is shorter
+        if (bytes != sizeof(header) + (uint64_t)pagesBefore(header.levels, header.levels) * TextureStreamer::PAGE_BYTES)
+            return false;
+        pages.size = header.size;
+        pages.levels = header.levels;
+        return true;
+    }
+
+    bool readPage(const std::string &filename, uint64_t offset, std::vector<uint32_t> &texels) {
+        std::ifstream file(filename, std::ios::binary);
+        texels.resize(PAGE_WORDS);
+        return file.seekg((std::streamoff)offset) && file.read(reinterpret_cast<char*>(texels.data()), TextureStreamer::PAGE_BYTES);
+    }
+
+    // Slot of page (page_x, page_y) of every map of a mip with size^2 texels, the border wraps around like GL_REPEAT
+    void cutPage(const glm::fvec4 *const *maps, uint32_t size, uint32_t page_x, uint32_t page_y, uint32_t *slot) {
+        constexpr int BORDER = (int)TextureStreamer::PAGE_BORDER;
+        for (uint32_t map = 0; map < TextureStreamer::MAPS; map++) {
+            for (int y = 0; y < (int)TextureStreamer::SLOT_SIZE; y++) {
+                const uint32_t source_y = (uint32_t)((int)(page_y * TextureStreamer::PAGE_SIZE) + y - BORDER + (int)size) % size;
+                const glm::fvec4 *row = maps[map] + (size_t)source_y * size;
+                for (int x = 0; x < (int)TextureStreamer::SLOT_SIZE; x++) {
+                    const uint32_t source_x = (uint32_t)((int)(page_x * TextureStreamer::PAGE_SIZE) + x - BORDER + (int)size) % size;
+                    *slot++ = packR11G11B10(row[source_x]);
+                }
+            }
+        }
+    }
+
+    /*
+        Decodes the maps in parallel and writes all pages of a mip at once, cut in parallel,
+        before the next mip is filtered from it.
+    */
+    bool buildPageFile(const std::string &name, const std::string &filename, uint64_t hash, st_material_pages &pages) {
+        TIMELINE_ZONE("buildPageFile", name);
+        st_exr_image images[TextureStreamer::MAPS];
+        bool decoded[TextureStreamer::MAPS]{};
+        {
+            TaskGroup group;
+            for (uint32_t map = 0; map < TextureStreamer::MAPS; map++)
+                group.run([&, map]() { decoded[map] = decodeEXR(name + MAP_SUFFIXES[map], images[map]); });
+        }
+        if (!decoded[0] || !decoded[1] || !decoded[2])
+            return false;
+
+        const int size = images[0].width;
+        bool valid = size >= (int)TextureStreamer::PAGE_SIZE && std::has_single_bit((uint32_t)size)
+                  && (uint32_t)size <= TextureStreamer::PAGE_SIZE << (MAX_LEVELS - 1);
+        for (const st_exr_image &image : images)
+            valid &= image.width == size && image.height == size;
+        if (!valid) {
+            std::cerr << "[ ERROR  ][Stream ] " << name << ": the maps have to be squares of the same power of two size of "
+                      << TextureStreamer::PAGE_SIZE << " to " << (TextureStreamer::PAGE_SIZE << (MAX_LEVELS - 1)) << " texels\n";
+            return false;
+        }
+        pages.size = (uint32_t)size;
+        pages.levels = (uint32_t)std::countr_zero(pages.size / TextureStreamer::PAGE_SIZE) + 1;
+
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), ec);
+        // renamed once complete, a worker building the same page file at the same time writes its own
+        const std::string tmp_name = temporaryPath(filename);
+        std::ofstream file(tmp_name, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+        st_PAGE_FILE_HEADER header;
+        header.hash = hash;
+        header.size = pages.size;
+        header.levels = pages.levels;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::vector<glm::fvec4> levels[TextureStreamer::MAPS];
+        const glm::fvec4 *maps[TextureStreamer::MAPS];
+        for (uint32_t map = 0; map < TextureStreamer::MAPS; map++)
+            maps[map] = reinterpret_cast<const glm::fvec4*>(images[map].pixels.get());
+
+        std::vector<uint32_t> slots;
+        for (uint32_t mip = 0; mip < pages.levels; mip++) {
+            const uint32_t mip_size = pages.size >> mip;
+            const uint32_t row = mip_size / TextureStreamer::PAGE_SIZE;
+            slots.resize((size_t)row * row * PAGE_WORDS);
+            TaskScheduler::parallelFor(0, (size_t)row * row, 1, [&](size_t first, size_t last) {
+                for (size_t page = first; page < last; page++)
+                    cutPage(maps, mip_size, (uint32_t)(page % row), (uint32_t)(page / row), &slots[page * PAGE_WORDS]);
+            });
+            file.write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(uint32_t));
+            if (mip + 1 == pages.levels)
+                break;
+
+            // box filtered, the normal map is normalized by the lookups
+            const uint32_t next_size = mip_size / 2;
+            for (uint32_t map = 0; map < TextureStreamer::MAPS; map++) {
+                std::vector<glm::fvec4> next((size_t)next_size * next_size);
+                const glm::fvec4 *source = maps[map];
+                TaskScheduler::parallelFor(0, next_size, 64, [&](size_t first, size_t last) {
+                    for (size_t y = first; y < last; y++) {
+                        const glm::fvec4 *upper = source + 2 * y * mip_size;
+                        const glm::fvec4 *lower = upper + mip_size;
+                        for (size_t x = 0; x < next_size; x++)
+                            next[y * next_size + x] = (upper[2*x] + upper[2*x + 1] + lower[2*x] + lower[2*x + 1]) * 0.25f;
+                    }
+                });
+                levels[map] = std::move(next);
+                maps[map] = levels[map].data();
+                images[map].pixels.reset();
+            }
+        }
+        file.close();
+        if (!file.fail())
+            std::filesystem::rename(tmp_name, filename, ec);
+        if (file.fail() || ec) {
+            std::filesystem::remove(tmp_name, ec);
+            return false;
+        }
+        return true;
+    }
+
+}
+
+
+TextureStreamer::TextureStreamer(uint32_t materials, size_t cache_bytes)
+    : m_materials(materials), m_pageFiles(materials)
+{
+    GLint max_layers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    const size_t groups = std::clamp<size_t>(cache_bytes / (PAGE_BYTES * SLOTS_PER_LAYER), 1, std::max(max_layers / (GLint)MAPS, 1));
+    m_slots.resize(groups * SLOTS_PER_LAYER);
+    for (uint32_t slot = (uint32_t)m_slots.size(); slot-- > 0;)
+        m_freeSlots.push_back(slot);
+    m_stats.slots = (uint32_t)m_slots.size();
+
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &m_cache);
+    glTextureStorage3D(m_cache, 1, GL_R11F_G11F_B10F, SLOT_GRID * SLOT_SIZE, SLOT_GRID * SLOT_SIZE, (GLsizei)(groups * MAPS));
+    glTextureParameteri(m_cache, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(m_cache, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(m_cache, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(m_cache, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(m_cache, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glCreateBuffers(1, &m_materialBuffer);
+    glNamedBufferStorage(m_materialBuffer, sizeof(st_material_pages) * std::max(materials, 1u), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glClearNamedBufferData(m_materialBuffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    resizeFeedback();
+
+    std::cout << "[  INFO  ][Stream ] Page cache: " << m_slots.size() << " pages, "
+              << m_slots.size() * PAGE_BYTES / 1048576 << " MB\n";
+
+    m_thread = std::thread(&TextureStreamer::run, this);
+}
+
+TextureStreamer::~TextureStreamer() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_signal.notify_all();
+    m_thread.join();
+
+    for (uint32_t i = 0; i < READBACKS; i++) {
+        if (m_fences[i])
+            glDeleteSync(m_fences[i]);
+        glUnmapNamedBuffer(m_readback[i]);
+    }
+    glDeleteBuffers(READBACKS, m_readback);
+    glDeleteBuffers(1, &m_feedback);
+    glDeleteBuffers(1, &m_pageTableBuffer);
+    glDeleteBuffers(1, &m_materialBuffer);
+    glDeleteTextures(1, &m_cache);
+}
+
+
+bool TextureStreamer::addMaterial(const std::string &name, uint32_t material_id) {
+    TIMELINE_ZONE("addMaterial", name);
+    if (material_id >= m_materials.size())
+        return false;
+
+    const std::string filename = CACHE_DIRECTORY + std::filesystem::path(name).filename().string() + ".pages";
+    st_material_pages pages;
+    uint64_t hash = 0;
+    const bool sources = hashSources(name, hash);
+    if (sources && readPageFile(filename, hash, pages)) {
+        std::cout << "[  INFO  ][Stream ] Loaded " << filename << '\n';
+    } else if (!buildPageFile(name, filename, sources ? hash : 0, pages)) {
+        return false;
+    } else {
+        std::cout << "[  INFO  ][Stream ] Built " << filename << '\n';
+    }
+
+    // A material loaded again gives up its pages, an unchanged layout keeps its entries
+    st_material_pages &current = m_materials[material_id];
+    const uint32_t entries = pagesBefore(pages.levels, pages.levels);
+    if (current.levels > 0) {
+        const uint32_t first = current.first_entry;
+        const uint32_t last = first + pagesBefore(current.levels, current.levels);
+        for (uint32_t slot = 0; slot < m_slots.size(); slot++) {
+            if (m_slots[slot].entry >= first && m_slots[slot].entry < last) {
+                m_pageTable[m_slots[slot].entry] = 0;
+                m_slots[slot] = st_cache_slot();
+                m_freeSlots.push_back(slot);
+            }
+        }
+        for (uint32_t entry = first; entry < last; entry++) {
+            m_pendingCount -= m_pending[entry];
+            m_pending[entry] = 0;
+        }
+        glNamedBufferSubData(m_pageTableBuffer, sizeof(uint32_t) * first, sizeof(uint32_t) * (last - first), &m_pageTable[first]);
+    }
+    if (current.levels == 0 || pages.levels != current.levels) {
+        pages.first_entry = (uint32_t)m_pageTable.size();
+        m_pageTable.resize(m_pageTable.size() + entries, 0);
+        m_pending.resize(m_pageTable.size(), 0);
+        resizeFeedback();
+    } else {
+        pages.first_entry = current.first_entry;
+    }
+    current = pages;
+    glNamedBufferSubData(m_materialBuffer, sizeof(st_material_pages) * material_id, sizeof(st_material_pages), &current);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pageFiles[material_id] = filename;
+    }
+
+    // the coarse mips every lookup can fall back to
+    std::vector<uint32_t> texels;
+    const uint32_t first_pinned = pages.levels - std::min(pages.levels, FALLBACK_LEVELS);
+    for (uint32_t local = pagesBefore(pages.levels, first_pinned); local < entries; local++) {
+        if (!readPage(filename, sizeof(st_PAGE_FILE_HEADER) + (uint64_t)local * PAGE_BYTES, texels) ||
+            !uploadPage(pages.first_entry + local, texels.data(), true))
+        {
+            std::cerr << "[ ERROR  ][Stream ] Cannot make the coarse mips of " << name << " resident\n";
+            return false;
+        }
+    }
+    bind();
+    return true;
+}
+
+
+void TextureStreamer::bind() const {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, m_materialBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, m_pageTableBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, m_feedback);
+}
+
+void TextureStreamer::update() {
+    TIMELINE_ZONE("streamTextures");
+    collect(false);
+    capture();
+    uploadArrived(UPLOADS_PER_UPDATE);
+}
+
+uint32_t TextureStreamer::settle() {
+    TIMELINE_ZONE("settlePages");
+    collect(true);
+    capture();
+    collect(true);
+
+    uint32_t loaded = 0;
+    while (m_pendingCount > 0) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_arrivedSignal.wait(lock, [this] { return !m_arrived.empty(); });
+        }
+        loaded += uploadArrived(0xFFFFFFFFu);
+    }
+    return loaded;
+}
+
+st_streaming_stats TextureStreamer::stats() const {
+    st_streaming_stats stats = m_stats;
+    stats.resident = (uint32_t)(m_slots.size() - m_freeSlots.size());
+    stats.pending = m_pendingCount;
+    return stats;
+}
+
+
+uint32_t TextureStreamer::materialOf(uint32_t entry) const {
+    for (uint32_t material = 0; material < m_materials.size(); material++) {
+        const st_material_pages &pages = m_materials[material];
+        if (pages.levels > 0 && entry >= pages.first_entry && entry - pages.first_entry < pagesBefore(pages.levels, pages.levels))
+            return material;
+    }
+    return NO_ENTRY;
+}
+
+uint32_t TextureStreamer::mipOf(uint32_t entry) const {
+    const st_material_pages &pages = m_materials[materialOf(entry)];
+    const uint32_t local = entry - pages.first_entry;
+    uint32_t mip = 0;
+    while (local >= pagesBefore(pages.levels, mip + 1))
+        mip++;
+    return mip;
+}
+
+uint32_t TextureStreamer::parentEntry(uint32_t entry) const {
+    const st_material_pages &pages = m_materials[materialOf(entry)];
+    const uint32_t mip = mipOf(entry);
+    if (mip + 1 >= pages.levels)
+        return NO_ENTRY;
+    const uint32_t row = 1u << (pages.levels - 1 - mip);
+    const uint32_t index = entry - pages.first_entry - pagesBefore(pages.levels, mip);
+    const uint32_t x = index % row;
+    const uint32_t y = index / row;
+    return pages.first_entry + pagesBefore(pages.levels, mip + 1) + (y / 2) * (row / 2) + x / 2;
+}
+
+
+void TextureStreamer::resizeFeedback() {
+    // the readbacks in flight have the old size
+    for (uint32_t i = 0; i < READBACKS; i++) {
+        if (m_fences[i]) {
+            glClientWaitSync(m_fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(m_fences[i]);
+            m_fences[i] = nullptr;
+        }
+        if (m_readback[i])
+            glUnmapNamedBuffer(m_readback[i]);
+    }
+    glDeleteBuffers(READBACKS, m_readback);
+    glDeleteBuffers(1, &m_feedback);
+    glDeleteBuffers(1, &m_pageTableBuffer);
+    m_head = m_tail = 0;
+
+    glCreateBuffers(1, &m_pageTableBuffer);
+    glNamedBufferStorage(m_pageTableBuffer, sizeof(uint32_t) * std::max<size_t>(m_pageTable.size(), 1), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glClearNamedBufferData(m_pageTableBuffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    if (!m_pageTable.empty())
+        glNamedBufferSubData(m_pageTableBuffer, 0, sizeof(uint32_t) * m_pageTable.size(), m_pageTable.data());
+
+    // one bit per page
+    m_feedbackBytes = sizeof(uint32_t) * std::max<size_t>((m_pageTable.size() + 31) / 32, 1);
+    glCreateBuffers(1, &m_feedback);
+    glNamedBufferStorage(m_feedback, m_feedbackBytes, nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glClearNamedBufferData(m_feedback, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+    constexpr GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(READBACKS, m_readback);
+    for (uint32_t i = 0; i < READBACKS; i++) {
+        glNamedBufferStorage(m_readback[i], m_feedbackBytes, nullptr, flags);
+        m_mapped[i] = static_cast<const uint32_t*>(glMapNamedBufferRange(m_readback[i], 0, m_feedbackBytes, flags));
+    }
+}
+
+void TextureStreamer::capture() {
+    const uint32_t slot = m_head % READBACKS;
+    if (m_head - m_tail == READBACKS || m_pageTable.empty())
+        return;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    glCopyNamedBufferSubData(m_feedback, m_readback[slot], 0, 0, m_feedbackBytes);
+    glClearNamedBufferData(m_feedback, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    m_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_head++;
+}
+
+void TextureStreamer::collect(bool wait) {
+    std::vector<uint32_t> missing;
+    while (m_tail != m_head) {
+        const uint32_t slot = m_tail % READBACKS;
+        if (glClientWaitSync(m_fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0) == GL_TIMEOUT_EXPIRED)
+            break;
+        glDeleteSync(m_fences[slot]);
+        m_fences[slot] = nullptr;
+        m_tail++;
+        m_update++;
+
+        // The wanted pages and their coarser mips, those are the fallback while a finer page is missing
+        const uint32_t *words = m_mapped[slot];
+        for (size_t word = 0; word < (size_t)m_feedbackBytes / sizeof(uint32_t); word++) {
+            for (uint32_t bits = words[word]; bits != 0; bits &= bits - 1) {
+                for (uint32_t entry = (uint32_t)word * 32 + std::countr_zero(bits); entry != NO_ENTRY; entry = parentEntry(entry)) {
+                    if (m_pageTable[entry] != 0) {
+                        m_slots[m_pageTable[entry] - 1].wanted = m_update;
+                    } else if (!m_pending[entry]) {
+                        m_pending[entry] = 1;
+                        m_pendingCount++;
+                        missing.push_back(entry);
+                    }
+                }
+            }
+        }
+    }
+    if (!missing.empty())
+        request(missing);
+}
+
+void TextureStreamer::request(const std::vector<uint32_t> &entries) {
+    // coarse first, every page arrives after the pages that stand in for it
+    std::vector<std::pair<uint32_t, uint32_t>> ordered;
+    for (const uint32_t entry : entries)
+        ordered.emplace_back(mipOf(entry), entry);
+    std::sort(ordered.begin(), ordered.end(), std::greater<>());
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto &[mip, entry] : ordered) {
+            const uint32_t material = materialOf(entry);
+            m_queue.push_back({ material, entry, sizeof(st_PAGE_FILE_HEADER) + (uint64_t)(entry - m_materials[material].first_entry) * PAGE_BYTES });
+        }
+    }
+    m_signal.notify_all();
+}
+
+uint32_t TextureStreamer::uploadArrived(uint32_t limit) {
+    std::vector<st_loaded_page> arrived;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t count = std::min<size_t>(limit, m_arrived.size());
+        std::move(m_arrived.begin(), m_arrived.begin() + count, std::back_inserter(arrived));
+        m_arrived.erase(m_arrived.begin(), m_arrived.begin() + count);
+    }
+
+    uint32_t uploaded = 0;
+    for (const st_loaded_page &page : arrived) {
+        // given up by a material loaded again
+        if (page.entry >= m_pending.size() || !m_pending[page.entry])
+            continue;
+        m_pending[page.entry] = 0;
+        m_pendingCount--;
+        if (page.texels.empty())
+            continue;
+        if (uploadPage(page.entry, page.texels.data(), false))
+            uploaded++;
+        else
+            m_stats.dropped++;
+    }
+    return uploaded;
+}
+
+bool TextureStreamer::uploadPage(uint32_t entry, const uint32_t *texels, bool pinned) {
+    const uint32_t slot = allocateSlot();
+    if (slot == NO_ENTRY)
+        return false;
+
+    const uint32_t cell = slot % SLOTS_PER_LAYER;
+    const GLint x = (GLint)((cell % SLOT_GRID) * SLOT_SIZE);
+    const GLint y = (GLint)((cell / SLOT_GRID) * SLOT_SIZE);
+    for (uint32_t map = 0; map < MAPS; map++) {
+        glTextureSubImage3D(m_cache, 0, x, y, (GLint)((slot / SLOTS_PER_LAYER) * MAPS + map), SLOT_SIZE, SLOT_SIZE, 1,
+                            GL_RGB, GL_UNSIGNED_INT_10F_11F_11F_REV, texels + map * SLOT_WORDS);
+    }
+
+    m_slots[slot] = { entry, m_update, pinned };
+    m_pageTable[entry] = slot + 1;
+    writeTableEntry(entry);
+    m_stats.uploaded++;
+    return true;
+}
+
+uint32_t TextureStreamer::allocateSlot() {
+    if (!m_freeSlots.empty()) {
+        const uint32_t slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        return slot;
+    }
+
+    // least recently wanted, the pages of the latest feedback stay
+    uint32_t victim = NO_ENTRY;
+    for (uint32_t slot = 0; slot < m_slots.size(); slot++) {
+        const st_cache_slot &candidate = m_slots[slot];
+        if (!candidate.pinned && candidate.wanted < m_update && (victim == NO_ENTRY || candidate.wanted < m_slots[victim].wanted))
+            victim = slot;
+    }
+    if (victim == NO_ENTRY)
+        return NO_ENTRY;
+
+    m_pageTable[m_slots[victim].entry] = 0;
+    writeTableEntry(m_slots[victim].entry);
+    m_slots[victim] = st_cache_slot();
+    m_stats.evicted++;
+    return victim;
+}
+
+void TextureStreamer::writeTableEntry(uint32_t entry) {
+    glNamedBufferSubData(m_pageTableBuffer, sizeof(uint32_t) * entry, sizeof(uint32_t), &m_pageTable[entry]);
+}
+
+
+void TextureStreamer::run() {
+    Timeline::setThreadName("Texture streaming");
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_signal.wait(lock, [this] { return !m_queue.empty() || m_quit; });
+        if (m_quit)
+            return;
+
+        const st_page_request request = m_queue.front();
+        m_queue.pop_front();
+        const std::string filename = m_pageFiles[request.material];
+        lock.unlock();
+
+        // a page that can't be read arrives empty and is requested again when still wanted
+        st_loaded_page page{ request.entry, {} };
+        {
+            TIMELINE_ZONE("readPage");
+            if (!readPage(filename, request.offset, page.texels)) {
+                std::cerr << "[WARNING ][Stream ] Cannot read a page of " << filename << '\n';
+                page.texels.clear();
+            }
+        }
+
+        lock.lock();
+        m_arrived.push_back(std::move(page));
+        m_arrivedSignal.notify_all();
+    }
+}
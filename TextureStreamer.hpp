@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <GL/glew.h>
+#elif _WIN32
+#include "GL/glew.h"
+#endif
+
+
+// Pages of a streamed material, raytracer.glsl and model.fs read it as MaterialPages
+struct st_material_pages {
+    // index of the first page of mip 0 in the page table, the mips follow from fine to coarse
+    uint32_t first_entry{ 0 };
+    // texels of mip 0 per side, levels 0 for materials that aren't streamed
+    uint32_t size{ 0 };
+    uint32_t levels{ 0 };
+    uint32_t padding{ 0 };
+};
+
+struct st_streaming_stats {
+    uint32_t slots{ 0 };
+    uint32_t resident{ 0 };
+    // requested and not resident yet
+    uint32_t pending{ 0 };
+    uint64_t uploaded{ 0 };
+    uint64_t evicted{ 0 };
+    // arrived while every slot held a page of the latest feedback, requested again when still wanted
+    uint64_t dropped{ 0 };
+};
+
+/*
+    Material textures streamed page by page (virtual texturing), for texture sets larger than VRAM.
+    The albedo, normal and ARM maps of a material are cut into pages of PAGE_SIZE^2 texels on every mip,
+    the three maps of a page share one slot of the page cache, a 2D array texture with SLOT_GRID^2 slots per layer.
+    The tracer and the raster preview mark the pages their lookups want in a feedback bitset. update() reads it
+    back without waiting (like TracerStats), queues the missing pages coarse first for the streaming thread,
+    which reads them from the page file of the material, and uploads arrived pages into the least recently
+    wanted slots. Lookups use the next coarser resident mip until a page arrives, the FALLBACK_LEVELS coarsest
+    mips of every material are pinned.
+*/
+class TextureStreamer {
+public:
+    static constexpr uint32_t PAGE_SIZE = 128;
+    // texels of the neighbouring pages around a page, bilinear filtering never leaves its slot
+    static constexpr uint32_t PAGE_BORDER = 1;
+    static constexpr uint32_t SLOT_SIZE = PAGE_SIZE + 2 * PAGE_BORDER;
+    static constexpr uint32_t SLOT_GRID = 16;
+    // albedo, normal, ARM
+    static constexpr uint32_t MAPS = 3;
+    static constexpr uint32_t FALLBACK_LEVELS = 2;
+    // pages uploaded by one update(), the rest waits for the next frame
+    static constexpr uint32_t UPLOADS_PER_UPDATE = 32;
+    // R11F_G11F_B10F texels of all maps of a page
+    static constexpr size_t PAGE_BYTES = (size_t)SLOT_SIZE * SLOT_SIZE * MAPS * sizeof(uint32_t);
+
+    // A page cache of about cache_bytes, at least one layer of slots
+    TextureStreamer(uint32_t materials, size_t cache_bytes);
+    ~TextureStreamer();
+
+    TextureStreamer(const TextureStreamer&) = delete;
+    TextureStreamer &operator=(const TextureStreamer&) = delete;
+
+    /*
+        Streams name_albedo.exr, name_normal.exr and name_arm.exr, squares of the same power of two size.
+        They are cut into a page file in res/cache on first use, the pinned mips are resident on return.
+    */
+    bool addMaterial(const std::string &name, uint32_t material_id);
+
+    // The page table, the feedback and the cache at the bindings of raytracer.glsl and model.fs
+    void bind() const;
+    // Reads finished feedback, captures the feedback of the dispatches so far and uploads arrived pages
+    void update();
+    // Waits until the pages of all feedback so far are resident and returns how many were loaded
+    uint32_t settle();
+
+    [[nodiscard]] inline GLuint cacheTexture() const noexcept { return m_cache; }
+    [[nodiscard]] st_streaming_stats stats() const;
+
+private:
+    static constexpr uint32_t READBACKS = 3;
+    static constexpr uint32_t NO_ENTRY = 0xFFFFFFFFu;
+
+    struct st_cache_slot {
+        uint32_t entry{ NO_ENTRY };
+        // update() that last found the page in the feedback
+        uint64_t wanted{ 0 };
+        bool pinned{ false };
+    };
+
+    struct st_page_request {
+        uint32_t material;
+        uint32_t entry;
+        // of the page in the page file
+        uint64_t offset;
+    };
+
+    struct st_loaded_page {
+        uint32_t entry;
+        std::vector<uint32_t> texels;
+    };
+
+    uint32_t materialOf(uint32_t entry) const;
+    // Entry of the page that covers the same texels on the next coarser mip, NO_ENTRY for the coarsest
+    uint32_t parentEntry(uint32_t entry) const;
+    uint32_t mipOf(uint32_t entry) const;
+
+    void resizeFeedback();
+    void capture();
+    // Reads the finished readbacks, all in flight if wait
+    void collect(bool wait);
+    void request(const std::vector<uint32_t> &entries);
+    // Uploads up to limit arrived pages, returns how many
+    uint32_t uploadArrived(uint32_t limit);
+    bool uploadPage(uint32_t entry, const uint32_t *texels, bool pinned);
+    uint32_t allocateSlot();
+    void writeTableEntry(uint32_t entry);
+
+    void run();
+
+    std::vector<st_material_pages> m_materials;
+    std::vector<std::string> m_pageFiles;
+    // slot + 1 of every page, 0 while not resident
+    std::vector<uint32_t> m_pageTable;
+    std::vector<uint8_t> m_pending;
+    std::vector<st_cache_slot> m_slots;
+    std::vector<uint32_t> m_freeSlots;
+    uint64_t m_update{ 1 };
+    uint32_t m_pendingCount{ 0 };
+    st_streaming_stats m_stats;
+
+    GLuint m_cache{ 0 };
+    GLuint m_materialBuffer{ 0 };
+    GLuint m_pageTableBuffer{ 0 };
+    GLuint m_feedback{ 0 };
+    GLsizeiptr m_feedbackBytes{ 0 };
+    GLuint m_readback[READBACKS]{};
+    const uint32_t *m_mapped[READBACKS]{};
+    GLsync m_fences[READBACKS]{};
+    uint32_t m_head{ 0 };
+    uint32_t m_tail{ 0 };
+
+    // shared with the streaming thread
+    std::mutex m_mutex;
+    std::condition_variable m_signal;
+    std::condition_variable m_arrivedSignal;
+    std::deque<st_page_request> m_queue;
+    std::vector<st_loaded_page> m_arrived;
+    bool m_quit{ false };
+    std::thread m_thread;
+};
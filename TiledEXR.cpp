@@ -0,0 +1,193 @@
+#include "TiledEXR.hpp"
+#include "TaskScheduler.hpp"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+
+// Little endian, like the rest of the file formats here
+template<typename T>
+static void writeValue(std::ofstream &file, const T &value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void writeAttribute(std::ofstream &file, const char *name, const char *type, const void *value, int32_t size) {
+    file.write(name, strlen(name) + 1);
+    file.write(type, strlen(type) + 1);
+    writeValue(file, size);
+    file.write(reinterpret_cast<const char*>(value), size);
+}
+
+
+TiledEXRWriter::~TiledEXRWriter() {
+    if (m_file.is_open())
+        close();
+}
+
+bool TiledEXRWriter::open(const std::string &filename, int width, int height, int tile_size) {
+    m_file.open(filename, std::ios::binary);
+    if (!m_file) {
+        std::cerr << "Cannot open " << filename << '\n';
+        return false;
+    }
+
+    m_width = width;
+    m_height = height;
+    m_tileSize = tile_size;
+    m_tilesX = (width + tile_size - 1) / tile_size;
+    m_tilesY = (height + tile_size - 1) / tile_size;
+    m_offsets.assign((size_t)m_tilesX * m_tilesY, 0);
+
+    // magic number and version 2 with the single part tiled flag
+    writeValue(m_file, (int32_t)20000630);
+    writeValue(m_file, (int32_t)(2 | 0x200));
+
+    // B, G, R, alphabetical as the format wants it: name, FLOAT, linear, reserved, sampling
+    std::vector<char> channels;
+    for (const char *name : { "B", "G", "R" }) {
+        channels.push_back(name[0]);
+        channels.push_back('\0');
+        const int32_t channel[4] = { 2, 0, 1, 1 };
+        const char *bytes = reinterpret_cast<const char*>(channel);
+        channels.insert(channels.end(), bytes, bytes + sizeof(channel));
+    }
+    channels.push_back('\0');
+    writeAttribute(m_file, "channels", "chlist", channels.data(), (int32_t)channels.size());
+
+    const uint8_t zip_compression = 3;
+    writeAttribute(m_file, "compression", "compression", &zip_compression, 1);
+    const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+    writeAttribute(m_file, "dataWindow", "box2i", window, sizeof(window));
+    writeAttribute(m_file, "displayWindow", "box2i", window, sizeof(window));
+    const uint8_t random_y = 2;
+    writeAttribute(m_file, "lineOrder", "lineOrder", &random_y, 1);
+    const float aspect = 1.0f;
+    writeAttribute(m_file, "pixelAspectRatio", "float", &aspect, sizeof(aspect));
+    const float center[2] = { 0.0f, 0.0f };
+    writeAttribute(m_file, "screenWindowCenter", "v2f", center, sizeof(center));
+    writeAttribute(m_file, "screenWindowWidth", "float", &aspect, sizeof(aspect));
+
+    // tile size and ONE_LEVEL with ROUND_DOWN
+    uint8_t tiles[9];
+    const uint32_t size = tile_size;
+    memcpy(tiles, &size, 4);
+    memcpy(tiles + 4, &size, 4);
+    tiles[8] = 0;
+    writeAttribute(m_file, "tiles", "tiledesc", tiles, sizeof(tiles));
+    m_file.put('\0');
+
+    m_tableOffset = m_file.tellp();
+    const std::vector<uint64_t> table(m_offsets.size(), 0);
+    m_file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(uint64_t));
+    return (bool)m_file;
+}
+
+/*
+    Chunk data of a width x height tile: scanline by scanline, the channels of a scanline one after the other,
+    ZIP compressed if that is smaller. Runs on any thread.
+*/
+static void encodeTile(const glm::fvec3 *pixels, int stride, int width, int height, std::vector<uint8_t> &chunk) {
+    // reused by every tile of the thread
+    thread_local std::vector<uint8_t> raw;
+    thread_local std::vector<uint8_t> predicted;
+
+    const size_t raw_size = (size_t)width * height * 3 * sizeof(float);
+    raw.resize(raw_size);
+    float *out = reinterpret_cast<float*>(raw.data());
+    for (int y = 0; y < height; y++) {
+        const glm::fvec3 *row = pixels + (size_t)y * stride;
+        for (int channel = 2; channel >= 0; channel--) {
+            for (int x = 0; x < width; x++)
+                *out++ = row[x][channel];
+        }
+    }
+
+    // ZIP: low and high bytes split, differences of neighbours, deflate
+    predicted.resize(raw_size);
+    uint8_t *even = predicted.data();
+    uint8_t *odd = predicted.data() + (raw_size + 1) / 2;
+    for (size_t i = 0; i < raw_size; i += 2) {
+        *even++ = raw[i];
+        if (i + 1 < raw_size)
+            *odd++ = raw[i + 1];
+    }
+    uint8_t previous = predicted[0];
+    for (size_t i = 1; i < raw_size; i++) {
+        const uint8_t value = predicted[i];
+        predicted[i] = (uint8_t)(value - previous + 128);
+        previous = value;
+    }
+
+    uLongf compressed_size = compressBound(raw_size);
+    chunk.resize(compressed_size);
+    const bool compressed = compress(chunk.data(), &compressed_size, predicted.data(), raw_size) == Z_OK
+                         && compressed_size < raw_size;
+    // a chunk as large as the raw data is read as uncompressed
+    if (compressed)
+        chunk.resize(compressed_size);
+    else
+        chunk.assign(raw.begin(), raw.end());
+}
+
+bool TiledEXRWriter::writeTile(int tile_x, int tile_y, const glm::fvec3 *pixels, int stride) {
+    if (tile_x < 0 || tile_y < 0 || tile_x >= m_tilesX || tile_y >= m_tilesY)
+        return false;
+    return writeRegion(tile_x * m_tileSize, tile_y * m_tileSize, m_tileSize, m_tileSize, pixels, stride);
+}
+
+bool TiledEXRWriter::writeRegion(int x, int y, int width, int height, const glm::fvec3 *pixels, int stride) {
+    if (!m_file.is_open() || x < 0 || y < 0 || x % m_tileSize != 0 || y % m_tileSize != 0)
+        return false;
+
+    const int first_x = x / m_tileSize;
+    const int first_y = y / m_tileSize;
+    const int last_x = std::min(m_tilesX, (x + width + m_tileSize - 1) / m_tileSize);
+    const int last_y = std::min(m_tilesY, (y + height + m_tileSize - 1) / m_tileSize);
+    if (first_x >= last_x || first_y >= last_y)
+        return false;
+
+    const int columns = last_x - first_x;
+    std::vector<std::vector<uint8_t>> chunks((size_t)columns * (last_y - first_y));
+    TaskScheduler::parallelFor(0, chunks.size(), 1, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            const int tile_x = first_x + (int)(i % columns);
+            const int tile_y = first_y + (int)(i / columns);
+            // tiles at the right and bottom edge of the image or the region only use the part inside both
+            const int tile_width = std::min({ m_tileSize, m_width - tile_x * m_tileSize, x + width - tile_x * m_tileSize });
+            const int tile_height = std::min({ m_tileSize, m_height - tile_y * m_tileSize, y + height - tile_y * m_tileSize });
+            const glm::fvec3 *origin = pixels + (size_t)(tile_y * m_tileSize - y) * stride + (tile_x * m_tileSize - x);
+            encodeTile(origin, stride, tile_width, tile_height, chunks[i]);
+        }
+    });
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const int tile_x = first_x + (int)(i % columns);
+        const int tile_y = first_y + (int)(i / columns);
+        m_offsets[(size_t)tile_y * m_tilesX + tile_x] = (uint64_t)m_file.tellp();
+        writeValue(m_file, (int32_t)tile_x);
+        writeValue(m_file, (int32_t)tile_y);
+        writeValue(m_file, (int32_t)0);
+        writeValue(m_file, (int32_t)0);
+        writeValue(m_file, (int32_t)chunks[i].size());
+        m_file.write(reinterpret_cast<const char*>(chunks[i].data()), chunks[i].size());
+    }
+    return (bool)m_file;
+}
+
+bool TiledEXRWriter::close() {
+    if (!m_file.is_open())
+        return false;
+
+    bool complete = true;
+    for (uint64_t offset : m_offsets)
+        complete &= offset != 0;
+    if (!complete)
+        std::cerr << "Tiled EXR: not all tiles were written\n";
+
+    m_file.seekp(m_tableOffset);
+    m_file.write(reinterpret_cast<const char*>(m_offsets.data()), m_offsets.size() * sizeof(uint64_t));
+    const bool written = (bool)m_file;
+    m_file.close();
+    return complete && written;
+}
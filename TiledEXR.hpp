@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+
+#ifdef __linux__
+#include <glm/glm.hpp>
+#elif _WIN32
+#include "glm/glm.hpp"
+#endif
+
+
+/*
+    OpenEXR writer for images that don't fit into memory, the tiles are compressed and written as they arrive.
+    One level, RGB as 32 bit float like exportEXR, ZIP compressed tiles in any order (RANDOM_Y).
+    The offset table is reserved behind the header and filled in by close().
+    The tiles of a region are compressed in parallel (TaskScheduler) and written in order.
+*/
+class TiledEXRWriter {
+public:
+    ~TiledEXRWriter();
+
+    bool open(const std::string &filename, int width, int height, int tile_size);
+    /*
+        Pixels of tile (tile_x, tile_y) row by row, stride pixels apart, rows in the order of the render target
+        like exportEXR. Tiles at the right and bottom edge only use the part inside the image.
+    */
+    bool writeTile(int tile_x, int tile_y, const glm::fvec3 *pixels, int stride);
+    // All tiles of the region at pixel (x, y) on a tile corner, pixels like writeTile
+    bool writeRegion(int x, int y, int width, int height, const glm::fvec3 *pixels, int stride);
+    // Writes the offset table, false if a tile is missing or the file couldn't be written
+    bool close();
+
+    [[nodiscard]] inline int tilesX() const noexcept { return m_tilesX; }
+    [[nodiscard]] inline int tilesY() const noexcept { return m_tilesY; }
+    [[nodiscard]] inline int tileSize() const noexcept { return m_tileSize; }
+
+private:
+    std::ofstream m_file;
+    int m_width{ 0 };
+    int m_height{ 0 };
+    int m_tileSize{ 0 };
+    int m_tilesX{ 0 };
+    int m_tilesY{ 0 };
+    std::streamoff m_tableOffset{ 0 };
+    std::vector<uint64_t> m_offsets;
+};
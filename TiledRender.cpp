@@ -0,0 +1,194 @@
+#include "TiledRender.hpp"
+#include "TiledEXR.hpp"
+#include "Context.hpp"
+#include "Scene.hpp"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#ifdef __linux__
+#include <glm/gtx/transform.hpp>
+#elif _WIN32
+#include "glm/gtx/transform.hpp"
+#endif
+
+
+struct st_tiled_options {
+    std::string scene;
+    std::string output{};
+    int width{ 1920 };
+    int height{ 1080 };
+    int tile{ 1024 };
+    uint32_t spp{ 256 };
+    uint32_t seed{ 95834783u };
+    // Start pose of the interactive camera
+    glm::dvec3 position{ 0.0, 1.5, -3.0 };
+    double pitch{ -M_PI_4 };
+    double yaw{ 0.0 };
+    bool bvh_quality{ false };
+};
+
+// Tile copy in flight, read back into a pack buffer and fenced
+struct st_tile_readback {
+    GLuint buffer{ 0 };
+    GLsync fence{ nullptr };
+    int tile_x{ 0 };
+    int tile_y{ 0 };
+};
+
+static bool finishTile(st_tile_readback &readback, int tile_size, TiledEXRWriter &writer) {
+    if (!readback.fence)
+        return true;
+
+    glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(readback.fence);
+    readback.fence = nullptr;
+
+    // compressed straight from the mapped buffer, the tile is never copied on the CPU,
+    // its EXR tiles in parallel
+    const size_t bytes = (size_t)tile_size * tile_size * sizeof(glm::fvec3);
+    const void *mapped = glMapNamedBufferRange(readback.buffer, 0, bytes, GL_MAP_READ_BIT);
+    const bool written = writer.writeRegion(readback.tile_x * tile_size, readback.tile_y * tile_size, tile_size, tile_size,
+                                            reinterpret_cast<const glm::fvec3*>(mapped), tile_size);
+    glUnmapNamedBuffer(readback.buffer);
+    return written;
+}
+
+int runTiled(int argc, char* args[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: RayTracer --tiled <scene> --out poster.exr [--width W] [--height H] [--tile N] [--spp N] [--seed S] [--camera X Y Z PITCH YAW] [--bvh-quality]\n";
+        return EXIT_FAILURE;
+    }
+
+    st_tiled_options options;
+    options.scene = args[2];
+    for (int i = 3; i < argc; i++) {
+        const std::string arg(args[i]);
+        if (arg == "--out" && i + 1 < argc)
+            options.output = args[++i];
+        else if (arg == "--width" && i + 1 < argc)
+            options.width = atoi(args[++i]);
+        else if (arg == "--height" && i + 1 < argc)
+            options.height = atoi(args[++i]);
+        else if (arg == "--tile" && i + 1 < argc)
+            options.tile = atoi(args[++i]);
+        else if (arg == "--spp" && i + 1 < argc)
+            options.spp = (uint32_t)atoi(args[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            options.seed = (uint32_t)strtoul(args[++i], nullptr, 10);
+        else if (arg == "--camera" && i + 5 < argc) {
+            options.position = glm::dvec3(atof(args[i+1]), atof(args[i+2]), atof(args[i+3]));
+            options.pitch = atof(args[i+4]);
+            options.yaw = atof(args[i+5]);
+            i += 5;
+        }
+        else if (arg == "--bvh-quality")
+            options.bvh_quality = true;
+        else {
+            std::cerr << "Unknown tiled option " << arg << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.output.empty() || options.width <= 0 || options.height <= 0 || options.tile <= 0 || options.spp == 0) {
+        std::cerr << "Tiled rendering needs --out, a positive size, tile size and sample count\n";
+        return EXIT_FAILURE;
+    }
+    // a tile as large as the image is enough for small outputs
+    const int tile_size = std::min(options.tile, std::max(options.width, options.height));
+
+    // the EXR tiles divide a render tile, so its parts compress on all threads
+    int exr_tile_size = tile_size;
+    while (exr_tile_size > 256 && exr_tile_size % 2 == 0)
+        exr_tile_size /= 2;
+    const int tiles_x = (options.width + tile_size - 1) / tile_size;
+    const int tiles_y = (options.height + tile_size - 1) / tile_size;
+
+    TiledEXRWriter writer;
+    if (!writer.open(options.output, options.width, options.height, exr_tile_size))
+        return EXIT_FAILURE;
+
+    GLFWwindow *window = createGLContext(tile_size, tile_size, "GPU RT - Tiled", false);
+    if (!window)
+        return 2;
+
+    // Released before the context is gone
+    std::unique_ptr<Scene> scene(new Scene());
+    if (!scene->addWavefrontModel("./res/models/" + options.scene)) {
+        std::cerr << "Scene " << options.scene << " does not exist\n";
+        scene.reset();
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    scene->setBVHQuality(options.bvh_quality);
+    scene->finalizeObjects();
+    scene->loadEnvironmentTexture(window, "res/models/textures/brownStudio.exr");
+    scene->loadMaterial("res/models/textures/planks", 0);
+    scene->loadMaterial("res/models/textures/aluminium", 1);
+
+    // Every tile traces the full tile size, the edge tiles drop the pixels outside the image
+    scene->setSeed(options.seed);
+    scene->adaptResolution({ tile_size, tile_size });
+
+    // CAMERA = T * R_y(-yaw) * R_x(-pitch), as in the interactive loop
+    const glm::fmat4 camera = glm::translate(options.position)
+                            * glm::rotate(-options.yaw, glm::dvec3(0.0, 1.0, 0.0))
+                            * glm::rotate(-options.pitch, glm::dvec3(1.0, 0.0, 0.0));
+
+    // Two pack buffers, one being filled by the GPU while the other one is compressed
+    const size_t tile_bytes = (size_t)tile_size * tile_size * sizeof(glm::fvec3);
+    st_tile_readback readbacks[2];
+    for (st_tile_readback &readback : readbacks) {
+        glCreateBuffers(1, &readback.buffer);
+        glNamedBufferStorage(readback.buffer, tile_bytes, nullptr, GL_MAP_READ_BIT | GL_CLIENT_STORAGE_BIT);
+    }
+
+    const auto t0 = std::chrono::steady_clock::now();
+    const int tiles = tiles_x * tiles_y;
+    bool written = true;
+    for (int tile = 0; tile < tiles; tile++) {
+        st_tile_readback &current = readbacks[tile % 2];
+        st_tile_readback &previous = readbacks[(tile + 1) % 2];
+        const int tile_x = tile % tiles_x;
+        const int tile_y = tile / tiles_x;
+
+        scene->setTile({ tile_x * tile_size, tile_y * tile_size }, { options.width, options.height });
+        int width = tile_size;
+        int height = tile_size;
+        scene->prepare(width, height, false, camera);
+        scene->settleTextures(width, height);
+        for (uint32_t sample = 0; sample < options.spp; sample++) {
+            scene->traceScene(width, height, sample);
+            // The GPU has the first sample of this tile queued, now write the previous one
+            if (sample == 0)
+                written &= finishTile(previous, tile_size, writer);
+        }
+
+        written &= finishTile(current, tile_size, writer);
+        current.tile_x = tile_x;
+        current.tile_y = tile_y;
+        scene->readRenderTarget(current.buffer);
+        current.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+        std::cerr << "Tile " << (tile + 1) << '/' << tiles << " (" << tile_x << ", " << tile_y << ")\n";
+    }
+    for (int tile = tiles; tile < tiles + 2; tile++)
+        written &= finishTile(readbacks[tile % 2], tile_size, writer);
+    written &= writer.close();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << tiles << " tiles of " << options.width << 'x' << options.height << " in " << seconds << " s\n";
+
+    for (st_tile_readback &readback : readbacks)
+        glDeleteBuffers(1, &readback.buffer);
+    scene.reset();
+    glfwTerminate();
+
+    if (!written) {
+        std::cerr << options.output << " couldn't be written\n";
+        return EXIT_FAILURE;
+    }
+    std::cerr << "Image written to " << options.output << '\n';
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+    Out-of-core rendering of images larger than a render target, for print sizes.
+    The image is traced as independent tiles with the camera rays and pixel seeds of the whole image,
+    the GPU holds one tile and its readback, the CPU one tile being compressed, and every finished tile
+    goes straight into a tiled EXR. Memory only depends on the tile size, not on the output size.
+    --bvh-quality spends more time on the tracer BVH (BVH), worth it for the long renders of this mode.
+
+    RayTracer --tiled <scene> --out poster.exr [--width W] [--height H] [--tile N] [--spp N] [--seed S]
+                      [--camera X Y Z PITCH YAW] [--bvh-quality]
+*/
+int runTiled(int argc, char* args[]);
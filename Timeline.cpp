@@ -0,0 +1,243 @@
+#include "Timeline.hpp"
+#include "ChunkedArray.hpp"
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#ifdef __linux__
+#include <GLFW/glfw3.h>
+#elif _WIN32
+#include "GLFW/glfw3.h"
+#endif
+
+
+std::atomic<bool> Timeline::s_enabled{ false };
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+    // per thread, a day of frames at a few zones each stays far below
+    constexpr size_t MAX_EVENTS = 1 << 22;
+    // the GPU track, CPU threads count from 1
+    constexpr uint32_t GPU_TID = 0;
+
+    struct st_timeline_event {
+        const char *name;
+        uint64_t start;
+        uint64_t duration;
+        std::string detail;
+    };
+
+    // Written by its thread only, the lock is taken by finish() and setThreadName()
+    struct st_thread_events {
+        uint32_t tid{ 0 };
+        std::string name;
+        std::mutex lock;
+        // never moves what was recorded when it grows
+        ChunkedArray<st_timeline_event> events;
+        uint64_t dropped{ 0 };
+    };
+
+    struct st_gpu_zone {
+        const char *name;
+        GLuint queries[2];
+    };
+
+    std::mutex registryLock;
+    std::vector<std::shared_ptr<st_thread_events>> threadEvents;
+    uint32_t nextTid{ GPU_TID + 1 };
+    std::string outputName;
+    Clock::time_point epoch{ Clock::now() };
+
+    // GL thread only
+    std::vector<GLuint> freeQueries;
+    std::vector<st_gpu_zone> openZones;
+    std::vector<st_gpu_zone> pendingZones;
+    st_thread_events gpuEvents;
+    bool calibrated{ false };
+    int64_t gpuOffset{ 0 };
+
+    thread_local std::shared_ptr<st_thread_events> localEvents;
+
+    st_thread_events &threadLocalEvents() {
+        if (!localEvents) {
+            localEvents = std::make_shared<st_thread_events>();
+            std::lock_guard<std::mutex> guard(registryLock);
+            localEvents->tid = nextTid++;
+            localEvents->name = "Thread " + std::to_string(localEvents->tid);
+            threadEvents.push_back(localEvents);
+        }
+        return *localEvents;
+    }
+
+    void record(st_thread_events &events, const char *name, uint64_t start, uint64_t end, const std::string &detail) {
+        std::lock_guard<std::mutex> guard(events.lock);
+        if (events.events.size() >= MAX_EVENTS) {
+            events.dropped++;
+            return;
+        }
+        events.events.emplace_back(st_timeline_event{ name, start, end > start ? end - start : 0, detail });
+    }
+
+    std::string escape(const std::string &text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (const char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if ((unsigned char)c < 0x20) {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    void writeThread(std::ofstream &file, st_thread_events &events, bool &first, uint64_t &dropped) {
+        std::lock_guard<std::mutex> guard(events.lock);
+        file << (first ? "" : ",\n") << R"({"name":"thread_name","ph":"M","pid":1,"tid":)" << events.tid
+             << R"(,"args":{"name":")" << escape(events.name) << "\"}}";
+        first = false;
+
+        char timing[96];
+        for (const st_timeline_event &event : events.events) {
+            // microseconds, nanosecond resolution
+            snprintf(timing, sizeof(timing), R"("ts":%.3f,"dur":%.3f)", event.start * 1e-3, event.duration * 1e-3);
+            file << ",\n" << R"({"name":")" << escape(event.name) << R"(","ph":"X","pid":1,"tid":)" << events.tid << ',' << timing;
+            if (!event.detail.empty())
+                file << R"(,"args":{"detail":")" << escape(event.detail) << "\"}";
+            file << '}';
+        }
+        dropped += events.dropped;
+    }
+
+}
+
+
+void Timeline::start(const std::string &filename) {
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        outputName = filename;
+        epoch = Clock::now();
+        gpuEvents.tid = GPU_TID;
+        gpuEvents.name = "GPU";
+        s_enabled = true;
+    }
+    setThreadName("Main");
+}
+
+uint64_t Timeline::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+}
+
+void Timeline::setThreadName(const char *name) {
+    if (!enabled())
+        return;
+    st_thread_events &events = threadLocalEvents();
+    std::lock_guard<std::mutex> guard(events.lock);
+    events.name = name;
+}
+
+void Timeline::addZone(const char *name, uint64_t start, uint64_t end, const std::string &detail) {
+    if (enabled())
+        record(threadLocalEvents(), name, start, end, detail);
+}
+
+void Timeline::gpuBegin(const char *name) {
+    if (!calibrated) {
+        // GPU timestamps count from an arbitrary point, place them once relative to the CPU clock
+        GLint64 gpu_now = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+        gpuOffset = (int64_t)now() - gpu_now;
+        calibrated = true;
+    }
+
+    // modes that never collect a profiler still keep the query pool small
+    if (pendingZones.size() >= 64)
+        collectGpu(false);
+
+    st_gpu_zone zone{ name, { 0, 0 } };
+    if (freeQueries.size() >= 2) {
+        zone.queries[1] = freeQueries.back(); freeQueries.pop_back();
+        zone.queries[0] = freeQueries.back(); freeQueries.pop_back();
+    } else {
+        glCreateQueries(GL_TIMESTAMP, 2, zone.queries);
+    }
+    glQueryCounter(zone.queries[0], GL_TIMESTAMP);
+    openZones.push_back(zone);
+}
+
+void Timeline::gpuEnd() {
+    if (openZones.empty())
+        return;
+    const st_gpu_zone zone = openZones.back();
+    openZones.pop_back();
+    glQueryCounter(zone.queries[1], GL_TIMESTAMP);
+    pendingZones.push_back(zone);
+}
+
+void Timeline::collectGpu(bool wait) {
+    // The GPU finishes zones in the order they were issued, stop at the first unfinished one
+    size_t done = 0;
+    for (; done < pendingZones.size(); done++) {
+        const st_gpu_zone &zone = pendingZones[done];
+        if (!wait) {
+            GLint available = 0;
+            glGetQueryObjectiv(zone.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+        }
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(zone.queries[0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(zone.queries[1], GL_QUERY_RESULT, &end);
+        const int64_t start = (int64_t)begin + gpuOffset;
+        if (start >= 0)
+            record(gpuEvents, zone.name, start, (uint64_t)((int64_t)end + gpuOffset), std::string());
+
+        freeQueries.push_back(zone.queries[0]);
+        freeQueries.push_back(zone.queries[1]);
+    }
+    pendingZones.erase(pendingZones.begin(), pendingZones.begin() + done);
+}
+
+bool Timeline::finish() {
+    if (!enabled())
+        return false;
+
+    // GPU zones still in flight are lost once the context is gone
+    if (glfwGetCurrentContext()) {
+        collectGpu(true);
+        glDeleteQueries(freeQueries.size(), freeQueries.data());
+        freeQueries.clear();
+    }
+    s_enabled = false;
+
+    std::lock_guard<std::mutex> guard(registryLock);
+    std::ofstream file(outputName);
+    if (!file) {
+        std::cerr << "[WARNING ][Timeline] Cannot write " << outputName << '\n';
+        return false;
+    }
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    file << R"({"name":"process_name","ph":"M","pid":1,"tid":0,"args":{"name":"GPURayTracer"}})";
+    bool first = false;
+    uint64_t dropped = 0;
+    writeThread(file, gpuEvents, first, dropped);
+    for (const std::shared_ptr<st_thread_events> &events : threadEvents)
+        writeThread(file, *events, first, dropped);
+    file << "\n]}\n";
+
+    std::cout << "[  INFO  ][Timeline] Written " << outputName << '\n';
+    if (dropped)
+        std::cerr << "[WARNING ][Timeline] " << dropped << " zones dropped, the buffers were full\n";
+    return (bool)file;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+#ifdef __linux__
+#include <GL/glew.h>
+#elif _WIN32
+#include "GL/glew.h"
+#endif
+
+
+/*
+    Timeline of CPU scopes and GPU work, written as Chrome trace event JSON that opens in Perfetto or chrome://tracing.
+    Scopes are recorded into buffers of the thread they ran on, a disabled timeline costs one relaxed load per scope.
+    GPU zones are GL_TIMESTAMP query pairs of the GL thread, read without stalling once per frame
+    and drawn on their own track, moved onto the CPU clock by a calibration at the first zone.
+    Names have to outlive the timeline (string literals), details are copied.
+*/
+class Timeline {
+public:
+    // Records from now on and writes everything to filename at finish()
+    static void start(const std::string &filename);
+    // Resolves the GPU zones if the GL context is still current and writes the file
+    static bool finish();
+
+    [[nodiscard]] static inline bool enabled() noexcept { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Nanoseconds since start()
+    static uint64_t now();
+    static void setThreadName(const char *name);
+    static void addZone(const char *name, uint64_t start, uint64_t end, const std::string &detail = std::string());
+
+    // GL thread only, zones may nest
+    static void gpuBegin(const char *name);
+    static void gpuEnd();
+    // Reads the finished GPU zones, with wait all issued zones
+    static void collectGpu(bool wait = false);
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+
+class TimelineZone {
+public:
+    explicit TimelineZone(const char *name) : m_name(Timeline::enabled() ? name : nullptr) {
+        if (m_name)
+            m_start = Timeline::now();
+    }
+    TimelineZone(const char *name, const std::string &detail) : TimelineZone(name) {
+        if (m_name)
+            m_detail = detail;
+    }
+    ~TimelineZone() {
+        if (m_name)
+            Timeline::addZone(m_name, m_start, Timeline::now(), m_detail);
+    }
+
+    TimelineZone(const TimelineZone&) = delete;
+    TimelineZone &operator=(const TimelineZone&) = delete;
+
+private:
+    const char *m_name;
+    uint64_t m_start{ 0 };
+    std::string m_detail;
+};
+
+
+class TimelineGpuZone {
+public:
+    explicit TimelineGpuZone(const char *name) : m_active(Timeline::enabled()) {
+        if (m_active)
+            Timeline::gpuBegin(name);
+    }
+    ~TimelineGpuZone() {
+        if (m_active)
+            Timeline::gpuEnd();
+    }
+
+    TimelineGpuZone(const TimelineGpuZone&) = delete;
+    TimelineGpuZone &operator=(const TimelineGpuZone&) = delete;
+
+private:
+    bool m_active;
+};
+
+#define TIMELINE_CONCAT_(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_(a, b)
+// CPU scope until the end of the block, optionally with a detail like a file name
+#define TIMELINE_ZONE(...) TimelineZone TIMELINE_CONCAT(timelineZone, __LINE__)(__VA_ARGS__)
+#define TIMELINE_GPU_ZONE(name) TimelineGpuZone TIMELINE_CONCAT(timelineGpuZone, __LINE__)(name)
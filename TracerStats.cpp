@@ -0,0 +1,133 @@
+#include "TracerStats.hpp"
+#include <iostream>
+
+
+uint64_t st_tracer_stats::rays() const {
+    uint64_t rays = counters[STAT_SHADOW_LIGHT] + counters[STAT_SHADOW_SKY];
+    for (uint32_t depth = STAT_RAYS_DEPTH_0; depth <= STAT_RAYS_DEPTH_LAST; depth++)
+        rays += counters[depth];
+    return rays;
+}
+
+double st_tracer_stats::testsPerRay() const {
+    const uint64_t traced = rays();
+    return traced ? (double)(counters[STAT_TRIANGLE_TESTS] + counters[STAT_NODE_TESTS]) / traced : 0.0;
+}
+
+st_tracer_stats &st_tracer_stats::operator+=(const st_tracer_stats &other) {
+    for (uint32_t stat = 0; stat < STAT_COUNT; stat++)
+        counters[stat] += other.counters[stat];
+    sample = other.sample;
+    return *this;
+}
+
+
+TracerStats::TracerStats() {
+    // lower and upper 32 bits per counter, the shader carries into the upper half
+    glCreateBuffers(1, &m_counters);
+    glNamedBufferStorage(m_counters, BYTES, nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glClearNamedBufferData(m_counters, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+    constexpr GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(READBACKS, m_readback);
+    for (uint32_t i = 0; i < READBACKS; i++) {
+        glNamedBufferStorage(m_readback[i], BYTES, nullptr, flags);
+        m_mapped[i] = static_cast<const uint32_t*>(glMapNamedBufferRange(m_readback[i], 0, BYTES, flags));
+    }
+}
+
+TracerStats::~TracerStats() {
+    for (uint32_t i = 0; i < READBACKS; i++) {
+        if (m_fences[i])
+            glDeleteSync(m_fences[i]);
+        glUnmapNamedBuffer(m_readback[i]);
+    }
+    glDeleteBuffers(READBACKS, m_readback);
+    glDeleteBuffers(1, &m_counters);
+}
+
+void TracerStats::bind() const {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, m_counters);
+}
+
+void TracerStats::capture(uint32_t sample) {
+    const uint32_t slot = m_head % READBACKS;
+    if (m_head - m_tail == READBACKS)
+        return;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    glCopyNamedBufferSubData(m_counters, m_readback[slot], 0, 0, BYTES);
+    glClearNamedBufferData(m_counters, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    m_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_samples[slot] = sample;
+    m_head++;
+}
+
+void TracerStats::discard() {
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glClearNamedBufferData(m_counters, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+}
+
+bool TracerStats::collect() {
+    bool collected = false;
+    while (m_tail != m_head) {
+        const uint32_t slot = m_tail % READBACKS;
+        if (glClientWaitSync(m_fences[slot], 0, 0) == GL_TIMEOUT_EXPIRED)
+            break;
+        glDeleteSync(m_fences[slot]);
+        m_fences[slot] = nullptr;
+
+        st_tracer_stats frame;
+        for (uint32_t stat = 0; stat < STAT_COUNT; stat++)
+            frame.counters[stat] = (uint64_t)m_mapped[slot][2*stat + 1] << 32 | m_mapped[slot][2*stat];
+        frame.sample = m_samples[slot];
+        m_tail++;
+
+        m_latest = frame;
+        m_totals += frame;
+        collected = true;
+
+        if (m_csv.is_open()) {
+            m_csv << frame.sample;
+            for (uint32_t stat = 0; stat < STAT_COUNT; stat++)
+                m_csv << ',' << frame.counters[stat];
+            m_csv << '\n';
+        }
+    }
+    return collected;
+}
+
+bool TracerStats::openCSV(const std::string &filename) {
+    m_csv.open(filename);
+    if (!m_csv) {
+        std::cerr << "Cannot open " << filename << std::endl;
+        return false;
+    }
+
+    m_csv << "sample";
+    for (uint32_t stat = 0; stat < STAT_COUNT; stat++)
+        m_csv << ',' << statName(static_cast<TracerStat>(stat));
+    m_csv << '\n';
+    return true;
+}
+
+const char *TracerStats::statName(TracerStat stat) {
+    static const char *RAYS_DEPTH[] = {
+        "rays_depth_0", "rays_depth_1", "rays_depth_2", "rays_depth_3",
+        "rays_depth_4", "rays_depth_5", "rays_depth_6", "rays_depth_7+"
+    };
+    if (stat <= STAT_RAYS_DEPTH_LAST)
+        return RAYS_DEPTH[stat - STAT_RAYS_DEPTH_0];
+
+    switch (stat) {
+        case STAT_SHADOW_LIGHT: return "shadow_light";
+        case STAT_SHADOW_SKY: return "shadow_sky";
+        case STAT_TRIANGLE_TESTS: return "triangle_tests";
+        case STAT_NODE_TESTS: return "node_tests";
+        case STAT_ROULETTE: return "roulette";
+        case STAT_SKY_ESCAPES: return "sky_escapes";
+        case STAT_VISIBILITY_HITS: return "visibility_hits";
+        case STAT_PATHS: return "paths";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <fstream>
+
+#ifdef __linux__
+#include <GL/glew.h>
+#elif _WIN32
+#include "GL/glew.h"
+#endif
+
+
+// Counters of raytracer.glsl, the order of the STAT_* defines there
+enum TracerStat : uint32_t {
+    STAT_RAYS_DEPTH_0,
+    // one counter per bounce depth, the last one counts all deeper bounces too
+    STAT_RAYS_DEPTH_LAST = STAT_RAYS_DEPTH_0 + 7,
+    STAT_SHADOW_LIGHT,
+    STAT_SHADOW_SKY,
+    STAT_TRIANGLE_TESTS,
+    STAT_NODE_TESTS,
+    STAT_ROULETTE,
+    STAT_SKY_ESCAPES,
+    STAT_VISIBILITY_HITS,
+    STAT_PATHS,
+    STAT_COUNT
+};
+
+struct st_tracer_stats {
+    uint64_t counters[STAT_COUNT]{};
+    // sample count of the accumulation when the counters were captured
+    uint32_t sample{ 0 };
+
+    [[nodiscard]] uint64_t rays() const;
+    // Triangle and node tests per traced ray, camera, bounce and shadow rays
+    [[nodiscard]] double testsPerRay() const;
+    st_tracer_stats &operator+=(const st_tracer_stats &other);
+};
+
+/*
+    Ray and path counters of the tracer variants compiled with TRACER_STATS.
+    The counters accumulate on the GPU until capture() copies them into one of three readback buffers,
+    collect() reads the copies whose fence has passed. Neither waits for the GPU, a capture is skipped
+    while all readback buffers are in flight and its counts go to the next one.
+*/
+class TracerStats {
+public:
+    TracerStats();
+    ~TracerStats();
+
+    // Binds the counters to the SSBO binding of raytracer.glsl
+    void bind() const;
+
+    // Call once per frame after the dispatches, sample is the current sample count
+    void capture(uint32_t sample);
+    // Returns true if a new frame was read
+    bool collect();
+    // Drops the counts since the last capture(), of dispatches that aren't part of any frame
+    void discard();
+
+    [[nodiscard]] inline const st_tracer_stats &latest() const noexcept { return m_latest; }
+    // Sum of all frames collected since resetTotals()
+    [[nodiscard]] inline const st_tracer_stats &totals() const noexcept { return m_totals; }
+    inline void resetTotals() noexcept { m_totals = st_tracer_stats(); }
+
+    // Writes one line per collected frame
+    bool openCSV(const std::string &filename);
+
+    static const char *statName(TracerStat stat);
+
+private:
+    static constexpr uint32_t READBACKS = 3;
+    static constexpr GLsizeiptr BYTES = sizeof(uint32_t) * 2 * STAT_COUNT;
+
+    GLuint m_counters{ 0 };
+    GLuint m_readback[READBACKS]{};
+    const uint32_t *m_mapped[READBACKS]{};
+    GLsync m_fences[READBACKS]{};
+    uint32_t m_samples[READBACKS]{};
+    // next readback buffer to capture into and the oldest one in flight
+    uint32_t m_head{ 0 };
+    uint32_t m_tail{ 0 };
+
+    st_tracer_stats m_latest;
+    st_tracer_stats m_totals;
+    std::ofstream m_csv;
+};
@@ -63,8 +63,14 @@ layout(std430, binding=5) restrict writeonly buffer vertexBuffer {
     Vertex vertices[];
 };
 
+// Range of triangles to (re)build, allows partial updates after scene edits
+uniform layout(location=0) uint FIRST;
+uniform layout(location=1) uint COUNT;
+
 void main(void) {
-    const uint triID = uint(gl_GlobalInvocationID.x);
+    if (gl_GlobalInvocationID.x >= COUNT)
+        return;
+    const uint triID = FIRST + uint(gl_GlobalInvocationID.x);
 
     const TriangleModel tri = triangleModels[triID];
     const TriangleShading shade = triangleShadings[triID];
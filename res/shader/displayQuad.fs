@@ -28,7 +28,43 @@ vec3 LinearToP3(in vec3 C) {
     return pow(C, vec3(1.0/2.6));
 }
 
+vec3 textureCatmullRom(in sampler2D image, in vec2 uv) {
+    /*
+        Bicubic Catmull-Rom upscaling from 9 bilinear taps, the weights of neighbouring
+        texels are merged into one linear fetch. Reproduces the texels at 1:1 scale.
+    */
+    const vec2 size = vec2(textureSize(image, 0));
+    const vec2 inv_size = 1.0 / size;
+    const vec2 sample_pos = uv * size;
+    const vec2 center = floor(sample_pos - 0.5) + 0.5;
+    const vec2 f = sample_pos - center;
+
+    const vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+    const vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+    const vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+    const vec2 w3 = f * f * (-0.5 + 0.5 * f);
+
+    const vec2 w12 = w1 + w2;
+    const vec2 t0 = (center - 1.0) * inv_size;
+    const vec2 t3 = (center + 2.0) * inv_size;
+    const vec2 t12 = (center + w2 / w12) * inv_size;
+
+    vec3 result = vec3(0.0);
+    result += texture(image, vec2(t0.x,  t0.y)).rgb  * w0.x  * w0.y;
+    result += texture(image, vec2(t12.x, t0.y)).rgb  * w12.x * w0.y;
+    result += texture(image, vec2(t3.x,  t0.y)).rgb  * w3.x  * w0.y;
+    result += texture(image, vec2(t0.x,  t12.y)).rgb * w0.x  * w12.y;
+    result += texture(image, vec2(t12.x, t12.y)).rgb * w12.x * w12.y;
+    result += texture(image, vec2(t3.x,  t12.y)).rgb * w3.x  * w12.y;
+    result += texture(image, vec2(t0.x,  t3.y)).rgb  * w0.x  * w3.y;
+    result += texture(image, vec2(t12.x, t3.y)).rgb  * w12.x * w3.y;
+    result += texture(image, vec2(t3.x,  t3.y)).rgb  * w3.x  * w3.y;
+
+    // the negative lobes can overshoot
+    return max(result, vec3(0.0));
+}
+
 void main() {
-    vec3 rgb = texture(tex, vUV).rgb;
+    vec3 rgb = textureCatmullRom(tex, vUV);
     outFragColor = LinearTosRGB(rgb);
 } 
\ No newline at end of file
@@ -10,6 +10,31 @@ layout(std430, binding=6) restrict readonly buffer hasTextureBuffer {
     int hasTexture[];
 };
 
+// Streamed material textures like in raytracer.glsl, ATLAS is the page cache
+#define PAGE_SIZE 128u
+#define PAGE_BORDER 1u
+#define SLOT_SIZE 130u
+#define SLOT_GRID 16u
+
+struct MaterialPages {
+    uint first_entry;
+    uint size;
+    uint levels;
+    uint padding;
+};
+
+layout(std430, binding=12) restrict readonly buffer materialPagesBuffer {
+    MaterialPages materialPages[];
+};
+
+layout(std430, binding=13) restrict readonly buffer pageTableBuffer {
+    uint pageTable[];
+};
+
+layout(std430, binding=14) restrict buffer pageFeedbackBuffer {
+    uint pageFeedback[];
+};
+
 const vec3 LUMA = vec3(0.299, 0.587, 0.114);
 
 in vec3 vNormal;
@@ -66,6 +91,41 @@ vec3 LinearTosRGB(in vec3 C) {
 
 vec3 sRGBtoLinear(in vec3 C) { return pow((C + 0.055)/1.055, vec3(2.4)); }
 
+uint pageEntry(in const MaterialPages pages, in const uint mip, in const vec2 uv, out vec2 texel)
+{
+    const uint row = 1u << (pages.levels - 1u - mip);
+    texel = uv * float(row * PAGE_SIZE);
+    const uvec2 page = min(uvec2(texel) / PAGE_SIZE, uvec2(row - 1u));
+    texel -= vec2(page * PAGE_SIZE);
+    const uint before = ((1u << 2u*pages.levels) - (1u << 2u*(pages.levels - mip))) / 3u;
+    return pages.first_entry + before + page.y * row + page.x;
+}
+
+// Cache coordinates of the finest resident mip from lod on, marks the wanted page
+vec3 virtualTexel(in const uint mat_id, in const vec2 uv, in const float lod)
+{
+    const MaterialPages pages = materialPages[mat_id];
+    const vec2 wrapped = fract(uv);
+    uint mip = uint(clamp(lod, 0.0, float(pages.levels - 1u)));
+    vec2 texel;
+    uint entry = pageEntry(pages, mip, wrapped, texel);
+    const uint bit = 1u << (entry & 31u);
+    if ((pageFeedback[entry >> 5u] & bit) == 0u)
+        atomicOr(pageFeedback[entry >> 5u], bit);
+
+    uint slot = pageTable[entry];
+    while (slot == 0u && mip + 1u < pages.levels) {
+        mip++;
+        entry = pageEntry(pages, mip, wrapped, texel);
+        slot = pageTable[entry];
+    }
+    slot = max(slot, 1u) - 1u;
+
+    const uint cell = slot % (SLOT_GRID * SLOT_GRID);
+    const vec2 origin = vec2(cell % SLOT_GRID, cell / SLOT_GRID) * float(SLOT_SIZE) + float(PAGE_BORDER);
+    return vec3((origin + texel) / float(SLOT_GRID * SLOT_SIZE), float(slot / (SLOT_GRID * SLOT_GRID) * 3u));
+}
+
 vec3 skyColor(in const vec3 direction) {
     const vec2 uv = vec2(atan(direction.z, direction.x) * INV_PI * 0.5, -asin(direction.y) * INV_PI) + vec2(0.5);
     return texture(RADIANCE, uv).rgb * EXPOSURE;
@@ -80,9 +140,13 @@ void main() {
     const bool hasTex = ( hasTexture[vMatID] == 1 );
     const vec3 N = normalize(vNormal);
 
+    // the derivatives outside of the branch, the mip of the screen space footprint
+    const float lod = log2(max(max(length(dFdx(vUV)), length(dFdy(vUV))) * float(materialPages[vMatID].size), 1e-6));
+    const vec3 page_coord = hasTex ? virtualTexel(uint(vMatID), vUV, lod) : vec3(0.0);
+
     const vec3 T = normalize(vTangent - N * dot(N, vTangent));
     const mat3 TBNi = mat3(T, cross(T, N), N);
-    const vec3 tex_normal = normalize(texture(ATLAS, vec3(vUV, vMatID*3 + 1)).rgb*2.0-1.0);
+    const vec3 tex_normal = hasTex ? normalize(textureLod(ATLAS, page_coord + vec3(0.0, 0.0, 1.0), 0.0).rgb*2.0-1.0) : vec3(0.0, 0.0, 1.0);
     const vec3 normal = hasTex ? normalize(TBNi * tex_normal) : N;
 
     const vec3 view = normalize(vVertex - CAMERA);
@@ -103,8 +167,8 @@ void main() {
     float metallic = float(vRoughness < 0.125);
 
     if (hasTex) {
-        vec3 tex_color = texture(ATLAS, vec3(vUV, vMatID*3 + 0)).rgb;
-        vec3 arm = texture(ATLAS, vec3(vUV, vMatID*3 + 2)).rgb;
+        vec3 tex_color = textureLod(ATLAS, page_coord, 0.0).rgb;
+        vec3 arm = textureLod(ATLAS, page_coord + vec3(0.0, 0.0, 2.0), 0.0).rgb;
         diffuse = tex_color;
         specular *= tex_color * arm.x;
         roughness = arm.y;
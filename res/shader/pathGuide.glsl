@@ -0,0 +1,63 @@
+#version 450 core
+
+layout (local_size_x=64, local_size_y=1, local_size_z=1) in;
+
+/*
+    Resolve pass of the path guiding, one invocation per cell.
+    Rebuilds the directional histogram of every cell with enough records from the flux of the
+    finished iteration and clears the training for the next one. Cells without enough records
+    keep their previous histogram. PathGuide::resolveCell is the CPU reference.
+*/
+#define GUIDE_RES 16
+#define GUIDE_CELLS (GUIDE_RES*GUIDE_RES*GUIDE_RES)
+#define GUIDE_BINS 64
+#define GUIDE_LEAVES 20
+#define GUIDE_TRAINED 84
+#define GUIDE_STRIDE 88
+#define GUIDE_MIN_RECORDS 16u
+#define GUIDE_UNIFORM 0.1
+#define GUIDE_FLUX_SCALE 65536.0
+
+layout(std430, binding=7) restrict buffer guideTrainingBuffer {
+    uint guideRecords[GUIDE_CELLS];
+    uint guideFlux[];
+};
+
+layout(std430, binding=8) restrict buffer guideDistributionBuffer {
+    float guideNodes[];
+};
+
+void main(void) {
+    const uint cell = gl_GlobalInvocationID.x;
+    if (cell >= GUIDE_CELLS)
+        return;
+
+    const uint records = guideRecords[cell];
+    guideRecords[cell] = 0u;
+
+    float flux[GUIDE_BINS];
+    float total = 0.0;
+    for (uint bin = 0u; bin < GUIDE_BINS; bin++) {
+        // fixed point, a low and a high word per bin
+        const uint word = 2u * (cell * GUIDE_BINS + bin);
+        flux[bin] = float(guideFlux[word + 1u]) * (4294967296.0 / GUIDE_FLUX_SCALE) + float(guideFlux[word]) / GUIDE_FLUX_SCALE;
+        guideFlux[word] = 0u;
+        guideFlux[word + 1u] = 0u;
+        total += flux[bin];
+    }
+    if (records < GUIDE_MIN_RECORDS || total <= 0.0)
+        return;
+
+    const uint base = cell * GUIDE_STRIDE;
+    for (uint bin = 0u; bin < GUIDE_BINS; bin++)
+        guideNodes[base + GUIDE_LEAVES + bin] = (1.0 - GUIDE_UNIFORM) * (flux[bin] / total) + GUIDE_UNIFORM / GUIDE_BINS;
+    for (uint node = 0u; node < 16u; node++) {
+        const uint leaf = base + GUIDE_LEAVES + 4u*node;
+        guideNodes[base + 4u + node] = ((guideNodes[leaf] + guideNodes[leaf + 1u]) + guideNodes[leaf + 2u]) + guideNodes[leaf + 3u];
+    }
+    for (uint node = 0u; node < 4u; node++) {
+        const uint child = base + 4u + 4u*node;
+        guideNodes[base + node] = ((guideNodes[child] + guideNodes[child + 1u]) + guideNodes[child + 2u]) + guideNodes[child + 3u];
+    }
+    guideNodes[base + GUIDE_TRAINED] = 1.0;
+}
@@ -2,6 +2,23 @@
 
 layout (local_size_x=8, local_size_y=8, local_size_z=1) in;
 
+/*
+    Specialisation of the tracer, the host injects these per variant.
+    Without them the runtime uniforms are used.
+*/
+#ifndef TRACER_RECURSION
+#define TRACER_RECURSION max(RECURSION, 1)
+#endif
+#ifndef TRACER_TEXTURES
+#define TRACER_TEXTURES 1
+#endif
+#ifndef TRACER_LIGHTS
+#define TRACER_LIGHTS 1
+#endif
+#ifndef TRACER_STATS
+#define TRACER_STATS 0
+#endif
+
 struct Vec3 {
     float x, y, z;
 };
@@ -41,6 +58,9 @@ struct Material {
 
 
 uniform layout(rgba32f, binding=0) restrict image2D img_output;
+// Primary hit of the latest sample, shading normal and distance (0 for the sky)
+uniform layout(rgba32f, binding=1) restrict writeonly image2D img_gbuffer;
+// page cache of the streamed material textures
 uniform layout(location=1) sampler2DArray textureAtlas;
 uniform layout(location=2) sampler2D RADIANCE;
 uniform layout(location=3) sampler2D IRRADIANCE;
@@ -59,10 +79,62 @@ layout(std430, binding=3) restrict readonly buffer materialBuffer {
     Material materials[];
 };
 
+/*
+    Bounding volume hierarchy over the triangle slots, built by BVH.cpp. Inner nodes have count 0,
+    their left child follows them and offset is the right child. Leaves test count slots of bvhReferences from offset.
+*/
+struct BVHNode {
+    vec3 bb_min;
+    uint offset;
+    vec3 bb_max;
+    uint count;
+};
+
+layout(std430, binding=10) restrict readonly buffer bvhNodeBuffer {
+    BVHNode bvhNodes[];
+};
+
+layout(std430, binding=11) restrict readonly buffer bvhReferenceBuffer {
+    uint bvhReferences[];
+};
+
+// BVH::MAX_DEPTH
+#define BVH_STACK 64
+
 layout(std430, binding=6) restrict readonly buffer hasTextureBuffer {
     int hasTexture[];
 };
 
+/*
+    Streamed material textures, described in TextureStreamer.hpp. Every mip of a material is cut into pages
+    of PAGE_SIZE^2 texels, pageTable holds the cache slot + 1 of every page and 0 while it isn't resident.
+    Lookups mark the page they want in pageFeedback and use the next coarser resident mip until it arrives.
+*/
+#define PAGE_SIZE 128u
+#define PAGE_BORDER 1u
+#define SLOT_SIZE 130u
+#define SLOT_GRID 16u
+
+struct MaterialPages {
+    uint first_entry;
+    uint size;
+    uint levels;
+    uint padding;
+};
+
+layout(std430, binding=12) restrict readonly buffer materialPagesBuffer {
+    MaterialPages materialPages[];
+};
+
+layout(std430, binding=13) restrict readonly buffer pageTableBuffer {
+    uint pageTable[];
+};
+
+// one bit per page table entry, cleared by TextureStreamer::update()
+layout(std430, binding=14) restrict buffer pageFeedbackBuffer {
+    uint pageFeedback[];
+};
+
 uniform layout(location = 4) mat4 CAMERA;
 
 uniform layout(location = 5) int COUNT;
@@ -70,15 +142,114 @@ uniform layout(location = 6) int LIGHTS;
 uniform layout(location = 7) int RECURSION;
 uniform layout(location = 8) uint SAMPLE;
 uniform layout(location = 9) uint CLOCK;
+// Samples accumulated by one dispatch, they take the indices SAMPLE .. SAMPLE + SAMPLES - 1
+uniform layout(location = 23) uint SAMPLES;
 
 uniform layout(location = 14) vec3 BB_CENTER;
 uniform layout(location = 15) int SPLIT_X;
 
+/*
+    Temporal reprojection, the first sample after a camera change continues
+    from the accumulation of a previous camera (PREV_VIEW is its inverse transform)
+    wherever depth and normal of the primary hit agree.
+*/
+uniform layout(location = 10) sampler2D HISTORY;
+uniform layout(location = 11) sampler2D HISTORY_GBUFFER;
+uniform layout(location = 16) uint REPROJECT;
+uniform layout(location = 17) mat4 PREV_VIEW;
+uniform layout(location = 21) vec3 PREV_POSITION;
+uniform layout(location = 22) float HISTORY_CAP;
+
+/*
+    Visibility buffer, slot + 1 of the triangle seen through each pixel center or 0 for the sky.
+    It is rasterized from the draw buffer, whose triangles have the same slots as triangleModels.
+*/
+uniform layout(location = 24) usampler2D VISIBILITY;
+uniform layout(location = 25) uint USE_VISIBILITY;
+
+/*
+    Tiled rendering, the render target holds the tile at TILE_OFFSET of an IMAGE_SIZE image.
+    Camera rays and pixel seeds are those of the whole image, (0, 0) renders the render target as the image.
+*/
+uniform layout(location = 29) ivec2 TILE_OFFSET;
+uniform layout(location = 30) ivec2 IMAGE_SIZE;
+
+/*
+    Path guiding (Mueller et al. 2017, Practical Path Guiding) on a fixed grid of GUIDE_RES^3 cells
+    over the scene bounds, each with a fixed directional histogram sampled through a quadtree over its bins.
+    The layout is described in PathGuide.hpp, pathGuide.glsl rebuilds the histograms from the flux the paths
+    add to guideFlux.
+*/
+#define GUIDE_RES 16
+#define GUIDE_CELLS (GUIDE_RES*GUIDE_RES*GUIDE_RES)
+#define GUIDE_BINS 64
+#define GUIDE_LEAVES 20
+#define GUIDE_TRAINED 84
+#define GUIDE_STRIDE 88
+#define GUIDE_VERTICES 8
+// Share of the guided directions on a fully rough surface
+#define GUIDE_FRACTION 0.5
+#define GUIDE_FLUX_SCALE 65536.0
+#define GUIDE_FLUX_MAX 65535.0
+
+layout(std430, binding=7) restrict buffer guideTrainingBuffer {
+    uint guideRecords[GUIDE_CELLS];
+    uint guideFlux[];
+};
+
+layout(std430, binding=8) restrict readonly buffer guideDistributionBuffer {
+    float guideNodes[];
+};
+
+uniform layout(location = 26) uint GUIDING;
+uniform layout(location = 27) vec3 GUIDE_MIN;
+uniform layout(location = 28) vec3 GUIDE_SCALE;
+
+/*
+    Ray and path counters, the order of TracerStat in TracerStats.hpp.
+    Each invocation counts into STATS and adds them once at the end of main,
+    the buffer holds a low and a high word per counter. Without TRACER_STATS none of it is compiled.
+*/
+#define STAT_RAYS_DEPTH 0
+#define STAT_SHADOW_LIGHT 8
+#define STAT_SHADOW_SKY 9
+#define STAT_TRIANGLE_TESTS 10
+#define STAT_NODE_TESTS 11
+#define STAT_ROULETTE 12
+#define STAT_SKY_ESCAPES 13
+#define STAT_VISIBILITY_HITS 14
+#define STAT_PATHS 15
+#define STAT_COUNT 16
+
+#if TRACER_STATS
+layout(std430, binding=9) restrict buffer statsBuffer {
+    uint stats[2 * STAT_COUNT];
+};
+
+uint STATS[STAT_COUNT];
+#define STAT_ADD(stat, n) STATS[stat] += uint(n)
+
+void flushStats() {
+    for (int i = 0; i < STAT_COUNT; i++) {
+        if (STATS[i] == 0u)
+            continue;
+        const uint low = atomicAdd(stats[2*i], STATS[i]);
+        if (low + STATS[i] < low)
+            atomicAdd(stats[2*i + 1], 1u);
+    }
+}
+#else
+#define STAT_ADD(stat, n)
+#endif
+
 const float PI = 3.141592653589793;
 const float TWO_PI = 6.283185307179586;
 const float INV_PI = 1.0/3.141592653589793;
 uvec2 SIZE;
 ivec2 TEXEL;
+// pixel in the whole image and its size
+uvec2 IMAGE;
+ivec2 PIXEL;
 
 const uint A = 747796405u;
 const uint B = 2891336453u;
@@ -92,12 +263,59 @@ uint pcgHash(in const uint k) {
     return (word >> 22U) ^ word;
 }
 
-float unitFloat(inout uint seed) {
-    seed = pcgHash(seed);
-    return seed * INV_UINT_MAX;
+float hashFloat(inout uint state) {
+    state = pcgHash(state);
+    return state * INV_UINT_MAX;
+}
+
+/*
+    Owen-scrambled Sobol sampler (Burley 2020, Practical Hash-based Owen Scrambling).
+    Every random decision of a path takes the next dimension, each dimension is a
+    2D Sobol sequence shuffled and scrambled with hashes of (pixel, dimension).
+    Any (pixel, sample, dimension) is evaluated directly, without per-sample setup.
+*/
+uint PIXEL_SEED;
+uint SAMPLE_INDEX;
+
+uint nestedUniformScramble(in uint x, in const uint seed) {
+    // Laine-Karras permutation on the reversed bits, every bit only depends on the higher ones
+    x = bitfieldReverse(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return bitfieldReverse(x);
+}
+
+uvec2 sobol2D(in const uint index) {
+    // van der Corput for the first dimension, the second uses the direction numbers v_i = v_i-1 ^ (v_i-1 >> 1)
+    uint y = 0u;
+    uint v = 1u << 31;
+    for (uint bits = index; bits != 0u; bits >>= 1, v ^= v >> 1) {
+        if ((bits & 1u) != 0u)
+            y ^= v;
+    }
+    return uvec2(bitfieldReverse(index), y);
+}
+
+vec2 sobolOwen(in const uint dimension) {
+    const uint seed = pcgHash(PIXEL_SEED ^ pcgHash(dimension));
+    const uvec2 point = sobol2D(nestedUniformScramble(SAMPLE_INDEX, seed));
+    const uvec2 scrambled = uvec2(nestedUniformScramble(point.x, pcgHash(seed)), nestedUniformScramble(point.y, pcgHash(seed + 1u)));
+    // 24 bits, exactly representable and always < 1
+    return vec2(scrambled >> 8) * (1.0 / 16777216.0);
+}
+
+float unitFloat(inout uint dimension) {
+    return sobolOwen(dimension++).x;
+}
+
+vec2 unitFloat2(inout uint dimension) {
+    return sobolOwen(dimension++);
 }
 
-vec3 randomSphere(inout uint seed)
+vec3 randomSphere(inout uint dimension)
 {
     /*
         Uniformly distributed point on the boundary of a sphere with radius 1.
@@ -105,19 +323,20 @@ vec3 randomSphere(inout uint seed)
         the position of the area on the sphere does not change the density.
         (Rotational symmetry)
     */
-    const float theta = TWO_PI * unitFloat(seed);
-    const float x = unitFloat(seed) * 2.0 - 1.0;
+    const vec2 u = unitFloat2(dimension);
+    const float theta = TWO_PI * u.x;
+    const float x = u.y * 2.0 - 1.0;
     const float sinx = sqrt(1.0-x*x);
 
     return vec3(sinx * cos(theta), sinx * sin(theta), x);
 }
 
-vec3 randomHemi(in const vec3 n, inout uint seed)
+vec3 randomHemi(in const vec3 n, inout uint dimension)
 {
     /*
         Uniformly distributed point on the upper hemisphere with radius 1 with maximum in direction n.
     */
-    const vec3 u = randomSphere(seed);
+    const vec3 u = randomSphere(dimension);
     return (dot(u, n) < 0) ? -u : u;
 }
 
@@ -161,40 +380,6 @@ bool intersectTriangle(in const Ray ray, in const TriangleModel triangle, inout
     return true;
 }
 
-bool intersectTriangleShadow(in const Ray ray, in const TriangleModel triangle, in float max_t)
-{
-    /*
-        Unlike the intersectTriangle, these function discards front facing triangles
-        and does not calculate the relative coordinates in local space.
-        All triangles farther away than max_t are discarded, can be used as precalculated light source distance.
-    */
-    const vec3 true_normal = vec3(triangle.true_normal.x, triangle.true_normal.y, triangle.true_normal.z);
-    const float determinant = dot(ray.direction, true_normal);
-    // Frontface culling
-    if (determinant <= 0.0)
-        return false;
-
-    const vec3 tri_pos = vec3(triangle.position.x, triangle.position.y, triangle.position.z);
-    const vec3 delta = tri_pos - ray.position;
-    const float relative_depth = dot(true_normal, delta);
-    if (relative_depth <= 0.0)
-        return false;
-    
-    // discard if the previous intersection is closer
-    if (relative_depth > determinant * max_t)
-        return false;
-
-    // some linear algebra to solve inverse(u, v, ray.direction) * Delta
-    const vec3 minor = cross(ray.direction, delta);
-    const vec3 tri_u = vec3(triangle.u.x, triangle.u.y, triangle.u.z);
-    const vec3 tri_v = vec3(triangle.v.x, triangle.v.y, triangle.v.z);
-    const vec2 relative = vec2(-dot(minor, tri_v), dot(minor, tri_u));
-
-    if (relative.x < 0.0 || relative.y < 0.0 || relative.x + relative.y > determinant)
-        return false;
-    return true;
-}
-
 float getTransmission(in const float cosThetaI, in const float etaI, in const float etaT)
 {
     /*
@@ -214,18 +399,76 @@ float getTransmission(in const float cosThetaI, in const float etaI, in const fl
     return dot(reflectance, reflectance) * 0.5;
 }
 
+vec3 inverseDirection(in const vec3 direction)
+{
+    // axis parallel rays get a huge but finite slope, so the slab test has no 0 * inf
+    return 1.0 / mix(direction, vec3(1e-20), equal(direction, vec3(0.0)));
+}
+
+float intersectNode(in const Ray ray, in const vec3 inv_direction, in const BVHNode node, in const float max_t)
+{
+    // Distance at which the ray enters the bounds of node, -1 if it misses them before max_t
+    const vec3 t0 = (node.bb_min - ray.position) * inv_direction;
+    const vec3 t1 = (node.bb_max - ray.position) * inv_direction;
+    const vec3 near = min(t0, t1);
+    const vec3 far = max(t0, t1);
+    const float enter = max(max(near.x, near.y), max(near.z, 0.0));
+    const float leave = min(min(far.x, far.y), min(far.z, max_t));
+    return (enter <= leave) ? enter : -1.0;
+}
+
+float intersectionDistance(in const vec4 isec)
+{
+    return (isec.z >= 0.0 && isec.w > 0.0) ? isec.z / isec.w : 3.0e38;
+}
+
 int findIntersection(in const Ray ray, out vec3 current_intersection)
 {
     /*
-        Iterates all triangles (the light sources included) and returns the ID of the closest.
+        Traverses the BVH (the light sources included) and returns the ID of the closest triangle.
+        The nearer child is visited first, the other is skipped once a closer hit is known.
         The local coordinates are stored in current_intersection
     */
     int current_tri = -1;
     vec4 intersection = vec4(0.0, 0.0, -1.0, 1.0);
-    for (int triID = 0; triID < COUNT; triID++)
+    const vec3 inv_direction = inverseDirection(ray.direction);
+
+    uint stack[BVH_STACK];
+    int top = 0;
+    STAT_ADD(STAT_NODE_TESTS, 1);
+    if (COUNT > 0 && intersectNode(ray, inv_direction, bvhNodes[0], 3.0e38) >= 0.0)
+        stack[top++] = 0u;
+
+    while (top > 0)
     {
-        if (intersectTriangle(ray, triangleModels[triID], intersection))
-            current_tri = triID;
+        const uint index = stack[--top];
+        const BVHNode node = bvhNodes[index];
+        if (node.count > 0u) {
+            STAT_ADD(STAT_TRIANGLE_TESTS, node.count);
+            for (uint r = node.offset; r < node.offset + node.count; r++)
+            {
+                const uint triID = bvhReferences[r];
+                if (intersectTriangle(ray, triangleModels[triID], intersection))
+                    current_tri = int(triID);
+            }
+            continue;
+        }
+
+        const float max_t = intersectionDistance(intersection);
+        uint near_child = index + 1u;
+        uint far_child = node.offset;
+        float near_t = intersectNode(ray, inv_direction, bvhNodes[near_child], max_t);
+        float far_t = intersectNode(ray, inv_direction, bvhNodes[far_child], max_t);
+        STAT_ADD(STAT_NODE_TESTS, 2);
+        if (far_t >= 0.0 && (near_t < 0.0 || far_t < near_t)) {
+            const uint swap_child = near_child; near_child = far_child; far_child = swap_child;
+            const float swap_t = near_t; near_t = far_t; far_t = swap_t;
+        }
+        // a leaf popped later can still reject the far child by the hit distance of its triangles
+        if (far_t >= 0.0)
+            stack[top++] = far_child;
+        if (near_t >= 0.0)
+            stack[top++] = near_child;
     }
 
     const float inv_det = 1.0 / intersection.w;
@@ -234,6 +477,104 @@ int findIntersection(in const Ray ray, out vec3 current_intersection)
     return current_tri;
 }
 
+int primaryIntersection(in const Ray ray, out vec3 current_intersection)
+{
+    /*
+        Camera rays only test the triangle the rasterizer found for the pixel. The jittered ray may
+        see another triangle where the neighbouring pixels do, these pixels and rays that miss the
+        triangle take the full traversal.
+    */
+    const uint visible = texelFetch(VISIBILITY, TEXEL, 0).r;
+    const ivec2 last = ivec2(SIZE) - 1;
+    if (visible == texelFetch(VISIBILITY, min(TEXEL + ivec2(1, 0), last), 0).r &&
+        visible == texelFetch(VISIBILITY, max(TEXEL - ivec2(1, 0), ivec2(0)), 0).r &&
+        visible == texelFetch(VISIBILITY, min(TEXEL + ivec2(0, 1), last), 0).r &&
+        visible == texelFetch(VISIBILITY, max(TEXEL - ivec2(0, 1), ivec2(0)), 0).r)
+    {
+        current_intersection = vec3(0.0);
+        if (visible == 0u) {
+            STAT_ADD(STAT_VISIBILITY_HITS, 1);
+            return -1;
+        }
+
+        vec4 intersection = vec4(0.0, 0.0, -1.0, 1.0);
+        STAT_ADD(STAT_TRIANGLE_TESTS, 1);
+        if (intersectTriangle(ray, triangleModels[visible - 1u], intersection)) {
+            STAT_ADD(STAT_VISIBILITY_HITS, 1);
+            current_intersection = intersection.xyz / intersection.w;
+            return int(visible - 1u);
+        }
+    }
+    return findIntersection(ray, current_intersection);
+}
+
+int guideCell(in const vec3 position)
+{
+    const ivec3 cell = clamp(ivec3((position - GUIDE_MIN) * GUIDE_SCALE), ivec3(0), ivec3(GUIDE_RES - 1));
+    return (cell.z * GUIDE_RES + cell.y) * GUIDE_RES + cell.x;
+}
+
+uint guideBin(in const vec3 direction)
+{
+    // cylindrical equal-area map, 8 x 8 leaves in Morton order
+    const vec2 map = vec2(direction.z * 0.5 + 0.5, atan(direction.y, direction.x) * (0.5 * INV_PI) + 0.5);
+    const uvec2 bin = uvec2(clamp(ivec2(map * 8.0), ivec2(0), ivec2(7)));
+    uint leaf = 0u;
+    for (uint bit = 0u; bit < 3u; bit++)
+        leaf |= ((bin.x >> bit) & 1u) << (2u*bit) | ((bin.y >> bit) & 1u) << (2u*bit + 1u);
+    return leaf;
+}
+
+float guidePdf(in const int cell, in const vec3 direction)
+{
+    // a leaf covers 4 PI / GUIDE_BINS steradians
+    return guideNodes[cell * GUIDE_STRIDE + GUIDE_LEAVES + guideBin(direction)] * (GUIDE_BINS / (4.0 * PI));
+}
+
+vec3 sampleGuide(in const int cell, in vec2 u)
+{
+    /*
+        Descends the quadtree of the cell, u.x picks the child on every level and is rescaled
+        to the chosen child, the remaining u places the direction inside the leaf.
+    */
+    const uint base = uint(cell) * GUIDE_STRIDE;
+    uint node = 0u;
+    uint level_offset = 0u;
+    float mass = 1.0;
+    for (uint level = 0u; level < 3u; level++) {
+        const uint first = base + level_offset + 4u*node;
+        float pick = u.x * mass;
+        uint child = 0u;
+        for (; child < 3u; child++) {
+            if (pick < guideNodes[first + child])
+                break;
+            pick -= guideNodes[first + child];
+        }
+        const float p = guideNodes[first + child];
+        u.x = clamp(pick / p, 0.0, 0.99999994);
+        mass = p;
+        node = 4u*node + child;
+        level_offset += 4u << (2u*level);
+    }
+
+    uvec2 bin = uvec2(0u);
+    for (uint bit = 0u; bit < 3u; bit++)
+        bin |= ((uvec2(node) >> uvec2(2u*bit, 2u*bit + 1u)) & 1u) << bit;
+    const float z = ((bin.x + u.x) / 8.0) * 2.0 - 1.0;
+    const float phi = ((bin.y + u.y) / 8.0 - 0.5) * TWO_PI;
+    const float r = sqrt(max(1.0 - z*z, 0.0));
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+void addGuideFlux(in const uint index, in const float flux)
+{
+    // float atomicAdd isn't core, the sums are fixed point with a carry into the high word as in flushStats
+    const uint fixed = uint(min(flux, GUIDE_FLUX_MAX) * GUIDE_FLUX_SCALE + 0.5);
+    const uint low = atomicAdd(guideFlux[2u*index], fixed);
+    if (low + fixed < low)
+        atomicAdd(guideFlux[2u*index + 1u], 1u);
+}
+
 vec3 sRGBtoLinear(in vec3 C) { return pow((C + 0.055)/1.055, vec3(2.4)); }
 
 vec3 calculateN(in const TriangleShading tri, in const vec3 intersection)
@@ -269,6 +610,62 @@ mat3 calculateTBN(in const TriangleShading tri, in const vec3 N, in const vec3 i
     return mat3(T, cross(T, N), N);
 }
 
+// Page table entry of the page of mip that holds uv, texel is the position of uv in the page
+uint pageEntry(in const MaterialPages pages, in const uint mip, in const vec2 uv, out vec2 texel)
+{
+    const uint row = 1u << (pages.levels - 1u - mip);
+    texel = uv * float(row * PAGE_SIZE);
+    const uvec2 page = min(uvec2(texel) / PAGE_SIZE, uvec2(row - 1u));
+    texel -= vec2(page * PAGE_SIZE);
+    // pages of the finer mips, pagesBefore() in TextureStreamer.cpp
+    const uint before = ((1u << 2u*pages.levels) - (1u << 2u*(pages.levels - mip))) / 3u;
+    return pages.first_entry + before + page.y * row + page.x;
+}
+
+/*
+    Cache coordinates of uv of material mat_id at the level of detail lod, z is the layer of the albedo map.
+    Takes the finest resident mip from lod on, the pinned coarsest mips are always there.
+    The wanted page is only marked when its bit isn't set yet, most lookups get away without an atomic.
+*/
+vec3 virtualTexel(in const uint mat_id, in const vec2 uv, in const float lod)
+{
+    const MaterialPages pages = materialPages[mat_id];
+    const vec2 wrapped = fract(uv);
+    uint mip = uint(clamp(lod, 0.0, float(pages.levels - 1u)));
+    vec2 texel;
+    uint entry = pageEntry(pages, mip, wrapped, texel);
+    const uint bit = 1u << (entry & 31u);
+    if ((pageFeedback[entry >> 5u] & bit) == 0u)
+        atomicOr(pageFeedback[entry >> 5u], bit);
+
+    uint slot = pageTable[entry];
+    while (slot == 0u && mip + 1u < pages.levels) {
+        mip++;
+        entry = pageEntry(pages, mip, wrapped, texel);
+        slot = pageTable[entry];
+    }
+    slot = max(slot, 1u) - 1u;
+
+    const uint cell = slot % (SLOT_GRID * SLOT_GRID);
+    const vec2 origin = vec2(cell % SLOT_GRID, cell / SLOT_GRID) * float(SLOT_SIZE) + float(PAGE_BORDER);
+    return vec3((origin + texel) / float(SLOT_GRID * SLOT_SIZE), float(slot / (SLOT_GRID * SLOT_GRID) * 3u));
+}
+
+/*
+    Mip for a ray cone of width cone_width hitting the triangle (Akenine-Moeller et al. 2019,
+    Texture Level of Detail Strategies for Real-Time Ray Tracing), the texels per unit length of the triangle
+    follow from its area in texture and in world space.
+*/
+float textureMip(in const TriangleModel model, in const TriangleShading tri, in const uint mat_id, in const float cone_width)
+{
+    const vec3 u = vec3(model.u.x, model.u.y, model.u.z);
+    const vec3 v = vec3(model.v.x, model.v.y, model.v.z);
+    const float world_area = length(cross(u, v));
+    const float uv_area = abs(tri.tex_u.s * tri.tex_v.t - tri.tex_u.t * tri.tex_v.s);
+    const float texels = sqrt(uv_area / max(world_area, 1e-12)) * float(materialPages[mat_id].size);
+    return log2(max(cone_width * texels, 1e-6));
+}
+
 
 vec3 skyColor(in const vec3 direction) {
     const vec2 uv = vec2(atan(direction.z, direction.x) * INV_PI * 0.5, -asin(direction.y) * INV_PI) + vec2(0.5);
@@ -280,62 +677,214 @@ vec3 skyColorDiffuse(in const vec3 direction) {
 }
 
 
-bool sampleSky(in const vec3 position, in const vec3 normal,
-               in const int current, inout uint seed, out vec3 light)
+float misWeight(in const float pdf, in const float other_pdf)
 {
-    Ray light_probe_ray;
-    light_probe_ray.position = position;
-    light_probe_ray.direction = normalize(randomSphere(seed) + normal);
+    /*
+        Power heuristic (beta = 2) of a strategy with density pdf against the other one.
+        A negative pdf marks a delta distribution, the other strategy can't produce it.
+    */
+    if (pdf < 0.0)
+        return 1.0;
+    if (pdf == 0.0)
+        return 0.0;
+    const float ratio = other_pdf / pdf;
+    return 1.0 / fma(ratio, ratio, 1.0);
+}
+
+float scatterPdf(in const vec3 direction, in const vec3 axis, in const float radius)
+{
+    /*
+        Solid angle density of normalize(randomSphere() * radius + axis), axis of unit length.
+        The direction crosses the sphere of the given radius around axis at t = c +- sqrt(D),
+        each crossing maps the uniform area density 1 / (4 PI radius^2) with dA = t^2 / |cos| dw.
+        radius = 1 is the cosine distribution, radius = 0 a delta distribution (density 0 here).
+    */
+    if (radius <= 0.0)
+        return 0.0;
+
+    const float c = dot(direction, axis);
+    const float D = fma(c, c, fma(radius, radius, -1.0));
+    if (D <= 0.0)
+        return 0.0;
+
+    const float s = sqrt(D);
+    if (radius < 1.0) {
+        // origin outside of the sphere, both crossings in front of it
+        if (c <= 0.0)
+            return 0.0;
+        return (c*c + D) / (TWO_PI * radius * s);
+    }
+    const float t = c + s;
+    return t*t / (4.0 * PI * radius * s);
+}
+
+float orenNayar(in const float cos_i, in const float cos_o, in const float variance)
+{
+    const float theta_i = acos(cos_i);
+    const float theta_o = acos(cos_o);
+    const float A = 1.0 - 0.5 * variance / (variance + 0.33);
+    const float B = 0.45 * variance / (variance + 0.09);
+    const float alpha = max(theta_i, theta_o);
+    const float beta = min(theta_i, theta_o);
+
+    return A + B*max(0.0, theta_i-theta_o)*sin(alpha)*tan(beta);
+}
+
+struct Surface
+{
+    vec3 normal;
+    vec3 specular_ray;
+    vec3 albedo;
+    vec3 specular;
+    float roughness;
+    float variance;
+    float metallic;
+    float occlusion;
+    float fresnel;
+    float cos_i;
+};
+
+float evaluateScatter(in const Surface surface, in const vec3 direction, out vec3 weight)
+{
+    /*
+        Density of the scattered direction of trace over its rough lobes (metallic, Oren-Nayar, glossy).
+        weight receives the sum of every lobe's probability * density * path weight,
+        the BSDF times cosine as the lobes sample it. Fresnel reflection and lobes without
+        roughness are delta distributions and left out, a light sample never hits them.
+    */
+    const float cos_o = dot(direction, surface.normal);
+
+    const float scatter = 1.0 - surface.fresnel;
+    const float p_metallic = scatter * surface.metallic;
+    const float p_diffuse = scatter * (1.0 - surface.metallic) * surface.roughness;
+    const float p_glossy = scatter * (1.0 - surface.metallic) * (1.0 - surface.roughness);
+
+    const float pdf_metallic = p_metallic * scatterPdf(direction, surface.specular_ray, surface.variance);
+    const float pdf_diffuse = p_diffuse * max(cos_o, 0.0) * INV_PI;
+    const float pdf_glossy = p_glossy * scatterPdf(direction, surface.normal, surface.variance);
+
+    const float oren_nayar = (pdf_diffuse > 0.0) ? orenNayar(surface.cos_i, cos_o, surface.variance) : 0.0;
+
+    weight = surface.albedo * (pdf_metallic + pdf_diffuse * oren_nayar * surface.occlusion)
+           + surface.specular * (pdf_glossy * (1.0 - surface.roughness));
+    return pdf_metallic + pdf_diffuse + pdf_glossy;
+}
 
-    vec4 intersection = vec4(0.0, 0.0, -1.0, 0.0);
 
-    for (int triID = 0; triID < COUNT; triID++)
+float scatterDensity(in const Surface surface, in const vec3 direction, in const int cell, in const float guide, out vec3 weight)
+{
+    /*
+        Density of the scattered direction when a share guide of the rough (non-Fresnel) scattering
+        is drawn from the path guide, weight as in evaluateScatter.
+    */
+    const float pdf = evaluateScatter(surface, direction, weight);
+    if (guide <= 0.0)
+        return pdf;
+    return mix(pdf, (1.0 - surface.fresnel) * guidePdf(cell, direction), guide);
+}
+
+
+bool occluded(in const Ray ray, in const int skip, in const int skip_light, in vec4 intersection)
+{
+    /*
+        Any hit traversal for shadow rays, true at the first triangle other than skip and skip_light
+        that intersectTriangle accepts with the limit of intersection.
+    */
+    const vec3 inv_direction = inverseDirection(ray.direction);
+    const float max_t = intersectionDistance(intersection);
+
+    uint stack[BVH_STACK];
+    int top = 0;
+    STAT_ADD(STAT_NODE_TESTS, 1);
+    if (COUNT > 0 && intersectNode(ray, inv_direction, bvhNodes[0], max_t) >= 0.0)
+        stack[top++] = 0u;
+
+    while (top > 0)
     {
-        if (triID == current)
+        const uint index = stack[--top];
+        const BVHNode node = bvhNodes[index];
+        if (node.count > 0u) {
+            for (uint r = node.offset; r < node.offset + node.count; r++)
+            {
+                const int triID = int(bvhReferences[r]);
+                if (triID == skip || triID == skip_light)
+                    continue;
+                STAT_ADD(STAT_TRIANGLE_TESTS, 1);
+                if (intersectTriangle(ray, triangleModels[triID], intersection))
+                    return true;
+            }
             continue;
-        if (intersectTriangle(light_probe_ray, triangleModels[triID], intersection))
-            return false;
+        }
+
+        STAT_ADD(STAT_NODE_TESTS, 2);
+        if (intersectNode(ray, inv_direction, bvhNodes[node.offset], max_t) >= 0.0)
+            stack[top++] = node.offset;
+        if (intersectNode(ray, inv_direction, bvhNodes[index + 1u], max_t) >= 0.0)
+            stack[top++] = index + 1u;
     }
+    return false;
+}
 
-    light = skyColor(normal);
-    return true;
+float skyPdf(in const vec3 direction, in const vec3 normal) {
+    return max(dot(direction, normal), 0.0) * INV_PI;
 }
 
-bool sampleSkyDiffuse(in const vec3 position, in const vec3 normal,
-               in const int current, inout uint seed, out vec3 light)
+bool sampleSky(in const vec3 position, in const vec3 normal, in const vec3 true_normal,
+               in const int current, inout uint dimension, out vec3 direction, out vec3 light)
 {
-
+    /*
+        Cosine distributed direction around normal, returns the sky radiance if nothing is in the way.
+        The density is skyPdf.
+    */
     Ray light_probe_ray;
     light_probe_ray.position = position;
-    light_probe_ray.direction = normalize(randomSphere(seed) + normal);
-    vec4 intersection = vec4(0.0, 0.0, -1.0, 0.0);
-    int lightID = -1;
-    
-    for (int triID = 0; triID < COUNT; triID++)
-    {
-        if (triID == current)
-            continue;
-        if (intersectTriangle(light_probe_ray, triangleModels[triID], intersection))
-            return false;
-    }
+    light_probe_ray.direction = normalize(randomSphere(dimension) + normal);
+    direction = light_probe_ray.direction;
 
-    light = skyColor(light_probe_ray.direction) * INV_PI;// / (LIGHTS + 2);
+    // trace can't leave the surface below its true normal either
+    if (dot(direction, true_normal) <= 0.0)
+        return false;
+
+    STAT_ADD(STAT_SHADOW_SKY, 1);
+    if (occluded(light_probe_ray, current, -1, vec4(0.0, 0.0, -1.0, 0.0)))
+        return false;
+
+    light = skyColor(direction);
     return true;
 }
 
-bool sampleLight(in const vec3 position, in const vec3 normal,
-                 in const int current, inout uint seed, out vec3 light)
+
+float lightPdf(in const int light_id, in const vec3 direction, in const float distance)
+{
+    /*
+        Solid angle density of sampleLight choosing the point at distance along direction on light_id:
+        1 / LIGHTS for the light, 1 / area on it, converted with distance^2 / cos.
+        |true_normal| is twice the area, so area * cos = 0.5 * -dot(direction, true_normal).
+    */
+    const TriangleModel light_tri = triangleModels[light_id];
+    const vec3 true_normal = vec3(light_tri.true_normal.x, light_tri.true_normal.y, light_tri.true_normal.z);
+    const float projected_area = -0.5 * dot(direction, true_normal);
+    if (projected_area <= 0.0)
+        return 0.0;
+
+    return distance * distance / (projected_area * LIGHTS);
+}
+
+bool sampleLight(in const vec3 position, in const vec3 true_normal, in const int current,
+                 inout uint dimension, out vec3 direction, out float pdf, out vec3 light)
 {
     /*
-        Samples one random light source as representation for all sources present,
-        assuming diffuse behaviour of the material.
+        Samples a uniformly chosen point on a uniformly chosen light source.
+        Returns its emission if it is visible, the solid angle density is lightPdf.
     */
     if (LIGHTS == 0)
         return false;
 
-    const int light_id = int(unitFloat(seed) * LIGHTS);
+    const int light_id = min(int(unitFloat(dimension) * LIGHTS), LIGHTS - 1);
+    if (light_id == current)
+        return false;
 
-    const TriangleModel light_tri = triangleModels[light_id-1];
+    const TriangleModel light_tri = triangleModels[light_id];
 
     const mat3 UVP = mat3(
         light_tri.u.x, light_tri.u.y, light_tri.u.z,
@@ -349,7 +898,7 @@ bool sampleLight(in const vec3 position, in const vec3 normal,
         2. reflect point outside the lower left triangle through (0.5, 0.5) to its inside: {(x,y) | x+y < 1 ; x,y >= 0}
         3. use these as coefficients for the span vectors of the triangle
     */
-    vec2 coords = vec2(unitFloat(seed), unitFloat(seed));
+    vec2 coords = unitFloat2(dimension);
     if (coords.x + coords.y > 1)
         coords = 1.0 - coords;
 
@@ -360,258 +909,344 @@ bool sampleLight(in const vec3 position, in const vec3 normal,
     Ray light_probe_ray;
     light_probe_ray.position = position;
     light_probe_ray.direction = delta / max_t;
+    direction = light_probe_ray.direction;
 
-    // Sampled light source is behind the point, therefore it cannot be lit.
-
-    const vec3 true_normal = vec3(light_tri.true_normal.x, light_tri.true_normal.y, light_tri.true_normal.z);
-    const float DdN = dot(light_probe_ray.direction, normal);
-    const float DdL = dot(light_probe_ray.direction, true_normal);
-    if (DdN <= 0.0 || DdL >= 0.0)
+    // Sampled light source is behind the point or facing away, therefore it cannot be lit.
+    if (dot(direction, true_normal) <= 0.0)
+        return false;
+    pdf = lightPdf(light_id, direction, max_t);
+    if (pdf <= 0.0)
         return false;
-        
-    for (int triID = 0; triID < COUNT; triID++)
-    {
-        if (triID == current)
-            continue;
-        if (intersectTriangleShadow(light_probe_ray, triangleModels[triID], max_t))
-            return false;
-    }
-    const Material material = materials[triangleShadings[light_id].material_id];
-
-    const float tri_area = 0.5 * length(cross(UVP[0], UVP[1]));
-
-    const float light_vis_area_ratio = -DdL;
-    const float probe_ratio = DdN;
-    const float distance_ratio = fma(max_t, max_t + 2.0, 1.0);
-    light = material.emission_ior.rgb * (tri_area * light_vis_area_ratio * probe_ratio / distance_ratio * LIGHTS);
-    return true;
-}
-
-
-bool sampleLightGlossy(in const vec3 position, in const vec3 normal, in const Ray view,
-                       in const float roughness, in const int current, inout uint seed, out vec3 light)
-{
-    /*
-        Calculates, how much light in sampled glossy direction is incoming if the point is viewed from view
-    */
-
-    const vec3 viewDir = normalize(position - view.position);
-    Ray light_probe_ray;
-    light_probe_ray.position = position;
-    light_probe_ray.direction = reflect(viewDir, normalize(randomSphere(seed)*roughness + normal));
-
-    vec4 intersection = vec4(0.0, 0.0, -1.0, 0.0);
-    int lightID = -1;
-    
-    for (int triID = 0; triID < COUNT; triID++)
-    {
-        if (triID == current)
-            continue;
-        if (intersectTriangle(light_probe_ray, triangleModels[triID], intersection)) {
-            if (triID < LIGHTS) {
-                lightID = triID;
-            }
-            else {
-                lightID = -1;
-                break;
-            }
-        }
-    }
-    if (lightID < 0)
-    {
-        if (intersection.z < 0.0)
-            light = skyColor(light_probe_ray.direction);
-        return (intersection.z < 0.0);
-    }
-    
-    const float inv_det = 1.0 / intersection.w;
-    intersection.xyz *= inv_det;
-
-    const TriangleShading light_tri = triangleShadings[lightID];
-    const Material material = materials[light_tri.material_id];
-    const vec3 N = calculateN(light_tri, intersection.xyz);
 
-    const float d = intersection.z;
+    // Same culling as findIntersection, so it agrees with the paths hitting the light
+    STAT_ADD(STAT_SHADOW_LIGHT, 1);
+    if (occluded(light_probe_ray, current, light_id, vec4(0.0, 0.0, max_t * 0.9999, 1.0)))
+        return false;
 
-    light = material.emission_ior.rgb * max(dot(light_probe_ray.direction, N), 0.0);// / fma(d, d+2.0, 1.0));
+    light = materials[triangleShadings[light_id].material_id].emission_ior.rgb;
     return true;
 }
 
-vec3 trace(in Ray ray, in uint seed, in uint light_seed) {
+vec3 trace(in Ray ray, in uint dimension, in uint light_seed, out vec4 primary) {
     vec3 energy = vec3(0.0);
     vec3 path = vec3(1.0);
-    
-    bool isSpecular = true;
+    primary = vec4(0.0);
 
-    const int MAX_RECURSION = max(RECURSION, 1);
+    /*
+        Direct light is sampled with a light or a sky sample per bounce and with the scattered ray
+        hitting a light or the sky, both weighted by multiple importance sampling.
+        The branch is chosen with light_seed, so all pixels of a sample take the same one.
+    */
+#if TRACER_LIGHTS
+    const float light_choice = (LIGHTS > 0) ? 0.5 : 0.0;
+#else
+    const float light_choice = 0.0;
+#endif
+    // density of the last scattered direction, negative for delta distributions and the camera ray
+    float scatter_pdf = -1.0;
+    vec3 last_normal = vec3(0.0);
+
+    // Ray cone for the texture mips, it starts at the pixel angle and rough bounces widen it
+    float cone_spread = 2.0 / float(IMAGE.y);
+    float cone_width = 0.0;
+
+    // Scattering vertices of this path, their incident radiance trains the path guide once it is known
+    const bool train = GUIDING != 0u && ((uint(TEXEL.x) ^ uint(TEXEL.y) ^ SAMPLE_INDEX) & 3u) == 0u;
+    int guide_count = 0;
+    uint guide_index[GUIDE_VERTICES];
+    vec3 guide_energy[GUIDE_VERTICES];
+    vec3 guide_path[GUIDE_VERTICES];
+    float guide_pdf[GUIDE_VERTICES];
+
+    const int MAX_RECURSION = TRACER_RECURSION;
     for (int depth=0; depth < MAX_RECURSION; depth++)
     {
+        STAT_ADD(STAT_RAYS_DEPTH + min(depth, 7), 1);
         vec3 current_intersection;
-        const int current_tri = findIntersection(ray, current_intersection);
+        const int current_tri = (depth == 0 && USE_VISIBILITY != 0u)
+            ? primaryIntersection(ray, current_intersection)
+            : findIntersection(ray, current_intersection);
 
         if (current_tri < 0)
         {
-            energy += skyColor(ray.direction) * path;
+            const float sky_pdf = (1.0 - light_choice) * skyPdf(ray.direction, last_normal);
+            energy += skyColor(ray.direction) * path * misWeight(scatter_pdf, sky_pdf);
+            STAT_ADD(STAT_SKY_ESCAPES, 1);
             break;
         }
     
         const TriangleShading tri = triangleShadings[current_tri];
         const uint mat_id = tri.material_id;
         const Material material = materials[mat_id];
+#if TRACER_TEXTURES
         const bool has_texture = hasTexture[mat_id] == 1;
+#else
+        const bool has_texture = false;
+#endif
 
-        if (current_tri < LIGHTS)
+        const vec3 sec = current_intersection;
+        if (TRACER_LIGHTS != 0 && current_tri < LIGHTS)
         {
-            energy += path * material.emission_ior.rgb;
+            const float light_pdf = light_choice * lightPdf(current_tri, ray.direction, sec.z);
+            energy += path * material.emission_ior.rgb * misWeight(scatter_pdf, light_pdf);
         }
 
-        const vec3 sec = current_intersection;
         const vec3 N = calculateN(tri, sec);
+        if (depth == 0)
+            primary = vec4(N, sec.z);
         
         const vec2 tex_coord = calculateUV(tri, sec);
         const mat3 TBNi = calculateTBN(tri, N, sec);
 
-        const vec3 texel_albedo = texture(textureAtlas, vec3(tex_coord, mat_id*3 + 0)).rgb;
-        const vec3 tex_normal = normalize(texture(textureAtlas, vec3(tex_coord, mat_id*3 + 1)).xyz*2.0-1.0);
-        const vec3 texel_arm = texture(textureAtlas, vec3(tex_coord, mat_id*3 + 2)).rgb;
+        const TriangleModel tri_model = triangleModels[current_tri];
+        const vec3 true_normal = vec3(tri_model.true_normal.x, tri_model.true_normal.y, tri_model.true_normal.z);
+        cone_width += cone_spread * sec.z;
+
+        // untextured materials don't touch the page cache and leave no feedback
+        vec3 texel_albedo = vec3(0.0);
+        vec3 tex_normal = vec3(0.0, 0.0, 1.0);
+        vec3 texel_arm = vec3(0.0);
+        if (has_texture) {
+            const float footprint = cone_width / max(abs(dot(true_normal, ray.direction)), 0.05);
+            const vec3 page_coord = virtualTexel(mat_id, tex_coord, textureMip(tri_model, tri, mat_id, footprint));
+            texel_albedo = textureLod(textureAtlas, page_coord, 0.0).rgb;
+            tex_normal = normalize(textureLod(textureAtlas, page_coord + vec3(0.0, 0.0, 1.0), 0.0).xyz*2.0-1.0);
+            texel_arm = textureLod(textureAtlas, page_coord + vec3(0.0, 0.0, 2.0), 0.0).rgb;
+        }
 
-        const vec3 normal = (has_texture) ? normalize(TBNi * tex_normal) : N;
+        Surface surface;
+        surface.normal = (has_texture) ? normalize(TBNi * tex_normal) : N;
 
-        const vec3 albedo = (has_texture) ? texel_albedo : material.albedo.rgb;
-        const vec3 specular = (has_texture) ? texel_albedo : material.specular_roughness.rgb;
+        surface.albedo = (has_texture) ? texel_albedo : material.albedo.rgb;
+        surface.specular = (has_texture) ? texel_albedo : material.specular_roughness.rgb;
         const float ior = material.emission_ior.a;
 
-        const float occlusion = (has_texture) ? texel_arm.r : 1.0;
-        const float roughness = (has_texture) ? texel_arm.g : material.specular_roughness.a;
-        const float variance = roughness * roughness;
-        const float metallic = (has_texture) ? texel_arm.b : float(roughness < 0.125);
+        surface.occlusion = (has_texture) ? texel_arm.r : 1.0;
+        surface.roughness = (has_texture) ? texel_arm.g : material.specular_roughness.a;
+        surface.variance = surface.roughness * surface.roughness;
+        surface.metallic = (has_texture) ? texel_arm.b : float(surface.roughness < 0.125);
 
-        const vec3 specular_ray           = normalize(reflect(ray.direction, normal));
-        const vec3 scattered_specular_ray = normalize(randomSphere(seed)*variance + specular_ray);
-        const vec3 scattered_diffuse      = normalize(randomSphere(seed) + normal);
-        const vec3 scattered_glossy_ray   = normalize(randomSphere(seed)*variance + normal);
+        const vec3 normal = surface.normal;
+        const float roughness = surface.roughness;
+        const float variance = surface.variance;
 
-        const float cos_theta = max(-dot(normal, ray.direction), 0.0);
-        
-        const float transmission = (ior == 0.0) ? 0.0 : getTransmission(cos_theta, 1.00029, ior);
-        const float fresnel_reflectance = fma(1.0-transmission, pow(1.0-cos_theta, 5), transmission);
+        surface.specular_ray              = normalize(reflect(ray.direction, normal));
+        const vec3 scattered_specular_ray = normalize(randomSphere(dimension)*variance + surface.specular_ray);
+        const vec3 scattered_diffuse      = normalize(randomSphere(dimension) + normal);
+        const vec3 scattered_glossy_ray   = normalize(randomSphere(dimension)*variance + normal);
 
-        const float rand_reflectance = unitFloat(seed);
-        const float rand_scatter = unitFloat(seed);
-        const float rand_metallic = unitFloat(seed);
+        surface.cos_i = max(-dot(normal, ray.direction), 0.0);
+        
+        const float transmission = (ior == 0.0) ? 0.0 : getTransmission(surface.cos_i, 1.00029, ior);
+        surface.fresnel = fma(1.0-transmission, pow(1.0-surface.cos_i, 5), transmission);
 
-        Ray old_ray;
-        old_ray.position = ray.position;
-        old_ray.direction = ray.direction;
+        const float rand_reflectance = unitFloat(dimension);
+        const float rand_scatter = unitFloat(dimension);
+        const float rand_metallic = unitFloat(dimension);
 
         ray.position += ray.direction * sec.z;
 
-        if (rand_reflectance < fresnel_reflectance) {
+        // Only rough surfaces are guided, the more diffuse the larger the guided share
+        const int cell = (GUIDING != 0u) ? guideCell(ray.position) : 0;
+        const float guide = (GUIDING != 0u && roughness > 0.0 && guideNodes[cell * GUIDE_STRIDE + GUIDE_TRAINED] > 0.0)
+            ? GUIDE_FRACTION * roughness : 0.0;
+        const float rand_guide = unitFloat(dimension);
+        const vec2 guide_sample = unitFloat2(dimension);
+
+        // Light or sky sample, on the last bounce the scattered ray isn't traced and it takes the full weight
+        const bool last_bounce = depth + 1 == MAX_RECURSION;
+        vec3 direct = vec3(0.0);
+        vec3 light_dir;
+        vec3 light;
+        vec3 scatter_weight;
+        if (hashFloat(light_seed) < light_choice)
+        {
+            float light_pdf;
+            if (sampleLight(ray.position, true_normal, current_tri, dimension, light_dir, light_pdf, light)) {
+                light_pdf *= light_choice;
+                const float light_scatter_pdf = scatterDensity(surface, light_dir, cell, guide, scatter_weight);
+                const float weight = last_bounce ? 1.0 : misWeight(light_pdf, light_scatter_pdf);
+                direct = scatter_weight * light * (weight / light_pdf);
+            }
+        }
+        else if (sampleSky(ray.position, normal, true_normal, current_tri, dimension, light_dir, light))
+        {
+            const float sky_pdf = (1.0 - light_choice) * skyPdf(light_dir, normal);
+            const float sky_scatter_pdf = scatterDensity(surface, light_dir, cell, guide, scatter_weight);
+            const float weight = last_bounce ? 1.0 : misWeight(sky_pdf, sky_scatter_pdf);
+            direct = scatter_weight * light * (weight / sky_pdf);
+        }
+        energy += path * direct;
+
+        bool delta = false;
+        float guided_pdf = 0.0;
+        if (rand_reflectance < surface.fresnel) {
             // Fresnel effect, total reflection
-            path *= (rand_metallic < metallic) ? vec3(1.0-roughness) : specular;
-            ray.direction = specular_ray;
-            isSpecular = true;
+            path *= (rand_metallic < surface.metallic) ? vec3(1.0-roughness) : surface.specular;
+            ray.direction = surface.specular_ray;
+            delta = true;
+        }
+        else if (guide > 0.0) {
+            // One sample MIS of the rough lobes and the guide, both share the density of scatterDensity
+            ray.direction = (rand_guide < guide) ? sampleGuide(cell, guide_sample)
+                          : (rand_metallic < surface.metallic) ? scattered_specular_ray
+                          : (rand_scatter < roughness) ? scattered_diffuse : scattered_glossy_ray;
+            guided_pdf = scatterDensity(surface, ray.direction, cell, guide, scatter_weight);
+            path *= (guided_pdf > 0.0) ? scatter_weight / guided_pdf : vec3(0.0);
         }
         else {
-            if (rand_metallic < metallic)
+            if (rand_metallic < surface.metallic)
             {
                 // Metallic reflection with roughness
-                path *= albedo;
+                path *= surface.albedo;
                 ray.direction = scattered_specular_ray;
-                isSpecular = true;
+                delta = variance <= 0.0;
             }
             else {
                 if (rand_scatter < roughness)
                 {
-                    // Oren-Nayar
-                    const float theta_i = acos(cos_theta);
-                    const float theta_o = acos(dot(scattered_diffuse, normal));
-                    const float variance = roughness * roughness;
-                    const float A = 1.0 - 0.5 * variance / (variance + 0.33);
-                    const float B = 0.45 * variance / (variance + 0.09);
-                    const float alpha = max(theta_i, theta_o);
-                    const float beta = min(theta_i, theta_o);
-
-                    path *= albedo * ((A + B*max(0, theta_i-theta_o)*sin(alpha)*tan(beta)) * INV_PI * occlusion);
+                    // Oren-Nayar, the cosine distribution cancels the cosine and 1/PI of the BRDF
+                    const float oren_nayar = orenNayar(surface.cos_i, max(dot(scattered_diffuse, normal), 0.0), variance);
+                    path *= surface.albedo * (oren_nayar * surface.occlusion);
                     ray.direction = scattered_diffuse;
-                    isSpecular = false;
                 }
                 else
                 {
                     // Glossy reflection
-                    path *= specular * (1.0-roughness);
+                    path *= surface.specular * (1.0-roughness);
                     ray.direction = scattered_glossy_ray;
-                    isSpecular = true;
+                    delta = variance <= 0.0;
                 }
             }
         }
+        scatter_pdf = delta ? -1.0 : (guided_pdf > 0.0) ? guided_pdf : scatterDensity(surface, ray.direction, cell, guide, scatter_weight);
+        last_normal = normal;
+        // the spread of the lobe, textures seen through rough reflections only need coarse mips
+        if (!delta)
+            cone_spread += variance;
 
-        vec3 diff_light = vec3(0.0);
-        vec3 spec_light = vec3(0.0);
-        //*
-        bool has_light = false;
-        if (unitFloat(light_seed) < 0.5)
-            has_light = sampleLight(ray.position, normal, current_tri, seed, diff_light);
-        else
-            has_light = sampleLightGlossy(ray.position, normal, old_ray, roughness, current_tri, seed, spec_light);
-        const vec3 global_light = (albedo * diff_light * roughness + specular * spec_light * (fresnel_reflectance + 1.0 - roughness)) * 2.0;
-        /*/
-        bool has_light = sampleLight(ray.position, normal, current_tri, seed, diff_light);
-        bool has_spec_light = sampleLightGlossy(ray.position, normal, old_ray, roughness, current_tri, seed, spec_light);
-        has_light = has_light || has_spec_light;
-        const vec3 global_light = albedo * diff_light * roughness * occlusion + specular * spec_light * (fresnel_reflectance + 1.0 - roughness);
-        //*/
-
-        if (has_light)
-            energy += path * global_light;
-
-        const TriangleModel tri_model = triangleModels[current_tri];
-        const vec3 true_normal = vec3(tri_model.true_normal.x, tri_model.true_normal.y, tri_model.true_normal.z);
         if (dot(ray.direction, true_normal) <= 0.0)
             break;
 
+        if (train && !delta && roughness > 0.0 && scatter_pdf > 0.0 && guide_count < GUIDE_VERTICES) {
+            guide_index[guide_count] = uint(cell) * GUIDE_BINS + guideBin(ray.direction);
+            guide_energy[guide_count] = energy;
+            guide_path[guide_count] = path;
+            guide_pdf[guide_count] = scatter_pdf;
+            guide_count++;
+        }
+
         //*
         // Russian roulette
-        float brightness = clamp(max(dot(global_light, path), (path.r+path.g+path.b) / 3.0), 1.0/8.0, 1.0);
-        if (unitFloat(seed) > brightness)
+        float brightness = clamp(max(dot(direct, path), (path.r+path.g+path.b) / 3.0), 1.0/8.0, 1.0);
+        if (unitFloat(dimension) > brightness) {
+            STAT_ADD(STAT_ROULETTE, 1);
             break;
+        }
         
         path /= brightness;
         //*/
     }
-    
+
+    for (int i = 0; i < guide_count; i++) {
+        // radiance arriving along the scattered direction, divided by its density
+        const vec3 incident = (energy - guide_energy[i]) / max(guide_path[i], vec3(1e-6));
+        const float flux = dot(incident, vec3(0.2126, 0.7152, 0.0722)) / guide_pdf[i];
+        atomicAdd(guideRecords[guide_index[i] / GUIDE_BINS], 1u);
+        if (flux > 0.0 && !isinf(flux))
+            addGuideFlux(guide_index[i], flux);
+    }
+
     return energy;
 }
 
+vec4 reproject(in const Ray ray, in const vec4 primary) {
+    /*
+        Looks up the primary hit in the previous accumulation.
+        The sky is reprojected as a direction, surfaces have to match the
+        previous distance and normal or their history is discarded.
+    */
+    const bool sky = primary.w == 0.0;
+    const vec3 point = sky ? ray.direction : ray.position + ray.direction * primary.w;
+    const vec3 local = (PREV_VIEW * vec4(point, sky ? 0.0 : 1.0)).xyz;
+    if (local.z <= 0.0)
+        return vec4(0.0);
+
+    // inverse of the detector mapping in main
+    const ivec2 size = textureSize(HISTORY, 0);
+    const vec2 detector = 0.5 * local.xy / local.z;
+    const ivec2 texel = ivec2(round(vec2(detector.x * size.y + 0.5 * size.x - 0.5, (detector.y + 0.5) * size.y - 0.5)));
+    if (any(lessThan(texel, ivec2(0))) || any(greaterThanEqual(texel, size)))
+        return vec4(0.0);
+
+    const vec4 prev_primary = texelFetch(HISTORY_GBUFFER, texel, 0);
+    if (sky != (prev_primary.w == 0.0))
+        return vec4(0.0);
+    if (!sky) {
+        const float expected = distance(point, PREV_POSITION);
+        if (abs(prev_primary.w - expected) > 0.03 * expected || dot(prev_primary.xyz, primary.xyz) < 0.9)
+            return vec4(0.0);
+    }
+
+    const vec4 history = texelFetch(HISTORY, texel, 0);
+    return vec4(history.rgb, min(history.a, HISTORY_CAP));
+}
+
 void main(void) {
     SIZE = imageSize(img_output);
-    float inv_width = 1.0 / SIZE.x;
-    float inv_height = 1.0 / SIZE.y;
     TEXEL = ivec2(gl_GlobalInvocationID.xy);
     if (TEXEL.x >= SIZE.x || TEXEL.y >=  SIZE.y)
         return;
-
-    uint seed = CLOCK + (TEXEL.x * SIZE.y + TEXEL.y + 394587U) * (SAMPLE+1U) * 13U + SAMPLE;
-    uint light_seed = CLOCK;
-    for (int i=0; i < SAMPLE; i++) {
-        light_seed = pcgHash(light_seed);
+    IMAGE = (IMAGE_SIZE.x > 0) ? uvec2(IMAGE_SIZE) : SIZE;
+    PIXEL = TEXEL + TILE_OFFSET;
+    float inv_width = 1.0 / IMAGE.x;
+    float inv_height = 1.0 / IMAGE.y;
+
+    // CLOCK stays constant during an accumulation, the sample index walks along the sequence
+    PIXEL_SEED = pcgHash(CLOCK ^ pcgHash(PIXEL.x * IMAGE.y + PIXEL.y));
+    const uint samples = max(SAMPLES, 1u);
+#if TRACER_STATS
+    for (int i = 0; i < STAT_COUNT; i++)
+        STATS[i] = 0u;
+    STAT_ADD(STAT_PATHS, samples);
+#endif
+
+    vec3 radiance = vec3(0.0);
+    vec4 primary;
+    Ray primary_ray;
+    for (uint s = 0u; s < samples; s++) {
+        SAMPLE_INDEX = SAMPLE + s;
+        uint dimension = 0u;
+        // same for all pixels of a sample, keeps the light sampling branch coherent
+        uint light_seed = pcgHash(CLOCK ^ pcgHash(SAMPLE_INDEX));
+
+        vec4 position = vec4(0.0, 0.0, 0.0, 1.0);
+        vec3 dtctor = normalize(vec3((PIXEL.x - 0.5*IMAGE.x + 0.5)*inv_height, (PIXEL.y + 0.5)*inv_height - 0.5, 0.5) + vec3(unitFloat2(dimension)*vec2(inv_width, inv_height), 0.0));
+        vec4 direction = vec4(normalize(dtctor - position.xyz), 0.0);
+        Ray ray;
+        ray.position = (CAMERA * position).xyz;
+        ray.direction = normalize(CAMERA * direction).xyz;
+        vec4 hit;
+        radiance += trace(ray, dimension, light_seed, hit);
+        // the first sample of the dispatch provides the G-buffer and the reprojection
+        if (s == 0u) {
+            primary = hit;
+            primary_ray = ray;
+        }
     }
+    imageStore(img_gbuffer, TEXEL, primary);
 
-    vec4 color = vec4(0.0, 0.0, 0.0, 1.0);
-    vec4 position = vec4(0.0, 0.0, 0.0, 1.0);
-    vec3 dtctor = normalize(vec3((TEXEL.x - 0.5*SIZE.x + 0.5)*inv_height, (TEXEL.y + 0.5)*inv_height - 0.5, 0.5) + vec3(unitFloat(seed)*inv_width, unitFloat(seed)*inv_height, 0.0));
-    vec4 direction = vec4(normalize(dtctor - position.xyz), 0.0);
-    Ray ray;
-    ray.position = (CAMERA * position).xyz;
-    ray.direction = normalize(CAMERA * direction).xyz;
-    color.rgb = trace(ray, seed, light_seed);
-
-    if (SAMPLE > 0) {
-        const vec3 prev = imageLoad(img_output, TEXEL).rgb;
-        float inv_samples = 1.0 / (SAMPLE + 1U);
-        float scale = SAMPLE * inv_samples;
-        imageStore(img_output, TEXEL, vec4(prev * scale + inv_samples * color.rgb, 1.0));
-    }
-    else
-        imageStore(img_output, TEXEL, vec4(color.rgb, 1.0));
+    vec4 history = vec4(0.0);
+    if (REPROJECT != 0U)
+        history = reproject(primary_ray, primary);
+    else if (SAMPLE > 0U)
+        history = imageLoad(img_output, TEXEL);
+
+    // alpha holds the number of samples of the pixel
+    const float count = history.a + float(samples);
+    imageStore(img_output, TEXEL, vec4(mix(history.rgb, radiance / float(samples), float(samples) / count), count));
+
+#if TRACER_STATS
+    flushStats();
+#endif
 }
@@ -0,0 +1,9 @@
+#version 450 core
+
+// Tracer slot + 1 of the closest triangle, 0 is the sky
+layout (location=0) out uint outTriangle;
+
+void main() {
+	// glDrawArrays emits the triangles in slot order, the primitive is the slot
+	outTriangle = uint(gl_PrimitiveID) + 1u;
+}
@@ -0,0 +1,10 @@
+#version 450 core
+
+layout(location=0) in vec4 aPosition;
+
+// Projection of the tracer camera, world space positions as the tracer intersects them
+uniform mat4 VIEW_PROJECTION;
+
+void main() {
+	gl_Position = VIEW_PROJECTION * vec4(aPosition.xyz, 1.0);
+}